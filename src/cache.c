@@ -2,153 +2,679 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <assert.h>
 
-/* when this proportion of slots are used, we resize the hashtable */
+#include "lock.h"
+#include "epoch.h"
+
+/* when there are more entries than this proportion of buckets, we grow the
+ * hashtable */
 #define LOAD_FACTOR 0.7
-/* if we grow the table, this is how many times larger the new one is 
+/* if we grow the table, this is how many times larger the new one is
  * going to be */
 #define GROW_FACTOR 2
-/* if we have more than this many items (times hash table size), we start 
- * removing old and unpinned ones */
-#define CHAIN_FACTOR 2
+/* number of buckets moved from the old to the new table with each operation
+ * while a resize is in progress. needs to be at least GROW_FACTOR so that a
+ * resize is always finished before the next one is due */
+#define REHASH_STEP 4
 
 // -------- implementation of declared public structures --------
 
+/* the lists the eviction policies keep entries on. LRU only uses the first one,
+ * ARC uses all of them as described in "ARC: A Self-Tuning, Low Overhead
+ * Replacement Cache" by Megiddo and Modha */
+enum cache_list_idx {
+    // entries that have been used once since they were put in the cache
+    LIST_T1 = 0,
+    // entries that have been used more than once
+    LIST_T2,
+    // ghosts of entries recently evicted from T1 and T2 respectively. these
+    // only hold the id and tell us whether a miss would have been a hit if
+    // the respective list had been larger
+    LIST_B1,
+    LIST_B2,
+    CACHE_LISTS
+};
+
+/* id and object never change once the entry is in a bucket, and list_next is
+ * only changed atomically, so that lookups can traverse the buckets without
+ * holding the latch */
 struct cache_entry {
+    object_id id;
+    // NULL for ghost entries
     struct lobject *object;
-    struct cache_entry *list_next;
+    struct cache_entry *_Atomic list_next;
+    // footprint of the object as of the last time it was released, see
+    // obj_get_footprint()
+    size_t size;
+    // the policy list the entry belongs to. entries get taken off the list
+    // when they are pinned under the latch, but a lock-free lookup can pin an
+    // entry that is on a list, so eviction may still come across pinned ones
+    int list;
+    bool linked;
+    // see cache_remove_object(), the entry goes once it is released
+    bool removed;
+    // set by lookups, which cannot touch the lists. the hit is passed on to
+    // the policy later, under the latch
+    atomic_bool referenced;
     struct cache_entry *newer;
     struct cache_entry *older;
 };
 
-struct cache {
-    struct cache_entry **table;
+struct cache_list {
     struct cache_entry *newest;
     struct cache_entry *oldest;
+    // total size of the entries belonging to the list, including pinned ones
+    size_t bytes;
+};
+
+/* an eviction policy only decides which list an entry belongs to and which
+ * entry to evict next, the cache does the actual linking and unlinking */
+struct cache_policy_ops {
+    // a new entry is put in the cache, needs to assign it to a list
+    void (*insert)(struct cache *c, struct cache_entry *ce);
+    // an entry has been found by cache_get_object()
+    void (*hit)(struct cache *c, struct cache_entry *ce);
+    // returns the unpinned entry to evict next, NULL if there is none
+    struct cache_entry* (*victim)(struct cache *c);
+    // an entry has been evicted, it still has its id, list and size but is
+    // not linked anymore
+    void (*evicted)(struct cache *c, struct cache_entry *ce);
+};
+
+struct cache_table {
     int size;
-    int slots_used;
+    struct cache_entry *_Atomic buckets[];
+};
+
+/* growing the table does not move all entries at once, which would cause a
+ * latency spike proportional to the size of the cache. instead the old table
+ * is kept around and a few buckets are moved across with every modifying
+ * operation on the cache. an entry is in the old table if its bucket there
+ * has not been moved yet (i.e. is at or after rehash_idx), and in the new one
+ * otherwise.
+ *
+ * lookups take no latch and may therefore run concurrently with a rehash or an
+ * eviction. they may miss an entry that is being moved between tables, which
+ * is fine as the caller then falls back to looking again under the latch.
+ * tables, entries and lobjects that have been unlinked are only freed once no
+ * lookup can still see them, see epoch.h */
+struct cache {
+    struct cache_table *_Atomic table;
+    // NULL unless a resize is in progress
+    struct cache_table *_Atomic old_table;
+    int rehash_idx;
     int entries;
+    // sum of the sizes of all entries, compared against the budget which is 0
+    // if unbounded
+    size_t bytes;
+    size_t budget;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+    // NULL if every unpinned object can be evicted
+    bool (*evict_check)(struct lobject *lo, void *arg);
+    void *evict_check_arg;
+    const struct cache_policy_ops *policy;
+    struct cache_list lists[CACHE_LISTS];
+    // ARC only: target size of T1, and the ghost entries by id. the ghost
+    // table grows when it has twice as many ghosts as buckets
+    size_t arc_target;
+    struct cache_entry *_Atomic *ghosts;
+    int ghosts_size;
+    int ghosts_count;
 };
 
 // -------- internal functions --------
 
+struct cache_table* cache_table_new(int size) {
+    struct cache_table *t = malloc(sizeof(struct cache_table)
+        + sizeof(struct cache_entry*) * size);
+    t->size = size;
+    for (int i = 0; i < size; i++) {
+        atomic_init(&t->buckets[i], NULL);
+    }
+    return t;
+}
+
+void cache_table_free(void *p) {
+    free(p);
+}
+
+void cache_lobject_free(void *p) {
+    lobject_free(p);
+}
+
+// returns the bucket an object with this id is in, or would need to go into.
+// only valid under the latch
+struct cache_entry *_Atomic * cache_bucket(struct cache *c, object_id id) {
+    struct cache_table *old = atomic_load_explicit(&c->old_table, memory_order_relaxed);
+    if (old && ((id % old->size) >= c->rehash_idx)) {
+        return &old->buckets[id % old->size];
+    }
+    struct cache_table *t = atomic_load_explicit(&c->table, memory_order_relaxed);
+    return &t->buckets[id % t->size];
+}
+
+// pins the entry for this id in one bucket, without taking the latch. needs
+// to be called inside a read section
+struct lobject* cache_lookup_bucket(struct cache_entry *_Atomic *bucket, object_id id) {
+    struct cache_entry *ce = atomic_load_explicit(bucket, memory_order_acquire);
+    while (ce != NULL) {
+        if (ce->id == id) {
+            if (!lobject_try_pin(ce->object)) {
+                // being evicted
+                return NULL;
+            }
+            if (!atomic_load_explicit(&ce->referenced, memory_order_relaxed)) {
+                atomic_store_explicit(&ce->referenced, true, memory_order_relaxed);
+            }
+            return ce->object;
+        }
+        ce = atomic_load_explicit(&ce->list_next, memory_order_acquire);
+    }
+    return NULL;
+}
+
+// moves up to steps buckets across from the old table
+void cache_rehash_step(struct cache *c, int steps) {
+    struct cache_table *old = atomic_load_explicit(&c->old_table, memory_order_relaxed);
+    if (!old) {
+        return;
+    }
+    struct cache_table *t = atomic_load_explicit(&c->table, memory_order_relaxed);
+    // don't spend too long skipping empty buckets either
+    int empty_visits = steps * 10;
+    while ((steps > 0) && (c->rehash_idx < old->size)) {
+        struct cache_entry *ce = atomic_load_explicit(&old->buckets[c->rehash_idx],
+            memory_order_relaxed);
+        if (!ce) {
+            c->rehash_idx++;
+            if (--empty_visits == 0) {
+                break;
+            }
+            continue;
+        }
+        while (ce) {
+            // a lookup traversing the old bucket may follow the entry into
+            // the new one and miss the rest of the old chain, but it will
+            // never see a broken chain
+            struct cache_entry *next = atomic_load_explicit(&ce->list_next,
+                memory_order_relaxed);
+            struct cache_entry *_Atomic *bucket = &t->buckets[ce->id % t->size];
+            atomic_store_explicit(&ce->list_next,
+                atomic_load_explicit(bucket, memory_order_relaxed), memory_order_relaxed);
+            atomic_store_explicit(bucket, ce, memory_order_release);
+            ce = next;
+        }
+        atomic_store_explicit(&old->buckets[c->rehash_idx], NULL, memory_order_release);
+        c->rehash_idx++;
+        steps--;
+    }
+    if (c->rehash_idx == old->size) {
+        atomic_store_explicit(&c->old_table, NULL, memory_order_release);
+        c->rehash_idx = 0;
+        epoch_retire(old, cache_table_free);
+    }
+}
+
+// starts growing the table, the actual moving happens in cache_rehash_step()
 void cache_resize(struct cache *c) {
-    int new_size = c->size * GROW_FACTOR;
-    struct cache_entry **new_table = malloc(sizeof(struct cache_entry*) * new_size);
-    memset(new_table, 0, sizeof(struct cache_entry*) * new_size);
+    if (atomic_load_explicit(&c->old_table, memory_order_relaxed)) {
+        // the previous resize has not finished, which can only happen if
+        // REHASH_STEP is too small. finish it the hard way
+        cache_rehash_step(c, atomic_load(&c->old_table)->size);
+    }
+    struct cache_table *t = atomic_load_explicit(&c->table, memory_order_relaxed);
+    c->rehash_idx = 0;
+    atomic_store_explicit(&c->old_table, t, memory_order_release);
+    atomic_store_explicit(&c->table, cache_table_new(t->size * GROW_FACTOR),
+        memory_order_release);
+}
+
+void cache_list_unlink(struct cache_list *l, struct cache_entry *ce) {
+    if (l->newest == ce) {
+        l->newest = ce->older;
+    }
+    if (l->oldest == ce) {
+        l->oldest = ce->newer;
+    }
+    if (ce->older != NULL) {
+        ce->older->newer = ce->newer;
+    }
+    if (ce->newer != NULL) {
+        ce->newer->older = ce->older;
+    }
+    ce->older = NULL;
+    ce->newer = NULL;
+    ce->linked = false;
+}
+
+void cache_list_push(struct cache_list *l, struct cache_entry *ce) {
+    ce->linked = true;
+    ce->newer = NULL;
+    ce->older = l->newest;
+    if (l->newest) {
+        l->newest->newer = ce;
+    }
+    l->newest = ce;
+    if (l->oldest == NULL) {
+        l->oldest = ce;
+    }
+}
+
+// makes a resident entry belong to a different list, it must not be linked
+void cache_assign_list(struct cache *c, struct cache_entry *ce, int list) {
+    c->lists[ce->list].bytes -= ce->size;
+    ce->list = list;
+    c->lists[list].bytes += ce->size;
+}
+
+// -------- LRU policy --------
+
+void lru_insert(struct cache *c, struct cache_entry *ce) {
+    ce->list = LIST_T1;
+    c->lists[LIST_T1].bytes += ce->size;
+}
 
-    // XXX implement movement of old items across
-    assert(false);
+void lru_hit(struct cache *c, struct cache_entry *ce) {
+}
+
+struct cache_entry* lru_victim(struct cache *c) {
+    return c->lists[LIST_T1].oldest;
+}
+
+void lru_evicted(struct cache *c, struct cache_entry *ce) {
+}
+
+static const struct cache_policy_ops lru_policy = {
+    lru_insert, lru_hit, lru_victim, lru_evicted
+};
+
+// -------- ARC policy --------
+
+// finds and unlinks the ghost entry for this id, NULL if there is none
+struct cache_entry* arc_take_ghost(struct cache *c, object_id id) {
+    if (!c->ghosts) {
+        return NULL;
+    }
+    struct cache_entry *_Atomic *pge = &c->ghosts[id % c->ghosts_size];
+    while (*pge) {
+        struct cache_entry *ge = *pge;
+        if (ge->id == id) {
+            *pge = ge->list_next;
+            cache_list_unlink(&c->lists[ge->list], ge);
+            c->lists[ge->list].bytes -= ge->size;
+            c->ghosts_count--;
+            return ge;
+        }
+        pge = &ge->list_next;
+    }
+    return NULL;
+}
 
-    c->table = new_table;
-    c->size = new_size;    
+void arc_drop_oldest_ghost(struct cache *c, int list) {
+    struct cache_entry *ge = arc_take_ghost(c, c->lists[list].oldest->id);
+    free(ge);
+}
+
+void arc_grow_ghosts(struct cache *c) {
+    int new_size = c->ghosts_size * GROW_FACTOR;
+    struct cache_entry *_Atomic *ghosts = malloc(sizeof(struct cache_entry*) * new_size);
+    memset(ghosts, 0, sizeof(struct cache_entry*) * new_size);
+    for (int i = 0; i < c->ghosts_size; i++) {
+        struct cache_entry *ge = c->ghosts[i];
+        while (ge) {
+            struct cache_entry *next = ge->list_next;
+            ge->list_next = ghosts[ge->id % new_size];
+            ghosts[ge->id % new_size] = ge;
+            ge = next;
+        }
+    }
+    free(c->ghosts);
+    c->ghosts = ghosts;
+    c->ghosts_size = new_size;
+}
+
+void arc_insert(struct cache *c, struct cache_entry *ce) {
+    struct cache_entry *ge = arc_take_ghost(c, ce->id);
+    if (!ge) {
+        ce->list = LIST_T1;
+        c->lists[LIST_T1].bytes += ce->size;
+        return;
+    }
+    // we have recently evicted this one, so the list it was evicted from
+    // should have been larger by its size. adapt the target, faster if the
+    // other ghost list is larger. the ghost has already been taken off its
+    // list, so we add it back in for the ratio
+    size_t b1 = c->lists[LIST_B1].bytes;
+    size_t b2 = c->lists[LIST_B2].bytes;
+    size_t delta = ge->size;
+    if (ge->list == LIST_B1) {
+        if (b2 > b1 + ge->size) {
+            delta = ge->size * (b2 / (b1 + ge->size));
+        }
+        c->arc_target = (c->arc_target + delta > c->budget)
+            ? c->budget : c->arc_target + delta;
+    }
+    else {
+        if (b1 > b2 + ge->size) {
+            delta = ge->size * (b1 / (b2 + ge->size));
+        }
+        c->arc_target = (delta > c->arc_target) ? 0 : c->arc_target - delta;
+    }
+    free(ge);
+    ce->list = LIST_T2;
+    c->lists[LIST_T2].bytes += ce->size;
+}
+
+void arc_hit(struct cache *c, struct cache_entry *ce) {
+    if (ce->list == LIST_T1) {
+        cache_assign_list(c, ce, LIST_T2);
+    }
+}
+
+struct cache_entry* arc_victim(struct cache *c) {
+    struct cache_entry *t1 = c->lists[LIST_T1].oldest;
+    struct cache_entry *t2 = c->lists[LIST_T2].oldest;
+    if (t1 && ((c->lists[LIST_T1].bytes > c->arc_target) || !t2)) {
+        return t1;
+    }
+    return t2;
+}
+
+void arc_evicted(struct cache *c, struct cache_entry *ce) {
+    struct cache_entry *ge = malloc(sizeof(struct cache_entry));
+    ge->id = ce->id;
+    ge->object = NULL;
+    ge->size = ce->size;
+    ge->list = (ce->list == LIST_T1) ? LIST_B1 : LIST_B2;
+    ge->list_next = c->ghosts[ge->id % c->ghosts_size];
+    c->ghosts[ge->id % c->ghosts_size] = ge;
+    cache_list_push(&c->lists[ge->list], ge);
+    c->lists[ge->list].bytes += ge->size;
+    if (++c->ghosts_count > c->ghosts_size * 2) {
+        arc_grow_ghosts(c);
+    }
+
+    // T1 and B1 together never exceed the budget, and all four lists never
+    // exceed twice the budget
+    struct cache_list *l = c->lists;
+    while ((l[LIST_T1].bytes + l[LIST_B1].bytes > c->budget) && l[LIST_B1].oldest) {
+        arc_drop_oldest_ghost(c, LIST_B1);
+    }
+    while ((l[LIST_T1].bytes + l[LIST_T2].bytes + l[LIST_B1].bytes + l[LIST_B2].bytes
+            > 2 * c->budget) && (l[LIST_B1].oldest || l[LIST_B2].oldest)) {
+        arc_drop_oldest_ghost(c, l[LIST_B2].oldest ? LIST_B2 : LIST_B1);
+    }
+}
+
+static const struct cache_policy_ops arc_policy = {
+    arc_insert, arc_hit, arc_victim, arc_evicted
+};
+
+// -------- eviction --------
+
+// takes an entry that has been marked as evicted and is on no list out of its
+// bucket. it and its object get freed once no lookup can see them anymore
+void cache_drop_entry(struct cache *c, struct cache_entry *ce) {
+    c->lists[ce->list].bytes -= ce->size;
+    struct cache_entry *_Atomic *pce = cache_bucket(c, ce->id);
+    while (atomic_load_explicit(pce, memory_order_relaxed) != ce) {
+        pce = &atomic_load_explicit(pce, memory_order_relaxed)->list_next;
+    }
+    // lookups that are looking at this entry right now can still follow
+    // its list_next, and will fail to pin it
+    atomic_store_explicit(pce, atomic_load_explicit(&ce->list_next,
+        memory_order_relaxed), memory_order_release);
+    // the lobject goes along with its objects, lookups that found it before
+    // it got unlinked can still look at it
+    if (lobject_get_lock(ce->object)) {
+        lock_free(lobject_get_lock(ce->object));
+    }
+    c->entries--;
+    c->bytes -= ce->size;
+    epoch_retire(ce->object, cache_lobject_free);
+    epoch_retire(ce, free);
+}
+
+// evicts unpinned entries as chosen by the policy until we are within budget
+void cache_evict(struct cache *c) {
+    int skipped = 0;
+    while (c->budget && (c->bytes > c->budget)) {
+        struct cache_entry *ce = c->policy->victim(c);
+        if (!ce) {
+            // everything is pinned
+            return;
+        }
+        cache_list_unlink(&c->lists[ce->list], ce);
+        if (c->evict_check && !c->evict_check(ce->object, c->evict_check_arg)) {
+            // not yet, it goes back on as if it had just been released. once
+            // we went through everything there is nothing left to evict
+            cache_list_push(&c->lists[ce->list], ce);
+            if (++skipped >= c->entries) {
+                return;
+            }
+            continue;
+        }
+        if (!lobject_try_evict(ce->object)) {
+            // pinned by a lookup since it was put on the list, it goes back
+            // on when it gets released
+            continue;
+        }
+        // committed objects are persisted, so they can be loaded again
+        c->evictions++;
+        c->evicted_bytes += ce->size;
+        c->policy->evicted(c, ce);
+        cache_drop_entry(c, ce);
+    }
 }
 
 // -------- implementation of public functions --------
 
-struct cache* cache_new(int initial_size) {
+struct cache* cache_new(int initial_size, size_t budget, enum cache_policy policy) {
     struct cache *ret = malloc(sizeof(struct cache));
-    ret->table = malloc(sizeof(struct cache_entry*) * initial_size);
-    ret->size = initial_size;
-    ret->slots_used = 0;
+    atomic_init(&ret->table, cache_table_new(initial_size));
+    atomic_init(&ret->old_table, NULL);
+    ret->rehash_idx = 0;
     ret->entries = 0;
-    ret->newest = NULL;
-    ret->oldest = NULL;
-    memset(ret->table, 0, sizeof(struct cache_entry*) * initial_size);
+    ret->bytes = 0;
+    ret->budget = budget;
+    ret->evictions = 0;
+    ret->evicted_bytes = 0;
+    ret->evict_check = NULL;
+    ret->evict_check_arg = NULL;
+    memset(ret->lists, 0, sizeof(ret->lists));
+    ret->arc_target = 0;
+    ret->ghosts = NULL;
+    ret->ghosts_size = 0;
+    ret->ghosts_count = 0;
+    switch (policy) {
+        case CACHE_POLICY_LRU:
+            ret->policy = &lru_policy;
+            break;
+        case CACHE_POLICY_ARC:
+            ret->policy = &arc_policy;
+            if (budget > 0) {
+                ret->ghosts_size = initial_size;
+                ret->ghosts = malloc(sizeof(struct cache_entry*) * initial_size);
+                memset(ret->ghosts, 0, sizeof(struct cache_entry*) * initial_size);
+            }
+            break;
+        default:
+            assert(false);
+    }
     return ret;
 }
 
 void cache_free(struct cache *c) {
-    free(c->table);
-    while (c->oldest) {
-        struct cache_entry *ce = c->oldest;
-        c->oldest = ce->newer;
-        // XXX free object?
-        free(ce);
+    struct cache_table *old = atomic_load(&c->old_table);
+    if (old) {
+        cache_rehash_step(c, old->size);
+    }
+    struct cache_table *t = atomic_load(&c->table);
+    for (int i = 0; i < t->size; i++) {
+        while (t->buckets[i]) {
+            struct cache_entry *ce = t->buckets[i];
+            t->buckets[i] = ce->list_next;
+            // XXX free object?
+            free(ce);
+        }
+    }
+    for (int i = 0; i < c->ghosts_size; i++) {
+        while (c->ghosts[i]) {
+            struct cache_entry *ge = c->ghosts[i];
+            c->ghosts[i] = ge->list_next;
+            free(ge);
+        }
     }
+    free(c->ghosts);
+    free(t);
     free(c);
+    epoch_reclaim();
 }
 
-struct lobject* cache_get_object(struct cache *c, object_id id) {
-    struct cache_entry *ce = c->table[id % c->size];
-    while (ce != NULL) {
-        if (obj_get_id(lobject_get_object(ce->object)) == id) {
-            lobject_pin(ce->object);
-
-            // remove from recently-used linkedlist
-            if (c->newest == ce) {
-                c->newest = ce->older;
-            }
-            if (c->oldest == ce) {
-                c->oldest = ce->newer;
-            }
-            if (ce->older != NULL) {
-                ce->older->newer = ce->newer;
-            }
-            if (ce->newer != NULL) {
-                ce->newer->older = ce->older;
-            }
-            ce->older = NULL;
-            ce->newer = NULL;
+void cache_set_evict_check(struct cache *c,
+        bool (*check)(struct lobject *lo, void *arg), void *arg) {
+    c->evict_check = check;
+    c->evict_check_arg = arg;
+}
 
-            return ce->object;
+struct lobject* cache_get_object(struct cache *c, object_id id) {
+    epoch_enter();
+    struct cache_table *t = atomic_load_explicit(&c->table, memory_order_acquire);
+    struct lobject *ret = cache_lookup_bucket(&t->buckets[id % t->size], id);
+    if (!ret) {
+        struct cache_table *old = atomic_load_explicit(&c->old_table, memory_order_acquire);
+        if (old) {
+            ret = cache_lookup_bucket(&old->buckets[id % old->size], id);
         }
-        ce = ce->list_next;
     }
-    return NULL;
+    epoch_exit();
+    return ret;
+}
+
+struct lobject* cache_peek_object(struct cache *c, object_id id) {
+    struct cache_entry *ce = atomic_load_explicit(cache_bucket(c, id), memory_order_relaxed);
+    while (ce && (ce->id != id)) {
+        ce = atomic_load_explicit(&ce->list_next, memory_order_relaxed);
+    }
+    return ce ? ce->object : NULL;
 }
 
 void cache_put_object(struct cache *c, struct lobject *o) {
+    cache_rehash_step(c, REHASH_STEP);
     object_id id = obj_get_id(lobject_get_object(o));
-    struct cache_entry *ce = c->table[id % c->size];
+    struct cache_entry *_Atomic *bucket = cache_bucket(c, id);
     struct cache_entry *ne = malloc(sizeof(struct cache_entry));
     c->entries++;
+    ne->id = id;
     ne->object = o;
-    ne->list_next = ce;
+    ne->size = obj_get_footprint(lobject_get_object(o));
+    c->bytes += ne->size;
+    atomic_init(&ne->list_next, atomic_load_explicit(bucket, memory_order_relaxed));
+    ne->linked = false;
+    ne->removed = false;
+    atomic_init(&ne->referenced, false);
     ne->newer = NULL;
     ne->older = NULL;
-    c->table[id % c->size] = ne;
+    c->policy->insert(c, ne);
     lobject_pin(o);
-    if (ce == NULL) {
-        c->slots_used++;
-    }
-    if (c->slots_used > c->size * LOAD_FACTOR) {
+    atomic_store_explicit(bucket, ne, memory_order_release);
+    struct cache_table *t = atomic_load_explicit(&c->table, memory_order_relaxed);
+    if ((!atomic_load_explicit(&c->old_table, memory_order_relaxed))
+            && (c->entries > t->size * LOAD_FACTOR)) {
         cache_resize(c);
     }
-    // XXX newer and older are never set...
+    cache_evict(c);
 }
 
 void cache_release_object(struct cache *c, struct lobject *o) {
+    cache_rehash_step(c, REHASH_STEP);
     lobject_unpin(o);
+    if (lobject_is_pinned(o)) {
+        // someone else is still using it
+        return;
+    }
     object_id id = obj_get_id(lobject_get_object(o));
-    struct cache_entry *ce = c->table[id % c->size];
+    struct cache_entry *ce = atomic_load_explicit(cache_bucket(c, id), memory_order_relaxed);
     while (ce != NULL) {
-        if (obj_get_id(lobject_get_object(ce->object)) == id) {
-            // this is the object we are looking for, splice it into
-            // recently-used linkedlist
-            ce->newer = NULL;
-            ce->older = c->newest;
-            c->newest = ce;
-            if (c->oldest == NULL) {
-                c->oldest = ce;
+        if (ce->object == o) {
+            if (ce->removed) {
+                // a lookup that pins it from now on releases it again
+                if (lobject_try_evict(o)) {
+                    cache_drop_entry(c, ce);
+                }
+                return;
+            }
+            // this is the object we are looking for. tell the policy about
+            // any lookups since it was last released, then make it
+            // evictable
+            if (ce->linked) {
+                cache_list_unlink(&c->lists[ce->list], ce);
             }
+            // objects only get modified while pinned, so this is the time to
+            // pick up changes to the size
+            size_t size = obj_get_footprint(lobject_get_object(o));
+            c->bytes = c->bytes - ce->size + size;
+            c->lists[ce->list].bytes = c->lists[ce->list].bytes - ce->size + size;
+            ce->size = size;
+            if (atomic_exchange_explicit(&ce->referenced, false, memory_order_relaxed)) {
+                c->policy->hit(c, ce);
+            }
+            cache_list_push(&c->lists[ce->list], ce);
             break;
         }
-        ce = ce->list_next;
+        ce = atomic_load_explicit(&ce->list_next, memory_order_relaxed);
     }
     assert(ce != NULL);
 
-    while ((c->entries > c->size * CHAIN_FACTOR) && (c->oldest)) {
-        ce = c->oldest;
-        c->oldest = ce->newer;
-        if (c->oldest == NULL) {
-            c->newest = NULL;
-        }
-        else {
-            c->oldest->older = NULL;
+    cache_evict(c);
+}
+
+void cache_remove_object(struct cache *c, struct lobject *o) {
+    cache_rehash_step(c, REHASH_STEP);
+    object_id id = obj_get_id(lobject_get_object(o));
+    struct cache_entry *ce = atomic_load_explicit(cache_bucket(c, id), memory_order_relaxed);
+    while (ce->object != o) {
+        ce = atomic_load_explicit(&ce->list_next, memory_order_relaxed);
+    }
+    if (ce->linked) {
+        cache_list_unlink(&c->lists[ce->list], ce);
+    }
+    ce->removed = true;
+    if (lobject_try_evict(o)) {
+        cache_drop_entry(c, ce);
+    }
+}
+
+int cache_get_entries(struct cache *c) {
+    return c->entries;
+}
+
+void cache_get_stats(struct cache *c, struct cache_stats *stats) {
+    stats->objects = c->entries;
+    stats->resident_bytes = c->bytes;
+    stats->pinned_objects = 0;
+    stats->pinned_bytes = 0;
+    stats->evictions = c->evictions;
+    stats->evicted_bytes = c->evicted_bytes;
+    struct cache_table *tables[] = {
+        atomic_load_explicit(&c->table, memory_order_relaxed),
+        atomic_load_explicit(&c->old_table, memory_order_relaxed)
+    };
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; tables[i] && (j < tables[i]->size); j++) {
+            struct cache_entry *ce = atomic_load_explicit(&tables[i]->buckets[j],
+                memory_order_relaxed);
+            while (ce) {
+                if (lobject_is_pinned(ce->object)) {
+                    stats->pinned_objects++;
+                    stats->pinned_bytes += ce->size;
+                }
+                ce = atomic_load_explicit(&ce->list_next, memory_order_relaxed);
+            }
         }
-        free(ce);
-        c->entries--;
     }
 }
@@ -6,19 +6,72 @@
 
 /* this implements a simple cache of objects. objects are pinned in the cache
  * until released, which means they will not be removed from the cache until
- * released. */
+ * released. the cache keeps track of the memory footprint of the objects in
+ * it (see obj_get_footprint()), and once that exceeds its budget, unpinned
+ * objects are thrown out according to the eviction policy chosen at
+ * cache_new() */
+
+enum cache_policy {
+    // plain least-recently-used
+    CACHE_POLICY_LRU,
+    // adaptive replacement cache: objects used once and objects used
+    // repeatedly are kept on separate lists, and the split between the two
+    // adapts based on misses on recently evicted ids. a sweep across many
+    // objects that are only used once can therefore not push out the hot ones
+    CACHE_POLICY_ARC
+};
 
 struct cache;
 
-struct cache* cache_new(int initial_size);
+struct cache_stats {
+    int objects;
+    size_t resident_bytes;
+    int pinned_objects;
+    size_t pinned_bytes;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+};
+
+// the budget is in bytes, 0 means the cache grows without bounds and never
+// evicts
+struct cache* cache_new(int initial_size, size_t budget, enum cache_policy policy);
 void cache_free(struct cache *c);
+// with a check set, only unpinned objects that it returns true for get
+// evicted. the others stay in the cache and get checked again later, so the
+// cache can stay above its budget for a while. this gets called with
+// whatever serializes the modifying functions held
+void cache_set_evict_check(struct cache *c,
+    bool (*check)(struct lobject *lo, void *arg), void *arg);
+
+/* all functions apart from cache_get_object() modify the cache and need to be
+ * serialized by the caller. cache_get_object() takes no locks and can be
+ * called concurrently with anything else */
 
 // get object from cache, increase refcount by one. you need to release() the object
-// so that it can be purged from cache. return NULL if not found.
+// so that it can be purged from cache. return NULL if not found. when called
+// concurrently with a modification, this may return NULL for an object that
+// is in the cache, so callers need to look again under their latch before
+// concluding that it is absent.
 struct lobject* cache_get_object(struct cache *c, object_id id);
+// get object from cache without pinning it or counting it as a use for the
+// eviction policy, NULL if not found. this needs to be serialized like the
+// modifying functions, and the object is only safe to use while it is
+struct lobject* cache_peek_object(struct cache *c, object_id id);
 // put object in cache, it must not be there already. sets to pinned as well
 void cache_put_object(struct cache *c, struct lobject *o);
 // unpin item so that it can be replaced in the cache
 void cache_release_object(struct cache *c, struct lobject *o);
+// take an object that cannot be loaded again, e.g. because it never got
+// committed, out of the cache and free it. this does not count as an eviction.
+// if it is pinned, that only happens once the last pin is released, lookups
+// can still find it until then
+void cache_remove_object(struct cache *c, struct lobject *o);
+
+// number of objects currently in the cache, pinned or not
+int cache_get_entries(struct cache *c);
+// fills in the current usage of the cache. this walks the whole cache to
+// find the pinned objects, so it is meant for introspection rather than for
+// frequent calls
+void cache_get_stats(struct cache *c, struct cache_stats *stats);
 
 #endif /* CACHE_H */
@@ -1,10 +1,13 @@
 #include "cmc.h"
 
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "cc_par.h"
 #include "cc_lex.h"
 #include "cc_ast.h"
+#include "object.h"
+#include "image.h"
 
 struct cmc_ctx* cmc_parse(char *buffer, int mode) {
 
@@ -22,3 +25,63 @@ struct cmc_ctx* cmc_parse(char *buffer, int mode) {
     free(buffer);
     return ctx;
 }
+
+// lists are built back to front by the parser, this puts them in source order
+static int cmc_list_to_array(list_entry *l, ast_node ***entries) {
+    int count = 0;
+    for (list_entry *e = l; e; e = e->prev) {
+        count++;
+    }
+    *entries = malloc(sizeof(ast_node*) * (count ? count : 1));
+    int i = count;
+    for (list_entry *e = l; e; e = e->prev) {
+        (*entries)[--i] = e->entry;
+    }
+    return count;
+}
+
+static struct object* cmc_make_object(object_def *def, object_id oid) {
+    struct object *o = obj_new();
+    obj_set_id(o, oid);
+    ast_node **globals;
+    int count = cmc_list_to_array(def->globals, &globals);
+    for (int i = 0; i < count; i++) {
+        global *g = (global*)globals[i];
+        val v;
+        val_init(&v);
+        if (g->value && yyisa(g->value, literal)) {
+            v = ((literal*)g->value)->value;
+            val_inc_ref(v);
+        }
+        // XXX anything but a literal needs to be evaluated, which we can't yet
+        obj_set_global(o, g->name, v);
+    }
+    free(globals);
+    // XXX the slots need code generation, which we don't have yet
+    return o;
+}
+
+bool cmc_emit_image(struct cmc_ctx *ctx, char *path, object_id first_id) {
+    if (ctx->error || !ctx->resp || !yyisa(ctx->resp, comp_unit)) {
+        return false;
+    }
+    if (first_id == 0) {
+        fprintf(stderr, "object 0 would need an init slot, which we cannot generate yet\n");
+        return false;
+    }
+    ast_node **defs;
+    int count = cmc_list_to_array(((comp_unit*)ctx->resp)->objects, &defs);
+    struct object **objs = malloc(sizeof(struct object*) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        objs[i] = cmc_make_object((object_def*)defs[i], first_id + i);
+        printf("%s -> #%lu\n", ((object_def*)defs[i])->name,
+            (unsigned long)(first_id + i));
+    }
+    bool ret = image_write(path, objs, count);
+    for (int i = 0; i < count; i++) {
+        obj_free(objs[i]);
+    }
+    free(objs);
+    free(defs);
+    return ret;
+}
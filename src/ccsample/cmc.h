@@ -1,6 +1,10 @@
 #ifndef CMC_H
 #define CMC_H
 
+#include <stdbool.h>
+
+#include "types.h"
+
 #define MODE_SLOT       0
 #define MODE_COMPUNIT   1
 #define MODE_OFF        2
@@ -17,6 +21,17 @@ struct cmc_ctx {
     YYNODESTATE ast_state;
 };
 
+/* the first id objects get by default. ids below this are reserved for the
+ * bootstrap objects the store starts out with, see persist_open() */
+#define CMC_FIRST_ID    1000
+
 struct cmc_ctx* cmc_parse(char *buffer, int mode);
+/* writes the objects of a parsed compilation unit to a core image, see
+ * image.h. they get consecutive ids from first_id on, in the order of the
+ * source. returns false if there was nothing to write or it failed.
+ * an image with object 0 replaces the bootstrap objects, and the driver calls
+ * "init" on that. we cannot generate code for slots yet, so such an image
+ * would not start, and first_id 0 is refused */
+bool cmc_emit_image(struct cmc_ctx *ctx, char *path, object_id first_id);
 
 #endif /* CMC_H */
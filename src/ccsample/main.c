@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "cmc.h"
 // XXX fro now we need access to the ast directly, also in the deps in the
@@ -26,12 +27,32 @@ size_t readfile(FILE *in, char **buffer) {
     return size;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
+    // with -o, the input is a compilation unit that goes into a core image,
+    // and -f sets the id of its first object
+    char *image = NULL;
+    object_id first_id = CMC_FIRST_ID;
+    if ((argc >= 3) && (strcmp(argv[1], "-o") == 0)) {
+        image = argv[2];
+    }
+    if ((argc == 5) && image && (strcmp(argv[3], "-f") == 0)) {
+        first_id = strtoull(argv[4], NULL, 10);
+    }
+    else if ((argc != 1) && !(image && (argc == 3))) {
+        fprintf(stderr, "usage: %s [-o image [-f first_id]] < source\n", argv[0]);
+        return 1;
+    }
     char *buffer = NULL;
     readfile(stdin, &buffer);
-    struct cmc_ctx *ctx = cmc_parse(buffer, MODE_SLOT);
+    struct cmc_ctx *ctx = cmc_parse(buffer, image ? MODE_COMPUNIT : MODE_SLOT);
 
-    if (!ctx->error) {
+    if (image) {
+        if (!cmc_emit_image(ctx, image, first_id)) {
+            fprintf(stderr, "%s: could not write image\n", image);
+            return 1;
+        }
+    }
+    else if (!ctx->error) {
         printf("------------------\n");
         dump(ctx->resp, 0, false, false);
         printf("------------------\n");
@@ -23,4 +23,7 @@ typedef uint64_t object_id;
  * */
 typedef uint64_t val;
 
+/* an interned name, see symbol.h */
+typedef uint32_t symbol;
+
 #endif /* DEFS_H */
@@ -0,0 +1,134 @@
+#include "epoch.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* number of retired items after which we try to reclaim */
+#define RECLAIM_THRESHOLD   64
+
+// -------- internal structures --------
+
+/* each thread that ever entered a read section has one of these. active is
+ * 0 outside of a read section, and the global epoch at the time of entering
+ * plus one inside. they are aligned to a cache line so that threads entering
+ * and leaving do not disturb each other */
+struct epoch_record {
+    _Alignas(64) atomic_uint_fast64_t active;
+    int depth;
+    struct epoch_record *next;
+};
+
+struct epoch_retired {
+    void *p;
+    void (*free_fn)(void *p);
+    uint64_t epoch;
+    struct epoch_retired *next;
+};
+
+// -------- module state --------
+
+static atomic_uint_fast64_t global_epoch = 1;
+
+static _Thread_local struct epoch_record *local_record = NULL;
+
+// records of all threads, these are never freed. the latch also protects the
+// list of retired items
+static pthread_mutex_t epoch_latch = PTHREAD_MUTEX_INITIALIZER;
+static struct epoch_record *_Atomic records = NULL;
+static struct epoch_retired *retired = NULL;
+static int retired_count = 0;
+
+// -------- internal functions --------
+
+struct epoch_record* epoch_local_record(void) {
+    if (!local_record) {
+        struct epoch_record *r = aligned_alloc(64, sizeof(struct epoch_record));
+        atomic_init(&r->active, 0);
+        r->depth = 0;
+        pthread_mutex_lock(&epoch_latch);
+        r->next = atomic_load(&records);
+        atomic_store(&records, r);
+        pthread_mutex_unlock(&epoch_latch);
+        local_record = r;
+    }
+    return local_record;
+}
+
+// advances the global epoch if all threads in a read section have seen the
+// current one. needs to be called with the latch held
+void epoch_try_advance(void) {
+    uint64_t e = atomic_load(&global_epoch);
+    struct epoch_record *r = atomic_load(&records);
+    while (r) {
+        uint64_t a = atomic_load(&r->active);
+        if ((a != 0) && (a != e + 1)) {
+            return;
+        }
+        r = r->next;
+    }
+    atomic_compare_exchange_strong(&global_epoch, &e, e + 1);
+}
+
+// frees all retired items that are safe to free, the latch needs to be held.
+// items retired in epoch e may still be seen by readers that entered in e or
+// e - 1, once the global epoch has moved on twice none of them can be left
+void epoch_free_safe(void) {
+    uint64_t e = atomic_load(&global_epoch);
+    struct epoch_retired **pr = &retired;
+    while (*pr) {
+        struct epoch_retired *item = *pr;
+        if (item->epoch + 2 <= e) {
+            *pr = item->next;
+            item->free_fn(item->p);
+            free(item);
+            retired_count--;
+        }
+        else {
+            pr = &item->next;
+        }
+    }
+}
+
+// -------- implementation of public functions --------
+
+void epoch_enter(void) {
+    struct epoch_record *r = epoch_local_record();
+    if (r->depth++ == 0) {
+        // needs to be sequentially consistent so that a writer that advances
+        // the epoch after this store is guaranteed to see us
+        atomic_store(&r->active, atomic_load(&global_epoch) + 1);
+    }
+}
+
+void epoch_exit(void) {
+    struct epoch_record *r = local_record;
+    if (--r->depth == 0) {
+        atomic_store_explicit(&r->active, 0, memory_order_release);
+    }
+}
+
+void epoch_retire(void *p, void (*free_fn)(void *p)) {
+    struct epoch_retired *item = malloc(sizeof(struct epoch_retired));
+    item->p = p;
+    item->free_fn = free_fn;
+    pthread_mutex_lock(&epoch_latch);
+    item->epoch = atomic_load(&global_epoch);
+    item->next = retired;
+    retired = item;
+    retired_count++;
+    if (retired_count >= RECLAIM_THRESHOLD) {
+        epoch_try_advance();
+        epoch_free_safe();
+    }
+    pthread_mutex_unlock(&epoch_latch);
+}
+
+void epoch_reclaim(void) {
+    pthread_mutex_lock(&epoch_latch);
+    epoch_try_advance();
+    epoch_try_advance();
+    epoch_free_safe();
+    pthread_mutex_unlock(&epoch_latch);
+}
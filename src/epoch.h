@@ -0,0 +1,29 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/* this implements epoch-based reclamation, which allows readers to traverse
+ * shared structures without taking locks while writers concurrently unlink
+ * parts of them. Readers wrap their accesses in epoch_enter()/epoch_exit(),
+ * writers hand unlinked memory to epoch_retire() rather than freeing it. The
+ * memory is only actually freed once every thread that was inside a read
+ * section at the time has left it.
+ *
+ * Entering and leaving a read section only touches a per-thread record and
+ * reads the global epoch, so it takes no locks and does not write to any
+ * shared cache line. Retiring takes a global mutex, which is fine as long as
+ * unlinking is rare compared to reading.
+ * */
+
+/* read sections nest, and must not block for long as they hold up
+ * reclamation for everyone */
+void epoch_enter(void);
+void epoch_exit(void);
+
+/* free p by calling free_fn(p) once no reader can still be looking at it */
+void epoch_retire(void *p, void (*free_fn)(void *p));
+
+/* frees whatever has become safe to free, this happens automatically every
+ * now and then when retiring but can also be called explicitly */
+void epoch_reclaim(void);
+
+#endif /* EPOCH_H */
@@ -5,14 +5,29 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdatomic.h>
 // XXX
 #include <stdio.h>
 
 #include "types.h"
+#include "epoch.h"
 #include "object.h"
 #include "store.h"
+#include "symbol.h"
+#include "trace.h"
 
 #define INITIAL_STACK_SIZE  1024
+// how deeply nested calls can get before the tracer loses track of ip offsets
+#define TRACE_MAX_DEPTH     64
+// number of call sites with an inline cache, needs to be a power of two
+#define CALL_IC_SIZE        1024
+// number of different receivers cached per call site
+#define CALL_IC_WAYS        4
+// maximum number of objects consulted while resolving a method for the
+// result to still be cacheable
+#define CALL_IC_DEPTH       4
+// number of GETGLOBAL/SETGLOBAL sites with an inline cache, power of two
+#define GLOBAL_IC_SIZE      1024
 
 // XXX this file needs reodering and sections
 
@@ -25,7 +40,7 @@ union stack_element {
 
 struct syscall_entry {
     uint8_t arity;
-    char *name;
+    symbol name;
     union syscall_arity {
         val (*a0)(void *ctx);
         val (*a1)(void *ctx, val v1);
@@ -40,6 +55,53 @@ struct syscall_table {
     void *ctx;
 };
 
+/* method resolution for OP_CALL is cached per call site, keyed by the address
+ * of the CALL instruction. the name of the method comes from a register, so
+ * a site can call different methods on the same receiver, and an entry is for
+ * a receiver and a name. it remembers every object that was consulted
+ * while resolving the method, along with its code version. the first of them
+ * is the receiver, the last one the object that defines the method. the entry
+ * is only used while all these versions still match, so any obj_set_code() or
+ * parent change along the way invalidates it. the store bumps the code version
+ * of an object when it gets superseded by a version with different code. with
+ * STORE_MVCC this means a hit can return code from a parent version that is
+ * newer than the snapshot of the transaction. methods change rarely enough
+ * that we accept this.
+ * the entry holds a reference on each object in the path, so their code
+ * versions can be checked even after the store has dropped them. a replaced
+ * entry gives these up through epoch_retire(), as a concurrent lookup might
+ * still be looking at them. the code that a lookup returns stays valid for as
+ * long as eval_exec() runs, which is a read section for that reason */
+struct call_ic_entry {
+    symbol name;
+    int depth;
+    struct object *path[CALL_IC_DEPTH];
+    uint32_t versions[CALL_IC_DEPTH];
+    opcode *code;
+};
+
+/* the caches are shared by all threads, so each call site is protected by a
+ * seqlock: writers that can't get it just don't update the cache, readers
+ * never block and retry the slow way if they see a concurrent update */
+struct call_ic {
+    atomic_uint seq;    // odd while an update is in progress
+    opcode *site;
+    int next_way;
+    struct call_ic_entry entries[CALL_IC_WAYS];
+};
+
+/* GETGLOBAL and SETGLOBAL cache the index of the global per instruction site,
+ * keyed by the shape of the object and the name. shapes never change, so
+ * such an entry stays valid for as long as the object has the cached shape.
+ * these use the same seqlock scheme as the call-site caches */
+struct global_ic {
+    atomic_uint seq;
+    opcode *site;
+    struct shape *shape;
+    symbol name;
+    int idx;
+};
+
 struct eval_ctx {
     // our base registers
     union stack_element *fp;
@@ -56,6 +118,12 @@ struct eval_ctx {
     struct store_tx *stx;
     // XXX bit of a kludge, need to find a better way to recurse
     struct lobject *obj;
+#ifdef EVAL_TRACE
+    // start of the code of each active method, so that the tracer can record
+    // offsets rather than raw addresses
+    opcode *trace_bases[TRACE_MAX_DEPTH];
+    int trace_depth;
+#endif
 };
 
 struct eval_ctx* eval_new_ctx(uint64_t task_id, struct store_tx *stx) {
@@ -73,6 +141,9 @@ struct eval_ctx* eval_new_ctx(uint64_t task_id, struct store_tx *stx) {
     ret->task_id = task_id;
     ret->stx = stx;
     ret->obj = NULL;
+#ifdef EVAL_TRACE
+    ret->trace_depth = 0;
+#endif
     return ret;
 }
 
@@ -89,23 +160,258 @@ void eval_free_ctx(struct eval_ctx *ctx) {
     free(ctx);
 }
 
-int eval_get_code_recursive(struct lobject *lo, char *name, opcode **code_buf, struct store_tx *stx) {
+// -------- call-site inline caches --------
+
+static struct call_ic call_ics[CALL_IC_SIZE];
+static struct global_ic global_ics[GLOBAL_IC_SIZE];
+
+uint64_t eval_site_hash(opcode *site) {
+    uint64_t h = (uint64_t)site;
+    h ^= h >> 17;
+    return h;
+}
+
+struct call_ic* call_ic_for_site(opcode *site) {
+    return &call_ics[eval_site_hash(site) & (CALL_IC_SIZE - 1)];
+}
+
+void eval_retired_object_free(void *p) {
+    obj_free(p);
+}
+
+void call_ic_entry_retain(struct call_ic_entry *ce) {
+    for (int i = 0; i < ce->depth; i++) {
+        obj_retain(ce->path[i]);
+    }
+}
+
+void call_ic_entry_release(struct call_ic_entry *ce) {
+    for (int i = 0; i < ce->depth; i++) {
+        epoch_retire(ce->path[i], eval_retired_object_free);
+    }
+}
+
+// returns the cached code for calling the method name from the given site on
+// receiver, or NULL if there is no valid cache entry. needs to be called in a
+// read section, see struct call_ic_entry
+opcode* call_ic_lookup(opcode *site, struct object *receiver, symbol name) {
+    struct call_ic *ic = call_ic_for_site(site);
+    unsigned int seq = atomic_load_explicit(&ic->seq, memory_order_acquire);
+    if ((seq & 1) || (ic->site != site)) {
+        return NULL;
+    }
+    struct call_ic_entry ce;
+    ce.depth = 0;
+    for (int i = 0; i < CALL_IC_WAYS; i++) {
+        if ((ic->entries[i].path[0] == receiver) && (ic->entries[i].name == name)) {
+            ce = ic->entries[i];
+            break;
+        }
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if ((ce.depth == 0) || (atomic_load_explicit(&ic->seq, memory_order_relaxed) != seq)) {
+        return NULL;
+    }
+    for (int i = 0; i < ce.depth; i++) {
+        if (obj_get_code_version(ce.path[i]) != ce.versions[i]) {
+            return NULL;
+        }
+    }
+    return ce.code;
+}
+
+void call_ic_update(opcode *site, struct call_ic_entry *ce) {
+    if ((ce->depth == 0) || (ce->depth > CALL_IC_DEPTH)) {
+        // not cacheable
+        return;
+    }
+    struct call_ic *ic = call_ic_for_site(site);
+    unsigned int seq = atomic_load_explicit(&ic->seq, memory_order_relaxed);
+    if ((seq & 1) || !atomic_compare_exchange_strong(&ic->seq, &seq, seq + 1)) {
+        // someone else is updating this site, we can just skip it
+        return;
+    }
+    // the references of replaced entries only go once the update is visible
+    struct call_ic_entry replaced[CALL_IC_WAYS];
+    int num_replaced = 0;
+    if (ic->site != site) {
+        // evict whatever call site was here before
+        memcpy(replaced, ic->entries, sizeof(ic->entries));
+        num_replaced = CALL_IC_WAYS;
+        memset(ic->entries, 0, sizeof(ic->entries));
+        ic->site = site;
+        ic->next_way = 0;
+    }
+    int way = -1;
+    for (int i = 0; i < CALL_IC_WAYS; i++) {
+        if ((ic->entries[i].path[0] == ce->path[0]) && (ic->entries[i].name == ce->name)) {
+            way = i;
+            break;
+        }
+    }
+    if (way == -1) {
+        way = ic->next_way;
+        ic->next_way = (ic->next_way + 1) % CALL_IC_WAYS;
+    }
+    if (num_replaced == 0) {
+        replaced[num_replaced++] = ic->entries[way];
+    }
+    call_ic_entry_retain(ce);
+    ic->entries[way] = *ce;
+    atomic_store_explicit(&ic->seq, seq + 2, memory_order_release);
+    for (int i = 0; i < num_replaced; i++) {
+        call_ic_entry_release(&replaced[i]);
+    }
+}
+
+// returns the cached index of a global for objects of a shape, or -1 if
+// there is no matching cache entry
+int global_ic_lookup(opcode *site, struct shape *shape, symbol name) {
+    struct global_ic *ic = &global_ics[eval_site_hash(site) & (GLOBAL_IC_SIZE - 1)];
+    unsigned int seq = atomic_load_explicit(&ic->seq, memory_order_acquire);
+    if (seq & 1) {
+        return -1;
+    }
+    int ret = -1;
+    if ((ic->site == site) && (ic->shape == shape) && (ic->name == name)) {
+        ret = ic->idx;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&ic->seq, memory_order_relaxed) != seq) {
+        return -1;
+    }
+    return ret;
+}
+
+void global_ic_update(opcode *site, struct shape *shape, symbol name, int idx) {
+    struct global_ic *ic = &global_ics[eval_site_hash(site) & (GLOBAL_IC_SIZE - 1)];
+    unsigned int seq = atomic_load_explicit(&ic->seq, memory_order_relaxed);
+    if ((seq & 1) || !atomic_compare_exchange_strong(&ic->seq, &seq, seq + 1)) {
+        return;
+    }
+    ic->site = site;
+    ic->shape = shape;
+    ic->name = name;
+    ic->idx = idx;
+    atomic_store_explicit(&ic->seq, seq + 2, memory_order_release);
+}
+
+// the global accessors as used by GETGLOBAL and SETGLOBAL, going through the
+// inline cache of the instruction site
+val eval_get_global(opcode *site, struct object *o, symbol name) {
+    struct shape *shape = obj_get_shape(o);
+    int idx = global_ic_lookup(site, shape, name);
+    if (idx < 0) {
+        idx = shape_get_global_index(shape, name);
+        if (idx < 0) {
+            return val_make_nil();
+        }
+        global_ic_update(site, shape, name, idx);
+    }
+    return obj_get_global_at(o, idx);
+}
+
+void eval_set_global(opcode *site, struct object *o, symbol name, val v) {
+    struct shape *shape = obj_get_shape(o);
+    int idx = global_ic_lookup(site, shape, name);
+    if (idx < 0) {
+        idx = shape_get_global_index(shape, name);
+        if (idx < 0) {
+            // adds the global and changes the shape of the object, only the
+            // new shape is worth caching
+            obj_set_global_sym(o, name, v);
+            shape = obj_get_shape(o);
+            global_ic_update(site, shape, name, shape_get_global_index(shape, name));
+            return;
+        }
+        global_ic_update(site, shape, name, idx);
+    }
+    obj_set_global_at(o, idx, v);
+}
+
+// -------- method resolution --------
+
+// turns a name operand into a symbol. names are normally loaded as symbols,
+// strings are accepted as well but are only interned if requested. returns
+// SYM_NONE if there is no symbol for the name, nothing can be found under it
+// then
+symbol eval_name_to_sym(val name, bool intern) {
+    if (val_type(name) == TYPE_SYMBOL) {
+        return val_get_symbol(name);
+    }
+    if (val_type(name) == TYPE_STRING) {
+        if (intern) {
+            return sym_intern(val_get_string_data(name), val_get_string_len(name));
+        }
+        return sym_lookup(val_get_string_data(name), val_get_string_len(name));
+    }
+    return SYM_NONE;
+}
+
+// resolves a method on an object or its parents, if ce is not NULL all objects
+// consulted are recorded in it for the inline caches
+int eval_get_code_recursive(struct lobject *lo, symbol name, opcode **code_buf,
+        struct call_ic_entry *ce, struct store_tx *stx) {
+    struct object *o = store_get_version(stx, lo);
+    if (ce) {
+        // get the version before looking, so that a concurrent change
+        // invalidates the result
+        if (ce->depth < CALL_IC_DEPTH) {
+            ce->path[ce->depth] = o;
+            ce->versions[ce->depth] = obj_get_code_version(o);
+        }
+        ce->depth++;
+    }
     // XXX this should really be BFS rather than DFS
-    int ret = obj_get_code(lobject_get_object(lo), name, code_buf);
+    int ret = obj_get_code_sym(o, name, code_buf);
     int idx = 0;
-    int pc = obj_get_parent_count(lobject_get_object(lo));
+    int pc = obj_get_parent_count(o);
     while ((ret == 0) && (idx < pc)) {
-        object_id parent_id = obj_get_parent(lobject_get_object(lo), idx);
+        object_id parent_id = obj_get_parent(o, idx);
         struct lobject *parent = store_get_object(stx, parent_id);
         assert(parent);
         // XXX assert it is non-null, should be
-        ret = eval_get_code_recursive(parent, name, code_buf, stx);
+        ret = eval_get_code_recursive(parent, name, code_buf, ce, stx);
         idx++;
     }
     return ret;
 }
 
-int eval_exec(struct eval_ctx *ctx, opcode *code) {
+#ifdef EVAL_TRACE
+void eval_trace_enter(struct eval_ctx *ctx, opcode *code) {
+    ctx->trace_depth++;
+    if (ctx->trace_depth < TRACE_MAX_DEPTH) {
+        ctx->trace_bases[ctx->trace_depth] = code;
+    }
+}
+
+void eval_trace_op(struct eval_ctx *ctx, opcode *ip) {
+    uint32_t offset = TRACE_IP_UNKNOWN;
+    if ((ctx->trace_depth >= 0) && (ctx->trace_depth < TRACE_MAX_DEPTH)) {
+        offset = ip - ctx->trace_bases[ctx->trace_depth];
+    }
+    object_id oid = ctx->obj ? obj_get_id(lobject_get_object(ctx->obj)) : 0;
+    trace_record(*ip, offset, oid, ctx->task_id);
+}
+
+// the tracing hooks are macros so that they vanish completely if tracing is
+// not compiled in. the bases are tracked even if tracing is disabled at
+// runtime, so that it can be switched on in the middle of a call
+#define TRACE_ENTER(code)   eval_trace_enter(ctx, code)
+#define TRACE_LEAVE()       ctx->trace_depth--
+#define DISPATCH()          do { \
+                                if (trace_is_enabled()) { \
+                                    eval_trace_op(ctx, ip); \
+                                } \
+                                goto *dispatch_table[*ip++]; \
+                            } while (0)
+#else
+#define TRACE_ENTER(code)
+#define TRACE_LEAVE()
+#define DISPATCH()          goto *dispatch_table[*ip++]
+#endif
+
+int eval_run(struct eval_ctx *ctx, opcode *code) {
     // XXX we probably want to cache sp/fp/ip in register variables
     void* dispatch_table[] = {
         &&do_noop,
@@ -150,32 +456,31 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         &&do_self,
         &&do_parent,
         &&do_usleep,
+        &&do_load_symbol,
     };
-    #define DISPATCH() goto *dispatch_table[*ip++]
 
     opcode *ip = code;
-    printf(",----------------------------------,\n");
+#ifdef EVAL_TRACE
+    ctx->trace_depth = -1;
+#endif
+    TRACE_ENTER(code);
     DISPATCH();
     // some vars we need below, can't be declared after label...
     while(1) {
         do_noop: {
-            printf("| NOOP                             |\n");
             DISPATCH();
         }
         do_halt: {
-            printf("| HALT                             |\n");
             while (ctx->sp != ctx->stack) {
                 val_clear(&ctx->sp->val);
                 ctx->sp--;
             }
-            printf("'----------------------------------'\n");
             return EVAL_OK;
             DISPATCH();
         }
         do_debugi: {
             int32_t msg = *((int32_t*)ip);
             ip += 4;
-            printf("| DEBUGI 0x%08X                |\n", msg);
             if (ctx->callback) {
                 ctx->callback(val_make_int(msg), ctx->cb_arg);
             }
@@ -184,9 +489,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_debugr: {
             uint8_t msg_r = *((uint8_t*)ip);
             ip += 1;
-            char *val_text = val_print(ctx->fp[msg_r].val);
-            printf("| DEBUGR r0x%02X 0x%016lX %s\n", msg_r, ctx->fp[msg_r].val, val_text);
-            free(val_text);
             if (&ctx->fp[msg_r] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -201,7 +503,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src = *((uint8_t*)ip);
             ip += 1;
-            printf("| MOV r0x%02X <- r0x%02X               |\n", dst, src);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -219,9 +520,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_push: {
             uint8_t src = *((uint8_t*)ip);
             ip += 1;
-            char *val_text = val_print(ctx->fp[src].val);
-            printf("| PUSH r0x%02X %s\n", src, val_text);
-            free(val_text);
             if (&ctx->fp[src] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -237,7 +535,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_pop: {
             uint8_t dst = *((uint8_t*)ip);
             ip += 1;
-            printf("| POP r0x%02X                        |\n", dst);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -250,18 +547,30 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_call: {
             uint8_t nargs = *((uint8_t*)ip);
             ip += 1;
-            printf("| CALL %-4i                        |\n", nargs);
             val method_name = ctx->sp[nargs * -1 - 1].val;
             val obj_ref = ctx->sp[nargs * -1 - 2].val;
             // XXX assertions
             // XXX we need to push obj on the stack as well!!
             struct lobject *obj = store_get_object(ctx->stx, val_get_objref(obj_ref));
             assert(obj);
-            opcode *ccode;
-            int ret = eval_get_code_recursive(obj, val_get_string_data(method_name), &ccode, ctx->stx);
-            if (!ret) {
-                // XXX raise
-                printf("!! method not found\n");
+            // the site is the address of the CALL opcode itself. note that a
+            // cache hit means we do not lock the parents of the receiver
+            opcode *site = ip - 2;
+            symbol name = eval_name_to_sym(method_name, false);
+            opcode *ccode = call_ic_lookup(site, store_get_version(ctx->stx, obj), name);
+            if (!ccode) {
+                struct call_ic_entry ce;
+                ce.name = name;
+                ce.depth = 0;
+                int ret = eval_get_code_recursive(obj, name, &ccode, &ce, ctx->stx);
+                if (ret) {
+                    ce.code = ccode;
+                    call_ic_update(site, &ce);
+                }
+                else {
+                    // XXX raise
+                    printf("!! method not found\n");
+                }
             }
             val_dec_ref(ctx->sp[nargs * -1 - 2].val);
             ctx->sp[nargs * -1 - 2].se = ctx->fp;
@@ -272,12 +581,12 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ctx->obj = obj;
             ctx->fp = &ctx->sp[nargs * -1 + 1];
             ip = ccode;
+            TRACE_ENTER(ccode);
             DISPATCH();
         }
         do_return: {
             uint8_t reg = *((uint8_t*)ip);
             ip += 1;
-            printf("| RETURN r0x%02X                     |\n", reg);
             val ret = ctx->fp[reg].val; 
             union stack_element *old_fp = ctx->fp;
             ctx->obj = old_fp[-1].obj;
@@ -293,6 +602,7 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             // it's the old frame pointer! and val_clear()ing that is quite
             // unsafe...
             old_fp[-2].val = TYPE_NIL;
+            TRACE_LEAVE();
             DISPATCH();
         }
         do_args_locals: {
@@ -300,7 +610,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t nlocals = *((uint8_t*)ip);
             ip += 1;
-            printf("| ARGS_LOCALS 0x%02X 0x%02X            |\n", nargs, nlocals);
             if (ctx->sp != &ctx->fp[nargs - 1]) {
                 // XXX raise
                 printf("!! invalid number of arguments\n");
@@ -315,7 +624,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_clear: {
             uint8_t reg = *((uint8_t*)ip);
             ip += 1;
-            printf("| CLEAR r0x%02X                      |\n", reg);
             if (&ctx->fp[reg] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -326,7 +634,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_true: {
             uint8_t reg = *((uint8_t*)ip);
             ip += 1;
-            printf("| TRUE r0x%02X <- TRUE               |\n", reg);
             if (&ctx->fp[reg] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -340,7 +647,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             int32_t nval = *((int32_t*)ip);
             ip += 4;
-            printf("| LOAD_INT r0x%02X <- 0x%08X     |\n", reg, nval);
             if (&ctx->fp[reg] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -354,7 +660,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             float nval = *((float*)ip);
             ip += 4;
-            printf("| LOAD_FLOAT r0x%02X <- %8.3f     |\n", reg, nval);
             if (&ctx->fp[reg] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -369,9 +674,19 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             uint16_t len = *((uint16_t*)ip);
             ip += 2;
             val s = val_make_string(len, (char*)ip);
-            char *val_text = val_print(s);
-            printf("| LOAD_STRING r0x%02X <- %2i %s\n", reg, len, val_text);
-            free(val_text);
+            val_clear(&ctx->fp[reg].val);
+            ctx->fp[reg].val = s;
+            ip += len;
+            DISPATCH();
+        }
+        do_load_symbol: {
+            uint8_t reg = *((uint8_t*)ip);
+            ip += 1;
+            uint16_t len = *((uint16_t*)ip);
+            ip += 2;
+            // XXX we could patch the symbol into the code on first execution
+            // rather than looking it up every time
+            val s = val_make_symbol(sym_intern((char*)ip, len));
             val_clear(&ctx->fp[reg].val);
             ctx->fp[reg].val = s;
             ip += len;
@@ -382,7 +697,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src = *((uint8_t*)ip);
             ip += 1;
-            printf("| TYPE r0x%02X <- r0x%02X              |\n", dst, src);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -402,7 +716,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| LOGICAL_AND r0x%02X <- r0x%02X r0x%02X |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -437,7 +750,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| LOGICAL_OR r0x%02X <- r0x%02X r0x%02X  |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -470,7 +782,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src = *((uint8_t*)ip);
             ip += 1;
-            printf("| LOGICAL_NOT r0x%02X <- r0x%02X       |\n", dst, src);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -496,7 +807,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| EQ r0x%02X <- r0x%02X r0x%02X          |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -542,6 +852,10 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
                         result = false;
                     }
                 }
+                else if (val_type(ctx->fp[src_a].val) == TYPE_SYMBOL) {
+                    result = val_get_symbol(ctx->fp[src_a].val)
+                                == val_get_symbol(ctx->fp[src_b].val);
+                }
                 // XXX float
             }
             ctx->fp[dst].val = val_make_bool(result);
@@ -554,7 +868,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| LE r0x%02X <- r0x%02X r0x%02X          |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -603,7 +916,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| LT r0x%02X <- r0x%02X r0x%02X          |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -642,7 +954,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             else {
                 printf("!! argument type mismatch\n");
             }
-            printf("=> %s\n", result ? "true" : "false");
             ctx->fp[dst].val = val_make_bool(result);
             DISPATCH();
         }
@@ -653,7 +964,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| ADD r0x%02X <- r0x%02X r0x%02X         |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -694,7 +1004,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| SUB r0x%02X <- r0x%02X r0x%02X         |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -735,7 +1044,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| MUL r0x%02X <- r0x%02X r0x%02X         |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -778,7 +1086,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_jump: {
             int32_t rel_addr = *((int32_t*)ip);
             ip += 4;
-            printf("| JUMP %08i                    |\n", rel_addr);
             ip += rel_addr;
             DISPATCH();
         }
@@ -787,7 +1094,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             int32_t rel_addr = *((int32_t*)ip);
             ip += 4;
-            printf("| JUMP_IF r0x%02X %08i           |\n", cond, rel_addr);
             if (&ctx->fp[cond] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -813,16 +1119,14 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_syscall: {
             uint8_t nargs = *((uint8_t*)ip);
             ip += 1;
-            printf("| SYSCALL %-4i                     |\n", nargs);
             val syscall_name = ctx->sp[nargs * -1].val;
-            if (val_type(syscall_name) == TYPE_STRING) {
-                char *buf = malloc(val_get_string_len(syscall_name) + 1);
-                memcpy(buf, val_get_string_data(syscall_name), val_get_string_len(syscall_name));
-                buf[val_get_string_len(syscall_name)] = '\0';
+            if (   (val_type(syscall_name) == TYPE_SYMBOL)
+                || (val_type(syscall_name) == TYPE_STRING) ) {
+                symbol sname = eval_name_to_sym(syscall_name, false);
                 struct syscall_entry *se = NULL;
                 struct syscall_entry *cse = ctx->syscall_table->syscalls;
                 while (cse) {
-                    if ( (cse->arity == nargs) && (!strcmp(buf, cse->name)) ) {
+                    if ( (cse->arity == nargs) && (cse->name == sname) ) {
                         se = cse;
                         break;
                     }
@@ -849,9 +1153,10 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
                 }
                 else {
                     // XXX raise
-                    printf("!! syscall '%s' not found\n", buf);
+                    char *name = val_print(syscall_name);
+                    printf("!! syscall '%s' not found\n", name);
+                    free(name);
                 }
-                free(buf);
                 for (int i = 0; i <= nargs; i++) {
                     val_clear(&ctx->sp->val);
                     ctx->sp--;
@@ -870,7 +1175,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src = *((uint8_t*)ip);
             ip += 1;
-            printf("| LENGTH r0x%02X <- r0x%02X            |\n", dst, src);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -882,7 +1186,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             if (val_type(ctx->fp[src].val) == TYPE_STRING) {
                 val_clear(&ctx->fp[dst].val);
                 int result = val_get_string_len(ctx->fp[src].val);
-                printf("=> %i\n", result);
                 ctx->fp[dst].val = val_make_int(result);
             }
             else {
@@ -898,7 +1201,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t src_b = *((uint8_t*)ip);
             ip += 1;
-            printf("| CONCAT r0x%02X <- r0x%02X r0x%02X      |\n", dst, src_a, src_b);
             if (&ctx->fp[dst] > ctx->sp) {
                 // XXX raise
                 printf("!! access to reg outside stack\n");
@@ -929,28 +1231,30 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             DISPATCH();
         }
         do_getglobal: {
+            opcode *site = ip - 1;
             uint8_t dst = *((uint8_t*)ip);
             ip += 1;
             uint8_t name = *((uint8_t*)ip);
             ip += 1;
-            printf("| GETGLOBAL r0x%02X r0x%02X            |\n", dst, name);
-            val tval = obj_get_global(lobject_get_object(ctx->obj), val_get_string_data(ctx->fp[name].val));
+            val tval = eval_get_global(site, store_get_version(ctx->stx, ctx->obj),
+                eval_name_to_sym(ctx->fp[name].val, false));
             val_clear(&ctx->fp[dst].val);
             ctx->fp[dst].val = tval;
             DISPATCH();
         }
         do_setglobal: {
+            opcode *site = ip - 1;
             uint8_t name = *((uint8_t*)ip);
             ip += 1;
             uint8_t rval = *((uint8_t*)ip);
             ip += 1;
-            printf("| SETGLOBAL r0x%02X r0x%02X            |\n", name, rval);
-            printf("### tx %lX locking obj %li EXCLUSIVE\n", ctx->stx,  obj_get_id(lobject_get_object(ctx->obj)));
-            if (lock_lock(lobject_get_lock(ctx->obj), LOCK_EXCLUSIVE, ctx->stx)) {
-                printf("!!!! lock failed, needs transaction rollback and retry\n");
+            struct object *wobj = store_write_object(ctx->stx, ctx->obj);
+            if (!wobj) {
+                printf("!!!! write failed, needs transaction rollback and retry\n");
                 return EVAL_RETRY_TX;
             }
-            obj_set_global(lobject_get_object(ctx->obj), val_get_string_data(ctx->fp[name].val), ctx->fp[rval].val);
+            eval_set_global(site, wobj,
+                eval_name_to_sym(ctx->fp[name].val, true), ctx->fp[rval].val);
             DISPATCH();
         }
         do_make_obj: {
@@ -958,7 +1262,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
             ip += 1;
             uint8_t parent_ref = *((uint8_t*)ip);
             ip += 1;
-            printf("| MAKE_OBJ r0x%02X r0x%02X             |\n", new_ref, parent_ref);
             // XXX assert parent_ref is an objref and that both are in range
             struct lobject *obj = store_make_object(ctx->stx, val_get_objref(ctx->fp[parent_ref].val));
             val_clear(&ctx->fp[new_ref].val);
@@ -968,7 +1271,6 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_self: {
             uint8_t dst = *((uint8_t*)ip);
             ip += 1;
-            printf("| SELF r0x%02X                       |\n", dst);
             // XXX check in range
             val_clear(&ctx->fp[dst].val);
             ctx->fp[dst].val = val_make_objref(obj_get_id(lobject_get_object(ctx->obj)));
@@ -978,18 +1280,17 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
         do_parent: {
             uint8_t dst = *((uint8_t*)ip);
             ip += 1;
-            printf("| PARENT r0x%02X                     |\n", dst);
             // XXX check in range
             val_clear(&ctx->fp[dst].val);
-            if (obj_get_parent_count(lobject_get_object(ctx->obj)) > 0) {
-                ctx->fp[dst].val = val_make_objref(obj_get_parent(lobject_get_object(ctx->obj), 0));
+            struct object *self = store_get_version(ctx->stx, ctx->obj);
+            if (obj_get_parent_count(self) > 0) {
+                ctx->fp[dst].val = val_make_objref(obj_get_parent(self, 0));
             }
             DISPATCH();
         }
         do_usleep: {
             int32_t interval_us = *((int32_t*)ip);
             ip += 4;
-            printf("| USLEEP %010i                |\n", interval_us);
             usleep(interval_us);
             DISPATCH();
         }
@@ -999,6 +1300,15 @@ int eval_exec(struct eval_ctx *ctx, opcode *code) {
     return EVAL_OK;
 }
 
+int eval_exec(struct eval_ctx *ctx, opcode *code) {
+    // objects the store drops while we run, and with them the code we might
+    // be running, stay around until we are done
+    epoch_enter();
+    int ret = eval_run(ctx, code);
+    epoch_exit();
+    return ret;
+}
+
 int eval_exec_method(struct eval_ctx *ctx, struct lobject *obj, val method, int num_args, ...) {
     // XXX find method on object, load code, push args and exec
     // XXX ...for now, this isn't quite right around globals and an object stack
@@ -1009,17 +1319,39 @@ int eval_exec_method(struct eval_ctx *ctx, struct lobject *obj, val method, int
         eval_push_arg(ctx, va_arg(argp, val));
     }
 
+    // the method might come from a parent that is not locked, see eval_exec()
+    epoch_enter();
     opcode *code;
-    int ret = eval_get_code_recursive(obj, val_get_string_data(method), &code, ctx->stx);
+    int ret = eval_get_code_recursive(obj, eval_name_to_sym(method, false), &code, NULL, ctx->stx);
     if (ret) {
         ctx->obj = obj;
-        return eval_exec(ctx, code);
+        ret = eval_exec(ctx, code);
     }
     else {
-        printf("!! method '%s' not found on object %li\n", val_get_string_data(method),
+        char *name = val_print(method);
+        printf("!! method '%s' not found on object %li\n", name,
             obj_get_id(lobject_get_object(obj)));
-        return 2; // XXX actually the unrecoverable error
+        free(name);
+        ret = 2; // XXX actually the unrecoverable error
+    }
+    epoch_exit();
+    return ret;
+}
+
+const char* eval_op_name(opcode op) {
+    static const char *names[] = {
+        "NOOP", "HALT", "DEBUGI", "DEBUGR", "MOV", "PUSH", "POP", "CALL",
+        "RETURN", "ARGS_LOCALS", "CLEAR", "TRUE", "LOAD_INT", "LOAD_FLOAT",
+        "LOAD_STRING", "TYPE", "LOGICAL_AND", "LOGICAL_OR", "LOGICAL_NOT",
+        "EQ", "LE", "LT", "ADD", "SUB", "MUL", "DIV", "MOD", "JUMP", "JUMP_IF",
+        "JUMP_EQ", "JUMP_NE", "JUMP_LE", "JUMP_LT", "SYSCALL", "LENGTH",
+        "CONCAT", "GETGLOBAL", "SETGLOBAL", "MAKE_OBJ", "SELF", "PARENT",
+        "USLEEP", "LOAD_SYMBOL",
+    };
+    if (op < sizeof(names) / sizeof(names[0])) {
+        return names[op];
     }
+    return "??";
 }
 
 void eval_push_arg(struct eval_ctx *ctx, val v) {
@@ -1047,7 +1379,6 @@ void syscall_table_free(struct syscall_table *st) {
     while (st->syscalls) {
         struct syscall_entry *se = st->syscalls;
         st->syscalls = se->next;
-        free(se->name);
         free(se);
     }
     free(st);
@@ -1056,8 +1387,7 @@ void syscall_table_free(struct syscall_table *st) {
 void syscall_table_add_a0(struct syscall_table *st, char *name, val (*syscall)(void*)) {
     struct syscall_entry *se = malloc(sizeof(struct syscall_entry));
     se->arity = 0;
-    se->name = malloc(strlen(name) + 1);
-    strcpy(se->name, name);
+    se->name = sym_intern(name, strlen(name));
     se->funcptr.a0 = syscall;
     se->next = st->syscalls;
     st->syscalls = se;
@@ -1066,8 +1396,7 @@ void syscall_table_add_a0(struct syscall_table *st, char *name, val (*syscall)(v
 void syscall_table_add_a1(struct syscall_table *st, char *name, val (*syscall)(void*, val v1)) {
     struct syscall_entry *se = malloc(sizeof(struct syscall_entry));
     se->arity = 1;
-    se->name = malloc(strlen(name) + 1);
-    strcpy(se->name, name);
+    se->name = sym_intern(name, strlen(name));
     se->funcptr.a1 = syscall;
     se->next = st->syscalls;
     st->syscalls = se;
@@ -1076,8 +1405,7 @@ void syscall_table_add_a1(struct syscall_table *st, char *name, val (*syscall)(v
 void syscall_table_add_a2(struct syscall_table *st, char *name, val (*syscall)(void*, val v1, val v2)) {
     struct syscall_entry *se = malloc(sizeof(struct syscall_entry));
     se->arity = 2;
-    se->name = malloc(strlen(name) + 1);
-    strcpy(se->name, name);
+    se->name = sym_intern(name, strlen(name));
     se->funcptr.a2 = syscall;
     se->next = st->syscalls;
     st->syscalls = se;
@@ -1086,8 +1414,7 @@ void syscall_table_add_a2(struct syscall_table *st, char *name, val (*syscall)(v
 void syscall_table_add_a3(struct syscall_table *st, char *name, val (*syscall)(void*, val v1, val v2, val v3)) {
     struct syscall_entry *se = malloc(sizeof(struct syscall_entry));
     se->arity = 3;
-    se->name = malloc(strlen(name) + 1);
-    strcpy(se->name, name);
+    se->name = sym_intern(name, strlen(name));
     se->funcptr.a3 = syscall;
     se->next = st->syscalls;
     st->syscalls = se;
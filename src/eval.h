@@ -146,9 +146,16 @@
 // XXX this is a temporary/debug aid to expose concurrency issues, this opcode
 // should not be used in actual code
 #define OP_USLEEP         0x29 // int32:microseconds to sleep
+// like LOAD_STRING, but interns the name and loads a symbol. method, global
+// and syscall names should be loaded this way so that resolving them is an
+// integer compare
+#define OP_LOAD_SYMBOL    0x2A // reg8:dst <= int16 length, string:name
 
 // XXX more ops
 
+// returns the mnemonic for an opcode, e.g. for decoding traces
+const char* eval_op_name(opcode op);
+
 #define EVAL_OK             0   // evaluation finished successfully
 #define EVAL_RETRY_TX       1   // indicates that evaluation failed recoveraby, e.g. a deadlock
 // XXX need nonrecoverable error
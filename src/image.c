@@ -0,0 +1,322 @@
+#include "image.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define IMAGE_MAGIC     "CMOOIMG"
+#define IMAGE_VERSION   2
+
+// -------- implementation of declared public structures --------
+
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t object_count;
+    uint64_t index_offset;
+    // of the whole file, so that a truncated image gets noticed
+    uint64_t size;
+};
+
+// the index is 8 byte aligned in the file, so the entries can be read in
+// place
+struct image_index_entry {
+    object_id id;
+    uint64_t offset;
+    uint32_t code_len;
+    uint32_t state_len;
+};
+
+struct image {
+    char *base;
+    size_t size;
+    struct image_header *header;
+    struct image_index_entry *index;
+};
+
+struct image_writer {
+    char *path;
+    // written to a temporary file first, so that an image that is in use
+    // does not get clobbered with a half written one
+    char *tmp_path;
+    FILE *f;
+    bool ok;
+    // where the next object goes
+    uint64_t offset;
+    // in the order the objects were added, sorted at the end
+    struct image_index_entry *index;
+    uint64_t count;
+    uint64_t index_size;
+    // for serializing objects
+    char *code;
+    int code_cap;
+    char *state;
+    int state_cap;
+};
+
+// -------- utility functions internal to this module --------
+
+int image_compare_entries(const void *a, const void *b) {
+    object_id ia = ((const struct image_index_entry*)a)->id;
+    object_id ib = ((const struct image_index_entry*)b)->id;
+    return ia < ib ? -1 : (ia > ib ? 1 : 0);
+}
+
+struct image_index_entry* image_find_entry(struct image *img, object_id oid) {
+    uint64_t lo = 0;
+    uint64_t hi = img->header->object_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (img->index[mid].id < oid) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if ((lo < img->header->object_count) && (img->index[lo].id == oid)) {
+        return &img->index[lo];
+    }
+    return NULL;
+}
+
+// makes a rename into the directory the file at path is in durable
+bool image_sync_parent_dir(const char *path) {
+    char *copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+    free(copy);
+    if (fd < 0) {
+        return false;
+    }
+    bool ret = fsync(fd) == 0;
+    close(fd);
+    return ret;
+}
+
+void image_writer_free(struct image_writer *w) {
+    free(w->code);
+    free(w->state);
+    free(w->index);
+    free(w->tmp_path);
+    free(w->path);
+    free(w);
+}
+
+// -------- implementation of public functions --------
+
+struct image* image_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct image_header)) {
+        fprintf(stderr, "%s: not a core image\n", path);
+        close(fd);
+        return NULL;
+    }
+    // the mapping stays valid after closing the file
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+    struct image_header *h = (struct image_header*)base;
+    if ((memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0)
+            || (h->version != IMAGE_VERSION)
+            || (h->header_size != sizeof(struct image_header))
+            || (h->size != (uint64_t)st.st_size)
+            || (h->index_offset % 8 != 0)
+            || (h->index_offset > h->size)
+            || (h->object_count > (h->size - h->index_offset) / sizeof(struct image_index_entry))) {
+        fprintf(stderr, "%s: not a core image, or not of version %d\n", path, IMAGE_VERSION);
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    // the index only gets looked at when objects are asked for, and the
+    // kernel only reads in what we touch
+    struct image *ret = malloc(sizeof(struct image));
+    ret->base = base;
+    ret->size = st.st_size;
+    ret->header = h;
+    ret->index = (struct image_index_entry*)(base + h->index_offset);
+    return ret;
+}
+
+void image_close(struct image *img) {
+    munmap(img->base, img->size);
+    free(img);
+}
+
+int image_get_object_count(struct image *img) {
+    return img->header->object_count;
+}
+
+object_id image_next_id(struct image *img) {
+    uint64_t count = img->header->object_count;
+    return count ? img->index[count - 1].id + 1 : 0;
+}
+
+bool image_contains(struct image *img, object_id oid) {
+    return image_find_entry(img, oid) != NULL;
+}
+
+bool image_find(struct image *img, object_id oid, char **code, int *code_len,
+        char **state, int *state_len) {
+    struct image_index_entry *e = image_find_entry(img, oid);
+    if (!e || (e->offset > img->header->index_offset)
+            || ((uint64_t)e->code_len + e->state_len > img->header->index_offset - e->offset)) {
+        return false;
+    }
+    *code = img->base + e->offset;
+    *code_len = e->code_len;
+    *state = *code + e->code_len;
+    *state_len = e->state_len;
+    return true;
+}
+
+struct object* image_get(struct image *img, object_id oid) {
+    char *code;
+    char *state;
+    int code_len;
+    int state_len;
+    if (!image_find(img, oid, &code, &code_len, &state, &state_len)) {
+        return NULL;
+    }
+    // the strings and code of the object stay in the mapping
+    struct object *ret = obj_new();
+    if (!obj_code_from_mapping(ret, code, code_len)
+            || !obj_state_from_mapping(ret, state, state_len)) {
+        fprintf(stderr, "image: object %lu cannot be read\n", (unsigned long)oid);
+        obj_free(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+object_id image_get_id(struct image *img, int idx) {
+    return img->index[idx].id;
+}
+
+struct image_writer* image_writer_new(const char *path) {
+    struct image_writer *w = malloc(sizeof(struct image_writer));
+    w->path = strdup(path);
+    size_t len = strlen(path) + 5;
+    w->tmp_path = malloc(len);
+    snprintf(w->tmp_path, len, "%s.tmp", path);
+    w->f = fopen(w->tmp_path, "wb");
+    if (!w->f) {
+        perror(w->tmp_path);
+        free(w->tmp_path);
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+    w->ok = true;
+    w->code = NULL;
+    w->code_cap = 0;
+    w->state = NULL;
+    w->state_cap = 0;
+    w->offset = sizeof(struct image_header);
+    w->count = 0;
+    w->index_size = 1024;
+    w->index = malloc(sizeof(struct image_index_entry) * w->index_size);
+    // the header goes in last, once we know where everything is
+    w->ok = (fseek(w->f, sizeof(struct image_header), SEEK_SET) == 0);
+    return w;
+}
+
+void image_writer_add(struct image_writer *w, object_id oid, char *code, int code_len,
+        char *state, int state_len) {
+    if (w->count == w->index_size) {
+        w->index_size *= 2;
+        w->index = realloc(w->index, sizeof(struct image_index_entry) * w->index_size);
+    }
+    struct image_index_entry *e = &w->index[w->count++];
+    e->id = oid;
+    e->offset = w->offset;
+    e->code_len = code_len;
+    e->state_len = state_len;
+    w->ok = w->ok && (fwrite(code, 1, code_len, w->f) == (size_t)code_len);
+    w->ok = w->ok && (fwrite(state, 1, state_len, w->f) == (size_t)state_len);
+    w->offset += code_len + state_len;
+}
+
+void image_writer_add_object(struct image_writer *w, struct object *o) {
+    // buf_len is the capacity on the way in, and the size on the way out
+    int code_len = w->code_cap;
+    int state_len = w->state_cap;
+    obj_code_to_buffer(o, &w->code, &code_len);
+    obj_state_to_buffer(o, &w->state, &state_len);
+    w->code_cap = code_len > w->code_cap ? code_len : w->code_cap;
+    w->state_cap = state_len > w->state_cap ? state_len : w->state_cap;
+    image_writer_add(w, obj_get_id(o), w->code, code_len, w->state, state_len);
+}
+
+void image_writer_abort(struct image_writer *w) {
+    fclose(w->f);
+    unlink(w->tmp_path);
+    image_writer_free(w);
+}
+
+bool image_writer_finish(struct image_writer *w) {
+    qsort(w->index, w->count, sizeof(struct image_index_entry), image_compare_entries);
+    for (uint64_t i = 1; i < w->count; i++) {
+        if (w->index[i - 1].id == w->index[i].id) {
+            fprintf(stderr, "%s: object %lu is in the image twice\n", w->path,
+                (unsigned long)w->index[i].id);
+            image_writer_abort(w);
+            return false;
+        }
+    }
+    char pad[8] = { 0 };
+    size_t padding = (8 - w->offset % 8) % 8;
+    w->ok = w->ok && (fwrite(pad, 1, padding, w->f) == padding);
+    w->offset += padding;
+
+    struct image_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.header_size = sizeof(h);
+    h.object_count = w->count;
+    h.index_offset = w->offset;
+    h.size = w->offset + sizeof(struct image_index_entry) * w->count;
+    w->ok = w->ok && (fwrite(w->index, sizeof(struct image_index_entry), w->count, w->f) == w->count);
+    w->ok = w->ok && (fseek(w->f, 0, SEEK_SET) == 0);
+    w->ok = w->ok && (fwrite(&h, sizeof(h), 1, w->f) == 1);
+    w->ok = w->ok && (fflush(w->f) == 0) && (fdatasync(fileno(w->f)) == 0);
+    w->ok = (fclose(w->f) == 0) && w->ok;
+    // only a complete image replaces what is there. until the directory is
+    // synced, a crash can still bring back the old one
+    w->ok = w->ok && (rename(w->tmp_path, w->path) == 0);
+    bool ret = w->ok && image_sync_parent_dir(w->path);
+    if (!ret) {
+        perror(w->path);
+        if (!w->ok) {
+            unlink(w->tmp_path);
+        }
+    }
+    image_writer_free(w);
+    return ret;
+}
+
+bool image_write(const char *path, struct object **objs, int count) {
+    struct image_writer *w = image_writer_new(path);
+    if (!w) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        image_writer_add_object(w, objs[i]);
+    }
+    return image_writer_finish(w);
+}
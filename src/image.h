@@ -0,0 +1,72 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdbool.h>
+
+#include "object.h"
+
+/* a core image is a read-only file with a set of objects, which the server
+ * maps into memory at startup rather than building its world one object at a
+ * time. the format is versioned and position-independent, i.e. it only has
+ * offsets relative to the start of the file and no pointers:
+ *
+ * - a header with a magic, the format version, the number of objects and the
+ *   offset of the index
+ * - the data of the objects, each being the code of the object (see
+ *   obj_code_to_buffer()) followed by its state (see obj_state_to_buffer())
+ * - the index, with an entry per object sorted by id that has the offset and
+ *   lengths of its data
+ *
+ * opening an image does not load anything. objects are found by a binary
+ * search over the mapped index, and get materialized from the mapped data
+ * when they are asked for. the numbers in the image are in host byte order,
+ * so images are not portable between architectures with different ones.
+ *
+ * all functions apart from the writing ones work on the read-only mapping, so
+ * they can be called concurrently */
+
+struct image;
+
+/* maps the image, returns NULL if it cannot be read or is not an image of a
+ * version we understand */
+struct image* image_open(const char *path);
+void image_close(struct image *img);
+
+int image_get_object_count(struct image *img);
+/* one past the largest object id in the image */
+object_id image_next_id(struct image *img);
+
+bool image_contains(struct image *img, object_id oid);
+/* the id of the idx-th object, they are sorted by id */
+object_id image_get_id(struct image *img, int idx);
+/* finds the data of an object in place, without materializing it. code and
+ * state point into the mapping and must not be modified. returns false if the
+ * image has no such object */
+bool image_find(struct image *img, object_id oid, char **code, int *code_len,
+    char **state, int *state_len);
+/* materializes an object from the image, the object is owned by the caller.
+ * its strings and code stay in the mapping (see obj_code_from_mapping()), so
+ * it must not outlive the image. returns NULL if the image has no such object
+ * or it cannot be read */
+struct object* image_get(struct image *img, object_id oid);
+
+/* writes the objects to a new image, replacing whatever is at path. the
+ * objects are not consumed. returns false if the file could not be written
+ * or the ids are not unique */
+bool image_write(const char *path, struct object **objs, int count);
+
+/* for writing an image one object at a time, without having all of them in
+ * memory. the objects can come in any order. the image only replaces what is
+ * at path once image_writer_finish() succeeds, which also frees the writer.
+ * returns NULL if the file cannot be created */
+struct image_writer;
+struct image_writer* image_writer_new(const char *path);
+/* adds an object that is already serialized */
+void image_writer_add(struct image_writer *w, object_id oid, char *code, int code_len,
+    char *state, int state_len);
+void image_writer_add_object(struct image_writer *w, struct object *o);
+bool image_writer_finish(struct image_writer *w);
+/* throws the image away and frees the writer, path stays as it was */
+void image_writer_abort(struct image_writer *w);
+
+#endif /* IMAGE_H */
@@ -1,35 +1,134 @@
 #include "lobject.h"
 
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include "epoch.h"
+
+// pin count of an object that has been evicted from the cache
+#define PIN_EVICTED     -1
+
+// -------- internal structures ------------
+
+/* versions are linked from newest to oldest. readers walk the chain without
+ * any synchronization, so a version only ever gets unlinked once no reader
+ * can reach it anymore, see lobject_prune_versions(). a reader might still
+ * hold on to a version it got to just before that though, so unlinked
+ * versions and their objects are freed through epoch_retire() */
+struct lobject_version {
+    struct object *obj;
+    _Atomic uint64_t ts;
+    struct lobject_version *older;
+};
 
 // -------- implementation of declared public structures --------
 
 struct lobject {
-    struct object *obj;
+    struct lobject_version *_Atomic versions;
     struct lock *lock;
-    int pin;
+    atomic_int pin;
 };
 
+// -------- internal functions --------
+
+void lobject_free_versions(struct lobject_version *v) {
+    while (v) {
+        struct lobject_version *older = v->older;
+        obj_free(v->obj);
+        free(v);
+        v = older;
+    }
+}
+
+void lobject_retired_versions_free(void *p) {
+    lobject_free_versions(p);
+}
+
 // -------- implementation of public functions --------
 
 struct lobject* lobject_new(void) {
     struct lobject *ret = malloc(sizeof(struct lobject));
-    ret->obj = NULL;
+    atomic_init(&ret->versions, NULL);
     ret->lock = NULL;
-    ret->pin = 0;
+    atomic_init(&ret->pin, 0);
     return ret;
 }
 
 void lobject_free(struct lobject *lo) {
+    lobject_free_versions(atomic_load(&lo->versions));
     free(lo);
 }
 
 void lobject_set_object(struct lobject *lo, struct object *obj) {
-    lo->obj = obj;
+    struct lobject_version *old = atomic_exchange(&lo->versions, NULL);
+    lobject_free_versions(old);
+    lobject_add_version(lo, obj, 0);
 }
 
 struct object* lobject_get_object(struct lobject *lo) {
-    return lo->obj;
+    epoch_enter();
+    struct lobject_version *v = atomic_load_explicit(&lo->versions, memory_order_acquire);
+    struct object *ret = v ? v->obj : NULL;
+    epoch_exit();
+    return ret;
+}
+
+void lobject_add_version(struct lobject *lo, struct object *o, uint64_t ts) {
+    struct lobject_version *v = malloc(sizeof(struct lobject_version));
+    v->obj = o;
+    atomic_init(&v->ts, ts);
+    v->older = atomic_load_explicit(&lo->versions, memory_order_relaxed);
+    atomic_store_explicit(&lo->versions, v, memory_order_release);
+}
+
+struct object* lobject_get_version(struct lobject *lo, uint64_t ts) {
+    epoch_enter();
+    struct lobject_version *v = atomic_load_explicit(&lo->versions, memory_order_acquire);
+    while (v && (atomic_load_explicit(&v->ts, memory_order_acquire) > ts)) {
+        v = v->older;
+    }
+    struct object *ret = v ? v->obj : NULL;
+    epoch_exit();
+    return ret;
+}
+
+uint64_t lobject_get_version_ts(struct lobject *lo) {
+    epoch_enter();
+    struct lobject_version *v = atomic_load_explicit(&lo->versions, memory_order_acquire);
+    assert(v);
+    uint64_t ret = atomic_load_explicit(&v->ts, memory_order_acquire);
+    epoch_exit();
+    return ret;
+}
+
+void lobject_set_version_ts(struct lobject *lo, uint64_t ts) {
+    struct lobject_version *v = atomic_load_explicit(&lo->versions, memory_order_relaxed);
+    assert(v);
+    atomic_store_explicit(&v->ts, ts, memory_order_release);
+}
+
+int lobject_prune_versions(struct lobject *lo, uint64_t oldest) {
+    // a reader with a timestamp of at least oldest stops at the first version
+    // that is not newer than that, so it never looks past it
+    struct lobject_version *v = atomic_load_explicit(&lo->versions, memory_order_relaxed);
+    while (v && (atomic_load_explicit(&v->ts, memory_order_relaxed) > oldest)) {
+        v = v->older;
+    }
+    if (!v) {
+        return 0;
+    }
+    struct lobject_version *old = v->older;
+    if (!old) {
+        return 0;
+    }
+    v->older = NULL;
+    int dropped = 0;
+    for (struct lobject_version *d = old; d; d = d->older) {
+        dropped++;
+    }
+    epoch_retire(old, lobject_retired_versions_free);
+    return dropped;
 }
 
 void lobject_set_lock(struct lobject *lo, struct lock *l) {
@@ -41,13 +140,29 @@ struct lock* lobject_get_lock(struct lobject *lo) {
 }
 
 void lobject_pin(struct lobject *lo) {
-    lo->pin = 1;
+    atomic_fetch_add(&lo->pin, 1);
 }
 
 void lobject_unpin(struct lobject *lo) {
-    lo->pin = 0;
+    int prev = atomic_fetch_sub(&lo->pin, 1);
+    assert(prev > 0);
 }
 
 int lobject_is_pinned(struct lobject *lo) {
-    return lo->pin;
+    return atomic_load(&lo->pin) > 0;
+}
+
+bool lobject_try_pin(struct lobject *lo) {
+    int pin = atomic_load(&lo->pin);
+    do {
+        if (pin == PIN_EVICTED) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&lo->pin, &pin, pin + 1));
+    return true;
+}
+
+bool lobject_try_evict(struct lobject *lo) {
+    int expected = 0;
+    return atomic_compare_exchange_strong(&lo->pin, &expected, PIN_EVICTED);
 }
@@ -2,34 +2,75 @@
 #define LOBJECT_H
 
 /* this implements a simple pair of an object and a corresponding lock,
- * as well as a flag that indicates whether the object is currently in use
- * and therefore "pinned" in a cache
- * XXX in the future this might need up to two versions of the object so that
- * a tx that cehcked out an object for writing has it's own copy
- * XXX really? are we not doing R/W locking rather than MVCC? so we have
- * exclusive access, we just need to throw away and reload from persistence on
- * rollback if dirty...
+ * as well as a count of the users of the object. while that is non-zero the
+ * object is "pinned" in a cache
+ *
+ * for snapshot reads (see STORE_MVCC in store.h) the lobject keeps a chain of
+ * committed versions of the object, each tagged with the timestamp of the
+ * commit that created it. the newest version is what lobject_get_object()
+ * returns, older ones stay around for as long as a transaction might still
+ * want to read them.
  * XXX while it seemed to make sense to split this at some point, it seems super
- * awkward now. so it could be folded into the object itself? but then how do we
- * handle two versions?
+ * awkward now. so it could be folded into the object itself?
  * */
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "object.h"
 #include "lock.h"
 
 struct lobject;
 
+/* the lobject owns the objects in its versions, freeing it or dropping
+ * versions frees these as well */
 struct lobject* lobject_new(void);
 void lobject_free(struct lobject *lo);
 
+/* setting the object drops all versions, the object becomes the only one
+ * with timestamp 0, i.e. visible to everyone. the dropped versions are freed
+ * right away, so this is only for setting up an lobject nobody else sees yet.
+ * getting the object returns the newest version, committed or not */
 void lobject_set_object(struct lobject *lo, struct object *o);
 struct object* lobject_get_object(struct lobject *lo);
 
+/* timestamp of a version that has not been committed yet, it is not visible
+ * to any snapshot */
+#define LOBJECT_UNCOMMITTED     UINT64_MAX
+
+/* the version functions are safe to call without any latch held while a
+ * single writer (the transaction holding the exclusive lock on the object)
+ * adds and prunes versions.
+ *
+ * makes o the newest version of the object, with commit timestamp ts */
+void lobject_add_version(struct lobject *lo, struct object *o, uint64_t ts);
+/* returns the newest version with a timestamp not larger than ts, or NULL if
+ * the object did not exist yet at that point */
+struct object* lobject_get_version(struct lobject *lo, uint64_t ts);
+/* timestamp of the newest version, and changing it e.g. from
+ * LOBJECT_UNCOMMITTED when an object created in a transaction gets committed */
+uint64_t lobject_get_version_ts(struct lobject *lo);
+void lobject_set_version_ts(struct lobject *lo, uint64_t ts);
+/* drops all versions that no reader with a timestamp of at least oldest can
+ * see anymore, i.e. everything older than the version that such a reader
+ * would get. returns the number of versions dropped */
+int lobject_prune_versions(struct lobject *lo, uint64_t oldest);
+
 void lobject_set_lock(struct lobject *lo, struct lock *l);
 struct lock* lobject_get_lock(struct lobject *lo);
 
+/* pins nest, the object stays pinned until each pin has been undone. pinning
+ * and unpinning are atomic, so that an object can be pinned by a lock-free
+ * cache lookup while someone else unpins it */
 void lobject_pin(struct lobject *lo);
 void lobject_unpin(struct lobject *lo);
 int lobject_is_pinned(struct lobject *lo);
 
+/* pins the object unless it has been marked as evicted, returns whether it
+ * succeeded */
+bool lobject_try_pin(struct lobject *lo);
+/* marks the object as evicted if it is not pinned, returns whether it
+ * succeeded. an evicted object cannot be pinned anymore */
+bool lobject_try_evict(struct lobject *lo);
+
 #endif /* LOBJECT_H */
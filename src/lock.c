@@ -6,67 +6,484 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "store.h"
 
+// the wait-for graph is a bitset per tx, with one bit for each tx it is waiting
+// for. this is how many words one of them takes
+#define WFG_WORDS(max_tasks)    (((max_tasks) + 63) / 64)
+
+// the longest a waiter spins before parking by default, if there is more than
+// one cpu. with one, the holder cannot get anywhere while we spin
+#define DEFAULT_MAX_SPIN_NS     50000
+// waiters spin for up to this many times the recent average wait on the lock,
+// a wait much longer than that is not going to be over soon
+#define SPIN_WAIT_FACTOR        2
+// how much the average wait moves towards each new one, as a shift
+#define WAIT_AVG_SHIFT          3
+// spinning backs off up to this many pauses between checks
+#define SPIN_MAX_BACKOFF        64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax()     __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax()     __asm__ __volatile__("yield")
+#else
+#define cpu_relax()     do { } while (0)
+#endif
+
+// a waitgroup has room for this many txes, more go to the heap
+#define WG_INLINE_ENTRIES       4
+
+// the state word of a lock: 0 if it is free, otherwise either the cid and mode
+// of its only holder, or inflated if the waitgroups say who holds it
+#define STATE_INFLATED          ((uint64_t)1 << 63)
+#define STATE_HELD              ((uint64_t)1 << 62)
+#define STATE_EXCLUSIVE         ((uint64_t)1 << 61)
+#define STATE_CID_MASK          0xFFFFFFFFull
+
+// statistics of freed locks are kept for this many ids, the ones waited on
+// the longest
+#define RETIRED_STATS           1024
+
 // -------- internal structures ------------
 
+// struct lock_stats, but updated without a latch. the id is in the lock
+struct lock_counters {
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t wait_hist[LOCK_WAIT_BUCKETS];
+    _Atomic uint64_t hold_ns;
+    _Atomic uint64_t hold_samples;
+    _Atomic uint64_t upgrades;
+    _Atomic uint64_t stale;
+    _Atomic uint64_t deadlocks;
+};
+
 struct lock_waitgroup {
     int mode;
-    pthread_cond_t sema;
-    struct store_tx **entries;
+    struct store_tx **entries;  // inline_entries unless there are more txes
     int entry_count;
+    int entry_capacity;
     struct lock_waitgroup *next;
-    struct store_tx *deadlocked;
+    struct store_tx *inline_entries[WG_INLINE_ENTRIES];
 };
 
 // -------- implementation of declared public structures --------
 
 struct locks_ctx {
     int max_tasks;
+    int policy;
     pthread_mutex_t deadlock_latch;
-    bool *wfg_matrix;   // we simply represent the wait-for-graph as a matrix
-                        // where a TRUE in [x,y] means X is waiting for Y. not
-                        // very compact or clever but there you go. this is a
-                        // flat representation, but max_tasks sized
-    struct store_tx **tx_by_cid;
-    struct lock_waitgroup **blocked_waitgroup_by_cid;
-    struct lock **blocked_lock_by_cid; // the lock that the waitgroups above are in
+    int wfg_words;
+    uint64_t *wfg_matrix;   // the wait-for-graph as a bit matrix, where bit y
+                            // set in row x means X is waiting for Y. rows are
+                            // wfg_words long, so that the DFS below can skip
+                            // 64 txes at a time that X is not waiting for
+    uint64_t *wfg_visited;  // scratch space for the DFS below, a bitset
+    struct wfg_frame *wfg_stack;
+    // also set by every tx taking a lock on the fast path, so that whoever
+    // inflates the lock can find it by its cid
+    _Atomic(struct store_tx*) *tx_by_cid;
+    struct lock **blocked_lock_by_cid;
+    bool *faulted_by_cid; // set when a blocked tx got picked to break a deadlock,
+                          // protected by the latch of the lock it is blocked on
+    // with LOCK_WOUND_WAIT, the sid + 1 of the tx with that cid if it got
+    // wounded. cids get reused, so this is only meaningful for the same sid
+    _Atomic uint64_t *wounded_by_cid;
+    // waitgroups for txes that have to wait are reused rather than freed,
+    // the ones holding a lock are part of it
+    pthread_mutex_t pool_latch;
+    struct lock_waitgroup *free_wait_groups;
+    // a blocked tx parks on the futex word of its cid, which gets bumped to
+    // wake it up. and whether it is actually asleep there, so that waking it
+    // only needs a syscall then
+    _Atomic uint32_t *wake_by_cid;
+    _Atomic bool *parked_by_cid;
+    uint64_t max_spin_ns;
+    // all locks, and the statistics of freed ones by id, so that the
+    // statistics can be collected. the latter is sorted by id
+    pthread_mutex_t stats_latch;
+    struct lock *all_locks;
+    struct lock_stats *retired_stats;
+    int retired_count;
 };
 
 struct lock {
     struct locks_ctx *ctx;
+    // a lock that only one tx holds, and nobody waits for, is taken and let go
+    // of with a compare-and-swap on this, see STATE_*. the rest of the lock is
+    // only used once a second tx comes along, which inflates it. it stays
+    // that way, protected by the latch, until it is free again
+    _Atomic uint64_t state;
     pthread_mutex_t latch;
     // the first wait group is who is currently holding the lock, the chain
-    // from there are the ones waiting
+    // from there are the ones waiting. the first one is always holders, or
+    // NULL if the lock is free, so that taking a lock nobody else wants does
+    // not need to allocate anything. the waitgroup next in line gets moved
+    // into it once the holders are gone
     struct lock_waitgroup *first_wait_group;
     struct lock_waitgroup *last_wait_group;
+    struct lock_waitgroup holders;
+    // how long it recently took for a waiter to get the lock, which tells
+    // the next one whether it is worth spinning. protected by the latch
+    uint64_t avg_wait_ns;
+    uint64_t id;
+    struct lock_counters counters;
+    // when the lock got taken while free, if that time is being measured
+    _Atomic uint64_t held_since;
+    // in all_locks of the ctx, protected by its stats_latch
+    struct lock *prev;
+    struct lock *next;
 };
 
 // -------- internal functions ---------
 
-struct lock_waitgroup* lock_waitgroup_new(int lock_mode, struct store_tx *tx) {
-    struct lock_waitgroup *nwg = malloc(sizeof(struct lock_waitgroup));
-    nwg->mode = lock_mode;
-    if (pthread_cond_init(&nwg->sema, NULL) != 0) {
-        fprintf(stderr, "pthread_cond_init failed\n");
-        exit(1);
+static inline uint64_t lock_state_held(int lock_mode, int cid) {
+    return STATE_HELD | (lock_mode == LOCK_EXCLUSIVE ? STATE_EXCLUSIVE : 0) | (uint64_t)cid;
+}
+
+// whether the lock is held by the tx with that cid alone, on the fast path
+static inline bool lock_state_holds(uint64_t state, int cid) {
+    return (state & STATE_HELD) && !(state & STATE_INFLATED)
+        && ((state & STATE_CID_MASK) == (uint64_t)cid);
+}
+
+void lock_waitgroup_init(struct lock_waitgroup *wg, int lock_mode, struct store_tx *tx) {
+    wg->mode = lock_mode;
+    wg->entries = wg->inline_entries;
+    wg->entry_capacity = WG_INLINE_ENTRIES;
+    wg->entry_count = 1;
+    wg->entries[0] = tx;
+    wg->next = NULL;
+}
+
+void lock_waitgroup_add(struct lock_waitgroup *wg, struct store_tx *tx) {
+    if (wg->entry_count == wg->entry_capacity) {
+        wg->entry_capacity *= 2;
+        if (wg->entries == wg->inline_entries) {
+            wg->entries = malloc(sizeof(struct store_tx*) * wg->entry_capacity);
+            memcpy(wg->entries, wg->inline_entries, sizeof(struct store_tx*) * wg->entry_count);
+        }
+        else {
+            wg->entries = realloc(wg->entries, sizeof(struct store_tx*) * wg->entry_capacity);
+        }
     }
-    nwg->entry_count = 1;
-    nwg->entries = malloc(sizeof(struct store_tx*) * nwg->entry_count);
-    nwg->entries[0] = tx;
-    nwg->next = NULL;
-    nwg->deadlocked = NULL;
+    wg->entries[wg->entry_count++] = tx;
+}
+
+// lets go of the entries that went to the heap
+void lock_waitgroup_clear(struct lock_waitgroup *wg) {
+    if (wg->entries != wg->inline_entries) {
+        free(wg->entries);
+    }
+    wg->entries = wg->inline_entries;
+    wg->entry_capacity = WG_INLINE_ENTRIES;
+    wg->entry_count = 0;
+}
+
+// a waitgroup for txes that have to wait, from the pool if there is one
+struct lock_waitgroup* lock_waitgroup_new(struct locks_ctx *ctx, int lock_mode, struct store_tx *tx) {
+    pthread_mutex_lock(&ctx->pool_latch);
+    struct lock_waitgroup *nwg = ctx->free_wait_groups;
+    if (nwg) {
+        ctx->free_wait_groups = nwg->next;
+    }
+    pthread_mutex_unlock(&ctx->pool_latch);
+    if (!nwg) {
+        nwg = malloc(sizeof(struct lock_waitgroup));
+    }
+    lock_waitgroup_init(nwg, lock_mode, tx);
     return nwg;
 }
 
-void lock_waitgroup_free(struct lock_waitgroup *wg) {
-    pthread_cond_destroy(&wg->sema);
-    free(wg->entries);
-    free(wg);
+void lock_waitgroup_free(struct locks_ctx *ctx, struct lock_waitgroup *wg) {
+    lock_waitgroup_clear(wg);
+    pthread_mutex_lock(&ctx->pool_latch);
+    wg->next = ctx->free_wait_groups;
+    ctx->free_wait_groups = wg;
+    pthread_mutex_unlock(&ctx->pool_latch);
+}
+
+uint64_t lock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// the current wake-up count of a tx. a waiter reads it before checking
+// whether it needs to wait at all, then anything that changes that in the
+// meantime makes lock_park() return right away
+static inline uint32_t lock_wake_seq(struct locks_ctx *ctx, int cid) {
+    return atomic_load(&ctx->wake_by_cid[cid]);
+}
+
+// wakes up the tx with that cid if it is waiting, or makes its next
+// lock_park() return if it is about to
+void lock_wake(struct locks_ctx *ctx, int cid) {
+    atomic_fetch_add(&ctx->wake_by_cid[cid], 1);
+    if (atomic_load(&ctx->parked_by_cid[cid])) {
+        syscall(SYS_futex, &ctx->wake_by_cid[cid], FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+// wakes up everyone in the waitgroup, after it has been handed the lock
+void lock_wake_waitgroup(struct locks_ctx *ctx, struct lock_waitgroup *wg) {
+    for (int i = 0; i < wg->entry_count; i++) {
+        lock_wake(ctx, store_tx_get_cid(wg->entries[i]));
+    }
+}
+
+// waits until the tx with that cid gets woken up after seq, see
+// lock_wake_seq(). called with the latch of the lock held, which gets let go
+// of in the meantime. as long as the lock usually changes hands quickly,
+// this spins for a bit first, which saves going to sleep and being woken up
+// again
+void lock_park(struct lock *l, int cid, uint32_t seq) {
+    struct locks_ctx *ctx = l->ctx;
+    _Atomic uint32_t *word = &ctx->wake_by_cid[cid];
+    uint64_t spin_ns = l->avg_wait_ns * SPIN_WAIT_FACTOR;
+    if (l->avg_wait_ns > ctx->max_spin_ns) {
+        spin_ns = 0;
+    }
+    else if (spin_ns > ctx->max_spin_ns) {
+        spin_ns = ctx->max_spin_ns;
+    }
+    pthread_mutex_unlock(&l->latch);
+
+    if (spin_ns > 0) {
+        uint64_t until = lock_now_ns() + spin_ns;
+        int backoff = 1;
+        while (atomic_load_explicit(word, memory_order_relaxed) == seq) {
+            for (int i = 0; i < backoff; i++) {
+                cpu_relax();
+            }
+            if (backoff < SPIN_MAX_BACKOFF) {
+                backoff *= 2;
+            }
+            else if (lock_now_ns() > until) {
+                break;
+            }
+        }
+    }
+    if (atomic_load(word) == seq) {
+        // the waker either sees that we are parked, or we see the new seq
+        atomic_store(&ctx->parked_by_cid[cid], true);
+        while (atomic_load(word) == seq) {
+            syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        }
+        atomic_store(&ctx->parked_by_cid[cid], false);
+    }
+    pthread_mutex_lock(&l->latch);
+}
+
+static inline void lock_count(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+// a request got the lock. if it was free, this might be the start of a hold
+// time to measure. this is on the fast path, so it does without a locked
+// instruction: acquisitions happen either under the latch, or on the fast
+// path when nobody can take the latch for the lock until they are done. the
+// exception is someone inflating the lock just after it got taken, who might
+// make this lose count
+void lock_count_acquisition(struct lock *l, bool was_free) {
+    uint64_t n = atomic_load_explicit(&l->counters.acquisitions, memory_order_relaxed);
+    atomic_store_explicit(&l->counters.acquisitions, n + 1, memory_order_relaxed);
+    if (was_free && (n % LOCK_HOLD_SAMPLE == 0)) {
+        atomic_store_explicit(&l->held_since, lock_now_ns(), memory_order_relaxed);
+    }
+}
+
+// the lock is about to become free. since is what held_since was before, the
+// lock might have been taken again in the meantime if it was let go of on the
+// fast path, which starts a new measurement
+void lock_count_release(struct lock *l, uint64_t since) {
+    if (since && atomic_compare_exchange_strong(&l->held_since, &since, 0)) {
+        lock_count(&l->counters.hold_ns, lock_now_ns() - since);
+        lock_count(&l->counters.hold_samples, 1);
+    }
+}
+
+// a waiter that started waiting at start got the lock, needs the latch held
+void lock_note_wait(struct lock *l, uint64_t start) {
+    uint64_t waited = lock_now_ns() - start;
+    l->avg_wait_ns = l->avg_wait_ns - (l->avg_wait_ns >> WAIT_AVG_SHIFT)
+        + (waited >> WAIT_AVG_SHIFT);
+
+    int bucket = 0;
+    if (waited >= 1024) {
+        bucket = 63 - __builtin_clzll(waited) - 9;
+        if (bucket >= LOCK_WAIT_BUCKETS) {
+            bucket = LOCK_WAIT_BUCKETS - 1;
+        }
+    }
+    lock_count_acquisition(l, false);
+    lock_count(&l->counters.contended, 1);
+    lock_count(&l->counters.wait_ns, waited);
+    lock_count(&l->counters.wait_hist[bucket], 1);
+}
+
+void lock_stats_add(struct lock_stats *to, struct lock_stats *from) {
+    to->acquisitions += from->acquisitions;
+    to->contended += from->contended;
+    to->wait_ns += from->wait_ns;
+    for (int i = 0; i < LOCK_WAIT_BUCKETS; i++) {
+        to->wait_hist[i] += from->wait_hist[i];
+    }
+    to->hold_ns += from->hold_ns;
+    to->hold_samples += from->hold_samples;
+    to->upgrades += from->upgrades;
+    to->stale += from->stale;
+    to->deadlocks += from->deadlocks;
+}
+
+int lock_stats_cmp_id(const void *a, const void *b) {
+    const struct lock_stats *sa = a;
+    const struct lock_stats *sb = b;
+    return (sa->id > sb->id) - (sa->id < sb->id);
+}
+
+int lock_stats_cmp_wait(const void *a, const void *b) {
+    const struct lock_stats *sa = a;
+    const struct lock_stats *sb = b;
+    if (sa->wait_ns != sb->wait_ns) {
+        return sa->wait_ns < sb->wait_ns ? 1 : -1;
+    }
+    return (sb->contended > sa->contended) - (sb->contended < sa->contended);
+}
+
+// keeps the statistics of a lock that is being freed, if it was contended at
+// all. needs the stats_latch held. once there are RETIRED_STATS ids, the one
+// waited on the least makes room
+void lock_retire_stats(struct locks_ctx *ctx, struct lock_stats *stats) {
+    if (!stats->contended && !stats->stale && !stats->deadlocks) {
+        return;
+    }
+    struct lock_stats *found = bsearch(stats, ctx->retired_stats, ctx->retired_count,
+        sizeof(struct lock_stats), lock_stats_cmp_id);
+    if (found) {
+        lock_stats_add(found, stats);
+        return;
+    }
+    if (ctx->retired_count == RETIRED_STATS) {
+        int least = 0;
+        for (int i = 1; i < ctx->retired_count; i++) {
+            if (ctx->retired_stats[i].wait_ns < ctx->retired_stats[least].wait_ns) {
+                least = i;
+            }
+        }
+        if (ctx->retired_stats[least].wait_ns > stats->wait_ns) {
+            return;
+        }
+        memmove(&ctx->retired_stats[least], &ctx->retired_stats[least + 1],
+            (ctx->retired_count - least - 1) * sizeof(struct lock_stats));
+        ctx->retired_count--;
+    }
+    int pos = 0;
+    while ((pos < ctx->retired_count) && (ctx->retired_stats[pos].id < stats->id)) {
+        pos++;
+    }
+    memmove(&ctx->retired_stats[pos + 1], &ctx->retired_stats[pos],
+        (ctx->retired_count - pos) * sizeof(struct lock_stats));
+    ctx->retired_stats[pos] = *stats;
+    ctx->retired_count++;
+}
+
+// the waitgroup after the holders gets the lock, and takes their place, and
+// its txes get woken up. they do not need to compete for the lock, it is
+// theirs already
+void lock_promote_waitgroup(struct lock *l) {
+    struct lock_waitgroup *h = &l->holders;
+    struct lock_waitgroup *next = h->next;
+    lock_waitgroup_clear(h);
+    h->mode = next->mode;
+    h->entry_count = next->entry_count;
+    if (next->entries == next->inline_entries) {
+        memcpy(h->inline_entries, next->inline_entries, sizeof(struct store_tx*) * next->entry_count);
+    }
+    else {
+        h->entries = next->entries;
+        h->entry_capacity = next->entry_capacity;
+        next->entries = next->inline_entries;
+    }
+    h->next = next->next;
+    if (l->last_wait_group == next) {
+        l->last_wait_group = h;
+    }
+    lock_waitgroup_free(l->ctx, next);
+    lock_wake_waitgroup(l->ctx, h);
+}
+
+// whether tx holds the lock in at least the requested mode
+bool lock_granted(struct lock *l, int lock_mode, struct store_tx *tx) {
+    struct lock_waitgroup *fwg = l->first_wait_group;
+    if ((fwg->mode != lock_mode) && (fwg->mode != LOCK_EXCLUSIVE)) {
+        return false;
+    }
+    for (int i = 0; i < fwg->entry_count; i++) {
+        if (fwg->entries[i] == tx) {
+            return true;
+        }
+    }
+    return false;
 }
 
-// we return this from a dfs recursion. if tx set NULL, then there is no cycle.
+// the waitgroup tx is waiting in, if any. a tx only ever waits in one
+// waitgroup per lock, but might hold the lock in the first one at the same
+// time when upgrading
+struct lock_waitgroup* lock_find_waitgroup(struct lock *l, struct store_tx *tx) {
+    for (struct lock_waitgroup *wg = l->first_wait_group->next; wg; wg = wg->next) {
+        for (int i = 0; i < wg->entry_count; i++) {
+            if (wg->entries[i] == tx) {
+                return wg;
+            }
+        }
+    }
+    return NULL;
+}
+
+// the wait-for-graph accessors, all of them need the deadlock latch held
+static inline uint64_t* wfg_row(struct locks_ctx *ctx, int x) {
+    return &ctx->wfg_matrix[(size_t)x * ctx->wfg_words];
+}
+
+// x is waiting for y
+static inline void wfg_set_edge(struct locks_ctx *ctx, int x, int y) {
+    wfg_row(ctx, x)[y / 64] |= (uint64_t)1 << (y % 64);
+}
+
+static inline void wfg_clear_edge(struct locks_ctx *ctx, int x, int y) {
+    wfg_row(ctx, x)[y / 64] &= ~((uint64_t)1 << (y % 64));
+}
+
+static inline bool wfg_has_edge(struct locks_ctx *ctx, int x, int y) {
+    return wfg_row(ctx, x)[y / 64] & ((uint64_t)1 << (y % 64));
+}
+
+// x is not waiting for anyone anymore
+static inline void wfg_clear_row(struct locks_ctx *ctx, int x) {
+    memset(wfg_row(ctx, x), 0, sizeof(uint64_t) * ctx->wfg_words);
+}
+
+// one tx on the path of the DFS below, with the txes it is waiting for that
+// still need to be looked at: those in the current word of its row, and the
+// words after that
+struct wfg_frame {
+    int cid;
+    int word;
+    uint64_t bits;
+};
+
+// we return this from the dfs. if tx set NULL, then there is no cycle.
 // otherwise the fields are all filled in with the candidate we want to fault
 // out of the cycle, i.e. the youngest by sid
 struct wfg_result {
@@ -76,36 +493,338 @@ struct wfg_result {
 };
 
 // this is the core deadlock detector, we DFS the wait-for-graph and return
-// whether there is a cycle, and if so which transaction should be faulted out
-// of the deadlock, the yougest by sid
-struct wfg_result wfg_dfs(struct locks_ctx *ctx, int cid, int root_cid) {
+// whether there is a cycle through the root, and if so which transaction
+// should be faulted out of the deadlock, the yougest by sid. every tx gets
+// visited at most once: if we did not find our way back to the root from it
+// the first time, we will not the next time either. so this is linear in the
+// size of the matrix at worst, and the path is kept on an explicit stack
+// rather than recursing, as it can be max_tasks long
+struct wfg_result wfg_dfs(struct locks_ctx *ctx, int root_cid) {
     struct wfg_result res;
-    for (int y = 0; y < ctx->max_tasks; y++) {
-        if (ctx->wfg_matrix[cid + y * ctx->max_tasks]) {
-            if (y == root_cid) {
-                res.cid = y;
-                res.tx = ctx->tx_by_cid[y];
-                res.sid = store_tx_get_sid(res.tx);
-                return res;
+    memset(ctx->wfg_visited, 0, sizeof(uint64_t) * ctx->wfg_words);
+    struct wfg_frame *stack = ctx->wfg_stack;
+    int depth = 0;
+    int cid = root_cid;
+    for (;;) {
+        // a tx that is new on the path: if it is waiting for the root, the
+        // path is a cycle. otherwise we go on with the ones it is waiting for
+        ctx->wfg_visited[cid / 64] |= (uint64_t)1 << (cid % 64);
+        if (wfg_has_edge(ctx, cid, root_cid)) {
+            res.cid = cid;
+            res.tx = ctx->tx_by_cid[cid];
+            res.sid = store_tx_get_sid(res.tx);
+            for (int i = 0; i < depth; i++) {
+                struct store_tx *tx = ctx->tx_by_cid[stack[i].cid];
+                if (store_tx_get_sid(tx) > res.sid) {
+                    res.cid = stack[i].cid;
+                    res.tx = tx;
+                    res.sid = store_tx_get_sid(tx);
+                }
             }
-            else {
-                struct wfg_result rec_res = wfg_dfs(ctx, y, root_cid);
-                if (rec_res.tx) {
-                    res.cid = y;
-                    res.tx = ctx->tx_by_cid[y];
-                    res.sid = store_tx_get_sid(res.tx);
-                    if (rec_res.sid < res.sid) {
-                        return res;
-                    }
-                    else {
-                        return rec_res;
-                    }
+            return res;
+        }
+        stack[depth].cid = cid;
+        stack[depth].word = 0;
+        stack[depth].bits = wfg_row(ctx, cid)[0] & ~ctx->wfg_visited[0];
+        depth++;
+
+        // find the next tx to descend into, backtracking if the one on top of
+        // the stack has none left
+        cid = -1;
+        while (depth > 0) {
+            struct wfg_frame *f = &stack[depth - 1];
+            while (!f->bits && (f->word + 1 < ctx->wfg_words)) {
+                f->word++;
+                f->bits = wfg_row(ctx, f->cid)[f->word] & ~ctx->wfg_visited[f->word];
+            }
+            if (!f->bits) {
+                depth--;
+                continue;
+            }
+            int y = f->word * 64 + __builtin_ctzll(f->bits);
+            f->bits &= f->bits - 1;
+            // the bits were filtered when the word got loaded, but we might
+            // have visited y since
+            if (!(ctx->wfg_visited[y / 64] & ((uint64_t)1 << (y % 64)))) {
+                cid = y;
+                break;
+            }
+        }
+        if (cid < 0) {
+            res.tx = NULL;
+            return res;
+        }
+    }
+}
+
+// removes tx from a waitgroup that is not the first one, and the waitgroup from
+// the lock if that leaves it empty. needs the latch of the lock held, and with
+// LOCK_DETECT the deadlock latch as well
+void lock_leave_waitgroup(struct lock *l, struct lock_waitgroup *wg, struct store_tx *tx) {
+    int found_idx = -1;
+    for (int i = 0; i < wg->entry_count; i++) {
+        if (wg->entries[i] == tx) {
+            found_idx = i;
+            break;
+        }
+    }
+    assert(found_idx >= 0);
+    memmove(&wg->entries[found_idx], &wg->entries[found_idx+1],
+        (wg->entry_count - found_idx - 1) * sizeof(struct store_tx*));
+    wg->entry_count--;
+    if (wg->entry_count == 0) {
+        // find the previous waitgroup
+        struct lock_waitgroup *prev = l->first_wait_group;
+        while (prev && (prev->next != wg)) {
+            prev = prev->next;
+        }
+        assert(prev->next == wg);
+        prev->next = wg->next;
+        if (l->last_wait_group == wg) {
+            l->last_wait_group = prev;
+        }
+        lock_waitgroup_free(l->ctx, wg);
+
+        // if that was an exclusive request between the active shared
+        // waitgroup and a shared one, the latter does not need to wait
+        // anymore, so the two get merged. the promoted waiters are not waiting
+        // for anyone anymore
+        struct lock_waitgroup *next = prev->next;
+        if ((prev == l->first_wait_group) && (prev->mode == LOCK_SHARED)
+                && next && (next->mode == LOCK_SHARED)) {
+            if (l->ctx->policy == LOCK_DETECT) {
+                for (int i = 0; i < next->entry_count; i++) {
+                    wfg_clear_row(l->ctx, store_tx_get_cid(next->entries[i]));
+                }
+            }
+            for (int i = 0; i < next->entry_count; i++) {
+                lock_waitgroup_add(prev, next->entries[i]);
+            }
+            prev->next = next->next;
+            if (l->last_wait_group == next) {
+                l->last_wait_group = prev;
+            }
+            lock_wake_waitgroup(l->ctx, next);
+            lock_waitgroup_free(l->ctx, next);
+        }
+    }
+}
+
+// blocks tx until it holds the lock in lock_mode, i.e. until the waitgroup it
+// has been added to becomes the first one, or until it gets faulted out of a
+// deadlock. this is called with the latch of the lock held, and releases it.
+// the deadlock latch always needs to be taken before any lock latch, as we
+// might need the latch of another lock to fault out a deadlocked tx. we are in
+// a waitgroup already, so nothing gets lost by letting go of the latch for a
+// moment to take them in the right order
+int lock_wait_detect(struct lock *l, int lock_mode, struct store_tx *tx) {
+    struct locks_ctx *ctx = l->ctx;
+    int tx_cid = store_tx_get_cid(tx);
+    uint64_t start = lock_now_ns();
+    pthread_mutex_unlock(&l->latch);
+    pthread_mutex_lock(&ctx->deadlock_latch);
+    pthread_mutex_lock(&l->latch);
+
+    if (!lock_granted(l, lock_mode, tx)) {
+        // we will be blocked, so we now inform the deadlock detector that the
+        // wait-for-graph has changed. we wait for everyone in the waitgroups
+        // ahead of ours, which might include ourselves when upgrading
+        struct lock_waitgroup *wg = lock_find_waitgroup(l, tx);
+        for (struct lock_waitgroup *ahead = l->first_wait_group; ahead != wg; ahead = ahead->next) {
+            for (int i = 0; i < ahead->entry_count; i++) {
+                if (tx != ahead->entries[i]) {
+                    wfg_set_edge(ctx, tx_cid, store_tx_get_cid(ahead->entries[i]));
                 }
             }
         }
+        ctx->tx_by_cid[tx_cid] = tx;
+        ctx->blocked_lock_by_cid[tx_cid] = l;
+
+        // and of course we need to consult the updated wait-for-graph via a
+        // DFS to figure out whether there is a deadlock. our new edges might
+        // close more than one cycle, and faulting out the youngest tx on the
+        // first one we find does not necessarily break the others, so we keep
+        // going until we are no longer part of any cycle
+        for (;;) {
+            struct wfg_result wfg_res = wfg_dfs(ctx, tx_cid);
+            if (!wfg_res.tx) {
+                break;
+            }
+            // we have indeed found a deadlock, so let's mark it and wake up
+            // the victim
+            struct lock *fl = ctx->blocked_lock_by_cid[wfg_res.cid];
+            // holding the deadlock latch makes it safe to take the latch of
+            // another lock while holding this one
+            if (fl != l) {
+                pthread_mutex_lock(&fl->latch);
+            }
+            ctx->faulted_by_cid[wfg_res.cid] = true;
+            lock_wake(ctx, wfg_res.cid);
+            if (fl != l) {
+                pthread_mutex_unlock(&fl->latch);
+            }
+            if (wfg_res.cid == tx_cid) {
+                break;
+            }
+            // the victim is not waiting for anyone anymore as far as the rest
+            // of the detection is concerned, it cleans up the rest itself
+            wfg_clear_row(ctx, wfg_res.cid);
+        }
+    }
+    pthread_mutex_unlock(&ctx->deadlock_latch);
+
+    // now wait for the lock to be available or for this tx to be marked as
+    // deadlocked
+    for (;;) {
+        uint32_t seq = lock_wake_seq(ctx, tx_cid);
+        if (lock_granted(l, lock_mode, tx) || ctx->faulted_by_cid[tx_cid]) {
+            break;
+        }
+        lock_park(l, tx_cid, seq);
+    }
+
+    bool faulted = !lock_granted(l, lock_mode, tx);
+    if (faulted) {
+        // faulted out of a deadlock, we need to clean up the wait-for-graph,
+        // and again need the latches in the right order for that
+        pthread_mutex_unlock(&l->latch);
+        pthread_mutex_lock(&ctx->deadlock_latch);
+        pthread_mutex_lock(&l->latch);
+    }
+    ctx->faulted_by_cid[tx_cid] = false;
+    if (lock_granted(l, lock_mode, tx)) {
+        // regular case: we finally have the lock! this might have happened
+        // just before noticing a deadlock fault, even while retaking the
+        // latches, but then the cycle is broken already anyway
+        lock_note_wait(l, start);
+        pthread_mutex_unlock(&l->latch);
+        if (faulted) {
+            pthread_mutex_unlock(&ctx->deadlock_latch);
+        }
+        return LOCK_TAKEN;
+    }
+
+    // we are not waiting for anyone anymore, and the ones behind us are not
+    // waiting for us on this lock either
+    struct lock_waitgroup *wg = lock_find_waitgroup(l, tx);
+    wfg_clear_row(ctx, tx_cid);
+    for (struct lock_waitgroup *behind = wg->next; behind; behind = behind->next) {
+        for (int i = 0; i < behind->entry_count; i++) {
+            wfg_clear_edge(ctx, store_tx_get_cid(behind->entries[i]), tx_cid);
+        }
+    }
+    lock_leave_waitgroup(l, wg, tx);
+    pthread_mutex_unlock(&l->latch);
+    pthread_mutex_unlock(&ctx->deadlock_latch);
+    return LOCK_DEADLOCK;
+}
+
+void locks_forget_tx(struct locks_ctx *ctx, struct store_tx *tx) {
+    uint64_t wound = store_tx_get_sid(tx) + 1;
+    atomic_compare_exchange_strong(&ctx->wounded_by_cid[store_tx_get_cid(tx)], &wound, 0);
+}
+
+bool lock_wounded(struct locks_ctx *ctx, struct store_tx *tx) {
+    return atomic_load(&ctx->wounded_by_cid[store_tx_get_cid(tx)]) == store_tx_get_sid(tx) + 1;
+}
+
+// the same as lock_wait_detect() for LOCK_WAIT_DIE and LOCK_WOUND_WAIT, which
+// only need to compare tx to the ones it would be waiting for on this lock.
+// those are the ones in the waitgroups ahead, and there will only ever be
+// fewer of them, so it is enough to look once. if all waits go from older to
+// younger txes, they cannot go around in a cycle. the same goes for waits
+// from younger to older ones, with wound-wait the older ones wait as well,
+// but only until the wounded ones ahead of them notice and fail
+int lock_wait_prevent(struct lock *l, int lock_mode, struct store_tx *tx) {
+    struct locks_ctx *ctx = l->ctx;
+    int tx_cid = store_tx_get_cid(tx);
+    uint64_t start = lock_now_ns();
+    uint64_t sid = store_tx_get_sid(tx);
+    struct lock_waitgroup *wg = lock_find_waitgroup(l, tx);
+    bool die = false;
+    for (struct lock_waitgroup *ahead = l->first_wait_group; ahead != wg; ahead = ahead->next) {
+        for (int i = 0; i < ahead->entry_count; i++) {
+            struct store_tx *other = ahead->entries[i];
+            if (other == tx) {
+                continue;
+            }
+            uint64_t other_sid = store_tx_get_sid(other);
+            if (ctx->policy == LOCK_WAIT_DIE) {
+                die |= sid > other_sid;
+            }
+            else if (sid < other_sid) {
+                // it might be waiting for another lock, and needs to notice
+                int other_cid = store_tx_get_cid(other);
+                atomic_store(&ctx->wounded_by_cid[other_cid], other_sid + 1);
+                lock_wake(ctx, other_cid);
+            }
+        }
+    }
+
+    while (!die) {
+        // the wound comes without the latch, so the seq needs to be read
+        // before looking for it
+        uint32_t seq = lock_wake_seq(ctx, tx_cid);
+        if (lock_granted(l, lock_mode, tx)) {
+            break;
+        }
+        if ((ctx->policy == LOCK_WOUND_WAIT) && lock_wounded(ctx, tx)) {
+            // the tx lets go of its locks after failing, which is what the
+            // wound was for. so it does not carry over if it gets retried
+            // with the same sid
+            uint64_t wound = sid + 1;
+            atomic_compare_exchange_strong(&ctx->wounded_by_cid[tx_cid], &wound, 0);
+            die = true;
+        }
+        else {
+            lock_park(l, tx_cid, seq);
+        }
+    }
+    if (die) {
+        // the waitgroups might have been shuffled around while waiting
+        lock_leave_waitgroup(l, lock_find_waitgroup(l, tx), tx);
+        pthread_mutex_unlock(&l->latch);
+        return LOCK_DEADLOCK;
+    }
+    lock_note_wait(l, start);
+    pthread_mutex_unlock(&l->latch);
+    return LOCK_TAKEN;
+}
+
+// blocks tx until it holds the lock, see above. called with the latch of the
+// lock held, and releases it
+int lock_wait(struct lock *l, int lock_mode, struct store_tx *tx) {
+    int ret;
+    if (l->ctx->policy == LOCK_DETECT) {
+        ret = lock_wait_detect(l, lock_mode, tx);
+    }
+    else {
+        ret = lock_wait_prevent(l, lock_mode, tx);
+    }
+    // the acquisition got counted when the lock was granted
+    if (ret == LOCK_DEADLOCK) {
+        lock_count(&l->counters.deadlocks, 1);
+    }
+    return ret;
+}
+
+// makes the waitgroups responsible for the lock, with the tx that holds it on
+// the fast path, if any, in the holders. needs the latch held, which keeps the
+// lock inflated until it is free again
+void lock_inflate(struct lock *l) {
+    uint64_t state = atomic_load(&l->state);
+    while (!(state & STATE_INFLATED)) {
+        if (atomic_compare_exchange_weak(&l->state, &state, STATE_INFLATED)) {
+            if (state & STATE_HELD) {
+                struct store_tx *holder = atomic_load(&l->ctx->tx_by_cid[state & STATE_CID_MASK]);
+                lock_waitgroup_init(&l->holders,
+                    (state & STATE_EXCLUSIVE) ? LOCK_EXCLUSIVE : LOCK_SHARED, holder);
+                l->first_wait_group = &l->holders;
+                l->last_wait_group = &l->holders;
+            }
+            return;
+        }
     }
-    res.tx = NULL;
-    return res;
 }
 
 // -------- implementation of public functions --------
@@ -113,32 +832,81 @@ struct wfg_result wfg_dfs(struct locks_ctx *ctx, int cid, int root_cid) {
 struct locks_ctx* locks_new_ctx(int max_tasks) {
     struct locks_ctx *ret = malloc(sizeof(struct locks_ctx));
     ret->max_tasks = max_tasks;
+    ret->policy = LOCK_DETECT;
     if (pthread_mutex_init(&ret->deadlock_latch, NULL) != 0) {
         fprintf(stderr, "pthread_mutex_init failed\n");
         exit(1);
     }
-    ret->wfg_matrix = malloc(sizeof(bool) * max_tasks * max_tasks);
-    memset(ret->wfg_matrix, 0, sizeof(bool) * max_tasks * max_tasks);
-    ret->tx_by_cid = malloc(sizeof(struct store_tx*) * max_tasks);
-    ret->blocked_waitgroup_by_cid = malloc(sizeof(struct lock_waitgroup*) * max_tasks);
+    ret->wfg_words = WFG_WORDS(max_tasks);
+    ret->wfg_matrix = calloc((size_t)max_tasks * ret->wfg_words, sizeof(uint64_t));
+    ret->wfg_visited = malloc(sizeof(uint64_t) * ret->wfg_words);
+    ret->wfg_stack = malloc(sizeof(struct wfg_frame) * max_tasks);
+    ret->tx_by_cid = malloc(sizeof(_Atomic(struct store_tx*)) * max_tasks);
+    for (int i = 0; i < max_tasks; i++) {
+        atomic_init(&ret->tx_by_cid[i], NULL);
+    }
     ret->blocked_lock_by_cid = malloc(sizeof(struct lock*) * max_tasks);
+    ret->faulted_by_cid = malloc(sizeof(bool) * max_tasks);
+    memset(ret->faulted_by_cid, 0, sizeof(bool) * max_tasks);
+    if (pthread_mutex_init(&ret->pool_latch, NULL) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed\n");
+        exit(1);
+    }
+    ret->free_wait_groups = NULL;
+    ret->wake_by_cid = malloc(sizeof(_Atomic uint32_t) * max_tasks);
+    ret->parked_by_cid = malloc(sizeof(_Atomic bool) * max_tasks);
+    for (int i = 0; i < max_tasks; i++) {
+        atomic_init(&ret->wake_by_cid[i], 0);
+        atomic_init(&ret->parked_by_cid[i], false);
+    }
+    ret->max_spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? DEFAULT_MAX_SPIN_NS : 0;
+    ret->wounded_by_cid = malloc(sizeof(_Atomic uint64_t) * max_tasks);
+    for (int i = 0; i < max_tasks; i++) {
+        atomic_init(&ret->wounded_by_cid[i], 0);
+    }
+    if (pthread_mutex_init(&ret->stats_latch, NULL) != 0) {
+        fprintf(stderr, "pthread_mutex_init failed\n");
+        exit(1);
+    }
+    ret->all_locks = NULL;
+    ret->retired_stats = malloc(sizeof(struct lock_stats) * RETIRED_STATS);
+    ret->retired_count = 0;
     return ret;
 }
 
 void locks_free_ctx(struct locks_ctx *ctx) {
     pthread_mutex_destroy(&ctx->deadlock_latch);
-    for (int x = 0; x < ctx->max_tasks; x++) {
-        for (int y = 0; y < ctx->max_tasks; y++) {
-            assert(!ctx->wfg_matrix[x + y * ctx->max_tasks]);
-        }
+    for (size_t i = 0; i < (size_t)ctx->max_tasks * ctx->wfg_words; i++) {
+        assert(!ctx->wfg_matrix[i]);
     }
     free(ctx->wfg_matrix);
+    free(ctx->wfg_visited);
+    free(ctx->wfg_stack);
     free(ctx->tx_by_cid);
-    free(ctx->blocked_waitgroup_by_cid);
     free(ctx->blocked_lock_by_cid);
+    free(ctx->faulted_by_cid);
+    free(ctx->wounded_by_cid);
+    while (ctx->free_wait_groups) {
+        struct lock_waitgroup *wg = ctx->free_wait_groups;
+        ctx->free_wait_groups = wg->next;
+        free(wg);
+    }
+    pthread_mutex_destroy(&ctx->pool_latch);
+    free(ctx->wake_by_cid);
+    free(ctx->parked_by_cid);
+    pthread_mutex_destroy(&ctx->stats_latch);
+    free(ctx->retired_stats);
     free(ctx);
 }
 
+void locks_set_policy(struct locks_ctx *ctx, int policy) {
+    ctx->policy = policy;
+}
+
+void locks_set_max_spin(struct locks_ctx *ctx, uint64_t max_spin_ns) {
+    ctx->max_spin_ns = max_spin_ns;
+}
+
 struct lock* lock_new(struct locks_ctx *ctx) {
     struct lock *ret = malloc(sizeof(struct lock));
     if (pthread_mutex_init(&ret->latch, NULL) != 0) {
@@ -146,28 +914,186 @@ struct lock* lock_new(struct locks_ctx *ctx) {
         exit(1);
     }
     ret->ctx = ctx;
+    atomic_init(&ret->state, 0);
     ret->first_wait_group = NULL;
     ret->last_wait_group = NULL;
+    ret->avg_wait_ns = 0;
+    ret->id = LOCK_NO_ID;
+    memset(&ret->counters, 0, sizeof(struct lock_counters));
+    atomic_init(&ret->held_since, 0);
+    ret->holders.entries = ret->holders.inline_entries;
+    ret->holders.entry_capacity = WG_INLINE_ENTRIES;
+    ret->holders.entry_count = 0;
+    pthread_mutex_lock(&ctx->stats_latch);
+    ret->prev = NULL;
+    ret->next = ctx->all_locks;
+    if (ret->next) {
+        ret->next->prev = ret;
+    }
+    ctx->all_locks = ret;
+    pthread_mutex_unlock(&ctx->stats_latch);
     return ret;
 }
 
 void lock_free(struct lock *l) {
-    if (l->first_wait_group) {
+    if (l->first_wait_group || atomic_load(&l->state)) {
         fprintf(stderr, "fatal: lock_free with waiting transactions\n");
         exit(1);
     }
+    lock_waitgroup_clear(&l->holders);
     pthread_mutex_destroy(&l->latch);
+
+    struct locks_ctx *ctx = l->ctx;
+    struct lock_stats stats;
+    lock_get_stats(l, &stats);
+    pthread_mutex_lock(&ctx->stats_latch);
+    if (l->prev) {
+        l->prev->next = l->next;
+    }
+    else {
+        ctx->all_locks = l->next;
+    }
+    if (l->next) {
+        l->next->prev = l->prev;
+    }
+    lock_retire_stats(ctx, &stats);
+    pthread_mutex_unlock(&ctx->stats_latch);
     free(l);
 }
 
+void lock_set_id(struct lock *l, uint64_t id) {
+    l->id = id;
+}
+
+void lock_get_stats(struct lock *l, struct lock_stats *stats) {
+    struct lock_counters *c = &l->counters;
+    stats->id = l->id;
+    stats->acquisitions = atomic_load_explicit(&c->acquisitions, memory_order_relaxed);
+    stats->contended = atomic_load_explicit(&c->contended, memory_order_relaxed);
+    stats->wait_ns = atomic_load_explicit(&c->wait_ns, memory_order_relaxed);
+    for (int i = 0; i < LOCK_WAIT_BUCKETS; i++) {
+        stats->wait_hist[i] = atomic_load_explicit(&c->wait_hist[i], memory_order_relaxed);
+    }
+    stats->hold_ns = atomic_load_explicit(&c->hold_ns, memory_order_relaxed);
+    stats->hold_samples = atomic_load_explicit(&c->hold_samples, memory_order_relaxed);
+    stats->upgrades = atomic_load_explicit(&c->upgrades, memory_order_relaxed);
+    stats->stale = atomic_load_explicit(&c->stale, memory_order_relaxed);
+    stats->deadlocks = atomic_load_explicit(&c->deadlocks, memory_order_relaxed);
+}
+
+int locks_top_contended(struct locks_ctx *ctx, struct lock_stats *stats, int n) {
+    // everything by id first, so that the live locks and the retired
+    // statistics for the same id can be added up
+    pthread_mutex_lock(&ctx->stats_latch);
+    int count = ctx->retired_count;
+    for (struct lock *l = ctx->all_locks; l; l = l->next) {
+        count++;
+    }
+    struct lock_stats *all = malloc(sizeof(struct lock_stats) * (count + 1));
+    memcpy(all, ctx->retired_stats, sizeof(struct lock_stats) * ctx->retired_count);
+    count = ctx->retired_count;
+    for (struct lock *l = ctx->all_locks; l; l = l->next) {
+        lock_get_stats(l, &all[count++]);
+    }
+    pthread_mutex_unlock(&ctx->stats_latch);
+
+    qsort(all, count, sizeof(struct lock_stats), lock_stats_cmp_id);
+    int ids = 0;
+    for (int i = 0; i < count; i++) {
+        if ((ids > 0) && (all[ids - 1].id == all[i].id)) {
+            lock_stats_add(&all[ids - 1], &all[i]);
+        }
+        else {
+            all[ids++] = all[i];
+        }
+    }
+    qsort(all, ids, sizeof(struct lock_stats), lock_stats_cmp_wait);
+    if (ids > n) {
+        ids = n;
+    }
+    memcpy(stats, all, sizeof(struct lock_stats) * ids);
+    free(all);
+    return ids;
+}
+
+// the upper bound of the bucket that the given fraction of the waits falls
+// into, in us. infinite for the last one, 0 without any waits
+static double lock_stats_wait_quantile(struct lock_stats *stats, double q) {
+    if (!stats->contended) {
+        return 0;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LOCK_WAIT_BUCKETS - 1; i++) {
+        seen += stats->wait_hist[i];
+        if (seen >= q * stats->contended) {
+            return (double)(1ull << (i + 10)) / 1e3;
+        }
+    }
+    return INFINITY;
+}
+
+void locks_dump_contention(struct locks_ctx *ctx, FILE *out, int n) {
+    struct lock_stats *stats = malloc(sizeof(struct lock_stats) * n);
+    int count = locks_top_contended(ctx, stats, n);
+    fprintf(out, "# top %i contended locks, waits in ms total and us otherwise\n", count);
+    fprintf(out, "%20s %10s %10s %10s %9s %9s %9s %9s %9s %9s %9s\n", "id", "acquired",
+        "contended", "wait", "avg wait", "p50 <", "p99 <", "avg hold", "upgrades",
+        "stale", "deadlocks");
+    for (int i = 0; i < count; i++) {
+        struct lock_stats *s = &stats[i];
+        if (s->id == LOCK_NO_ID) {
+            fprintf(out, "%20s", "-");
+        }
+        else {
+            fprintf(out, "%20lu", s->id);
+        }
+        fprintf(out, " %10lu %10lu %10.1f %9.1f %9.0f %9.0f %9.1f %9lu %9lu %9lu\n",
+            s->acquisitions, s->contended, s->wait_ns / 1e6,
+            s->contended ? s->wait_ns / 1e3 / s->contended : 0.0,
+            lock_stats_wait_quantile(s, 0.5), lock_stats_wait_quantile(s, 0.99),
+            s->hold_samples ? s->hold_ns / 1e3 / s->hold_samples : 0.0,
+            s->upgrades, s->stale, s->deadlocks);
+    }
+    free(stats);
+}
+
 int lock_lock(struct lock *l, int lock_mode, struct store_tx *tx) {
+    // the fast path, for a free lock or one we are the only holder of. it
+    // needs to be possible to find us by our cid before anyone can see it in
+    // the state
+    int cid = store_tx_get_cid(tx);
+    uint64_t state = atomic_load(&l->state);
+    if (state == 0) {
+        if (atomic_load_explicit(&l->ctx->tx_by_cid[cid], memory_order_relaxed) != tx) {
+            atomic_store_explicit(&l->ctx->tx_by_cid[cid], tx, memory_order_relaxed);
+        }
+        if (atomic_compare_exchange_strong(&l->state, &state, lock_state_held(lock_mode, cid))) {
+            lock_count_acquisition(l, true);
+            return LOCK_TAKEN;
+        }
+    }
+    else if (lock_state_holds(state, cid)) {
+        // case B and the immediate upgrade of case D below
+        if ((state & STATE_EXCLUSIVE) || (lock_mode == LOCK_SHARED)) {
+            return LOCK_TAKEN;
+        }
+        if (atomic_compare_exchange_strong(&l->state, &state, lock_state_held(LOCK_EXCLUSIVE, cid))) {
+            uint64_t upgrades = atomic_load_explicit(&l->counters.upgrades, memory_order_relaxed);
+            atomic_store_explicit(&l->counters.upgrades, upgrades + 1, memory_order_relaxed);
+            lock_count_acquisition(l, false);
+            return LOCK_TAKEN;
+        }
+    }
+
     pthread_mutex_lock(&l->latch);
+    lock_inflate(l);
 
     // case A: if the lock has no wait groups, just create one and we have the lock
     if (l->first_wait_group == NULL) {
-        struct lock_waitgroup *nwg = lock_waitgroup_new(lock_mode, tx);
-        l->first_wait_group = nwg;
-        l->last_wait_group = nwg;
+        lock_waitgroup_init(&l->holders, lock_mode, tx);
+        l->first_wait_group = &l->holders;
+        l->last_wait_group = &l->holders;
+        lock_count_acquisition(l, true);
         pthread_mutex_unlock(&l->latch);
         return LOCK_TAKEN;
     }
@@ -188,18 +1114,13 @@ int lock_lock(struct lock *l, int lock_mode, struct store_tx *tx) {
     // just join the group and return
     if ((lock_mode == LOCK_SHARED) && (l->last_wait_group->mode == LOCK_SHARED)) {
         struct lock_waitgroup *lwg = l->last_wait_group;
-        lwg->entry_count++;
-        lwg->entries = realloc(lwg->entries, sizeof(struct store_tx*) * lwg->entry_count);
-        lwg->entries[lwg->entry_count-1] = tx;
+        lock_waitgroup_add(lwg, tx);
         if (lwg != l->first_wait_group) {
-            // XXX ah darn, this needs to deal with possible deadlock faults
-            // as well, perhaps refactor the wait out of lock_lock()
             // we need to wait for that waitgroup to become active
-            do {
-                pthread_cond_wait(&lwg->sema, &l->latch);
-            } while (lwg != l->first_wait_group);
+            return lock_wait(l, lock_mode, tx);
         }
         // otherwise we joined an already active waitgroup, hoorah
+        lock_count_acquisition(l, false);
         pthread_mutex_unlock(&l->latch);
         return LOCK_TAKEN;
     }
@@ -210,12 +1131,14 @@ int lock_lock(struct lock *l, int lock_mode, struct store_tx *tx) {
         for (int i = 0; i < l->first_wait_group->entry_count; i++) {
             if (l->first_wait_group->entries[i] == tx) {
                 // great, this is a candidate for upgrading the lock!
+                lock_count(&l->counters.upgrades, 1);
                 if (l->first_wait_group != l->last_wait_group) {
                     // ah darn, someone else has come between the read lock that
                     // this tx already has, and the attempt to upgrade it. this
                     // lock request inbetween is a exclusive one because
                     // otherwise it would have been added to the current first
                     // wait group. therefore...
+                    lock_count(&l->counters.stale, 1);
                     pthread_mutex_unlock(&l->latch);
                     return LOCK_STALE;
                 }
@@ -224,6 +1147,7 @@ int lock_lock(struct lock *l, int lock_mode, struct store_tx *tx) {
                     if (l->first_wait_group->entry_count == 1) {
                         // even better, we can upgrade right away
                         l->first_wait_group->mode = LOCK_EXCLUSIVE;
+                        lock_count_acquisition(l, false);
                         pthread_mutex_unlock(&l->latch);
                         return LOCK_TAKEN;
                     }
@@ -241,99 +1165,44 @@ int lock_lock(struct lock *l, int lock_mode, struct store_tx *tx) {
     }
 
     // case E / otherwise: add a new waitgroup to the end, wait
-    struct lock_waitgroup *nwg = lock_waitgroup_new(lock_mode, tx);
+    struct lock_waitgroup *nwg = lock_waitgroup_new(l->ctx, lock_mode, tx);
     l->last_wait_group->next = nwg;
     l->last_wait_group = nwg;
 
-    // we will be blocked, so we now inform the deadlock detector that the
-    // wait-for-graph has changed
-    pthread_mutex_lock(&l->ctx->deadlock_latch);
-    int tx_cid = store_tx_get_cid(tx);
-    for (int i = 0; i < l->first_wait_group->entry_count; i++) {
-        // it is possible that the same tx shows up here, because there could
-        // be another waitgroup inbetween
-        if (tx != l->first_wait_group->entries[i]) {
-            l->ctx->wfg_matrix[tx_cid + store_tx_get_cid(l->first_wait_group->entries[i])
-                                        * l->ctx->max_tasks] = true;
-        }
-    }
-    l->ctx->tx_by_cid[tx_cid] = tx;
-    l->ctx->blocked_waitgroup_by_cid[tx_cid] = nwg;
-    l->ctx->blocked_lock_by_cid[tx_cid] = l;
-
-    // and of course we need to consult the updated wait-for-graph via a DFS to
-    // figure out whether there is a deadlock
-    struct wfg_result wfg_res = wfg_dfs(l->ctx, tx_cid, tx_cid);
-
-    if (wfg_res.tx) {
-        // we have indeed found a deadlock, so let's mark it and wake up the
-        // corresponding waitgroup
-        struct lock_waitgroup *fwg = l->ctx->blocked_waitgroup_by_cid[wfg_res.cid];
-        struct lock *fl = l->ctx->blocked_lock_by_cid[wfg_res.cid];
-        // it is safe to lock another's lock latch while holding this one only
-        // because we are inside the deadlock latch, which guarantees that this
-        // does not happen concurrently in the opposite direction
-        if (fl != l) {
-            pthread_mutex_lock(&fl->latch);
-        }
-        // XXX for now we only support a single deadlocked transaction per waitgroup,
-        // which is kinda broken
-        fwg->deadlocked = wfg_res.tx;
-        pthread_cond_broadcast(&fwg->sema);
-        if (fl != l) {
-            pthread_mutex_unlock(&fl->latch);
-        }
-    }
-    pthread_mutex_unlock(&l->ctx->deadlock_latch);
-
-    // now wait for the lock to be available or for this tx to be marked as
-    // deadlocked
-    while ((nwg != l->first_wait_group) && (nwg->deadlocked != tx)) {
-        pthread_cond_wait(&nwg->sema, &l->latch);
-    }
+    return lock_wait(l, lock_mode, tx);
+}
 
-    if (nwg->deadlocked == tx) {
-        // remove ourselves from the waitgroup
-        int found_idx = -1;
-        for (int i = 0; i < nwg->entry_count; i++) {
-            if (nwg->entries[i] == tx) {
-                found_idx = i;
-                break;
-            }
+void lock_unlock(struct lock *l, struct store_tx *tx) {
+    // if we hold it on the fast path, nobody is waiting for us. if someone
+    // else does, we cannot be holding it as well. either can change until we
+    // get to swap the state, but only by inflating the lock
+    uint64_t state = atomic_load(&l->state);
+    if (!(state & STATE_INFLATED)) {
+        if (!lock_state_holds(state, store_tx_get_cid(tx))) {
+            return;
         }
-        memmove(&nwg[found_idx], &nwg->entries[found_idx+1],
-            (nwg->entry_count - found_idx - 1) * sizeof(struct store_tx*));
-        nwg->entry_count--;
-        // now we only need to clean up the waitgroup if it is empty
-        if (nwg->entry_count == 0) {
-            // find the previous waitgroup
-            struct lock_waitgroup *prev = l->first_wait_group;
-            while (prev && (prev->next != nwg)) {
-                prev = prev->next;
-            }
-            assert(prev->next == nwg);
-            prev->next = nwg->next;
-            lock_waitgroup_free(nwg);
+        uint64_t since = atomic_load_explicit(&l->held_since, memory_order_relaxed);
+        if (atomic_compare_exchange_strong(&l->state, &state, 0)) {
+            lock_count_release(l, since);
+            return;
         }
-        nwg->deadlocked = NULL;
-
-        pthread_mutex_unlock(&l->latch);
-        return LOCK_DEADLOCK;
-    }
-    else {
-        // regular case: we finally have the lock!
-        pthread_mutex_unlock(&l->latch);
-        return LOCK_TAKEN;
     }
-}
 
-void lock_unlock(struct lock *l, struct store_tx *tx) {
+    // see lock_wait_detect() for the order of the latches. the other policies
+    // do not have a wait-for graph to update
+    bool detect = l->ctx->policy == LOCK_DETECT;
+    if (detect) {
+        pthread_mutex_lock(&l->ctx->deadlock_latch);
+    }
     pthread_mutex_lock(&l->latch);
 
     // because of the recursive nature of the lock, it is possible that there
     // isn't a waitgroup at all...
     if (!l->first_wait_group) {
         pthread_mutex_unlock(&l->latch);
+        if (detect) {
+            pthread_mutex_unlock(&l->ctx->deadlock_latch);
+        }
         return;
     }
 
@@ -349,6 +1218,9 @@ void lock_unlock(struct lock *l, struct store_tx *tx) {
     // the lock anymore
     if (found_idx == -1) {
         pthread_mutex_unlock(&l->latch);
+        if (detect) {
+            pthread_mutex_unlock(&l->ctx->deadlock_latch);
+        }
         return;
     }
 
@@ -357,22 +1229,28 @@ void lock_unlock(struct lock *l, struct store_tx *tx) {
         (l->first_wait_group->entry_count - found_idx - 1) * sizeof(struct store_tx*));
     l->first_wait_group->entry_count--;
 
-    // we will need this for the deadlock detector later, but it's easier to get
-    // it now because we have not yet and conditionally removed the first
-    // waitgroup
-    struct lock_waitgroup *cwg = l->first_wait_group->next;
+    // we now need to tell the deadlock detector that the wait-for-graph has
+    // changed. this needs to happen before the next waitgroup gets moved
+    // into the holders below
+    for (struct lock_waitgroup *cwg = l->first_wait_group->next; detect && cwg; cwg = cwg->next) {
+        for (int i = 0; i < cwg->entry_count; i++) {
+            wfg_clear_edge(l->ctx, store_tx_get_cid(cwg->entries[i]), store_tx_get_cid(tx));
+        }
+    }
 
     // check if the waitgroup is now empty
     if (l->first_wait_group->entry_count == 0) {
-        struct lock_waitgroup *old = l->first_wait_group;
-        l->first_wait_group = old->next;
-        if (!l->first_wait_group) {
-            l->last_wait_group = NULL;
+        if (l->first_wait_group->next) {
+            // now we can wake the threads in the next wait group
+            lock_promote_waitgroup(l);
         }
-        lock_waitgroup_free(old);
-        // now we can wake the threads in the next wait group
-        if (l->first_wait_group) {
-            pthread_cond_broadcast(&l->first_wait_group->sema);
+        else {
+            lock_waitgroup_clear(&l->holders);
+            l->first_wait_group = NULL;
+            l->last_wait_group = NULL;
+            lock_count_release(l, atomic_load_explicit(&l->held_since, memory_order_relaxed));
+            // back to the fast path
+            atomic_store(&l->state, 0);
         }
     }
     else if (l->first_wait_group->entry_count == 1) {
@@ -383,29 +1261,13 @@ void lock_unlock(struct lock *l, struct store_tx *tx) {
                 && (l->first_wait_group->next)
                 && (l->first_wait_group->next->mode == LOCK_EXCLUSIVE)
                 && (l->first_wait_group->entries[0] == l->first_wait_group->next->entries[0]) ) {
-            struct lock_waitgroup *old = l->first_wait_group;
-            l->first_wait_group = old->next;
-            if (!l->first_wait_group) {
-                l->last_wait_group = NULL;
-            }
-            lock_waitgroup_free(old);
-            pthread_cond_broadcast(&l->first_wait_group->sema);
+            lock_promote_waitgroup(l);
         }
     }
 
-    // we now need to tell the deadlock detector that the wait-for-graph has
-    // changed
-    pthread_mutex_lock(&l->ctx->deadlock_latch);
-    while (cwg) {
-        for (int i = 0; i < cwg->entry_count; i++) {
-            l->ctx->wfg_matrix[store_tx_get_cid(cwg->entries[i])
-                               + store_tx_get_cid(tx)
-                                 * l->ctx->max_tasks] = true;
-        }
-        cwg = cwg->next;
-    }
-    pthread_mutex_unlock(&l->ctx->deadlock_latch);
-
     pthread_mutex_unlock(&l->latch);
+    if (detect) {
+        pthread_mutex_unlock(&l->ctx->deadlock_latch);
+    }
 }
 
@@ -1,8 +1,12 @@
 #ifndef LOCK_H
 #define LOCK_H
 
+#include <stdio.h>
+#include <stdint.h>
+
 /* this is recursive (same thread can take the same lock multiple times), fair,
- * R/W, upgrading (R->W) and deadlock-detecting lock implementation */
+ * R/W, upgrading (R->W) and deadlock-detecting (or -preventing, see the
+ * policies below) lock implementation */
 
 /* return values from lock_lock, LOCK_TAKEN is success, everything else a
  * failure */
@@ -14,6 +18,54 @@
 #define LOCK_SHARED       0
 #define LOCK_EXCLUSIVE    1
 
+/* how deadlocks are dealt with, LOCK_DETECT is the default. all of them fail
+ * lock requests with LOCK_DEADLOCK, after which the tx has to let go of its
+ * locks. the sid of a tx decides who goes first, so a tx that gets retried
+ * should keep its sid to not starve */
+/* keep a global wait-for graph and fault out the youngest tx of a cycle once
+ * it closes. only txes that are actually deadlocked fail, but every request
+ * that has to wait takes a global latch */
+#define LOCK_DETECT       0
+/* a tx may only wait for younger ones, a younger one fails right away
+ * instead of waiting for an older one */
+#define LOCK_WAIT_DIE     1
+/* a tx may only wait for older ones, an older one waits as well but wounds
+ * the younger ones ahead of it: they fail their next request that has to
+ * wait, or the one they are waiting on */
+#define LOCK_WOUND_WAIT   2
+
+/* every lock keeps statistics about how contended it is, cheap enough to
+ * always be on. they are attributed to the id of the lock (for the store, the
+ * id of the object it protects), and outlive the lock, so that the hot spots
+ * still show up after their objects got evicted */
+#define LOCK_NO_ID          UINT64_MAX
+/* wait times are kept in buckets by powers of two: the first one is for waits
+ * below 1us (1024ns), bucket i for [2^(i+9), 2^(i+10))ns, and the last one
+ * for everything from about 16ms */
+#define LOCK_WAIT_BUCKETS   16
+/* hold times are measured for every this many acquisitions of a free lock */
+#define LOCK_HOLD_SAMPLE    64
+
+struct lock_stats {
+    uint64_t id;
+    // requests that got the lock, or upgraded it, rather than holding it
+    // already. and how many of them had to wait for it
+    uint64_t acquisitions;
+    uint64_t contended;
+    // how long those waited, in total and by bucket
+    uint64_t wait_ns;
+    uint64_t wait_hist[LOCK_WAIT_BUCKETS];
+    // how long the lock was held at a time, by anyone, from being taken while
+    // free until it is free again. for hold_samples of those times
+    uint64_t hold_ns;
+    uint64_t hold_samples;
+    // requests to upgrade a shared lock, the ones of them that were
+    // LOCK_STALE, and requests that failed with LOCK_DEADLOCK
+    uint64_t upgrades;
+    uint64_t stale;
+    uint64_t deadlocks;
+};
+
 /* locks are not independent from each other due to the deadlock detector, so
  * they need to be constructed over a central locking support structure */
 struct locks_ctx;
@@ -23,9 +75,31 @@ struct store_tx;
 
 struct locks_ctx* locks_new_ctx(int max_tasks);
 void locks_free_ctx(struct locks_ctx *ctx);
+/* selects one of the policies above, only before any of the locks is used */
+void locks_set_policy(struct locks_ctx *ctx, int policy);
+/* a tx that has to wait for a lock spins for a while before it goes to
+ * sleep, if the lock usually does not take long to become free. this is the
+ * longest it spins, 0 always goes to sleep right away. the default depends on
+ * the number of cpus */
+void locks_set_max_spin(struct locks_ctx *ctx, uint64_t max_spin_ns);
+/* called once tx let go of all its locks. with LOCK_WOUND_WAIT, a tx might
+ * have been wounded without waiting for a lock afterwards, and the wound must
+ * not fail a retry that starts with the same sid */
+void locks_forget_tx(struct locks_ctx *ctx, struct store_tx *tx);
 
 struct lock* lock_new(struct locks_ctx *ctx);
 void lock_free(struct lock *l);
+/* the id the statistics of the lock go under, LOCK_NO_ID by default */
+void lock_set_id(struct lock *l, uint64_t id);
+void lock_get_stats(struct lock *l, struct lock_stats *stats);
+
+/* the statistics of the n ids that were waited on the longest in total, over
+ * all locks with that id. freed locks are only remembered for the ids that
+ * were waited on the longest. returns how many there are, up to n. locks with
+ * LOCK_NO_ID count as one id */
+int locks_top_contended(struct locks_ctx *ctx, struct lock_stats *stats, int n);
+/* prints the top n of locks_top_contended() */
+void locks_dump_contention(struct locks_ctx *ctx, FILE *out, int n);
 
 // XXX this comment wont be true much longer, we will need  to look into the TX
 // for deadlock detection...
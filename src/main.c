@@ -1,15 +1,24 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 
 #include "net.h"
 #include "ntx.h"
 #include "tasks.h"
 #include "vm.h"
 #include "store.h"
+#include "lock.h"
+#include "trace.h"
 
 // XXX set dynamically and allow overriding from config/cmdline
 #define TASK_CONCURRENCY    4
+#define CACHE_SHARDS        16
+#define RUN_TIME_S          100
+#define CHECKPOINT_INTERVAL_S   30
+#define CONTENTION_TOP_N        20
 
 struct ntx_ctx *ntx = NULL;
 struct tasks_ctx *tasks = NULL;
@@ -26,14 +35,93 @@ void net_init_cb(struct net_ctx *net) {
 int main(int argc, char **argv) {
     printf("-=[ CMOO ]=-\n");
 
-    struct persist *persist = persist_new();
-    struct store *store = store_new(persist, TASK_CONCURRENCY);
+    // SIGUSR1 dumps the instruction traces and SIGUSR2 the most contended
+    // objects, we block them here before any threads get created so that only
+    // the sigtimedwait() below receives them
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    if (getenv("CMOO_TRACE")) {
+        trace_set_enabled(true);
+    }
+
+    // without a database directory, objects only live as long as the process.
+    // a core image (see cmc) provides the world to start out from
+    struct persist *persist = persist_open(getenv("CMOO_DB"), getenv("CMOO_IMAGE"), 0);
+    if (!persist) {
+        fprintf(stderr, "could not open the database\n");
+        exit(1);
+    }
+    // group commit: how many commits to wait for before syncing the log, and
+    // for how long at most
+    if (getenv("CMOO_GROUP_SIZE") || getenv("CMOO_GROUP_LATENCY_US")) {
+        persist_set_group_commit(persist,
+            getenv("CMOO_GROUP_SIZE") ? atoi(getenv("CMOO_GROUP_SIZE")) : 1,
+            getenv("CMOO_GROUP_LATENCY_US") ? atoi(getenv("CMOO_GROUP_LATENCY_US")) : 0);
+    }
+    // snapshot reads instead of shared locks, and optionally no locks at all
+    enum store_mode mode = STORE_LOCKING;
+    if (getenv("CMOO_MVCC")) {
+        mode = STORE_MVCC;
+    }
+    else if (getenv("CMOO_OCC")) {
+        mode = STORE_OCC;
+    }
+    struct store *store = store_new(persist, TASK_CONCURRENCY, CACHE_SHARDS, mode);
+    // deadlock prevention instead of detection
+    if (getenv("CMOO_WAIT_DIE")) {
+        store_set_lock_policy(store, LOCK_WAIT_DIE);
+    }
+    else if (getenv("CMOO_WOUND_WAIT")) {
+        store_set_lock_policy(store, LOCK_WOUND_WAIT);
+    }
+    // record object accesses for replaying against the cache policies
+    FILE *access_log = NULL;
+    if (getenv("CMOO_ACCESS_LOG")) {
+        access_log = fopen(getenv("CMOO_ACCESS_LOG"), "w");
+        if (!access_log) {
+            perror("could not open access log");
+            exit(1);
+        }
+        store_record_accesses(store, access_log);
+    }
     vm = vm_new(store);
     struct net_ctx *net = net_new_ctx(net_init_cb);
     net_start(net);
 
-    // XXX we should really have a signal handler...
-    sleep(100);
+    // periodic checkpoints of the world into a core image, which can be used
+    // as CMOO_IMAGE later on
+    char *checkpoint = getenv("CMOO_CHECKPOINT");
+    int checkpoint_interval = getenv("CMOO_CHECKPOINT_S") ? atoi(getenv("CMOO_CHECKPOINT_S"))
+        : CHECKPOINT_INTERVAL_S;
+
+    // XXX we should really have a signal handler for shutdown as well...
+    time_t end = time(NULL) + RUN_TIME_S;
+    time_t next_checkpoint = time(NULL) + checkpoint_interval;
+    time_t now;
+    while ((now = time(NULL)) < end) {
+        if (checkpoint && (now >= next_checkpoint)) {
+            struct store_checkpoint_stats stats;
+            store_get_checkpoint_stats(store, &stats);
+            if (!stats.running) {
+                printf("# checkpoint to %s, last one took %.1fms with a pause of %.2fms\n",
+                    checkpoint, stats.last_duration_ns / 1e6, stats.last_pause_ns / 1e6);
+                store_checkpoint(store, checkpoint);
+            }
+            next_checkpoint = now + checkpoint_interval;
+        }
+        time_t wake = (checkpoint && (next_checkpoint < end)) ? next_checkpoint : end;
+        struct timespec ts = { .tv_sec = wake - now, .tv_nsec = 0 };
+        int sig = sigtimedwait(&sigs, NULL, &ts);
+        if (sig == SIGUSR1) {
+            trace_dump(stderr);
+        }
+        else if (sig == SIGUSR2) {
+            store_dump_lock_contention(store, stderr, CONTENTION_TOP_N);
+        }
+    }
 
     tasks_stop(tasks);
     tasks_free_ctx(tasks);
@@ -43,6 +131,9 @@ int main(int argc, char **argv) {
     vm_free(vm);
     store_free(store);
     persist_free(persist);
+    if (access_log) {
+        fclose(access_log);
+    }
 
     return 0;
 }
@@ -1,60 +1,447 @@
 #include "object.h"
 
 #include <stdlib.h>
+#include <assert.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "symbol.h"
+
+/* tables with up to this many slots are searched linearly, larger ones get a
+ * hash index */
+#define SLOT_INDEX_MIN      4
+/* initial capacity of a slot table once the first slot is added */
+#define SLOT_INITIAL_CAP    4
 
 // -------- internal structures --------
 
+/* methods and globals are each kept in a slot table. the names are stored in
+ * a dense array, and the payloads at the same positions in a second array so
+ * that a linear search only touches the names. once a table grows past
+ * SLOT_INDEX_MIN entries, an open-addressing index from name to position is
+ * maintained in addition. the index holds the names inline so that probing
+ * does not have to go through the names array */
+struct slot_index_entry {
+    symbol name;
+    uint32_t pos;
+};
+
+struct slot_table {
+    int count;
+    int cap;
+    size_t payload_size;
+    symbol *names;
+    char *payload;
+    // NULL while the table is small, index_mask + 1 entries otherwise
+    uint32_t index_mask;
+    struct slot_index_entry *index;
+};
+
+/* code buffers are immutable once created and are shared between the copies
+ * of an object, so they are refcounted. the code is in data, unless the
+ * buffer refers to code somewhere else, see obj_code_from_mapping() */
+struct code_buffer {
+    atomic_int refs;
+    int len;
+    opcode *code;
+    opcode data[];
+};
+
 struct method_slot {
-    char *name;
-    opcode *code_buf;
-    int buf_len;
-    struct method_slot *next;
+    struct code_buffer *code;
 };
 
-struct global_slot {
-    char *name;
-    val global;
-    struct global_slot *next;
+/* the code (parents and methods) and the state (values of the globals) of an
+ * object are kept in separate, refcounted parts. obj_copy() just shares them
+ * with the copy, and whichever object modifies a shared part first gets its
+ * own copy of it. */
+struct obj_code {
+    atomic_int refs;
+    int parent_count;
+    object_id *parents;
+    struct slot_table methods;  // payload is struct method_slot
+    size_t code_bytes;          // sum of the sizes of the code buffers
+};
+
+struct obj_state {
+    atomic_int refs;
+    int count;                  // one per name in the shape of the object
+    int cap;
+    val *values;
+    size_t heap_bytes;          // sum of val_heap_size() of the values
 };
 
+/* the values of the globals of an object are kept in a flat array, and which
+ * global lives at which index is described by the shape of the object. all
+ * objects start out with the empty root shape, and adding a global moves an
+ * object to a shape that has the new name appended. these transitions are
+ * remembered, so that objects that get the same globals added in the same
+ * order (e.g. clones of the same parent) end up sharing the same shape.
+ * shapes are never modified or freed once published, apart from new
+ * transitions getting added */
+struct shape_transition {
+    symbol name;
+    struct shape *target;
+    struct shape_transition *next;
+};
+
+struct shape {
+    // the position of a name in the table is the index of the global, the
+    // table has no payload
+    struct slot_table names;
+    // prepended under the shape latch, but read without it
+    struct shape_transition *_Atomic transitions;
+};
+
+// -------- module state --------
+
+// source for code versions, so that no two objects ever share one. otherwise
+// a cache could mistake a new object at the address of a freed one for the
+// old one
+static atomic_uint code_version_seq = 1;
+
+// the shape of objects without globals, all other shapes derive from it
+static struct shape root_shape;
+// only needed for adding transitions, not for following them
+static pthread_mutex_t shape_latch = PTHREAD_MUTEX_INITIALIZER;
+
 // -------- implementation of declared public structures --------
 
 struct object {
+    atomic_int refs;
     object_id id;
-    int parent_count;
-    object_id *parents;
-    struct method_slot *methods;
-    struct global_slot *globals;
+    atomic_uint code_version;
+    struct obj_code *code;
+    struct shape *shape;
+    struct obj_state *state;
 };
 
+// -------- internal functions --------
+
+void slot_table_init(struct slot_table *t, size_t payload_size) {
+    memset(t, 0, sizeof(struct slot_table));
+    t->payload_size = payload_size;
+}
+
+void slot_table_destroy(struct slot_table *t) {
+    free(t->names);
+    free(t->payload);
+    free(t->index);
+}
+
+void* slot_table_payload(struct slot_table *t, int pos) {
+    return t->payload + pos * t->payload_size;
+}
+
+// bytes allocated by a slot table, not counting the structure itself
+size_t slot_table_bytes(struct slot_table *t) {
+    size_t ret = t->cap * (sizeof(symbol) + t->payload_size);
+    if (t->index) {
+        ret += (t->index_mask + 1) * sizeof(struct slot_index_entry);
+    }
+    return ret;
+}
+
+uint32_t slot_table_hash(symbol name) {
+    // symbols are handed out sequentially, multiplying by an odd constant
+    // spreads them while still mapping distinct symbols to distinct slots
+    return name * 2654435761u;
+}
+
+void slot_table_index_insert(struct slot_table *t, symbol name, uint32_t pos) {
+    uint32_t ipos = slot_table_hash(name) & t->index_mask;
+    while (t->index[ipos].name != SYM_NONE) {
+        ipos = (ipos + 1) & t->index_mask;
+    }
+    t->index[ipos].name = name;
+    t->index[ipos].pos = pos;
+}
+
+// (re)builds the index so that it has at least twice as many entries as the
+// table has capacity, which keeps the load factor at or below 0.5
+void slot_table_reindex(struct slot_table *t) {
+    uint32_t size = SLOT_INDEX_MIN * 2;
+    while (size < (uint32_t)t->cap * 2) {
+        size *= 2;
+    }
+    free(t->index);
+    t->index = calloc(size, sizeof(struct slot_index_entry));
+    t->index_mask = size - 1;
+    for (int i = 0; i < t->count; i++) {
+        slot_table_index_insert(t, t->names[i], i);
+    }
+}
+
+// returns the position of the name in the table, -1 if not found
+int slot_table_find(struct slot_table *t, symbol name) {
+    if (!t->index) {
+        for (int i = 0; i < t->count; i++) {
+            if (t->names[i] == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+    uint32_t ipos = slot_table_hash(name) & t->index_mask;
+    while (t->index[ipos].name != SYM_NONE) {
+        if (t->index[ipos].name == name) {
+            return t->index[ipos].pos;
+        }
+        ipos = (ipos + 1) & t->index_mask;
+    }
+    return -1;
+}
+
+// adds a name that is not in the table yet, returns its position. the
+// payload at that position is left uninitialized
+int slot_table_add(struct slot_table *t, symbol name) {
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : SLOT_INITIAL_CAP;
+        t->names = realloc(t->names, t->cap * sizeof(symbol));
+        if (t->payload_size) {
+            t->payload = realloc(t->payload, t->cap * t->payload_size);
+        }
+        if (t->cap > SLOT_INDEX_MIN) {
+            // this also inserts the existing names
+            slot_table_reindex(t);
+        }
+    }
+    int pos = t->count++;
+    t->names[pos] = name;
+    if (t->index) {
+        slot_table_index_insert(t, name, pos);
+    }
+    return pos;
+}
+
+// makes dst a copy of src, dst must not be initialized. payloads are copied
+// bytewise, any deep copying is left to the caller
+void slot_table_copy(struct slot_table *dst, struct slot_table *src) {
+    *dst = *src;
+    dst->names = NULL;
+    dst->payload = NULL;
+    dst->index = NULL;
+    if (src->cap) {
+        dst->names = malloc(src->cap * sizeof(symbol));
+        memcpy(dst->names, src->names, src->count * sizeof(symbol));
+    }
+    if (src->cap && src->payload_size) {
+        dst->payload = malloc(src->cap * src->payload_size);
+        memcpy(dst->payload, src->payload, src->count * src->payload_size);
+    }
+    if (src->index) {
+        dst->index = malloc((src->index_mask + 1) * sizeof(struct slot_index_entry));
+        memcpy(dst->index, src->index, (src->index_mask + 1) * sizeof(struct slot_index_entry));
+    }
+}
+
+// returns the shape that results from adding a global to an object with
+// shape s, the name must not be in s yet
+struct shape* shape_add_global(struct shape *s, symbol name) {
+    struct shape_transition *st = atomic_load_explicit(&s->transitions, memory_order_acquire);
+    while (st) {
+        if (st->name == name) {
+            return st->target;
+        }
+        st = st->next;
+    }
+
+    pthread_mutex_lock(&shape_latch);
+    // someone else could have added it in the meantime
+    st = atomic_load_explicit(&s->transitions, memory_order_relaxed);
+    while (st) {
+        if (st->name == name) {
+            pthread_mutex_unlock(&shape_latch);
+            return st->target;
+        }
+        st = st->next;
+    }
+    // XXX the child copies the whole name table of its parent, so a long
+    // chain of shapes needs quadratic space. if this becomes an issue the
+    // tables could be shared along the chain
+    struct shape *ret = malloc(sizeof(struct shape));
+    slot_table_copy(&ret->names, &s->names);
+    slot_table_add(&ret->names, name);
+    atomic_init(&ret->transitions, NULL);
+    st = malloc(sizeof(struct shape_transition));
+    st->name = name;
+    st->target = ret;
+    st->next = atomic_load_explicit(&s->transitions, memory_order_relaxed);
+    atomic_store_explicit(&s->transitions, st, memory_order_release);
+    pthread_mutex_unlock(&shape_latch);
+    return ret;
+}
+
+struct code_buffer* code_buffer_new(opcode *code, int len) {
+    struct code_buffer *ret = malloc(sizeof(struct code_buffer) + len * sizeof(opcode));
+    atomic_init(&ret->refs, 1);
+    ret->len = len;
+    ret->code = ret->data;
+    memcpy(ret->data, code, len * sizeof(opcode));
+    return ret;
+}
+
+// refers to the code rather than copying it
+struct code_buffer* code_buffer_new_ref(opcode *code, int len) {
+    struct code_buffer *ret = malloc(sizeof(struct code_buffer));
+    atomic_init(&ret->refs, 1);
+    ret->len = len;
+    ret->code = code;
+    return ret;
+}
+
+size_t code_buffer_bytes(struct code_buffer *cb) {
+    return sizeof(struct code_buffer) + (cb->code == cb->data ? cb->len * sizeof(opcode) : 0);
+}
+
+void code_buffer_release(struct code_buffer *cb) {
+    if (atomic_fetch_sub(&cb->refs, 1) == 1) {
+        free(cb);
+    }
+}
+
+struct obj_code* obj_code_new(void) {
+    struct obj_code *ret = malloc(sizeof(struct obj_code));
+    atomic_init(&ret->refs, 1);
+    ret->parent_count = 0;
+    ret->parents = NULL;
+    slot_table_init(&ret->methods, sizeof(struct method_slot));
+    ret->code_bytes = 0;
+    return ret;
+}
+
+void obj_code_release(struct obj_code *c) {
+    if (atomic_fetch_sub(&c->refs, 1) != 1) {
+        return;
+    }
+    for (int i = 0; i < c->methods.count; i++) {
+        struct method_slot *ms = slot_table_payload(&c->methods, i);
+        code_buffer_release(ms->code);
+    }
+    slot_table_destroy(&c->methods);
+    free(c->parents);
+    free(c);
+}
+
+struct obj_state* obj_state_new(int cap) {
+    struct obj_state *ret = malloc(sizeof(struct obj_state));
+    atomic_init(&ret->refs, 1);
+    ret->count = 0;
+    ret->cap = cap;
+    ret->values = cap ? malloc(cap * sizeof(val)) : NULL;
+    ret->heap_bytes = 0;
+    return ret;
+}
+
+void obj_state_release(struct obj_state *st) {
+    if (atomic_fetch_sub(&st->refs, 1) != 1) {
+        return;
+    }
+    for (int i = 0; i < st->count; i++) {
+        val_dec_ref(st->values[i]);
+    }
+    free(st->values);
+    free(st);
+}
+
+// makes sure the object has a code part that is not shared with any copies,
+// so that it can be modified
+struct obj_code* obj_own_code(struct object *o) {
+    struct obj_code *c = o->code;
+    if (atomic_load(&c->refs) == 1) {
+        return c;
+    }
+    struct obj_code *nc = malloc(sizeof(struct obj_code));
+    atomic_init(&nc->refs, 1);
+    nc->parent_count = c->parent_count;
+    nc->parents = malloc(c->parent_count * sizeof(object_id));
+    memcpy(nc->parents, c->parents, c->parent_count * sizeof(object_id));
+    // the code buffers themselves are immutable and can stay shared
+    slot_table_copy(&nc->methods, &c->methods);
+    nc->code_bytes = c->code_bytes;
+    for (int i = 0; i < nc->methods.count; i++) {
+        struct method_slot *ms = slot_table_payload(&nc->methods, i);
+        atomic_fetch_add(&ms->code->refs, 1);
+    }
+    obj_code_release(c);
+    o->code = nc;
+    return nc;
+}
+
+// like obj_own_code(), but for the state. also makes sure there is room for
+// at least min_cap values
+struct obj_state* obj_own_state(struct object *o, int min_cap) {
+    struct obj_state *st = o->state;
+    int cap = st->cap;
+    while (cap < min_cap) {
+        cap = cap ? cap * 2 : SLOT_INITIAL_CAP;
+    }
+    if (atomic_load(&st->refs) == 1) {
+        if (cap != st->cap) {
+            st->values = realloc(st->values, cap * sizeof(val));
+            st->cap = cap;
+        }
+        return st;
+    }
+    struct obj_state *nst = obj_state_new(cap);
+    nst->count = st->count;
+    nst->heap_bytes = st->heap_bytes;
+    for (int i = 0; i < st->count; i++) {
+        nst->values[i] = st->values[i];
+        val_inc_ref(nst->values[i]);
+    }
+    obj_state_release(st);
+    o->state = nst;
+    return nst;
+}
+
+// sets a method to a code buffer, which the object takes the reference to
+void obj_set_code_buffer(struct object *o, symbol name, struct code_buffer *cb) {
+    // XXX removal case
+    struct obj_code *c = obj_own_code(o);
+    struct method_slot *ms;
+    int pos = slot_table_find(&c->methods, name);
+    if (pos >= 0) {
+        ms = slot_table_payload(&c->methods, pos);
+        c->code_bytes -= code_buffer_bytes(ms->code);
+        code_buffer_release(ms->code);
+    }
+    else {
+        pos = slot_table_add(&c->methods, name);
+        ms = slot_table_payload(&c->methods, pos);
+    }
+    ms->code = cb;
+    c->code_bytes += code_buffer_bytes(ms->code);
+    obj_bump_code_version(o);
+}
+
 // -------- implementation of public functions --------
 
 struct object* obj_new(void) {
     struct object *ret = malloc(sizeof(struct object));
     memset(ret, 0, sizeof(struct object));
+    atomic_init(&ret->refs, 1);
+    ret->code = obj_code_new();
+    ret->shape = &root_shape;
+    ret->state = obj_state_new(0);
+    obj_bump_code_version(ret);
     return ret;
 }
 
 void obj_free(struct object *o) {
-    while (o->methods) {
-        struct method_slot *tmp = o->methods;
-        o->methods = o->methods->next;
-        free(tmp->name);
-        free(tmp->code_buf);
-        free(tmp);
-    }
-    while (o->globals) {
-        struct global_slot *tmp = o->globals;
-        o->globals = o->globals->next;
-        free(tmp->name);
-        val_dec_ref(tmp->global);
-        free(tmp);
-    }
-    free(o->parents);
+    if (atomic_fetch_sub(&o->refs, 1) != 1) {
+        return;
+    }
+    obj_code_release(o->code);
+    obj_state_release(o->state);
     free(o);
 }
 
+void obj_retain(struct object *o) {
+    atomic_fetch_add(&o->refs, 1);
+}
+
 object_id obj_get_id(struct object *o) {
     return o->id;
 }
@@ -64,25 +451,30 @@ void obj_set_id( struct object *o, object_id id) {
 }
 
 int obj_get_parent_count(struct object *o) {
-    return o->parent_count;
+    return o->code->parent_count;
 }
 
 object_id obj_get_parent(struct object *o, int idx) {
-    return o->parents[idx];
+    return o->code->parents[idx];
 }
 
 void obj_add_parent(struct object *o, object_id parent_id) {
-    o->parents = realloc(o->parents, (o->parent_count + 1) * sizeof(object_id));
-    o->parents[o->parent_count] = parent_id;
-    o->parent_count++;
+    struct obj_code *c = obj_own_code(o);
+    c->parents = realloc(c->parents, (c->parent_count + 1) * sizeof(object_id));
+    c->parents[c->parent_count] = parent_id;
+    c->parent_count++;
+    obj_bump_code_version(o);
 }
 
 void obj_remove_parent(struct object *o, object_id parent_id) {
-    for (int i = 0; i < o->parent_count; i++) {
-        if (o->parents[i] == parent_id) {
+    for (int i = 0; i < o->code->parent_count; i++) {
+        if (o->code->parents[i] == parent_id) {
             // found the one we are interested in, remove it
-            memmove(&o->parents[i], &o->parents[i+1], o->parent_count - i - 1);
-            o->parent_count--;
+            struct obj_code *c = obj_own_code(o);
+            memmove(&c->parents[i], &c->parents[i+1],
+                (c->parent_count - i - 1) * sizeof(object_id));
+            c->parent_count--;
+            obj_bump_code_version(o);
             // we don't actually shrink the memory region
             return;
         }
@@ -90,108 +482,487 @@ void obj_remove_parent(struct object *o, object_id parent_id) {
 }
 
 int obj_get_code(struct object *o, char *name, opcode **code_buf) {
-    struct method_slot *cms = o->methods;
-    while (cms) {
-        if (strcmp(cms->name, name) == 0) {
-            // found!
-            *code_buf = cms->code_buf;
-            return cms->buf_len;
+    // names that were never interned can't be on any object
+    symbol sname = sym_lookup(name, strlen(name));
+    if (sname == SYM_NONE) {
+        *code_buf = NULL;
+        return 0;
+    }
+    return obj_get_code_sym(o, sname, code_buf);
+}
+
+int obj_get_code_sym(struct object *o, symbol name, opcode **code_buf) {
+    int pos = slot_table_find(&o->code->methods, name);
+    if (pos < 0) {
+        // not found
+        *code_buf = NULL;
+        return 0;
+    }
+    struct method_slot *ms = slot_table_payload(&o->code->methods, pos);
+    *code_buf = ms->code->code;
+    return ms->code->len;
+}
+
+void obj_set_code(struct object *o, char *name, opcode *code_buf, int buf_len) {
+    obj_set_code_sym(o, sym_intern(name, strlen(name)), code_buf, buf_len);
+}
+
+void obj_set_code_sym(struct object *o, symbol name, opcode *code_buf, int buf_len) {
+    obj_set_code_buffer(o, name, code_buffer_new(code_buf, buf_len));
+}
+
+uint32_t obj_get_code_version(struct object *o) {
+    return atomic_load_explicit(&o->code_version, memory_order_acquire);
+}
+
+void obj_bump_code_version(struct object *o) {
+    atomic_store(&o->code_version, atomic_fetch_add(&code_version_seq, 1));
+}
+
+val obj_get_global(struct object *o, char *name) {
+    symbol sname = sym_lookup(name, strlen(name));
+    if (sname == SYM_NONE) {
+        return val_make_nil();
+    }
+    return obj_get_global_sym(o, sname);
+}
+
+val obj_get_global_sym(struct object *o, symbol name) {
+    int idx = shape_get_global_index(o->shape, name);
+    if (idx < 0) {
+        // not found!
+        return val_make_nil();
+    }
+    return obj_get_global_at(o, idx);
+}
+
+void obj_set_global(struct object *o, char *name, val v) {
+    obj_set_global_sym(o, sym_intern(name, strlen(name)), v);
+}
+
+void obj_set_global_sym(struct object *o, symbol name, val v) {
+    // XXX removal case
+    int idx = shape_get_global_index(o->shape, name);
+    if (idx >= 0) {
+        obj_set_global_at(o, idx, v);
+        return;
+    }
+    // not found, move the object to a shape with the new global
+    struct obj_state *st = obj_own_state(o, o->state->count + 1);
+    o->shape = shape_add_global(o->shape, name);
+    st->values[st->count++] = v;
+    st->heap_bytes += val_heap_size(v);
+    val_inc_ref(v);
+}
+
+struct shape* obj_get_shape(struct object *o) {
+    return o->shape;
+}
+
+int shape_get_global_index(struct shape *s, symbol name) {
+    return slot_table_find(&s->names, name);
+}
+
+val obj_get_global_at(struct object *o, int idx) {
+    val ret = o->state->values[idx];
+    val_inc_ref(ret);
+    return ret;
+}
+
+void obj_set_global_at(struct object *o, int idx, val v) {
+    struct obj_state *st = obj_own_state(o, 0);
+    st->heap_bytes -= val_heap_size(st->values[idx]);
+    val_dec_ref(st->values[idx]);
+    st->values[idx] = v;
+    st->heap_bytes += val_heap_size(v);
+    val_inc_ref(v);
+}
+
+/* the serialized form of an object does not depend on the byte order, the
+ * word size or the shapes of the running image. integers are varints (7 bits
+ * per byte, least significant first, the top bit set on all but the last
+ * byte), signed ones zigzag encoded so that small negative numbers stay
+ * small. names are a varint length and the bytes, and are stored once per
+ * buffer in a name table that everything else refers to by index.
+ *
+ * the code is the format version, the id, the number of parents and the
+ * parents, then the number of methods, their names, and the code of each as a
+ * varint length and the bytes.
+ *
+ * the state is the format version, the number of globals and the number of
+ * names, then the names, the first ones being those of the globals in order,
+ * followed by the names of symbol values that are not also names of globals.
+ * then the value of each global, which is a tag byte with the type in the
+ * lower bits and the payload:
+ * - nil: none. specials refer to runtime resources like sockets, they cannot
+ *   outlive the process and are stored as nil
+ * - bool: none, the value is in bit 3 of the tag
+ * - int: zigzag varint
+ * - float: the 4 bytes of the IEEE 754 representation, least significant
+ *   first
+ * - string: varint length, the bytes, and a terminating NUL, so that the
+ *   string can be used in place
+ * - objref: varint
+ * - symbol: varint index into the name table */
+#define OBJ_FORMAT_VERSION  1
+#define OBJ_TAG_TYPE_MASK   0x7
+#define OBJ_TAG_TRUE        0x8
+// the most bytes a 64 bit varint can take
+#define VARINT_MAX          10
+
+int varint_size(uint64_t v) {
+    int ret = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        ret++;
+    }
+    return ret;
+}
+
+char* varint_put(char *dst, uint64_t v) {
+    while (v >= 0x80) {
+        *dst++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *dst++ = (char)v;
+    return dst;
+}
+
+uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+int64_t zigzag_decode(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* a position in a buffer that is being read. nothing gets read past the end,
+ * instead ok turns false and everything reads as 0 from then on */
+struct obj_reader {
+    unsigned char *pos;
+    unsigned char *end;
+    bool ok;
+};
+
+uint64_t obj_read_varint(struct obj_reader *r) {
+    uint64_t ret = 0;
+    for (int shift = 0; (shift < 7 * VARINT_MAX) && (r->pos < r->end); shift += 7) {
+        unsigned char b = *r->pos++;
+        ret |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return ret;
         }
-        cms = cms->next;
     }
-    // not found
-    *code_buf = NULL;
+    r->ok = false;
     return 0;
 }
 
-void obj_set_code(struct object *o, char *name, opcode *code_buf, int buf_len) {
-    struct method_slot *cms = o->methods;
-    while (cms) {
-        if (strcmp(cms->name, name) == 0) {
-            // found!
-            // XXX removal case
-            cms->code_buf = realloc(cms->code_buf, buf_len);
-            memcpy(cms->code_buf, code_buf, buf_len);
-            cms->buf_len = buf_len;
-            return;
+// returns where the bytes are in the buffer
+char* obj_read_bytes(struct obj_reader *r, uint64_t len) {
+    if (!r->ok || (len > (uint64_t)(r->end - r->pos))) {
+        r->ok = false;
+        return NULL;
+    }
+    char *ret = (char*)r->pos;
+    r->pos += len;
+    return ret;
+}
+
+// a count of things that take at least one byte each, which cannot be more
+// than there are bytes left. this keeps corrupt counts from causing huge
+// allocations
+int obj_read_count(struct obj_reader *r) {
+    uint64_t ret = obj_read_varint(r);
+    if (ret > (uint64_t)(r->end - r->pos)) {
+        r->ok = false;
+        return 0;
+    }
+    return (int)ret;
+}
+
+// reads the name table and interns the names, the array is owned by the
+// caller
+symbol* obj_read_names(struct obj_reader *r, int count) {
+    symbol *ret = malloc(sizeof(symbol) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+        uint64_t len = obj_read_varint(r);
+        char *name = obj_read_bytes(r, len);
+        ret[i] = name ? sym_intern(name, len) : SYM_NONE;
+    }
+    return ret;
+}
+
+int obj_name_size(symbol name) {
+    int len = sym_name_len(name);
+    return varint_size(len) + len;
+}
+
+char* obj_put_name(char *dst, symbol name) {
+    int len = sym_name_len(name);
+    dst = varint_put(dst, len);
+    memcpy(dst, sym_name(name), len);
+    return dst + len;
+}
+
+/* the names of symbol values that are not names of globals, they go into the
+ * name table after the names of the globals. objects rarely have many of
+ * them, so they are just searched linearly */
+struct obj_extra_names {
+    symbol *names;
+    int count;
+    int cap;
+};
+
+// the index of a symbol value in the name table, adding it if needed
+int obj_name_index(struct object *o, struct obj_extra_names *extra, symbol s) {
+    int idx = shape_get_global_index(o->shape, s);
+    if (idx >= 0) {
+        return idx;
+    }
+    for (int i = 0; i < extra->count; i++) {
+        if (extra->names[i] == s) {
+            return o->state->count + i;
         }
-        cms = cms->next;
     }
-    // not found
-    cms = malloc(sizeof(struct method_slot));
-    cms->name = malloc(strlen(name)+1);
-    strcpy(cms->name, name);
-    cms->code_buf = malloc(buf_len);
-    memcpy(cms->code_buf, code_buf, buf_len);
-    cms->buf_len = buf_len;
-    cms->next = o->methods;
-    o->methods = cms;
+    if (extra->count == extra->cap) {
+        extra->cap = extra->cap ? extra->cap * 2 : 4;
+        extra->names = realloc(extra->names, sizeof(symbol) * extra->cap);
+    }
+    extra->names[extra->count++] = s;
+    return o->state->count + extra->count - 1;
 }
 
-val obj_get_global(struct object *o, char *name) {
-    struct global_slot *cgs = o->globals;
-    while (cgs) {
-        if (strcmp(cgs->name, name) == 0) {
-            // found!
-            val_inc_ref(cgs->global);
-            return cgs->global;
+int obj_value_size(struct object *o, struct obj_extra_names *extra, val v) {
+    switch (val_type(v)) {
+        case TYPE_INT:
+            return varint_size(zigzag_encode(val_get_int(v)));
+        case TYPE_FLOAT:
+            return 4;
+        case TYPE_STRING:
+            return varint_size(val_get_string_len(v)) + val_get_string_len(v) + 1;
+        case TYPE_OBJREF:
+            return varint_size(val_get_objref(v));
+        case TYPE_SYMBOL:
+            return varint_size(obj_name_index(o, extra, val_get_symbol(v)));
+        default:
+            return 0;
+    }
+}
+
+char* obj_put_value(char *dst, struct object *o, struct obj_extra_names *extra, val v) {
+    int type = val_type(v);
+    switch (type) {
+        case TYPE_BOOL:
+            *dst++ = TYPE_BOOL | (val_get_bool(v) ? OBJ_TAG_TRUE : 0);
+            break;
+        case TYPE_INT:
+            *dst++ = TYPE_INT;
+            dst = varint_put(dst, zigzag_encode(val_get_int(v)));
+            break;
+        case TYPE_FLOAT: {
+            union {
+                uint32_t i;
+                float f;
+            } fv;
+            fv.f = val_get_float(v);
+            *dst++ = TYPE_FLOAT;
+            for (int i = 0; i < 4; i++) {
+                *dst++ = (char)(fv.i >> (8 * i));
+            }
+            break;
         }
-        cgs = cgs->next;
+        case TYPE_STRING: {
+            uint16_t len = val_get_string_len(v);
+            *dst++ = TYPE_STRING;
+            dst = varint_put(dst, len);
+            memcpy(dst, val_get_string_data(v), len);
+            dst += len;
+            *dst++ = '\0';
+            break;
+        }
+        case TYPE_OBJREF:
+            *dst++ = TYPE_OBJREF;
+            dst = varint_put(dst, val_get_objref(v));
+            break;
+        case TYPE_SYMBOL:
+            *dst++ = TYPE_SYMBOL;
+            dst = varint_put(dst, obj_name_index(o, extra, val_get_symbol(v)));
+            break;
+        default:
+            *dst++ = TYPE_NIL;
+            break;
     }
-    // not found!
-    return val_make_nil();
+    return dst;
 }
 
-void obj_set_global(struct object *o, char *name, val v) {
-    struct global_slot *cgs = o->globals;
-    while (cgs) {
-        if (strcmp(cgs->name, name) == 0) {
-            // found!
-            // XXX removal case
-            val_dec_ref(cgs->global);
-            cgs->global = v;
-            val_inc_ref(cgs->global);
-            return;
+// with mapped, strings point into the buffer rather than being copied
+val obj_read_value(struct obj_reader *r, symbol *names, int name_count, bool mapped) {
+    char *tag = obj_read_bytes(r, 1);
+    if (!tag) {
+        return val_make_nil();
+    }
+    switch (*tag & OBJ_TAG_TYPE_MASK) {
+        case TYPE_NIL:
+            return val_make_nil();
+        case TYPE_BOOL:
+            return val_make_bool((*tag & OBJ_TAG_TRUE) != 0);
+        case TYPE_INT:
+            return val_make_int((int)zigzag_decode(obj_read_varint(r)));
+        case TYPE_FLOAT: {
+            unsigned char *b = (unsigned char*)obj_read_bytes(r, 4);
+            union {
+                uint32_t i;
+                float f;
+            } fv;
+            fv.i = b ? b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24) : 0;
+            return val_make_float(fv.f);
+        }
+        case TYPE_STRING: {
+            uint64_t len = obj_read_varint(r);
+            char *s = obj_read_bytes(r, len + 1);
+            if (!s || (len > UINT16_MAX) || (s[len] != '\0')) {
+                r->ok = false;
+                return val_make_nil();
+            }
+            return mapped ? val_make_string_ref(len, s) : val_make_string(len, s);
+        }
+        case TYPE_OBJREF: {
+            uint64_t ref = obj_read_varint(r);
+            if (ref >= 0x010000000000) {
+                r->ok = false;
+                return val_make_nil();
+            }
+            return val_make_objref(ref);
+        }
+        case TYPE_SYMBOL: {
+            uint64_t idx = obj_read_varint(r);
+            if (idx >= (uint64_t)name_count) {
+                r->ok = false;
+                return val_make_nil();
+            }
+            return val_make_symbol(names[idx]);
         }
-        cgs = cgs->next;
+        default:
+            r->ok = false;
+            return val_make_nil();
+    }
+}
+
+bool obj_state_read(struct object *o, char *buf, int buf_len, bool mapped) {
+    struct obj_reader r = { (unsigned char*)buf, (unsigned char*)buf + buf_len, true };
+    char *version = obj_read_bytes(&r, 1);
+    if (!version || (*version != OBJ_FORMAT_VERSION)) {
+        return false;
     }
-    // not found
-    cgs = malloc(sizeof(struct global_slot));
-    cgs->name = malloc(strlen(name)+1);
-    strcpy(cgs->name, name);
-    cgs->global = v;
-    val_inc_ref(cgs->global);
-    cgs->next = o->globals;
-    o->globals = cgs;
+    int count = obj_read_count(&r);
+    int name_count = obj_read_count(&r);
+    if (name_count < count) {
+        return false;
+    }
+    symbol *names = obj_read_names(&r, name_count);
+    for (int i = 0; (i < count) && r.ok; i++) {
+        val v = obj_read_value(&r, names, name_count, mapped);
+        obj_set_global_sym(o, names[i], v);
+        val_dec_ref(v);
+    }
+    free(names);
+    return r.ok && (r.pos == r.end);
 }
 
-void obj_state_from_buffer(struct object *o, char *buf, int buf_len) {
-    // XXX
+bool obj_code_read(struct object *o, char *buf, int buf_len, bool mapped) {
+    struct obj_reader r = { (unsigned char*)buf, (unsigned char*)buf + buf_len, true };
+    char *version = obj_read_bytes(&r, 1);
+    if (!version || (*version != OBJ_FORMAT_VERSION)) {
+        return false;
+    }
+    obj_set_id(o, obj_read_varint(&r));
+    int parent_count = obj_read_count(&r);
+    for (int i = 0; (i < parent_count) && r.ok; i++) {
+        obj_add_parent(o, obj_read_varint(&r));
+    }
+    int method_count = obj_read_count(&r);
+    symbol *names = obj_read_names(&r, method_count);
+    for (int i = 0; (i < method_count) && r.ok; i++) {
+        uint64_t len = obj_read_varint(&r);
+        opcode *code = (opcode*)obj_read_bytes(&r, len * sizeof(opcode));
+        if (code) {
+            obj_set_code_buffer(o, names[i],
+                mapped ? code_buffer_new_ref(code, len) : code_buffer_new(code, len));
+        }
+    }
+    free(names);
+    return r.ok && (r.pos == r.end);
 }
 
-void obj_code_from_buffer(struct object *o, char *buf, int buf_len) {
-    // XXX
+bool obj_state_from_buffer(struct object *o, char *buf, int buf_len) {
+    return obj_state_read(o, buf, buf_len, false);
+}
+
+bool obj_code_from_buffer(struct object *o, char *buf, int buf_len) {
+    return obj_code_read(o, buf, buf_len, false);
+}
+
+bool obj_state_from_mapping(struct object *o, char *buf, int buf_len) {
+    return obj_state_read(o, buf, buf_len, true);
+}
+
+bool obj_code_from_mapping(struct object *o, char *buf, int buf_len) {
+    return obj_code_read(o, buf, buf_len, true);
 }
 
 void obj_state_to_buffer(struct object *o, char **buffer, int *buf_len) {
-    // XXX
+    struct obj_state *st = o->state;
+    struct slot_table *names = &o->shape->names;
+    struct obj_extra_names extra = { NULL, 0, 0 };
+    // determine buffer size required, alloc and update buf_len. the sizes of
+    // the values need to come first, they fill in the extra names
+    int size_required = 1; // version
+    for (int i = 0; i < st->count; i++) {
+        size_required +=  obj_name_size(names->names[i])
+                        + 1 // tag
+                        + obj_value_size(o, &extra, st->values[i]);
+    }
+    for (int i = 0; i < extra.count; i++) {
+        size_required += obj_name_size(extra.names[i]);
+    }
+    size_required += varint_size(st->count) + varint_size(st->count + extra.count);
+    if (*buf_len < size_required) {
+        *buffer = realloc(*buffer, size_required);
+    }
+    *buf_len = size_required;
+    // copy the data
+    char *dst = *buffer;
+    *dst++ = OBJ_FORMAT_VERSION;
+    dst = varint_put(dst, st->count);
+    dst = varint_put(dst, st->count + extra.count);
+    for (int i = 0; i < st->count; i++) {
+        dst = obj_put_name(dst, names->names[i]);
+    }
+    for (int i = 0; i < extra.count; i++) {
+        dst = obj_put_name(dst, extra.names[i]);
+    }
+    for (int i = 0; i < st->count; i++) {
+        dst = obj_put_value(dst, o, &extra, st->values[i]);
+    }
+    assert(dst - *buffer == size_required);
+    free(extra.names);
 }
 
 void obj_code_to_buffer(struct object *o, char **buffer, int *buf_len) {
+    struct obj_code *c = o->code;
     // determine buffer size required, alloc and update buf_len
-    int size_required =   sizeof(object_id) // id
-                        + sizeof(int) // parent_count
-                        + o->parent_count * sizeof(object_id) // parents
-                        + sizeof(int); // method count
-    struct method_slot *cms = o->methods;
-    int method_count = 0;
-    while (cms) {
-        size_required +=  sizeof(int) // strlen(name)
-                        + strlen(cms->name) // name
-                        + sizeof(int) // buf_len
-                        + cms->buf_len * sizeof(opcode); // code_buf
-        method_count++;
-        cms = cms->next;
+    int size_required =   1 // version
+                        + varint_size(o->id)
+                        + varint_size(c->parent_count)
+                        + varint_size(c->methods.count);
+    for (int i = 0; i < c->parent_count; i++) {
+        size_required += varint_size(c->parents[i]);
+    }
+    for (int i = 0; i < c->methods.count; i++) {
+        struct method_slot *ms = slot_table_payload(&c->methods, i);
+        size_required +=  obj_name_size(c->methods.names[i])
+                        + varint_size(ms->code->len)
+                        + ms->code->len * sizeof(opcode);
     }
     if (*buf_len < size_required) {
         *buffer = realloc(*buffer, size_required);
@@ -199,73 +970,45 @@ void obj_code_to_buffer(struct object *o, char **buffer, int *buf_len) {
     *buf_len = size_required;
     // copy the data
     char *dst = *buffer;
-    memcpy(dst, &o->id, sizeof(object_id)); dst += sizeof(object_id);
-    memcpy(dst, &o->parent_count, sizeof(int)); dst += sizeof(int);
-    for (int i = 0; i < o->parent_count; i++) {
-        memcpy(dst, &o->parents[i], sizeof(object_id)); dst += sizeof(object_id);
+    *dst++ = OBJ_FORMAT_VERSION;
+    dst = varint_put(dst, o->id);
+    dst = varint_put(dst, c->parent_count);
+    for (int i = 0; i < c->parent_count; i++) {
+        dst = varint_put(dst, c->parents[i]);
     }
-    memcpy(dst, &method_count, sizeof(int)); dst += sizeof(int);
-    cms = o->methods;
-    while (cms) {
-        int nlen = strlen(cms->name);
-        memcpy(dst, &nlen, sizeof(int)); dst += sizeof(int);
-        memcpy(dst, cms->name, nlen), dst += nlen;
-        memcpy(dst, &cms->buf_len, sizeof(int)); dst += sizeof(int);
-        memcpy(dst, cms->code_buf, cms->buf_len * sizeof(opcode)); dst += cms->buf_len * sizeof(opcode);
-
-        cms = cms->next;
+    dst = varint_put(dst, c->methods.count);
+    for (int i = 0; i < c->methods.count; i++) {
+        dst = obj_put_name(dst, c->methods.names[i]);
     }
+    for (int i = 0; i < c->methods.count; i++) {
+        struct method_slot *ms = slot_table_payload(&c->methods, i);
+        dst = varint_put(dst, ms->code->len);
+        memcpy(dst, ms->code->code, ms->code->len * sizeof(opcode));
+        dst += ms->code->len * sizeof(opcode);
+    }
+    assert(dst - *buffer == size_required);
+}
+
+size_t obj_get_footprint(struct object *o) {
+    struct obj_code *c = o->code;
+    struct obj_state *st = o->state;
+    return sizeof(struct object)
+        + sizeof(struct obj_code) + c->parent_count * sizeof(object_id)
+        + slot_table_bytes(&c->methods) + c->code_bytes
+        + sizeof(struct obj_state) + st->cap * sizeof(val) + st->heap_bytes;
 }
 
 struct object* obj_copy(struct object *o) {
-    // XXX this could be some sort of shallow copy that only does 
-    // actually copying when written to...
+    // the copy shares code and state with the original, whichever of the two
+    // modifies them first creates its own
     struct object *ret = malloc(sizeof(struct object));
-    memset(ret, 0, sizeof(struct object));
+    atomic_init(&ret->refs, 1);
     ret->id = o->id;
-    ret->parent_count = o->parent_count;
-    ret->parents = malloc(ret->parent_count * sizeof(object_id));
-    memcpy(ret->parents, o->parents, ret->parent_count * sizeof(object_id));
-    struct method_slot *oms = o->methods;
-    struct method_slot *nms;
-    struct method_slot *pms = NULL;
-    while (oms) {
-        nms = malloc(sizeof(struct method_slot));
-        nms->name = malloc(strlen(oms->name)+1);
-        strcpy(nms->name, oms->name);
-        nms->buf_len = oms->buf_len;
-        nms->code_buf = malloc(nms->buf_len);
-        memcpy(nms->code_buf, oms->code_buf, nms->buf_len);
-        nms->next = NULL;
-        if (pms) {
-            pms->next = nms;
-        }
-        else {
-            ret->methods = pms;
-        }
-        pms = nms;
-        oms = oms->next;
-    }
-    struct global_slot *ogs = o->globals;
-    struct global_slot *ngs;
-    struct global_slot *pgs = NULL;
-    while (ogs) {
-        ngs = malloc(sizeof(struct global_slot));
-        ngs->name = malloc(strlen(ogs->name)+1);
-        strcpy(ngs->name, ogs->name);
-        ngs->global = ogs->global;
-        val_inc_ref(ngs->global);
-        ngs->next = NULL;
-        if (pgs) {
-            pgs->next = ngs;
-        }
-        else {
-            ret->globals = pgs;
-        }
-        pgs = ngs;
-        ogs = ogs->next;
-    }
- 
+    atomic_init(&ret->code_version, obj_get_code_version(o));
+    ret->code = o->code;
+    atomic_fetch_add(&ret->code->refs, 1);
+    ret->shape = o->shape;
+    ret->state = o->state;
+    atomic_fetch_add(&ret->state->refs, 1);
     return ret;
 }
-
@@ -75,9 +75,13 @@
 
 struct object;
 
-/* create/destroy an object */
+/* create/destroy an object. objects are refcounted, obj_new() returns one
+ * with a single reference that obj_free() drops. obj_retain() adds a
+ * reference, e.g. for caches that need to keep an object around that its
+ * owner might drop. the object is freed once the last reference is gone */
 struct object* obj_new(void);
 void obj_free(struct object *o);
+void obj_retain(struct object *o);
 
 /* each object in our world has a unique id. The id is of course not 
  * changeable on an existing object, the setter method here is purely 
@@ -96,32 +100,77 @@ object_id obj_get_parent(struct object *o, int idx);
 void obj_add_parent(struct object *o, object_id parent_id);
 void obj_remove_parent(struct object *o, object_id parent_id);
 
-/* updates code_buf and buf_len to refer to the code for the named
+/* the accessors below come in two flavours: one that takes the name as a
+ * NUL-terminated string, and one (suffixed _sym) that takes an interned
+ * symbol. names are interned internally anyway, so the latter avoids hashing
+ * the name and should be used on hot paths.
+ *
+ * updates code_buf and buf_len to refer to the code for the named
  * method. code_buf is set to NULL if the method does not exist, 
  * resolving to parent object is left to the caller. The code buffer 
  * is owned by the object and must not be modified or freed by the caller.
  * returns the size of the buffer, 0 if method not found */
 int obj_get_code(struct object *o, char *name, opcode **code_buf);
+int obj_get_code_sym(struct object *o, symbol name, opcode **code_buf);
 /* sets the method from the provided buffer, copying the contents rather than 
  * consuming them. use NULL for code_buf to remove a method */
 void obj_set_code(struct object *o, char *name, opcode *code_buf, int buf_len);
+void obj_set_code_sym(struct object *o, symbol name, opcode *code_buf, int buf_len);
+/* the code version changes whenever the methods or parents of the object
+ * change, so it can be used to validate cached method lookups. versions are
+ * unique across all objects, not just increasing per object. This can be
+ * called without holding a lock on the object */
+uint32_t obj_get_code_version(struct object *o);
+/* forces a new code version without changing anything, e.g. when the
+ * transaction layer supersedes the object with a newer version of it, so that
+ * method lookups cached through the old one get redone */
+void obj_bump_code_version(struct object *o);
 
 /* get set "global" member variable on object. getter returns nil if 
  * member does not exist, setter overwrites existing data. The setter 
  * copies val and does not consume, the getter creates a val that the
  * recipient has to clean up. */
 val obj_get_global(struct object *o, char *name);
+val obj_get_global_sym(struct object *o, symbol name);
 /* the the global, set to NIL to remove global */
 void obj_set_global(struct object *o, char *name, val v);
+void obj_set_global_sym(struct object *o, symbol name, val v);
+
+/* the values of the globals are stored in a flat array per object, and the
+ * layout of that array is described by the shape of the object. objects that
+ * got the same globals added in the same order share a shape. shapes are
+ * immutable and never freed, so a (shape, index) pair can be cached and
+ * compared by pointer, it stays valid for every object that has that shape.
+ * like the object itself, the shape of an object must only be looked at
+ * while holding a lock on it */
+struct shape;
+
+struct shape* obj_get_shape(struct object *o);
+/* returns the index of the named global in objects with this shape, -1 if
+ * they do not have it */
+int shape_get_global_index(struct shape *s, symbol name);
+/* get/set a global by index, the index needs to be valid for the shape of
+ * the object. same semantics around values as obj_get_global() and
+ * obj_set_global() */
+val obj_get_global_at(struct object *o, int idx);
+void obj_set_global_at(struct object *o, int idx, val v);
 
 /* reads the object state (globals) from the provided buffer, not consuming
- * it */
-void obj_state_from_buffer(struct object *o, char *buf, int buf_len);
+ * it. returns false if the buffer is not a valid serialized state, the
+ * object may have been partially initialized then. the format is compact and
+ * portable between machines, see object.c */
+bool obj_state_from_buffer(struct object *o, char *buf, int buf_len);
 /* reads the object methods and properties (id, parents...) from the
  * supplied buffer, not consuming it. Typically persistence would call 
  * obj_new() to create an empty object, and then obj_code_from_buffer() and
- * obj_state_from_buffer() to initialize it */
-void obj_code_from_buffer(struct object *o, char *buf, int buf_len);
+ * obj_state_from_buffer() to initialize it. returns false like
+ * obj_state_from_buffer() */
+bool obj_code_from_buffer(struct object *o, char *buf, int buf_len);
+/* like the above, but strings and code point into the buffer rather than
+ * getting copied. the buffer needs to stay around unchanged for as long as
+ * the object, its copies and values taken from it do, e.g. a mapped image */
+bool obj_state_from_mapping(struct object *o, char *buf, int buf_len);
+bool obj_code_from_mapping(struct object *o, char *buf, int buf_len);
 /* serializes the object state/globals. This reallocates buffer to the required 
  * length if necessary (e.g. if buf_len is less than required or buffer is 
  * NULL), and sets *buf_len to the size taken up, deallocation of the buffer
@@ -131,8 +180,19 @@ void obj_state_to_buffer(struct object *o, char **buffer, int *buf_len);
  * obj_state_to_buffer() around the buffer handling. */
 void obj_code_to_buffer(struct object *o, char **buffer, int *buf_len);
 
+/* returns the number of bytes of memory the object takes up, including its
+ * methods, code buffers, global values and the heap data (e.g. strings) these
+ * refer to. parts that are shared with copies of the object (see obj_copy())
+ * or between values are counted in full, shapes are shared by design and not
+ * counted at all. this is maintained as the object gets modified, so it is
+ * cheap to call */
+size_t obj_get_footprint(struct object *o);
+
 /* create a copy of an object, this is required e.g. to provide rollback
- * funtionality in the transaction layer. */
+ * funtionality in the transaction layer. This is cheap: the copy shares
+ * code and state with the original until either of them is modified, so
+ * only the parts that actually get changed are ever duplicated. Code
+ * buffers are never duplicated at all. */
 struct object* obj_copy(struct object *o);
 
 #endif /* OBJECT_H */
@@ -1,42 +1,697 @@
 #include "persist.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
+#include "image.h"
 // XXX for stubby objects
 #include "eval.h"
 
-// XXX this is a stub, not actually going to disk. single-linked-list
-// is also about the worst possible data structure for this
+// segments get rolled over at this size by default
+#define PERSIST_SEGMENT_BYTES   (16 * 1024 * 1024)
+// initial number of buckets of the index, it grows as required
+#define PERSIST_INDEX_SIZE      1024
+// how often the background thread looks for segments to compact
+#define PERSIST_COMPACT_MS      1000
+// by default, the flusher syncs as soon as anyone waits. commits that come in
+// while it is busy syncing go into the next sync together, so they batch up
+// under load anyway
+#define PERSIST_GROUP_SIZE      1
+#define PERSIST_GROUP_LATENCY   0
+// marks the start of each object record, "CMOO"
+#define PERSIST_MAGIC           0x4F4F4D43
+// marks a commit record, "CMTX"
+#define PERSIST_MAGIC_COMMIT    0x58544D43
 
-struct object_list_node {
-    struct object *object;
-    struct object_list_node *next;
+// -------- implementation of declared public structures --------
+
+/* an object record is this header followed by the code (see
+ * obj_code_to_buffer()) and the state (see obj_state_to_buffer()) of the
+ * object. the checksum covers the id, code_len and the payload, so that a torn
+ * write at the end of the log can be told apart from a valid record.
+ *
+ * the log is also the write-ahead log of the store: the objects written by a
+ * transaction are appended together, followed by a commit record without
+ * payload that has the number of objects in place of the id. recovery only
+ * applies the records of transactions that have their commit record */
+struct persist_record {
+    uint32_t magic;
+    uint32_t checksum;
+    uint32_t len;           // of the payload
+    uint32_t code_len;      // the rest of the payload is the state
+    object_id id;
 };
 
-// -------- implementation of declared public structures --------
+struct persist_segment {
+    int number;             // the file is seg-<number>.log
+    int fd;
+    // protected by the latch. the active segment only gets appended to, all
+    // others are immutable until they get compacted
+    uint64_t size;
+    uint64_t live;          // bytes of records the index points at
+    // up to where persist_flush() synced it. a segment we created is only
+    // there after a crash once its directory entry has been synced as well
+    uint64_t synced;
+    bool linked;
+    // flushes that are syncing it right now, compaction waits for them before
+    // it deletes the segment
+    int pins;
+};
+
+struct persist_index_entry {
+    object_id id;
+    struct persist_segment *seg;    // NULL for an empty bucket
+    uint64_t offset;
+    uint32_t len;                   // of the whole record
+    // append_lsn after the record got appended, 0 for records found in
+    // recovery. see persist_get_version()
+    uint64_t lsn;
+};
 
 struct persist {
-    struct object_list_node *objects;
+    char *dir;
+    bool temporary;
+    // objects that are not in the log come from here, NULL if there is none.
+    // the image never changes, the log shadows it
+    struct image *image;
+    size_t segment_bytes;
+    // protects the index, the counters and appending to the log
+    pthread_mutex_t latch;
+    struct persist_index_entry *index;
+    uint32_t index_mask;
+    int objects;
+    object_id next_id;
+    uint64_t compactions;
+    uint64_t compacted_bytes;
+    // protects the segment table. readers hold it for reading while reading
+    // a record, so a segment cannot go away under them. taken after the latch
+    pthread_rwlock_t segments_latch;
+    struct persist_segment **segments;   // in log order, the last is active
+    int segment_count;
+    int segment_cap;
+    // signalled with the latch when the pins of a segment go down to 0
+    pthread_cond_t unpin_cond;
+    // serializes compactions, and the background thread waits on it
+    pthread_mutex_t compact_latch;
+    pthread_cond_t compact_cond;
+    bool stopping;
+    pthread_t compactor;
+    // log sequence numbers are the number of bytes appended since the store
+    // got opened, the lsn of a commit is where its commit record ends.
+    // protected by the latch
+    uint64_t append_lsn;
+    uint64_t commits;
+    // group commit, see persist_sync(). the flusher waits on flush_cond for
+    // a group to fill up, the transactions wait on sync_cond for the flush
+    pthread_mutex_t sync_latch;
+    pthread_cond_t flush_cond;
+    pthread_cond_t sync_cond;
+    uint64_t durable_lsn;
+    // transactions waiting for the next flush, and when the first of them
+    // started waiting
+    int waiting;
+    struct timespec deadline;
+    int group_size;
+    int group_latency_us;
+    bool flusher_stopping;
+    uint64_t syncs;
+    pthread_t flusher;
 };
 
 // -------- utility functions internal to this module --------
 
-struct object* mk_duff_object(struct persist *p, object_id oid) {
+uint32_t persist_fnv1a(uint32_t h, const void *data, size_t len) {
+    const unsigned char *d = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= d[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint32_t persist_checksum(struct persist_record *r, const char *payload) {
+    uint32_t h = 2166136261u;
+    h = persist_fnv1a(h, &r->id, sizeof(object_id));
+    h = persist_fnv1a(h, &r->code_len, sizeof(uint32_t));
+    return persist_fnv1a(h, payload, r->len);
+}
+
+// pread()/pwrite() can be short, these return false on error or end of file
+bool persist_read_all(int fd, void *buf, size_t len, uint64_t offset) {
+    char *dst = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, dst, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+bool persist_write_all(int fd, const void *buf, size_t len, uint64_t offset) {
+    const char *src = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, src, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return false;
+        }
+        src += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+char* persist_segment_path(struct persist *p, int number) {
+    size_t len = strlen(p->dir) + 32;
+    char *ret = malloc(len);
+    snprintf(ret, len, "%s/seg-%06d.log", p->dir, number);
+    return ret;
+}
+
+// the index is open addressing with linear probing, entries never get removed
+struct persist_index_entry* persist_index_find(struct persist *p, object_id id) {
+    uint32_t i = (uint32_t)((id * 0x9E3779B97F4A7C15ull) >> 32) & p->index_mask;
+    while (p->index[i].seg && (p->index[i].id != id)) {
+        i = (i + 1) & p->index_mask;
+    }
+    return &p->index[i];
+}
+
+void persist_index_grow(struct persist *p) {
+    struct persist_index_entry *old = p->index;
+    uint32_t old_size = p->index_mask + 1;
+    p->index_mask = old_size * 2 - 1;
+    p->index = calloc(old_size * 2, sizeof(struct persist_index_entry));
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (old[i].seg) {
+            *persist_index_find(p, old[i].id) = old[i];
+        }
+    }
+    free(old);
+}
+
+// points the index at a new record for the object, under the latch
+void persist_index_set(struct persist *p, object_id id,
+        struct persist_segment *seg, uint64_t offset, uint32_t len) {
+    struct persist_index_entry *e = persist_index_find(p, id);
+    if (e->seg) {
+        e->seg->live -= e->len;
+    }
+    else {
+        if ((uint32_t)(p->objects + 1) * 4 > (p->index_mask + 1) * 3) {
+            persist_index_grow(p);
+            e = persist_index_find(p, id);
+        }
+        p->objects++;
+        if (id >= p->next_id) {
+            p->next_id = id + 1;
+        }
+    }
+    e->id = id;
+    e->seg = seg;
+    e->offset = offset;
+    e->len = len;
+    e->lsn = p->append_lsn;
+    seg->live += len;
+}
+
+struct persist_segment* persist_segment_open(struct persist *p, int number, int flags) {
+    char *path = persist_segment_path(p, number);
+    int fd = open(path, O_RDWR | flags, 0644);
+    if (fd < 0) {
+        perror(path);
+        free(path);
+        return NULL;
+    }
+    free(path);
+    struct persist_segment *ret = malloc(sizeof(struct persist_segment));
+    ret->number = number;
+    ret->fd = fd;
+    ret->size = 0;
+    ret->live = 0;
+    ret->synced = 0;
+    ret->linked = !(flags & O_CREAT);
+    ret->pins = 0;
+    return ret;
+}
+
+// makes creating and deleting segments durable, returns false on error
+bool persist_sync_dir(struct persist *p) {
+    int fd = open(p->dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ret = fsync(fd) == 0;
+    close(fd);
+    return ret;
+}
+
+void persist_segment_add(struct persist *p, struct persist_segment *seg) {
+    pthread_rwlock_wrlock(&p->segments_latch);
+    if (p->segment_count == p->segment_cap) {
+        p->segment_cap *= 2;
+        p->segments = realloc(p->segments, sizeof(struct persist_segment*) * p->segment_cap);
+    }
+    p->segments[p->segment_count++] = seg;
+    pthread_rwlock_unlock(&p->segments_latch);
+}
+
+// appends a record to the log, rolling over to a new segment if the active
+// one is full. returns the segment it ended up in, and the offset in there.
+// needs the latch
+struct persist_segment* persist_append(struct persist *p, const char *rec,
+        uint32_t len, uint64_t *offset) {
+    struct persist_segment *seg = p->segments[p->segment_count - 1];
+    if ((seg->size > 0) && (seg->size + len > p->segment_bytes)) {
+        struct persist_segment *next = persist_segment_open(p, seg->number + 1,
+            O_CREAT | O_TRUNC);
+        if (!next) {
+            exit(1);
+        }
+        persist_segment_add(p, next);
+        seg = next;
+    }
+    if (!persist_write_all(seg->fd, rec, len, seg->size)) {
+        // XXX the store has no way to deal with a failed commit yet
+        perror("could not write to object log");
+        exit(1);
+    }
+    *offset = seg->size;
+    seg->size += len;
+    p->append_lsn += len;
+    return seg;
+}
+
+// serializes the object into a new record, and sets len to its size
+char* persist_make_record(struct object *o, uint32_t *len) {
+    char *code = NULL;
+    int code_len = 0;
+    char *state = NULL;
+    int state_len = 0;
+    obj_code_to_buffer(o, &code, &code_len);
+    obj_state_to_buffer(o, &state, &state_len);
+    struct persist_record r;
+    r.magic = PERSIST_MAGIC;
+    r.len = code_len + state_len;
+    r.code_len = code_len;
+    r.id = obj_get_id(o);
+    *len = sizeof(r) + r.len;
+    char *ret = malloc(*len);
+    memcpy(ret + sizeof(r), code, code_len);
+    memcpy(ret + sizeof(r) + code_len, state, state_len);
+    r.checksum = persist_checksum(&r, ret + sizeof(r));
+    memcpy(ret, &r, sizeof(r));
+    free(code);
+    free(state);
+    return ret;
+}
+
+// writes the commit record for the count object records before it to dst
+void persist_make_commit(char *dst, uint32_t count) {
+    struct persist_record r;
+    r.magic = PERSIST_MAGIC_COMMIT;
+    r.len = 0;
+    r.code_len = 0;
+    r.id = count;
+    r.checksum = persist_checksum(&r, NULL);
+    memcpy(dst, &r, sizeof(r));
+}
+
+// reads the record at offset into a new buffer and checks it, returns NULL
+// if it is not a valid record
+char* persist_read_record(int fd, uint64_t offset, uint64_t limit) {
+    struct persist_record r;
+    if ((offset + sizeof(r) > limit) || !persist_read_all(fd, &r, sizeof(r), offset)) {
+        return NULL;
+    }
+    if (((r.magic != PERSIST_MAGIC) && (r.magic != PERSIST_MAGIC_COMMIT))
+            || (r.code_len > r.len)
+            || (offset + sizeof(r) + r.len > limit)) {
+        return NULL;
+    }
+    char *ret = malloc(sizeof(r) + r.len);
+    memcpy(ret, &r, sizeof(r));
+    if (!persist_read_all(fd, ret + sizeof(r), r.len, offset + sizeof(r))
+            || (persist_checksum(&r, ret + sizeof(r)) != r.checksum)) {
+        free(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+// rebuilds the index from a segment. anything after the last commit record
+// belongs to a transaction that did not make it to the log completely before
+// a crash. returns false if there is something like that, the size of the
+// segment is where it needs to be truncated then
+bool persist_recover_segment(struct persist *p, struct persist_segment *seg) {
+    struct stat st;
+    fstat(seg->fd, &st);
+    uint64_t offset = 0;
+    uint64_t committed = 0;
+    // the object records of the transaction, applied once its commit record
+    // shows up. transactions never span segments
+    int pending = 0;
+    int pending_cap = 16;
+    struct persist_index_entry *records = malloc(sizeof(struct persist_index_entry) * pending_cap);
+    char *rec;
+    while ((rec = persist_read_record(seg->fd, offset, st.st_size))) {
+        struct persist_record *r = (struct persist_record*)rec;
+        uint32_t len = sizeof(struct persist_record) + r->len;
+        if (r->magic == PERSIST_MAGIC_COMMIT) {
+            if (r->id != (object_id)pending) {
+                free(rec);
+                break;
+            }
+            for (int i = 0; i < pending; i++) {
+                persist_index_set(p, records[i].id, seg, records[i].offset, records[i].len);
+            }
+            pending = 0;
+            committed = offset + len;
+        }
+        else {
+            if (pending == pending_cap) {
+                pending_cap *= 2;
+                records = realloc(records, sizeof(struct persist_index_entry) * pending_cap);
+            }
+            records[pending].id = r->id;
+            records[pending].offset = offset;
+            records[pending].len = len;
+            pending++;
+        }
+        offset += len;
+        free(rec);
+    }
+    free(records);
+    seg->size = committed;
+    seg->synced = committed;
+    if (committed < (uint64_t)st.st_size) {
+        fprintf(stderr, "object log segment %d: dropping %lu bytes after offset %lu\n",
+            seg->number, (unsigned long)(st.st_size - committed), (unsigned long)committed);
+        return false;
+    }
+    return true;
+}
+
+int persist_compare_ints(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+// opens the existing segments in order and rebuilds the index from them,
+// returns false if the directory cannot be read. the segments after one that
+// had to be truncated are deleted: they can get to disk before the end of the
+// one before them, but the transactions in there might have read what got
+// lost, so replaying them would make up a state that never existed
+bool persist_recover(struct persist *p) {
+    DIR *d = opendir(p->dir);
+    if (!d) {
+        perror(p->dir);
+        return false;
+    }
+    int count = 0;
+    int cap = 16;
+    int *numbers = malloc(sizeof(int) * cap);
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        int number;
+        char tail;
+        if (sscanf(de->d_name, "seg-%d.lo%c", &number, &tail) == 2 && tail == 'g') {
+            if (count == cap) {
+                cap *= 2;
+                numbers = realloc(numbers, sizeof(int) * cap);
+            }
+            numbers[count++] = number;
+        }
+    }
+    closedir(d);
+    qsort(numbers, count, sizeof(int), persist_compare_ints);
+    bool intact = true;
+    for (int i = 0; i < count; i++) {
+        if (!intact) {
+            char *path = persist_segment_path(p, numbers[i]);
+            fprintf(stderr, "%s: dropping segment after a damaged one\n", path);
+            if (unlink(path) != 0) {
+                perror(path);
+                free(path);
+                free(numbers);
+                return false;
+            }
+            free(path);
+            continue;
+        }
+        struct persist_segment *seg = persist_segment_open(p, numbers[i], 0);
+        if (!seg) {
+            free(numbers);
+            return false;
+        }
+        persist_segment_add(p, seg);
+        // if the tail came back after another crash, it would take whatever
+        // gets appended after this recovery with it
+        intact = persist_recover_segment(p, seg);
+        if (!intact && ((ftruncate(seg->fd, seg->size) != 0) || (fdatasync(seg->fd) != 0))) {
+            perror("could not truncate object log");
+            free(numbers);
+            return false;
+        }
+    }
+    if (!intact && !persist_sync_dir(p)) {
+        perror(p->dir);
+        free(numbers);
+        return false;
+    }
+    // always start out with a fresh active segment, that way a segment that
+    // got truncated in recovery is never appended to
+    int number = count ? numbers[count - 1] + 1 : 0;
+    free(numbers);
+    struct persist_segment *seg = persist_segment_open(p, number, O_CREAT | O_TRUNC);
+    if (!seg) {
+        return false;
+    }
+    persist_segment_add(p, seg);
+    return true;
+}
+
+// makes everything appended so far durable, returns the lsn up to which it
+// is. the segments are pinned so that they cannot go away while we sync them,
+// no latch is held in the meantime so that others can carry on appending and
+// rolling over to new segments
+uint64_t persist_flush(struct persist *p) {
+    pthread_mutex_lock(&p->latch);
+    uint64_t ret = p->append_lsn;
+    int count = 0;
+    struct persist_segment **segs = malloc(sizeof(struct persist_segment*) * p->segment_count);
+    uint64_t *sizes = malloc(sizeof(uint64_t) * p->segment_count);
+    bool created = false;
+    for (int i = 0; i < p->segment_count; i++) {
+        struct persist_segment *seg = p->segments[i];
+        if (seg->synced < seg->size) {
+            seg->pins++;
+            segs[count] = seg;
+            sizes[count++] = seg->size;
+            created = created || !seg->linked;
+        }
+    }
+    pthread_mutex_unlock(&p->latch);
+    for (int i = 0; i < count; i++) {
+        if (fdatasync(segs[i]->fd) != 0) {
+            // XXX there is nothing sensible to do for the transactions
+            // waiting on this, see persist_append()
+            perror("could not sync object log");
+            exit(1);
+        }
+    }
+    if (created && !persist_sync_dir(p)) {
+        perror("could not sync object log directory");
+        exit(1);
+    }
+    // compaction might be flushing at the same time
+    pthread_mutex_lock(&p->latch);
+    for (int i = 0; i < count; i++) {
+        if (segs[i]->synced < sizes[i]) {
+            segs[i]->synced = sizes[i];
+        }
+        segs[i]->linked = segs[i]->linked || created;
+        if (--segs[i]->pins == 0) {
+            pthread_cond_broadcast(&p->unpin_cond);
+        }
+    }
+    pthread_mutex_unlock(&p->latch);
+    free(segs);
+    free(sizes);
+    return ret;
+}
+
+// moves the live records of the sealed segment with the most garbage to the
+// end of the log and deletes it. needs the compact latch, which keeps anyone
+// else from removing segments in the meantime. returns false if there was no
+// segment worth compacting
+bool persist_compact_segment(struct persist *p) {
+    struct persist_segment *seg = NULL;
+    pthread_mutex_lock(&p->latch);
+    for (int i = 0; i < p->segment_count - 1; i++) {
+        struct persist_segment *s = p->segments[i];
+        // at least half of it garbage, this includes empty segments
+        if ((s->live * 2 <= s->size) && (!seg || s->live * seg->size < seg->live * s->size)) {
+            seg = s;
+        }
+    }
+    uint64_t size = seg ? seg->size : 0;
+    pthread_mutex_unlock(&p->latch);
+    if (!seg) {
+        return false;
+    }
+
+    // the segment is immutable, so it can be read without the latch. whether
+    // a record is still live has to be checked under the latch though, as the
+    // object could get put at any time
+    uint64_t offset = 0;
+    while (offset < size) {
+        char *rec = persist_read_record(seg->fd, offset, size);
+        // recovery or the append made sure it is valid
+        assert(rec);
+        struct persist_record *r = (struct persist_record*)rec;
+        uint32_t len = sizeof(struct persist_record) + r->len;
+        object_id id = r->id;
+        pthread_mutex_lock(&p->latch);
+        struct persist_index_entry *e = persist_index_find(p, id);
+        if ((r->magic == PERSIST_MAGIC) && (e->seg == seg) && (e->offset == offset)) {
+            // each copy is a transaction of its own
+            rec = realloc(rec, len + sizeof(struct persist_record));
+            persist_make_commit(rec + len, 1);
+            uint64_t new_offset;
+            struct persist_segment *to = persist_append(p, rec,
+                len + sizeof(struct persist_record), &new_offset);
+            persist_index_set(p, id, to, new_offset, len);
+        }
+        pthread_mutex_unlock(&p->latch);
+        free(rec);
+        offset += len;
+    }
+    // the copies need to be on disk before the originals go away, and so does
+    // everything before them, as recovery stops at the first segment that is
+    // not complete. the same goes for the records that superseded the ones
+    // that were not copied. this does not return if syncing fails
+    persist_flush(p);
+    pthread_mutex_lock(&p->latch);
+    assert(seg->live == 0);
+    while (seg->pins > 0) {
+        pthread_cond_wait(&p->unpin_cond, &p->latch);
+    }
+    pthread_rwlock_wrlock(&p->segments_latch);
+    int i = 0;
+    while (p->segments[i] != seg) {
+        i++;
+    }
+    memmove(&p->segments[i], &p->segments[i + 1],
+        sizeof(struct persist_segment*) * (p->segment_count - i - 1));
+    p->segment_count--;
+    pthread_rwlock_unlock(&p->segments_latch);
+    p->compactions++;
+    p->compacted_bytes += size;
+    pthread_mutex_unlock(&p->latch);
+
+    close(seg->fd);
+    char *path = persist_segment_path(p, seg->number);
+    unlink(path);
+    free(path);
+    free(seg);
+    // not strictly needed, if the segment comes back after a crash the
+    // copies still shadow it. but its space would not be reclaimed
+    if (!persist_sync_dir(p)) {
+        perror(p->dir);
+        exit(1);
+    }
+    return true;
+}
+
+// sets ts to us microseconds from now, for pthread_cond_timedwait()
+void persist_deadline(struct timespec *ts, long us) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+bool persist_deadline_passed(struct timespec *ts) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec > ts->tv_sec)
+        || ((now.tv_sec == ts->tv_sec) && (now.tv_nsec >= ts->tv_nsec));
+}
+
+void* persist_compactor(void *arg) {
+    struct persist *p = arg;
+    pthread_mutex_lock(&p->compact_latch);
+    while (!p->stopping) {
+        struct timespec ts;
+        persist_deadline(&ts, PERSIST_COMPACT_MS * 1000L);
+        pthread_cond_timedwait(&p->compact_cond, &p->compact_latch, &ts);
+        while (!p->stopping && persist_compact_segment(p)) {
+        }
+    }
+    pthread_mutex_unlock(&p->compact_latch);
+    return NULL;
+}
+
+// waits for a group of transactions to wait for their commits, or for the
+// first of them to have waited for long enough, and syncs the log for all of
+// them at once
+void* persist_flusher(void *arg) {
+    struct persist *p = arg;
+    pthread_mutex_lock(&p->sync_latch);
+    while (!p->flusher_stopping || p->waiting) {
+        if (!p->waiting) {
+            pthread_cond_wait(&p->flush_cond, &p->sync_latch);
+            continue;
+        }
+        if ((p->waiting < p->group_size) && !p->flusher_stopping
+                && !persist_deadline_passed(&p->deadline)) {
+            pthread_cond_timedwait(&p->flush_cond, &p->sync_latch, &p->deadline);
+            continue;
+        }
+        // everyone waiting right now has appended already, so this flush
+        // covers them. whoever comes along from now on goes into the next
+        p->waiting = 0;
+        pthread_mutex_unlock(&p->sync_latch);
+        uint64_t lsn = persist_flush(p);
+        pthread_mutex_lock(&p->sync_latch);
+        p->durable_lsn = lsn;
+        p->syncs++;
+        pthread_cond_broadcast(&p->sync_cond);
+    }
+    pthread_mutex_unlock(&p->sync_latch);
+    return NULL;
+}
+
+struct object* mk_duff_object(object_id oid) {
     struct object *o = obj_new();
     obj_set_id(o, oid);
-    struct object_list_node *ln = malloc(sizeof(struct object_list_node));
-    ln->object = o;
-    ln->next = p->objects;
-    p->objects = ln;
     return o;
 }
 
-// -------- implementation of public functions --------
-
-struct persist* persist_new(void) {
-    struct persist *ret = malloc(sizeof(struct persist));
-    ret->objects = NULL;
-
+// fills an empty store with the objects needed to get going
+void persist_bootstrap(struct persist *p) {
     // XXX stubby shit
     // XXX this could be split into the root object, a base listener, and a base
     // client handler, driving some structural changes throughout the code. in
@@ -48,23 +703,23 @@ struct persist* persist_new(void) {
     // object 0 is the root object, the driver calls "init" and "shutdown" on
     // it. on init, the object will set up a listening socket and bind it to
     // an newly created child object based on the base-listener (see below).
-    struct object *o0 = mk_duff_object(ret, 0);
+    struct object *o0 = mk_duff_object(0);
     opcode code[] = {
                         OP_ARGS_LOCALS, 0x01, 0x02,
-                        OP_LOAD_STRING, 0x01, 0x11, 0x00, 'n', 'e', 't', '_', 'm', 'a', 'k', 'e', '_', 'l', 'i', 's', 't', 'e', 'n', 'e', 'r',
+                        OP_LOAD_SYMBOL, 0x01, 0x11, 0x00, 'n', 'e', 't', '_', 'm', 'a', 'k', 'e', '_', 'l', 'i', 's', 't', 'e', 'n', 'e', 'r',
                         OP_LOAD_INT, 0x02, 0x39, 0x30, 0x00, 0x00, // 0x3039 is port 12345
                         OP_PUSH, 0x01,
                         OP_PUSH, 0x02,
-                        OP_LOAD_STRING, 0x00, 0x0D, 0x00, 'b', 'a', 's', 'e', '-', 'l', 'i', 's', 't', 'e', 'n', 'e', 'r',
+                        OP_LOAD_SYMBOL, 0x00, 0x0D, 0x00, 'b', 'a', 's', 'e', '-', 'l', 'i', 's', 't', 'e', 'n', 'e', 'r',
                         OP_GETGLOBAL, 0x00, 0x00,
                         OP_MAKE_OBJ, 0x00, 0x00,
                         OP_PUSH, 0x00,
                         OP_SYSCALL, 0x02,
                         // call the new object and pass the
                         // base-socket-handler reference
-                        OP_LOAD_STRING, 0x01, 0x13, 0x00, 'b', 'a', 's', 'e', '-', 's', 'o', 'c', 'k', 'e', 't', '-', 'h', 'a', 'n', 'd', 'l', 'e', 'r', 
+                        OP_LOAD_SYMBOL, 0x01, 0x13, 0x00, 'b', 'a', 's', 'e', '-', 's', 'o', 'c', 'k', 'e', 't', '-', 'h', 'a', 'n', 'd', 'l', 'e', 'r', 
                         OP_GETGLOBAL, 0x01, 0x01,
-                        OP_LOAD_STRING, 0x02, 0x17, 0x00, 's', 'e', 't', '-', 'b', 'a', 's', 'e', '-', 's', 'o', 'c', 'k', 'e', 't', '-', 'h', 'a', 'n', 'd', 'l', 'e', 'r',
+                        OP_LOAD_SYMBOL, 0x02, 0x17, 0x00, 's', 'e', 't', '-', 'b', 'a', 's', 'e', '-', 's', 'o', 'c', 'k', 'e', 't', '-', 'h', 'a', 'n', 'd', 'l', 'e', 'r',
                         OP_DEBUGR, 0x02,
                         OP_DEBUGR, 0x01,
                         OP_DEBUGR, 0x00,
@@ -82,7 +737,7 @@ struct persist* persist_new(void) {
                         // XXX this should really delegate the shutdown code to
                         // the listener object created in "init"
                         OP_ARGS_LOCALS, 0x00, 0x03,
-                        OP_LOAD_STRING, 0x00, 0x15, 0x00, 'n', 'e', 't', '_', 's', 'h', 'u', 't', 'd', 'o', 'w', 'n', '_', 'l', 'i', 's', 't', 'e', 'n', 'e', 'r',
+                        OP_LOAD_SYMBOL, 0x00, 0x15, 0x00, 'n', 'e', 't', '_', 's', 'h', 'u', 't', 'd', 'o', 'w', 'n', '_', 'l', 'i', 's', 't', 'e', 'n', 'e', 'r',
                         OP_LOAD_INT, 0x01, 0x39, 0x30, 0x00, 0x00, // XXX why do we have this number here and in init?
                         OP_PUSH, 0x00,
                         OP_PUSH, 0x01,
@@ -94,11 +749,11 @@ struct persist* persist_new(void) {
 
     // object 1 is the base-listener, it reacts to "accept" calls by setting up
     // an object that handles the socket in question 
-    struct object *o1 = mk_duff_object(ret, 1);
+    struct object *o1 = mk_duff_object(1);
     opcode code3[] = {
                         OP_ARGS_LOCALS, 0x01, 0x03,
 
-                        OP_LOAD_STRING, 0x02, 0x13, 0x00, 'b', 'a', 's', 'e', '-', 's', 'o', 'c', 'k', 'e', 't', '-', 'h', 'a', 'n', 'd', 'l', 'e', 'r',
+                        OP_LOAD_SYMBOL, 0x02, 0x13, 0x00, 'b', 'a', 's', 'e', '-', 's', 'o', 'c', 'k', 'e', 't', '-', 'h', 'a', 'n', 'd', 'l', 'e', 'r',
                         OP_GETGLOBAL, 0x02, 0x02,
                         OP_DEBUGR, 0x02,
                         OP_MAKE_OBJ, 0x02, 0x02,
@@ -106,7 +761,7 @@ struct persist* persist_new(void) {
                         // call the newly created object and pass the socket
                         // special
                         OP_PUSH, 0x02,
-                        OP_LOAD_STRING, 0x03, 0x0A, 0x00, 's', 'e', 't', '_', 's', 'o', 'c', 'k', 'e', 't',
+                        OP_LOAD_SYMBOL, 0x03, 0x0A, 0x00, 's', 'e', 't', '_', 's', 'o', 'c', 'k', 'e', 't',
                         OP_PUSH, 0x03,
                         OP_CLEAR, 0x03,
                         OP_PUSH, 0x03,
@@ -115,7 +770,7 @@ struct persist* persist_new(void) {
                         OP_POP, 0x03,
 
 
-                        OP_LOAD_STRING, 0x01, 0x11, 0x00, 'n', 'e', 't', '_', 'a', 'c', 'c', 'e', 'p', 't', '_', 's', 'o', 'c', 'k', 'e', 't',
+                        OP_LOAD_SYMBOL, 0x01, 0x11, 0x00, 'n', 'e', 't', '_', 'a', 'c', 'c', 'e', 'p', 't', '_', 's', 'o', 'c', 'k', 'e', 't',
                         OP_PUSH, 0x01,
                         OP_PUSH, 0x00,
                         OP_PUSH, 0x02,
@@ -126,7 +781,7 @@ struct persist* persist_new(void) {
 
     opcode code4[] = {
                         OP_ARGS_LOCALS, 0x01, 0x01,
-                        OP_LOAD_STRING, 0x01, 0x13, 0x00, 'b', 'a', 's', 'e', '-', 's', 'o', 'c', 'k', 'e', 't', '-', 'h', 'a', 'n', 'd', 'l', 'e', 'r',
+                        OP_LOAD_SYMBOL, 0x01, 0x13, 0x00, 'b', 'a', 's', 'e', '-', 's', 'o', 'c', 'k', 'e', 't', '-', 'h', 'a', 'n', 'd', 'l', 'e', 'r',
                         OP_SETGLOBAL, 0x01, 0x00,
                         OP_CLEAR, 0x01,
                         OP_RETURN, 0x01};
@@ -135,10 +790,10 @@ struct persist* persist_new(void) {
 
     // object 2 is a parent to all socket handlers, reacts to 'read' and 'closed'
     // calls
-    struct object *o2 = mk_duff_object(ret, 2);
+    struct object *o2 = mk_duff_object(2);
     opcode code5[] = {
                         OP_ARGS_LOCALS, 0x01, 0x01,
-                        OP_LOAD_STRING, 0x01, 0x06, 0x00, 's', 'o', 'c', 'k', 'e', 't',
+                        OP_LOAD_SYMBOL, 0x01, 0x06, 0x00, 's', 'o', 'c', 'k', 'e', 't',
                         OP_SETGLOBAL, 0x01, 0x00,
                         OP_CLEAR, 0x01,
                         OP_RETURN, 0x01};
@@ -146,7 +801,7 @@ struct persist* persist_new(void) {
 
     opcode code6[] = {
                         OP_ARGS_LOCALS, 0x01, 0x01,
-                        OP_LOAD_STRING, 0x01, 0x0F, 0x00, 'n', 'e', 't', '_', 's', 'o', 'c', 'k', 'e', 't', '_', 'f', 'r', 'e', 'e', 
+                        OP_LOAD_SYMBOL, 0x01, 0x0F, 0x00, 'n', 'e', 't', '_', 's', 'o', 'c', 'k', 'e', 't', '_', 'f', 'r', 'e', 'e', 
                         OP_PUSH, 0x01,
                         OP_PUSH, 0x00,
                         OP_SYSCALL, 0x01,
@@ -169,15 +824,15 @@ struct persist* persist_new(void) {
                         OP_PARENT, 0x02,
                         OP_DEBUGR, 0x02,
                         OP_PUSH, 0x02,
-                        OP_LOAD_STRING, 0x02, 0x09, 0x00, 'i', 'n', 'c', '_', 'c', 'o', 'u', 'n', 't',
+                        OP_LOAD_SYMBOL, 0x02, 0x09, 0x00, 'i', 'n', 'c', '_', 'c', 'o', 'u', 'n', 't',
                         OP_PUSH, 0x02,
                         OP_CLEAR, 0x02,
                         OP_PUSH, 0x02,
                         OP_CALL, 0x00,
 
-                        OP_LOAD_STRING, 0x02, 0x10, 0x00, 'n', 'e', 't', '_', 's', 'o', 'c', 'k', 'e', 't', '_', 'w', 'r', 'i', 't', 'e',
+                        OP_LOAD_SYMBOL, 0x02, 0x10, 0x00, 'n', 'e', 't', '_', 's', 'o', 'c', 'k', 'e', 't', '_', 'w', 'r', 'i', 't', 'e',
                         OP_LOAD_STRING, 0x03, 0x02, 0x00, '>', ' ',
-                        OP_LOAD_STRING, 0x04, 0x06, 0x00, 's', 'o', 'c', 'k', 'e', 't',
+                        OP_LOAD_SYMBOL, 0x04, 0x06, 0x00, 's', 'o', 'c', 'k', 'e', 't',
                         OP_GETGLOBAL, 0x04, 0x04,
                         OP_DEBUGR, 0x04,
                         OP_PUSH, 0x02,
@@ -191,7 +846,7 @@ struct persist* persist_new(void) {
 
     opcode code8[] = {
                         OP_ARGS_LOCALS, 0x00, 0x03,
-                        OP_LOAD_STRING, 0x00, 0x05, 0x00, 'c', 'o', 'u', 'n', 't',
+                        OP_LOAD_SYMBOL, 0x00, 0x05, 0x00, 'c', 'o', 'u', 'n', 't',
                         OP_LOAD_INT, 0x01, 0x01, 0x00, 0x00, 0x00,
                         OP_GETGLOBAL, 0x02, 0x00,
                         OP_ADD, 0x02, 0x02, 0x01,
@@ -201,44 +856,340 @@ struct persist* persist_new(void) {
     obj_set_code(o2, "inc_count", code8, sizeof(code8));
     obj_set_global(o2, "count", val_make_int(0));
 
+    persist_put(p, o0);
+    persist_put(p, o1);
+    persist_put(p, o2);
+    obj_free(o0);
+    obj_free(o1);
+    obj_free(o2);
+}
+
+// -------- implementation of public functions --------
+
+struct persist* persist_open(const char *dir, const char *image, size_t segment_bytes) {
+    struct persist *ret = malloc(sizeof(struct persist));
+    ret->image = NULL;
+    if (image) {
+        ret->image = image_open(image);
+        if (!ret->image) {
+            free(ret);
+            return NULL;
+        }
+    }
+    if (dir) {
+        if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+            perror(dir);
+            if (ret->image) {
+                image_close(ret->image);
+            }
+            free(ret);
+            return NULL;
+        }
+        ret->dir = strdup(dir);
+        ret->temporary = false;
+    }
+    else {
+        const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+        size_t len = strlen(tmp) + 16;
+        ret->dir = malloc(len);
+        snprintf(ret->dir, len, "%s/cmoo-XXXXXX", tmp);
+        if (!mkdtemp(ret->dir)) {
+            perror(ret->dir);
+            free(ret->dir);
+            if (ret->image) {
+                image_close(ret->image);
+            }
+            free(ret);
+            return NULL;
+        }
+        ret->temporary = true;
+    }
+    ret->segment_bytes = segment_bytes ? segment_bytes : PERSIST_SEGMENT_BYTES;
+    if (pthread_mutex_init(&ret->latch, NULL) != 0
+            || pthread_rwlock_init(&ret->segments_latch, NULL) != 0
+            || pthread_cond_init(&ret->unpin_cond, NULL) != 0
+            || pthread_mutex_init(&ret->compact_latch, NULL) != 0
+            || pthread_cond_init(&ret->compact_cond, NULL) != 0
+            || pthread_mutex_init(&ret->sync_latch, NULL) != 0
+            || pthread_cond_init(&ret->flush_cond, NULL) != 0
+            || pthread_cond_init(&ret->sync_cond, NULL) != 0) {
+        fprintf(stderr, "pthread init failed\n");
+        exit(1);
+    }
+    ret->index = calloc(PERSIST_INDEX_SIZE, sizeof(struct persist_index_entry));
+    ret->index_mask = PERSIST_INDEX_SIZE - 1;
+    ret->objects = 0;
+    ret->next_id = 0;
+    ret->compactions = 0;
+    ret->compacted_bytes = 0;
+    ret->segment_count = 0;
+    ret->segment_cap = 16;
+    ret->segments = malloc(sizeof(struct persist_segment*) * ret->segment_cap);
+    ret->stopping = false;
+    ret->append_lsn = 0;
+    ret->commits = 0;
+    ret->durable_lsn = 0;
+    ret->waiting = 0;
+    ret->group_size = PERSIST_GROUP_SIZE;
+    ret->group_latency_us = PERSIST_GROUP_LATENCY;
+    ret->flusher_stopping = false;
+    ret->syncs = 0;
+    if (!persist_recover(ret)) {
+        // there are no threads to stop yet
+        ret->stopping = true;
+        persist_free(ret);
+        return NULL;
+    }
+    pthread_create(&ret->compactor, NULL, persist_compactor, ret);
+    pthread_create(&ret->flusher, NULL, persist_flusher, ret);
+    if (ret->image && (image_next_id(ret->image) > ret->next_id)) {
+        ret->next_id = image_next_id(ret->image);
+    }
+    // a new world, unless the image or the log already have one
+    if (!persist_index_find(ret, 0)->seg && !(ret->image && image_contains(ret->image, 0))) {
+        persist_bootstrap(ret);
+    }
     return ret;
 }
 
+struct persist* persist_new(void) {
+    return persist_open(NULL, NULL, 0);
+}
+
 void persist_free(struct persist *p) {
-    while (p->objects) {
-        struct object_list_node *t = p->objects;
-        p->objects = t->next;
-        obj_free(t->object);
-        free(t);
+    if (!p->stopping) {
+        pthread_mutex_lock(&p->compact_latch);
+        p->stopping = true;
+        pthread_cond_signal(&p->compact_cond);
+        pthread_mutex_unlock(&p->compact_latch);
+        pthread_join(p->compactor, NULL);
+        pthread_mutex_lock(&p->sync_latch);
+        p->flusher_stopping = true;
+        pthread_cond_signal(&p->flush_cond);
+        pthread_mutex_unlock(&p->sync_latch);
+        pthread_join(p->flusher, NULL);
+        // whatever nobody waited for should still make it to disk
+        persist_flush(p);
+    }
+    for (int i = 0; i < p->segment_count; i++) {
+        close(p->segments[i]->fd);
+        if (p->temporary) {
+            char *path = persist_segment_path(p, p->segments[i]->number);
+            unlink(path);
+            free(path);
+        }
+        free(p->segments[i]);
     }
+    if (p->temporary) {
+        rmdir(p->dir);
+    }
+    if (p->image) {
+        image_close(p->image);
+    }
+    pthread_mutex_destroy(&p->latch);
+    pthread_rwlock_destroy(&p->segments_latch);
+    pthread_cond_destroy(&p->unpin_cond);
+    pthread_mutex_destroy(&p->compact_latch);
+    pthread_cond_destroy(&p->compact_cond);
+    pthread_mutex_destroy(&p->sync_latch);
+    pthread_cond_destroy(&p->flush_cond);
+    pthread_cond_destroy(&p->sync_cond);
+    free(p->segments);
+    free(p->index);
+    free(p->dir);
     free(p);
 }
 
 struct object* persist_get(struct persist *p, object_id oid) {
-    struct object_list_node *ln = p->objects;
-    while (ln) {
-        if (obj_get_id(ln->object) == oid) {
-            return ln->object;
-        }
-        ln = ln->next;
+    pthread_mutex_lock(&p->latch);
+    struct persist_index_entry e = *persist_index_find(p, oid);
+    if (!e.seg) {
+        pthread_mutex_unlock(&p->latch);
+        // never written since the image was made, if it is there at all
+        return p->image ? image_get(p->image, oid) : NULL;
     }
-    return NULL;
+    // keeps the segment from getting compacted away while we read it, the
+    // record itself never changes once written
+    pthread_rwlock_rdlock(&p->segments_latch);
+    pthread_mutex_unlock(&p->latch);
+    char *rec = persist_read_record(e.seg->fd, e.offset, e.offset + e.len);
+    pthread_rwlock_unlock(&p->segments_latch);
+    if (!rec) {
+        fprintf(stderr, "object log: record for object %lu is corrupt\n", (unsigned long)oid);
+        return NULL;
+    }
+    struct persist_record *r = (struct persist_record*)rec;
+    char *payload = rec + sizeof(struct persist_record);
+    struct object *ret = obj_new();
+    if (!obj_code_from_buffer(ret, payload, r->code_len)
+            || !obj_state_from_buffer(ret, payload + r->code_len, r->len - r->code_len)) {
+        fprintf(stderr, "object log: object %lu cannot be read\n", (unsigned long)oid);
+        obj_free(ret);
+        ret = NULL;
+    }
+    free(rec);
+    return ret;
+}
+
+uint64_t persist_get_version(struct persist *p, object_id oid) {
+    pthread_mutex_lock(&p->latch);
+    struct persist_index_entry *e = persist_index_find(p, oid);
+    uint64_t ret = e->seg ? e->lsn : 0;
+    pthread_mutex_unlock(&p->latch);
+    return ret;
 }
 
 void persist_put(struct persist *p, struct object *o) {
-    object_id oid = obj_get_id(o);
-    struct object_list_node *ln = p->objects;
-    while (ln) {
-        if (obj_get_id(ln->object) == oid) {
-            obj_free(ln->object);
-            ln->object = o;
-            return;
-        }
-        ln = ln->next;
-    }
-    // not already present, append
-    ln = malloc(sizeof(struct object_list_node));
-    ln->object = o;
-    ln->next = p->objects;
-    p->objects = ln;
+    persist_sync(p, persist_commit(p, &o, 1));
+}
+
+uint64_t persist_commit(struct persist *p, struct object **objs, int count) {
+    // serializing happens outside the latch, only the append is serialized
+    char **recs = malloc(sizeof(char*) * count);
+    uint32_t *lens = malloc(sizeof(uint32_t) * count);
+    uint32_t len = sizeof(struct persist_record);
+    for (int i = 0; i < count; i++) {
+        recs[i] = persist_make_record(objs[i], &lens[i]);
+        len += lens[i];
+    }
+    char *buf = malloc(len);
+    char *dst = buf;
+    for (int i = 0; i < count; i++) {
+        memcpy(dst, recs[i], lens[i]); dst += lens[i];
+        free(recs[i]);
+    }
+    persist_make_commit(dst, count);
+
+    pthread_mutex_lock(&p->latch);
+    uint64_t offset;
+    struct persist_segment *seg = persist_append(p, buf, len, &offset);
+    for (int i = 0; i < count; i++) {
+        persist_index_set(p, obj_get_id(objs[i]), seg, offset, lens[i]);
+        offset += lens[i];
+    }
+    p->commits++;
+    uint64_t ret = p->append_lsn;
+    pthread_mutex_unlock(&p->latch);
+    free(buf);
+    free(recs);
+    free(lens);
+    return ret;
+}
+
+uint64_t persist_get_lsn(struct persist *p) {
+    pthread_mutex_lock(&p->latch);
+    uint64_t ret = p->append_lsn;
+    pthread_mutex_unlock(&p->latch);
+    return ret;
+}
+
+void persist_sync(struct persist *p, uint64_t lsn) {
+    pthread_mutex_lock(&p->sync_latch);
+    if (p->durable_lsn < lsn) {
+        if (!p->waiting) {
+            persist_deadline(&p->deadline, p->group_latency_us);
+        }
+        p->waiting++;
+        if ((p->waiting == 1) || (p->waiting >= p->group_size)) {
+            // the flusher needs to start the timer, or the group is complete
+            pthread_cond_signal(&p->flush_cond);
+        }
+        while (p->durable_lsn < lsn) {
+            pthread_cond_wait(&p->sync_cond, &p->sync_latch);
+        }
+    }
+    pthread_mutex_unlock(&p->sync_latch);
+}
+
+void persist_set_group_commit(struct persist *p, int group_size, int max_latency_us) {
+    pthread_mutex_lock(&p->sync_latch);
+    p->group_size = group_size > 0 ? group_size : 1;
+    p->group_latency_us = max_latency_us;
+    pthread_cond_signal(&p->flush_cond);
+    pthread_mutex_unlock(&p->sync_latch);
+}
+
+object_id persist_next_id(struct persist *p) {
+    pthread_mutex_lock(&p->latch);
+    object_id ret = p->next_id;
+    pthread_mutex_unlock(&p->latch);
+    return ret;
+}
+
+int persist_compact(struct persist *p) {
+    int ret = 0;
+    pthread_mutex_lock(&p->compact_latch);
+    while (persist_compact_segment(p)) {
+        ret++;
+    }
+    pthread_mutex_unlock(&p->compact_latch);
+    return ret;
+}
+
+void persist_freeze(struct persist *p) {
+    pthread_mutex_lock(&p->latch);
+    pthread_rwlock_rdlock(&p->segments_latch);
+}
+
+void persist_thaw(struct persist *p) {
+    pthread_rwlock_unlock(&p->segments_latch);
+    pthread_mutex_unlock(&p->latch);
+}
+
+int persist_frozen_ids(struct persist *p, object_id **ids) {
+    int image_count = p->image ? image_get_object_count(p->image) : 0;
+    *ids = malloc(sizeof(object_id) * (p->objects + image_count + 1));
+    int count = 0;
+    for (uint32_t i = 0; i <= p->index_mask; i++) {
+        if (p->index[i].seg) {
+            (*ids)[count++] = p->index[i].id;
+        }
+    }
+    for (int i = 0; i < image_count; i++) {
+        object_id oid = image_get_id(p->image, i);
+        if (!persist_index_find(p, oid)->seg) {
+            (*ids)[count++] = oid;
+        }
+    }
+    return count;
+}
+
+bool persist_frozen_read(struct persist *p, object_id oid, char **code, int *code_len,
+        char **state, int *state_len, char **buf) {
+    *buf = NULL;
+    struct persist_index_entry *e = persist_index_find(p, oid);
+    if (!e->seg) {
+        return p->image && image_find(p->image, oid, code, code_len, state, state_len);
+    }
+    *buf = persist_read_record(e->seg->fd, e->offset, e->offset + e->len);
+    if (!*buf) {
+        fprintf(stderr, "object log: record for object %lu is corrupt\n", (unsigned long)oid);
+        return false;
+    }
+    struct persist_record *r = (struct persist_record*)*buf;
+    *code = *buf + sizeof(struct persist_record);
+    *code_len = r->code_len;
+    *state = *code + r->code_len;
+    *state_len = r->len - r->code_len;
+    return true;
+}
+
+void persist_get_stats(struct persist *p, struct persist_stats *stats) {
+    pthread_mutex_lock(&p->latch);
+    stats->objects = p->objects;
+    stats->image_objects = p->image ? image_get_object_count(p->image) : 0;
+    stats->segments = p->segment_count;
+    stats->log_bytes = 0;
+    stats->live_bytes = 0;
+    for (int i = 0; i < p->segment_count; i++) {
+        stats->log_bytes += p->segments[i]->size;
+        stats->live_bytes += p->segments[i]->live;
+    }
+    stats->compactions = p->compactions;
+    stats->compacted_bytes = p->compacted_bytes;
+    stats->commits = p->commits;
+    pthread_mutex_unlock(&p->latch);
+    pthread_mutex_lock(&p->sync_latch);
+    stats->syncs = p->syncs;
+    pthread_mutex_unlock(&p->sync_latch);
 }
@@ -3,12 +3,109 @@
 
 #include "object.h"
 
+/* objects are stored in an append-only log of serialized objects, split into
+ * segment files in one directory. every persist_put() appends a new record for
+ * the object, and an in-memory index maps each object id to its newest
+ * record. on open, the index is rebuilt by scanning the segments, and a
+ * record that was only partially written when the process died gets cut off.
+ * records that got superseded by newer ones are garbage, a background thread
+ * compacts segments that are mostly garbage by copying their live records to
+ * the end of the log and deleting them.
+ *
+ * the log doubles as the write-ahead log of the store: persist_commit()
+ * appends the objects written by a transaction atomically, and
+ * persist_sync() waits for them to be durable. a flusher thread does the
+ * syncing, for as many commits at once as it can (group commit), so that the
+ * cost of an fdatasync() gets shared between transactions.
+ *
+ * the store can also start out from a core image (see image.h). objects that
+ * are not in the log come from the image, and once written, the log has the
+ * newer version.
+ *
+ * all functions can be called concurrently */
+
 struct persist;
 
+struct persist_stats {
+    // in the log, and in the image. objects that got written since the image
+    // got made are in both
+    int objects;
+    int image_objects;
+    int segments;
+    // size of all segments, and how much of that is taken up by the newest
+    // record of each object
+    uint64_t log_bytes;
+    uint64_t live_bytes;
+    uint64_t compactions;
+    uint64_t compacted_bytes;
+    // with group commit there are fewer syncs than commits
+    uint64_t commits;
+    uint64_t syncs;
+};
+
+/* opens the store in dir, creating the directory if necessary. with dir NULL,
+ * a temporary directory is used and removed again on persist_free(). image is
+ * the path of a core image to start out from, or NULL. segments are rolled
+ * over once they reach segment_bytes, 0 selects the default. returns NULL if
+ * the directory or image cannot be used. if neither the log nor the image
+ * have the root object 0, the store gets the bootstrap objects (the root
+ * object and its helpers) */
+struct persist* persist_open(const char *dir, const char *image, size_t segment_bytes);
+/* shorthand for a temporary store, mostly for tests */
 struct persist* persist_new(void);
 void persist_free(struct persist *p);
 
+/* returns a new copy of the object as last put, which is owned by the caller,
+ * or NULL if there is no such object. objects from the image refer to its
+ * mapping, so they must not outlive the store */
 struct object* persist_get(struct persist *p, object_id oid);
+/* changes whenever the object gets put or committed, so it tells whether
+ * what persist_get() returned after getting this is still current. moving
+ * records around can change it as well */
+uint64_t persist_get_version(struct persist *p, object_id oid);
+/* stores the current state of the object and waits for it to be durable,
+ * the object is not consumed */
 void persist_put(struct persist *p, struct object *o);
+/* stores the objects atomically, i.e. after a crash either all of them or
+ * none are there, and returns the log sequence number of the commit. the
+ * objects are not consumed. this does not wait for them to be durable, see
+ * persist_sync() */
+uint64_t persist_commit(struct persist *p, struct object **objs, int count);
+/* the log sequence number of the last commit, i.e. everything persist_get()
+ * might have returned is covered by it */
+uint64_t persist_get_lsn(struct persist *p);
+/* waits until everything up to the log sequence number is durable */
+void persist_sync(struct persist *p, uint64_t lsn);
+/* the flusher syncs as soon as group_size transactions wait for it, or once
+ * the first of them has waited for max_latency_us. commits that come in
+ * while a sync is running always wait for the next one, so the defaults of 1
+ * and 0 already batch them up under load. larger groups trade latency for
+ * fewer syncs */
+void persist_set_group_commit(struct persist *p, int group_size, int max_latency_us);
+/* one past the largest object id that got stored, so that new objects do not
+ * reuse ids after a restart */
+object_id persist_next_id(struct persist *p);
+
+/* compacts all segments that are worth it right now, rather than waiting for
+ * the background thread. returns the number of segments compacted */
+int persist_compact(struct persist *p);
+void persist_get_stats(struct persist *p, struct persist_stats *stats);
+
+/* for reading the whole store in a child process while the parent goes on,
+ * see store_checkpoint(). persist_freeze() waits for changes to the index
+ * that are in progress and holds off new ones until persist_thaw(). a child
+ * forked in between has a consistent copy of the store, on which it can use
+ * the persist_frozen_*() functions, which take no latches. nothing else works
+ * in the child, the latches stay taken there */
+void persist_freeze(struct persist *p);
+void persist_thaw(struct persist *p);
+/* the ids of all objects, from the log and from the image, in no particular
+ * order. the array is owned by the caller, returns its size */
+int persist_frozen_ids(struct persist *p, object_id **ids);
+/* the object as it is stored, in the form of obj_code_to_buffer() and
+ * obj_state_to_buffer(). the data is either in the image or read into *buf,
+ * which the caller needs to free. returns false if it cannot be read */
+bool persist_frozen_read(struct persist *p, object_id oid, char **code, int *code_len,
+    char **state, int *state_len, char **buf);
 
 #endif /* PERSIST_H */
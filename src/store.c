@@ -5,81 +5,490 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include "cache.h"
+#include "epoch.h"
+#include "image.h"
 
+// initial number of buckets across all cache shards, the caches grow as
+// required
 #define CACHE_SIZE      1024
+// memory budget across all cache shards in bytes. with snapshots, only
+// objects that every snapshot sees the newest version of can be evicted, see
+// store_evict_check()
+#define CACHE_BUDGET    (64 * 1024 * 1024)
+
+// the store can log every object access and lock, which is handy when
+// debugging locking issues but far too much output otherwise. build with
+// "make STORE_DEBUG=1" to get it
+#ifdef STORE_DEBUG
+#define store_debug(...)    printf(__VA_ARGS__)
+#else
+#define store_debug(...)
+#endif
 
 // -------- implementation of declared public structures --------
 
-struct store {
+/* the cache is split into shards by object id, each with its own latch, so
+ * that transactions working on different objects do not serialize on a single
+ * mutex. the latch is outside the cache so that we can do overhand locking
+ * with the object itself */
+struct store_shard {
     struct cache *cache;
+    pthread_mutex_t latch;
+};
+
+struct store {
+    struct store_shard *shards;
+    int num_shards;
+    enum store_mode mode;
     struct persist *persist;
-    // the cache latch is outside the cache so that we can do overhand locking
-    // with the object itself
-    pthread_mutex_t cache_latch;
+    // if not NULL, accessed object ids get written here. stdio locks the
+    // stream itself, so this only needs to be set before the store is used
+    // concurrently
+    FILE *access_log;
     // XXX kludge, need better allocator with persistence integration
     struct locks_ctx *locks_ctx;
-    int alloc_id;
-    // the sid is sequential per store_tx and wraps around, used to determine
-    // the younger transaction in a deadlock
-    uint64_t sid_seq;
+    // protected by the ids latch
+    object_id alloc_id;
+    // see store_new_sid()
+    _Atomic uint64_t sid_seq;
     int max_tasks;
     bool *cid_used;
+    // the snapshot of the transaction using each cid, for STORE_MVCC and
+    // STORE_OCC. this determines which old versions of objects are still
+    // needed
+    uint64_t *snapshot_by_cid;
     pthread_mutex_t ids_latch;
+    // timestamp of the last commit for STORE_MVCC and STORE_OCC. this only
+    // gets advanced under the commit latch, once all versions of a commit are
+    // in place, so that a snapshot never sees half a commit
+    _Atomic uint64_t commit_ts;
+    pthread_mutex_t commit_latch;
+    // no snapshot still in use is older than this, it only ever goes up
+    _Atomic uint64_t stable_ts;
+    // held for reading while a transaction publishes its writes, and for
+    // writing while forking a checkpoint, so that the child sees no commit
+    // half done. writers are preferred, a steady stream of commits would
+    // otherwise hold off a checkpoint forever
+    pthread_rwlock_t checkpoint_gate;
+    // protects the checkpoint state below
+    pthread_mutex_t checkpoint_latch;
+    // of the running checkpoint, 0 if none is
+    pid_t checkpoint_pid;
+    uint64_t checkpoint_start_ns;
+    struct store_checkpoint_stats checkpoint_stats;
 };
 
 struct lobject_list_node {
     struct lobject *lo;
+    // whether the tx holds a lock on the object through this node, reads do
+    // not take one for STORE_MVCC, and nothing does for STORE_OCC
+    bool locked;
     struct lobject_list_node *next;
 };
 
+/* an object written by the tx. this is a private copy that gets published as
+ * the newest version on commit, or the object itself if it has been created in
+ * the tx */
+struct store_write {
+    struct lobject *lo;
+    struct object *obj;
+    struct store_write *next;
+};
+
 struct store_tx {
     struct store *store;
     struct lobject_list_node *locked;
+    struct store_write *writes;
     uint64_t sid;
     int cid;
+    // commit timestamp the tx reads at for STORE_MVCC and STORE_OCC
+    uint64_t snapshot;
 };
 
+// -------- internal functions --------
+
+// the cache hashes ids into buckets by modulo, so we need to pick the shard by
+// a different hash, otherwise each shard would only use some of its buckets
+struct store_shard* store_get_shard(struct store *s, object_id oid) {
+    uint64_t h = oid * 0x9E3779B97F4A7C15ull;
+    return &s->shards[(h >> 32) % s->num_shards];
+}
+
+// puts an object into the tx, so that it gets released when the tx finishes.
+// each node holds one pin on the object
+void store_tx_add_object(struct store_tx *tx, struct lobject *lo, bool locked) {
+    struct lobject_list_node *list_node = malloc(sizeof(struct lobject_list_node));
+    list_node->lo = lo;
+    list_node->locked = locked;
+    list_node->next = tx->locked;
+    tx->locked = list_node;
+}
+
+// releases all objects and locks held by the tx
+void store_tx_release_objects(struct store_tx *tx) {
+    struct store *s = tx->store;
+    while (tx->locked) {
+        struct lobject_list_node *temp = tx->locked;
+        tx->locked = temp->next;
+        object_id oid = obj_get_id(lobject_get_object(temp->lo));
+        struct store_shard *shard = store_get_shard(s, oid);
+        store_debug("### tx %lX unlocking obj %li\n", tx, oid);
+        pthread_mutex_lock(&shard->latch);
+        if (temp->locked) {
+            lock_unlock(lobject_get_lock(temp->lo), tx);
+        }
+        cache_release_object(shard->cache, temp->lo);
+        pthread_mutex_unlock(&shard->latch);
+        free(temp);
+    }
+}
+
+struct store_write* store_tx_find_write(struct store_tx *tx, struct lobject *lo) {
+    for (struct store_write *w = tx->writes; w; w = w->next) {
+        if (w->lo == lo) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+void store_retired_object_free(void *p) {
+    obj_free(p);
+}
+
+// copies from aborted transactions. a method running in the tx might have
+// cached a lookup through the copy, which holds its own reference, but the
+// copy might still be looked at by a concurrent cache lookup
+void store_drop_object(struct object *o) {
+    epoch_retire(o, store_retired_object_free);
+}
+
+// the oldest snapshot any transaction but tx might still read at, versions
+// older than what such a snapshot sees can go
+uint64_t store_oldest_snapshot(struct store_tx *tx) {
+    struct store *s = tx->store;
+    pthread_mutex_lock(&s->ids_latch);
+    // transactions that start from now on get at least the current timestamp
+    uint64_t oldest = atomic_load(&s->commit_ts);
+    for (int i = 0; i < s->max_tasks; i++) {
+        if (s->cid_used[i] && (i != tx->cid) && (s->snapshot_by_cid[i] < oldest)) {
+            oldest = s->snapshot_by_cid[i];
+        }
+    }
+    pthread_mutex_unlock(&s->ids_latch);
+    return oldest;
+}
+
+// snapshots that are in use only get newer, so any oldest snapshot we ever
+// found stays a lower bound for them
+void store_advance_stable_ts(struct store *s, uint64_t oldest) {
+    uint64_t stable = atomic_load(&s->stable_ts);
+    while ((stable < oldest)
+            && !atomic_compare_exchange_weak(&s->stable_ts, &stable, oldest)) {
+    }
+}
+
+// the commit timestamps of versions are not persisted, so an evicted object
+// comes back as a single version visible to everyone, see store_get_object().
+// that is only right if every snapshot in use sees the newest version anyway.
+// objects that are being used are pinned, so they don't get here
+bool store_evict_check(struct lobject *lo, void *arg) {
+    struct store *s = arg;
+    return lobject_get_version_ts(lo) <= atomic_load(&s->stable_ts);
+}
+
+// appends the write set of the tx to the log, and returns the lsn of the
+// commit. this needs to happen before anyone else can see the writes, so that
+// nobody depends on something that is not in the log yet
+uint64_t store_tx_log_writes(struct store_tx *tx) {
+    int count = 0;
+    for (struct store_write *w = tx->writes; w; w = w->next) {
+        count++;
+    }
+    struct object **objs = malloc(sizeof(struct object*) * count);
+    count = 0;
+    for (struct store_write *w = tx->writes; w; w = w->next) {
+        objs[count++] = w->obj;
+    }
+    uint64_t ret = persist_commit(tx->store->persist, objs, count);
+    free(objs);
+    return ret;
+}
+
+// makes the writes of the tx visible. the tx still holds the exclusive locks
+// on all objects it wrote, so it is the only one adding or pruning versions
+// on these, and they go into the log in the order they get committed. with
+// STORE_LOCKING nobody can read an object without the lock, so the copy
+// simply replaces the committed version
+void store_tx_publish_locked_writes(struct store_tx *tx) {
+    for (struct store_write *w = tx->writes; w; w = w->next) {
+        struct object *old = lobject_get_object(w->lo);
+        if (w->obj == old) {
+            continue;
+        }
+        if (obj_get_code_version(w->obj) != obj_get_code_version(old)) {
+            obj_bump_code_version(old);
+        }
+        // readers that got here through a lock-free cache lookup only ever
+        // look at the newest version, so the old one can go once they are
+        // done looking, see lobject_prune_versions()
+        lobject_add_version(w->lo, w->obj, 0);
+        lobject_prune_versions(w->lo, 0);
+    }
+}
+
+// checks that nothing the tx has read or written got committed by someone else
+// since its snapshot, for STORE_OCC. this needs the commit latch, so that
+// nobody commits between validating and publishing
+bool store_tx_validate(struct store_tx *tx) {
+    for (struct lobject_list_node *node = tx->locked; node; node = node->next) {
+        uint64_t newest = lobject_get_version_ts(node->lo);
+        if (newest == LOBJECT_UNCOMMITTED) {
+            // fine if we created it, otherwise we never saw it anyway
+            if (!store_tx_find_write(tx, node->lo)) {
+                return false;
+            }
+        }
+        else if (newest > tx->snapshot) {
+            store_debug("### tx %lX read stale obj %li\n", tx, obj_get_id(lobject_get_object(node->lo)));
+            return false;
+        }
+    }
+    return true;
+}
+
+// returns false if the tx could not be committed and has to be retried. this
+// only happens for STORE_OCC, the other modes find conflicts before. sets lsn
+// to what needs to be durable before the tx may tell anyone about its outcome
+bool store_tx_publish_writes(struct store_tx *tx, uint64_t *lsn) {
+    struct store *s = tx->store;
+    if (!tx->writes) {
+        // reading from a snapshot is consistent by itself, but what we read
+        // might not be durable yet
+        *lsn = persist_get_lsn(s->persist);
+        return true;
+    }
+    if (s->mode == STORE_LOCKING) {
+        *lsn = store_tx_log_writes(tx);
+        store_tx_publish_locked_writes(tx);
+        return true;
+    }
+    // getting this before the commit latch is on the safe side, it can only
+    // go up in the meantime
+    uint64_t oldest = store_oldest_snapshot(tx);
+    store_advance_stable_ts(s, oldest);
+    pthread_mutex_lock(&s->commit_latch);
+    if ((s->mode == STORE_OCC) && !store_tx_validate(tx)) {
+        pthread_mutex_unlock(&s->commit_latch);
+        return false;
+    }
+    // under the commit latch, so the log has the versions of an object in
+    // commit order
+    *lsn = store_tx_log_writes(tx);
+    uint64_t ts = atomic_load(&s->commit_ts) + 1;
+    for (struct store_write *w = tx->writes; w; w = w->next) {
+        uint64_t newest = lobject_get_version_ts(w->lo);
+        if (newest == LOBJECT_UNCOMMITTED) {
+            // created in this tx, it only needs to become visible
+            lobject_set_version_ts(w->lo, ts);
+            continue;
+        }
+        // the snapshot got validated when the lock was taken or just now, and
+        // nobody could have committed a version since
+        assert(newest <= tx->snapshot);
+        struct object *old = lobject_get_object(w->lo);
+        if (obj_get_code_version(w->obj) != obj_get_code_version(old)) {
+            // method lookups cached through the old version are stale for
+            // everyone reading the new one
+            obj_bump_code_version(old);
+        }
+        lobject_add_version(w->lo, w->obj, ts);
+    }
+    atomic_store(&s->commit_ts, ts);
+    store_debug("### tx %lX committed at %lu\n", tx, ts);
+
+    // without exclusive locks for STORE_OCC, the commit latch is what keeps
+    // other transactions from adding and pruning versions at the same time
+    for (struct store_write *w = tx->writes; w; w = w->next) {
+        lobject_prune_versions(w->lo, oldest);
+    }
+    pthread_mutex_unlock(&s->commit_latch);
+    return true;
+}
+
+// releases everything the tx holds and frees it, after it has been committed
+// or aborted
+void store_tx_end(struct store_tx *tx) {
+    struct store *s = tx->store;
+    while (tx->writes) {
+        struct store_write *w = tx->writes;
+        tx->writes = w->next;
+        free(w);
+    }
+    store_tx_release_objects(tx);
+    locks_forget_tx(s->locks_ctx, tx);
+
+    pthread_mutex_lock(&s->ids_latch);
+    assert(s->cid_used[tx->cid]);
+    s->cid_used[tx->cid] = false;
+    pthread_mutex_unlock(&s->ids_latch);
+    free(tx);
+}
+
+uint64_t store_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// runs in the forked child, which has a copy of the store as of the last
+// commit and nobody else running. objects in the cache are serialized from
+// there, all others are copied across as they are stored. objects that are
+// only in the cache have not been committed yet and are left out
+bool store_checkpoint_child(struct store *s, const char *path) {
+    struct image_writer *w = image_writer_new(path);
+    if (!w) {
+        return false;
+    }
+    object_id *ids;
+    int count = persist_frozen_ids(s->persist, &ids);
+    for (int i = 0; i < count; i++) {
+        // the latches are taken by the parent, but the cache cannot change
+        struct lobject *lo = cache_peek_object(store_get_shard(s, ids[i])->cache, ids[i]);
+        if (lo) {
+            image_writer_add_object(w, lobject_get_object(lo));
+            continue;
+        }
+        char *code;
+        char *state;
+        char *buf;
+        int code_len;
+        int state_len;
+        if (!persist_frozen_read(s->persist, ids[i], &code, &code_len, &state, &state_len, &buf)) {
+            free(ids);
+            image_writer_abort(w);
+            return false;
+        }
+        image_writer_add(w, ids[i], code, code_len, state, state_len);
+        free(buf);
+    }
+    free(ids);
+    return image_writer_finish(w);
+}
+
+// collects the running checkpoint, under the checkpoint latch. returns false
+// if it has not finished yet
+bool store_checkpoint_reap(struct store *s, bool wait) {
+    if (!s->checkpoint_pid) {
+        return true;
+    }
+    int status;
+    pid_t pid = waitpid(s->checkpoint_pid, &status, wait ? 0 : WNOHANG);
+    if (pid == 0) {
+        return false;
+    }
+    struct store_checkpoint_stats *st = &s->checkpoint_stats;
+    if ((pid > 0) && WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+        st->checkpoints++;
+    }
+    else {
+        st->failures++;
+    }
+    st->last_duration_ns = store_now_ns() - s->checkpoint_start_ns;
+    if (st->last_duration_ns > st->max_duration_ns) {
+        st->max_duration_ns = st->last_duration_ns;
+    }
+    st->running = false;
+    s->checkpoint_pid = 0;
+    return true;
+}
+
 // -------- implementation of public functions --------
 
-struct store* store_new(struct persist *p, int max_tasks) {
+struct store* store_new(struct persist *p, int max_tasks, int num_shards,
+        enum store_mode mode) {
     struct store *ret = malloc(sizeof(struct store));
     ret->persist = p;
-    // XXX should we get cache from args like persist?
-    ret->cache = cache_new(CACHE_SIZE);
-    if (pthread_mutex_init(&ret->cache_latch, NULL) != 0) {
+    ret->mode = mode;
+    assert(num_shards > 0);
+    ret->num_shards = num_shards;
+    ret->shards = malloc(sizeof(struct store_shard) * num_shards);
+    int shard_size = CACHE_SIZE / num_shards > 16 ? CACHE_SIZE / num_shards : 16;
+    for (int i = 0; i < num_shards; i++) {
+        // XXX should we get cache from args like persist?
+        ret->shards[i].cache = cache_new(shard_size, CACHE_BUDGET / num_shards,
+            CACHE_POLICY_ARC);
+        if (mode != STORE_LOCKING) {
+            cache_set_evict_check(ret->shards[i].cache, store_evict_check, ret);
+        }
+        if (pthread_mutex_init(&ret->shards[i].latch, NULL) != 0) {
+            fprintf(stderr, "pthread_mutex_init failed\n");
+            exit(1);
+        }
+    }
+    if (pthread_mutex_init(&ret->ids_latch, NULL) != 0) {
         fprintf(stderr, "pthread_mutex_init failed\n");
         exit(1);
     }
-    if (pthread_mutex_init(&ret->ids_latch, NULL) != 0) {
+    if (pthread_mutex_init(&ret->commit_latch, NULL) != 0) {
         fprintf(stderr, "pthread_mutex_init failed\n");
         exit(1);
     }
+    atomic_init(&ret->commit_ts, 0);
+    atomic_init(&ret->stable_ts, 0);
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    if ((pthread_rwlock_init(&ret->checkpoint_gate, &attr) != 0)
+            || (pthread_mutex_init(&ret->checkpoint_latch, NULL) != 0)) {
+        fprintf(stderr, "pthread_rwlock_init failed\n");
+        exit(1);
+    }
+    pthread_rwlockattr_destroy(&attr);
+    ret->checkpoint_pid = 0;
+    memset(&ret->checkpoint_stats, 0, sizeof(struct store_checkpoint_stats));
+    ret->access_log = NULL;
     ret->locks_ctx = locks_new_ctx(max_tasks);
-    ret->alloc_id = 1000;
-    ret->sid_seq = 0;
+    // ids below 1000 are reserved for the bootstrap objects
+    ret->alloc_id = persist_next_id(p) > 1000 ? persist_next_id(p) : 1000;
+    atomic_init(&ret->sid_seq, 0);
     ret->max_tasks = max_tasks;
     ret->cid_used = malloc(sizeof(bool) * max_tasks);
     memset(ret->cid_used, 0, sizeof(bool) * max_tasks); // memset for stdbool feels dirty...
+    ret->snapshot_by_cid = malloc(sizeof(uint64_t) * max_tasks);
     return ret;
 }
 
 void store_free(struct store *s) {
-    cache_free(s->cache);
+    store_checkpoint_wait(s);
+    for (int i = 0; i < s->num_shards; i++) {
+        cache_free(s->shards[i].cache);
+        pthread_mutex_destroy(&s->shards[i].latch);
+    }
+    free(s->shards);
     locks_free_ctx(s->locks_ctx);
-    pthread_mutex_destroy(&s->cache_latch);
     pthread_mutex_destroy(&s->ids_latch);
+    pthread_mutex_destroy(&s->commit_latch);
+    pthread_rwlock_destroy(&s->checkpoint_gate);
+    pthread_mutex_destroy(&s->checkpoint_latch);
     free(s->cid_used);
+    free(s->snapshot_by_cid);
     free(s);
 }
 
-struct store_tx* store_start_tx(struct store *s) {
+struct store_tx* store_start_tx(struct store *s, uint64_t sid) {
     struct store_tx *ret = malloc(sizeof(struct store_tx));
     ret->store = s;
     ret->locked = NULL;
+    ret->writes = NULL;
+    ret->sid = sid;
     pthread_mutex_lock(&s->ids_latch);
-    ret->sid = s->sid_seq++;
     // allocate a cid, which is reused, and can never exceed max_tasks
     for (int i = 0; i < s->max_tasks; i++) {
         if (!s->cid_used[i]) {
@@ -88,46 +497,171 @@ struct store_tx* store_start_tx(struct store *s) {
             break;
         }
     }
+    // taking the snapshot under the ids latch means that anyone pruning
+    // versions either sees it, or pruned before it was taken
+    ret->snapshot = atomic_load(&s->commit_ts);
+    s->snapshot_by_cid[ret->cid] = ret->snapshot;
     pthread_mutex_unlock(&s->ids_latch);
     assert(ret->cid < s->max_tasks);
-    printf("## store_start_tx -> %p sid:%i cid:%i\n", ret, ret->sid, ret->cid);
+    store_debug("## store_start_tx -> %p sid:%lu cid:%i\n", ret, ret->sid, ret->cid);
     return ret;
 }
 
-void store_finish_tx(struct store_tx *tx) {
-    printf("## store_finish_tx %p\n", tx);
-    struct store *s = tx->store;
-    pthread_mutex_lock(&s->cache_latch);
-    while (tx->locked) {
-        struct lobject_list_node *temp = tx->locked;
-        tx->locked = temp->next;
-        printf("### tx %lX unlocking obj %li\n", tx, obj_get_id(lobject_get_object(temp->lo)));
-        lock_unlock(lobject_get_lock(temp->lo), tx);
-        cache_release_object(s->cache, temp->lo);
-        free(temp);
+bool store_finish_tx(struct store_tx *tx) {
+    store_debug("## store_finish_tx %p\n", tx);
+    struct persist *p = tx->store->persist;
+    uint64_t lsn;
+    // a read-only tx has nothing to publish, and does not need to wait for a
+    // checkpoint being forked
+    bool gated = tx->writes != NULL;
+    if (gated) {
+        pthread_rwlock_rdlock(&tx->store->checkpoint_gate);
+    }
+    bool published = store_tx_publish_writes(tx, &lsn);
+    if (gated) {
+        pthread_rwlock_unlock(&tx->store->checkpoint_gate);
+    }
+    if (!published) {
+        store_abort_tx(tx);
+        return false;
     }
-    pthread_mutex_unlock(&s->cache_latch);
+    // the locks can go before the commit is durable: whoever sees our writes
+    // commits after us in the log, so it cannot be durable before we are.
+    // that way the locks are not held across the sync
+    store_tx_end(tx);
+    persist_sync(p, lsn);
+    return true;
+}
 
-    pthread_mutex_lock(&s->ids_latch);
-    assert(s->cid_used[tx->cid]);
-    pthread_mutex_unlock(&s->ids_latch);
-    s->cid_used[tx->cid] = false;
-    free(tx);
+void store_abort_tx(struct store_tx *tx) {
+    store_debug("## store_abort_tx %p\n", tx);
+    for (struct store_write *w = tx->writes; w; w = w->next) {
+        if (w->obj != lobject_get_object(w->lo)) {
+            store_drop_object(w->obj);
+            continue;
+        }
+        // created in the tx, nobody can ever see it. it goes once the tx
+        // releases it. its id does not get reused
+        object_id oid = obj_get_id(w->obj);
+        struct store_shard *shard = store_get_shard(tx->store, oid);
+        pthread_mutex_lock(&shard->latch);
+        cache_remove_object(shard->cache, w->lo);
+        pthread_mutex_unlock(&shard->latch);
+    }
+    store_tx_end(tx);
 }
 
 uint64_t store_tx_get_sid(struct store_tx *tx) {
     return tx->sid;
 }
 
+uint64_t store_new_sid(struct store *s) {
+    return atomic_fetch_add(&s->sid_seq, 1);
+}
+
 int store_tx_get_cid(struct store_tx *tx) {
     return tx->cid;
 }
 
+void store_set_lock_policy(struct store *s, int policy) {
+    locks_set_policy(s->locks_ctx, policy);
+}
+
+void store_record_accesses(struct store *s, FILE *f) {
+    s->access_log = f;
+}
+
+bool store_checkpoint(struct store *s, const char *path) {
+    pthread_mutex_lock(&s->checkpoint_latch);
+    if (!store_checkpoint_reap(s, false)) {
+        pthread_mutex_unlock(&s->checkpoint_latch);
+        return false;
+    }
+    // waits for the commits that are being published. after that, the latches
+    // keep the caches and the log as they are for the fork. the child gets
+    // its own copy of everything, the pages only get copied once either side
+    // writes to them
+    uint64_t start = store_now_ns();
+    pthread_rwlock_wrlock(&s->checkpoint_gate);
+    for (int i = 0; i < s->num_shards; i++) {
+        pthread_mutex_lock(&s->shards[i].latch);
+    }
+    persist_freeze(s->persist);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // only this thread made it into the child, and the latches above
+        // stay taken here. so the child does its thing and leaves without
+        // running any exit handlers
+        _exit(store_checkpoint_child(s, path) ? 0 : 1);
+    }
+    persist_thaw(s->persist);
+    for (int i = s->num_shards - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&s->shards[i].latch);
+    }
+    pthread_rwlock_unlock(&s->checkpoint_gate);
+    uint64_t pause = store_now_ns() - start;
+
+    struct store_checkpoint_stats *st = &s->checkpoint_stats;
+    st->last_pause_ns = pause;
+    st->total_pause_ns += pause;
+    if (pause > st->max_pause_ns) {
+        st->max_pause_ns = pause;
+    }
+    if (pid < 0) {
+        perror("fork");
+        st->failures++;
+        pthread_mutex_unlock(&s->checkpoint_latch);
+        return false;
+    }
+    s->checkpoint_pid = pid;
+    s->checkpoint_start_ns = start;
+    st->running = true;
+    pthread_mutex_unlock(&s->checkpoint_latch);
+    return true;
+}
+
+bool store_checkpoint_wait(struct store *s) {
+    pthread_mutex_lock(&s->checkpoint_latch);
+    uint64_t failures = s->checkpoint_stats.failures;
+    store_checkpoint_reap(s, true);
+    bool ret = s->checkpoint_stats.failures == failures;
+    pthread_mutex_unlock(&s->checkpoint_latch);
+    return ret;
+}
+
+void store_get_checkpoint_stats(struct store *s, struct store_checkpoint_stats *stats) {
+    pthread_mutex_lock(&s->checkpoint_latch);
+    store_checkpoint_reap(s, false);
+    *stats = s->checkpoint_stats;
+    pthread_mutex_unlock(&s->checkpoint_latch);
+}
+
+void store_get_cache_stats(struct store *s, struct cache_stats *stats) {
+    memset(stats, 0, sizeof(struct cache_stats));
+    for (int i = 0; i < s->num_shards; i++) {
+        struct cache_stats shard_stats;
+        pthread_mutex_lock(&s->shards[i].latch);
+        cache_get_stats(s->shards[i].cache, &shard_stats);
+        pthread_mutex_unlock(&s->shards[i].latch);
+        stats->objects += shard_stats.objects;
+        stats->resident_bytes += shard_stats.resident_bytes;
+        stats->pinned_objects += shard_stats.pinned_objects;
+        stats->pinned_bytes += shard_stats.pinned_bytes;
+        stats->evictions += shard_stats.evictions;
+        stats->evicted_bytes += shard_stats.evicted_bytes;
+    }
+}
+
+void store_dump_lock_contention(struct store *s, FILE *out, int n) {
+    locks_dump_contention(s->locks_ctx, out, n);
+}
+
 struct store_tx *store_new_mock_tx(uint64_t sid, int cid) {
     struct store_tx *ret = malloc(sizeof(struct store_tx));
     memset(ret, 0, sizeof(struct store_tx));
     ret->sid = sid;
     ret->cid = cid;
+    return ret;
 }
 
 void store_free_mock_tx(struct store_tx *tx) {
@@ -135,63 +669,162 @@ void store_free_mock_tx(struct store_tx *tx) {
 }
 
 struct lobject* store_get_object(struct store_tx *tx, object_id oid) {
-    printf("## store_get_object %li\n", oid);
+    store_debug("## store_get_object %li\n", oid);
     struct store *s = tx->store;
+    struct store_shard *shard = store_get_shard(s, oid);
     struct lobject *lo;
-    pthread_mutex_lock(&s->cache_latch);
-    lo = cache_get_object(s->cache, oid);
+    if (s->access_log) {
+        fprintf(s->access_log, "%lu\n", oid);
+    }
+    // the common case is an object that is already in the cache, which we can
+    // get without taking the latch
+    lo = cache_get_object(shard->cache, oid);
 
     if (lo == NULL) {
+        // loading can take a while, so it happens without the latch. whoever
+        // puts the object in the cache first wins
+        uint64_t version = persist_get_version(s->persist, oid);
         struct object *po = persist_get(s->persist, oid);
-        // XXX not sure what to do in this case...
-        assert(po != NULL);
-        struct lock *l = lock_new(s->locks_ctx);
-        lo = lobject_new();
-        lobject_set_object(lo, po);
-        lobject_set_lock(lo, l);
-        cache_put_object(s->cache, lo);
+        pthread_mutex_lock(&shard->latch);
+        // the lock-free lookup can also miss objects that are being moved
+        // around in the cache, including ones that have not been committed
+        // and that we therefore could not load
+        lo = cache_get_object(shard->cache, oid);
+        if ((lo != NULL) && (po != NULL)) {
+            obj_free(po);
+        }
+        else if (lo == NULL) {
+            if (!po || (persist_get_version(s->persist, oid) != version)) {
+                // someone else loaded, changed and evicted it while we were
+                // loading. nobody can change it while we hold the latch and
+                // it is not in the cache, so loading again gets it right
+                if (po) {
+                    obj_free(po);
+                }
+                po = persist_get(s->persist, oid);
+            }
+            if (po == NULL) {
+                // never committed, e.g. created in a tx that got aborted
+                pthread_mutex_unlock(&shard->latch);
+                return NULL;
+            }
+            struct lock *l = lock_new(s->locks_ctx);
+            lock_set_id(l, oid);
+            lo = lobject_new();
+            lobject_set_object(lo, po);
+            lobject_set_lock(lo, l);
+            cache_put_object(shard->cache, lo);
+        }
+        pthread_mutex_unlock(&shard->latch);
     }
 
-    pthread_mutex_unlock(&s->cache_latch);
+    if (s->mode != STORE_LOCKING) {
+        // no lock needed, but the object might not have existed yet when the
+        // snapshot was taken, or might never have been committed
+        store_tx_add_object(tx, lo, false);
+        if (!lobject_get_version(lo, tx->snapshot) && !store_tx_find_write(tx, lo)) {
+            return NULL;
+        }
+        return lo;
+    }
 
-    printf("### tx %lX locking obj %li SHARED\n", tx, obj_get_id(lobject_get_object(lo)));
-    if (lock_lock(lobject_get_lock(lo), LOCK_SHARED, tx)) {
+    store_debug("### tx %lX locking obj %li SHARED\n", tx, obj_get_id(lobject_get_object(lo)));
+    // the object is pinned either way, so it goes into the tx even if the
+    // lock fails
+    int lock_ret = lock_lock(lobject_get_lock(lo), LOCK_SHARED, tx);
+    store_tx_add_object(tx, lo, lock_ret == LOCK_TAKEN);
+    if (lock_ret != LOCK_TAKEN) {
         return NULL;
     }
-
-    // put in tx to release later
-    struct lobject_list_node *list_node = malloc(sizeof(struct lobject_list_node));
-    list_node->lo = lo;
-    list_node->next = tx->locked;
-    tx->locked = list_node;
-
     return lo;
 }
 
 struct lobject* store_make_object(struct store_tx *tx, object_id parent_id) {
-    printf("## store_make_object %li\n", parent_id);
+    store_debug("## store_make_object %li\n", parent_id);
     struct store *s = tx->store;
-    pthread_mutex_lock(&s->cache_latch);
+    pthread_mutex_lock(&s->ids_latch);
+    object_id oid = s->alloc_id++;
+    pthread_mutex_unlock(&s->ids_latch);
+    struct store_shard *shard = store_get_shard(s, oid);
+    pthread_mutex_lock(&shard->latch);
     struct object *obj = obj_new();
-    obj_set_id(obj, s->alloc_id++);
+    obj_set_id(obj, oid);
     obj_add_parent(obj, parent_id);
     struct lock *l = lock_new(s->locks_ctx);
+    lock_set_id(l, oid);
     struct lobject *lo = lobject_new();
     lobject_set_object(lo, obj);
     lobject_set_lock(lo, l);
-    cache_put_object(s->cache, lo);
-    printf("### tx %lX locking %li EXCLUSIVE\n", tx, obj_get_id(lobject_get_object(lo)));
-    lock_lock(lobject_get_lock(lo), LOCK_EXCLUSIVE, tx);
-    pthread_mutex_unlock(&s->cache_latch);
-    printf("##   -> %li\n", obj_get_id(obj));
-
-    // put in tx to release later
-    // XXX refactor into own method
-    struct lobject_list_node *list_node = malloc(sizeof(struct lobject_list_node));
-    list_node->lo = lo;
-    list_node->next = tx->locked;
-    tx->locked = list_node;
+    if (s->mode != STORE_LOCKING) {
+        // nobody else gets to see the object before the tx commits
+        lobject_set_version_ts(lo, LOBJECT_UNCOMMITTED);
+    }
+    // nobody else can have a reference to the object yet, so the tx can write
+    // to it directly
+    struct store_write *w = malloc(sizeof(struct store_write));
+    w->lo = lo;
+    w->obj = obj;
+    w->next = tx->writes;
+    tx->writes = w;
+    cache_put_object(shard->cache, lo);
+    bool locked = false;
+    if (s->mode != STORE_OCC) {
+        store_debug("### tx %lX locking %li EXCLUSIVE\n", tx, obj_get_id(lobject_get_object(lo)));
+        lock_lock(lobject_get_lock(lo), LOCK_EXCLUSIVE, tx);
+        locked = true;
+    }
+    pthread_mutex_unlock(&shard->latch);
+    store_debug("##   -> %li\n", obj_get_id(obj));
 
+    store_tx_add_object(tx, lo, locked);
     return lo;
 }
 
+struct object* store_get_version(struct store_tx *tx, struct lobject *lo) {
+    struct store_write *w = store_tx_find_write(tx, lo);
+    if (w) {
+        return w->obj;
+    }
+    if (tx->store->mode == STORE_LOCKING) {
+        return lobject_get_object(lo);
+    }
+    return lobject_get_version(lo, tx->snapshot);
+}
+
+struct object* store_write_object(struct store_tx *tx, struct lobject *lo) {
+    struct store *s = tx->store;
+    struct store_write *w = store_tx_find_write(tx, lo);
+    if (w) {
+        return w->obj;
+    }
+    if (s->mode != STORE_OCC) {
+        store_debug("### tx %lX locking obj %li EXCLUSIVE\n", tx, obj_get_id(lobject_get_object(lo)));
+        if (lock_lock(lobject_get_lock(lo), LOCK_EXCLUSIVE, tx)) {
+            return NULL;
+        }
+        // the object is in the tx already, it now needs unlocking as well
+        struct lobject_list_node *node = tx->locked;
+        while (node && (node->lo != lo)) {
+            node = node->next;
+        }
+        assert(node);
+        node->locked = true;
+    }
+
+    // first updater wins: if someone committed a newer version than what we
+    // have seen, whatever we do based on that is void. for STORE_MVCC this
+    // check is what validates the commit, as nobody else can add a version
+    // while we hold the lock. for STORE_OCC it only saves us some work, the
+    // commit has to check again
+    if ((s->mode != STORE_LOCKING) && (lobject_get_version_ts(lo) > tx->snapshot)) {
+        store_debug("### tx %lX snapshot of obj %li is stale\n", tx, obj_get_id(lobject_get_object(lo)));
+        return NULL;
+    }
+    w = malloc(sizeof(struct store_write));
+    w->lo = lo;
+    w->obj = obj_copy(lobject_get_object(lo));
+    w->next = tx->writes;
+    tx->writes = w;
+    return w->obj;
+}
+
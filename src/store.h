@@ -1,8 +1,12 @@
 #ifndef STORE_H
 #define STORE_H
 
+#include <stdio.h>
+#include <stdbool.h>
+
 #include "defs.h"
 #include "persist.h"
+#include "cache.h"
 
 /* this store sits on top of a persistent backend and allows concurrent access
  * to object. The objects are cached, and the store manages locks against the
@@ -15,22 +19,111 @@
 struct store;
 struct store_tx;
 
-struct store* store_new(struct persist *p, int max_tasks);
+/* how concurrent transactions are kept apart from each other */
+enum store_mode {
+    /* strict two-phase locking: reading an object takes a shared lock on it,
+     * writing an exclusive one, and all locks are held until the transaction
+     * finishes. so readers block writers and vice versa. writes go to a
+     * private copy of the object that replaces it on commit */
+    STORE_LOCKING,
+    /* multi-version concurrency control: a transaction reads the objects as
+     * they were committed when it started, without taking any lock. writing
+     * takes an exclusive lock and works on a private copy of the object that
+     * becomes the newest version on commit. writing fails if another
+     * transaction committed a newer version of the object in the meantime,
+     * the transaction then has to be retried */
+    STORE_MVCC,
+    /* optimistic concurrency control: reads work like for STORE_MVCC, but
+     * writes do not take any lock either. instead, committing checks whether
+     * anything the transaction read or wrote has been committed by someone
+     * else since it started, and fails if so. this saves all locking overhead
+     * if transactions rarely touch the same objects, but wastes more work
+     * than STORE_MVCC when they do */
+    STORE_OCC,
+};
+
+/* the object cache is split into num_shards independently latched parts, more
+ * shards means less contention between concurrent transactions */
+struct store* store_new(struct persist *p, int max_tasks, int num_shards,
+    enum store_mode mode);
 void store_free(struct store *s);
 
+/* how lock requests that would deadlock are dealt with for STORE_LOCKING
+ * and STORE_MVCC, one of the policies in lock.h. only before the first
+ * transaction starts. failed transactions keep their sid when they are
+ * retried, so with LOCK_WAIT_DIE and LOCK_WOUND_WAIT they get older with
+ * every try and eventually win against the ones that keep failing them */
+void store_set_lock_policy(struct store *s, int policy);
+
 /* start/finish a transaction, you need to explicitely finish a transaction even 
- * if it failed */
-struct store_tx* store_start_tx(struct store *s);
-void store_finish_tx(struct store_tx *tx);
+ * if it failed. finishing commits the changes made, aborting throws them away.
+ * objects created in an aborted transaction get thrown away as well, their
+ * ids are not reused. finishing returns false if the transaction could not be
+ * committed and got aborted instead, which only happens for STORE_OCC. it
+ * needs to be retried then. finishing only returns once the commit, and
+ * every commit the transaction read from, is durable (see persist_sync()),
+ * so whatever the caller does based on the outcome, e.g. replying over the
+ * network, cannot get ahead of the log */
+struct store_tx* store_start_tx(struct store *s, uint64_t sid);
+bool store_finish_tx(struct store_tx *tx);
+void store_abort_tx(struct store_tx *tx);
 // the sid of a tx is a sequential id that can be used to determine the younger
-// transaction for e.g. deadlocks. it might eventually wrap around but that's
-// going to be a while and is ok even then 
+// transaction for e.g. deadlocks. it is given by the caller, so that a retried
+// transaction can start again with the sid of its first try. no two running
+// transactions may have the same sid, so all of them need to come from the
+// same sequence, e.g. the task ids or store_new_sid(). it might eventually wrap
+// around but that's going to be a while and is ok even then 
 uint64_t store_tx_get_sid(struct store_tx *tx);
+// the next sid from a sequence kept by the store, for transactions that do
+// not have one already
+uint64_t store_new_sid(struct store *s);
 // the cid is a small id bound by max_tasks and will be reused eagerly, it can
 // be used to e.g. represent the transaction through an index into an array-based 
 // wait-for-graph
 int store_tx_get_cid(struct store_tx *tx);
 
+/* write the id of every object requested through store_get_object() to f, one
+ * per line, or stop doing so if f is NULL. the resulting trace can be replayed
+ * against the different cache eviction policies, see bench_cache.c */
+void store_record_accesses(struct store *s, FILE *f);
+
+/* reports the memory used by the object cache, summed up across all shards.
+ * the shards are looked at one after the other, so this is not an atomic
+ * snapshot when other transactions are running */
+void store_get_cache_stats(struct store *s, struct cache_stats *stats);
+
+/* prints the n objects whose locks were waited on the longest in total, see
+ * locks_top_contended() */
+void store_dump_lock_contention(struct store *s, FILE *out, int n);
+
+struct store_checkpoint_stats {
+    // finished checkpoints, and ones that could not be forked or written
+    uint64_t checkpoints;
+    uint64_t failures;
+    // how long commits were held up for forking
+    uint64_t last_pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t total_pause_ns;
+    // from the start of a checkpoint until the snapshot is complete
+    uint64_t last_duration_ns;
+    uint64_t max_duration_ns;
+    bool running;
+};
+
+/* writes a snapshot of every committed object to a core image at path (see
+ * image.h), which can be used to start a new store from. new commits are held
+ * off briefly while the process forks, the child then writes the snapshot from
+ * its copy-on-write view of the store while the parent goes on. the snapshot
+ * has all commits that got published before, and none that came after. this
+ * returns once the child runs, false if another checkpoint is still running
+ * or forking failed. must not be called from within a transaction */
+bool store_checkpoint(struct store *s, const char *path);
+/* waits for the running checkpoint to finish, returns false if it failed.
+ * returns true if there is none */
+bool store_checkpoint_wait(struct store *s);
+/* also notices a checkpoint that has finished in the meantime */
+void store_get_checkpoint_stats(struct store *s, struct store_checkpoint_stats *stats);
+
 #ifdef TESTABILITY_FEATURES
 // these are for locking unit tests only, so you can create store_tx with sid/cid 
 // but without connection to an actual store.
@@ -47,7 +140,16 @@ struct lobject* store_get_object(struct store_tx *tx, object_id oid);
 /* create a new, empty object with an initial parent link. the id is allocated */
 struct lobject* store_make_object(struct store_tx *tx, object_id parent_id);
 
-// XXX we need a way to write to an object, but only have the writable copy in the TX
-// until comitted
+/* the version of an object from store_get_object() or store_make_object() that
+ * the transaction sees. that is its own copy if it wrote to the object, or
+ * otherwise the committed one, as of its snapshot for STORE_MVCC. only use this
+ * for reading */
+struct object* store_get_version(struct store_tx *tx, struct lobject *lo);
+/* prepares an object from store_get_object() or store_make_object() for
+ * writing and returns the version of it that can be modified. returns NULL if
+ * the exclusive lock could not be taken or, for STORE_MVCC and STORE_OCC, if
+ * someone else committed a newer version since the snapshot of the
+ * transaction. the transaction needs to be aborted and retried in that case */
+struct object* store_write_object(struct store_tx *tx, struct lobject *lo);
 
 #endif /* STORE_H */
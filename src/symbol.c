@@ -0,0 +1,168 @@
+#include "symbol.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <assert.h>
+
+/* symbols are allocated sequentially and their entries live in chunks that
+ * never move once allocated, so that readers can access them without locking
+ * while the table grows */
+#define CHUNK_SIZE          1024
+#define MAX_CHUNKS          4096
+/* initial number of slots in the hash index, needs to be a power of two */
+#define INITIAL_INDEX_SIZE  1024
+/* when this proportion of index slots are used, we grow the index */
+#define LOAD_FACTOR         0.5
+
+// -------- internal structures --------
+
+struct sym_entry {
+    char *name;
+    int len;
+    uint32_t hash;
+};
+
+/* open-addressing index from name hash to symbol, a slot containing SYM_NONE
+ * is empty. When the index grows a new one is built and published, the old
+ * ones are retained because readers might still be probing them */
+struct sym_index {
+    uint32_t size;
+    struct sym_index *retired;
+    atomic_uint slots[];
+};
+
+// -------- module state --------
+
+static pthread_mutex_t sym_latch = PTHREAD_MUTEX_INITIALIZER;
+static struct sym_entry *_Atomic chunks[MAX_CHUNKS];
+static struct sym_index *_Atomic index_ptr = NULL;
+// next symbol to hand out, 0 is SYM_NONE. only modified under the latch
+static uint32_t next_sym = 1;
+
+// -------- internal functions --------
+
+uint32_t sym_hash_name(const char *name, int len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+struct sym_entry* sym_get_entry(symbol s) {
+    struct sym_entry *chunk = atomic_load_explicit(&chunks[s / CHUNK_SIZE], memory_order_acquire);
+    return &chunk[s % CHUNK_SIZE];
+}
+
+struct sym_index* sym_index_new(uint32_t size) {
+    struct sym_index *ret = malloc(sizeof(struct sym_index) + sizeof(atomic_uint) * size);
+    ret->size = size;
+    ret->retired = NULL;
+    for (uint32_t i = 0; i < size; i++) {
+        atomic_init(&ret->slots[i], SYM_NONE);
+    }
+    return ret;
+}
+
+void sym_index_insert(struct sym_index *idx, symbol s, uint32_t hash) {
+    uint32_t pos = hash & (idx->size - 1);
+    while (atomic_load_explicit(&idx->slots[pos], memory_order_relaxed) != SYM_NONE) {
+        pos = (pos + 1) & (idx->size - 1);
+    }
+    atomic_store_explicit(&idx->slots[pos], s, memory_order_release);
+}
+
+symbol sym_index_find(struct sym_index *idx, const char *name, int len, uint32_t hash) {
+    uint32_t pos = hash & (idx->size - 1);
+    symbol s;
+    while ((s = atomic_load_explicit(&idx->slots[pos], memory_order_acquire)) != SYM_NONE) {
+        struct sym_entry *e = sym_get_entry(s);
+        if ((e->hash == hash) && (e->len == len) && (memcmp(e->name, name, len) == 0)) {
+            return s;
+        }
+        pos = (pos + 1) & (idx->size - 1);
+    }
+    return SYM_NONE;
+}
+
+// -------- implementation of public functions --------
+
+symbol sym_lookup(const char *name, int len) {
+    struct sym_index *idx = atomic_load_explicit(&index_ptr, memory_order_acquire);
+    if (!idx) {
+        return SYM_NONE;
+    }
+    return sym_index_find(idx, name, len, sym_hash_name(name, len));
+}
+
+symbol sym_intern(const char *name, int len) {
+    uint32_t hash = sym_hash_name(name, len);
+    struct sym_index *idx = atomic_load_explicit(&index_ptr, memory_order_acquire);
+    symbol ret;
+    if (idx && ((ret = sym_index_find(idx, name, len, hash)) != SYM_NONE)) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&sym_latch);
+    idx = atomic_load_explicit(&index_ptr, memory_order_relaxed);
+    if (!idx) {
+        idx = sym_index_new(INITIAL_INDEX_SIZE);
+        atomic_store_explicit(&index_ptr, idx, memory_order_release);
+    }
+    // someone else could have interned it in the meantime
+    ret = sym_index_find(idx, name, len, hash);
+    if (ret != SYM_NONE) {
+        pthread_mutex_unlock(&sym_latch);
+        return ret;
+    }
+
+    ret = next_sym++;
+    if (ret / CHUNK_SIZE >= MAX_CHUNKS) {
+        fprintf(stderr, "fatal: symbol table full\n");
+        exit(1);
+    }
+    struct sym_entry *chunk = atomic_load_explicit(&chunks[ret / CHUNK_SIZE], memory_order_relaxed);
+    if (!chunk) {
+        chunk = malloc(sizeof(struct sym_entry) * CHUNK_SIZE);
+        atomic_store_explicit(&chunks[ret / CHUNK_SIZE], chunk, memory_order_release);
+    }
+    struct sym_entry *e = &chunk[ret % CHUNK_SIZE];
+    e->name = malloc(len + 1);
+    memcpy(e->name, name, len);
+    e->name[len] = '\0';
+    e->len = len;
+    e->hash = hash;
+    // the release store into the index publishes the entry as well
+    sym_index_insert(idx, ret, hash);
+
+    if (next_sym > idx->size * LOAD_FACTOR) {
+        struct sym_index *nidx = sym_index_new(idx->size * 2);
+        for (symbol s = 1; s < next_sym; s++) {
+            sym_index_insert(nidx, s, sym_get_entry(s)->hash);
+        }
+        nidx->retired = idx;
+        atomic_store_explicit(&index_ptr, nidx, memory_order_release);
+    }
+    pthread_mutex_unlock(&sym_latch);
+    return ret;
+}
+
+const char* sym_name(symbol s) {
+    assert(s != SYM_NONE);
+    return sym_get_entry(s)->name;
+}
+
+int sym_name_len(symbol s) {
+    assert(s != SYM_NONE);
+    return sym_get_entry(s)->len;
+}
+
+uint32_t sym_hash(symbol s) {
+    assert(s != SYM_NONE);
+    return sym_get_entry(s)->hash;
+}
@@ -0,0 +1,37 @@
+#ifndef SYMBOL_H
+#define SYMBOL_H
+
+#include "defs.h"
+
+/* this implements a process-wide table of interned names. Each distinct name
+ * gets a small integer id (a "symbol") that stays valid for the lifetime of
+ * the process, so that method, global and syscall names can be compared as
+ * integers rather than strings.
+ *
+ * Looking up a name never takes a lock and never allocates, only interning a
+ * name that is not yet in the table takes a (global) mutex. Interned names are
+ * never removed, which is fine as long as the set of names is bounded by the
+ * code that exists in the world rather than by user input.
+ * */
+
+/* symbol id that never refers to a name */
+#define SYM_NONE    0
+
+/* returns the symbol for the name, interning it if required. the name does not
+ * need to be NUL-terminated and is copied */
+symbol sym_intern(const char *name, int len);
+
+/* returns the symbol for a name if it has been interned before, SYM_NONE
+ * otherwise */
+symbol sym_lookup(const char *name, int len);
+
+/* returns the NUL-terminated name of a symbol, the buffer is owned by the
+ * symbol table and valid for the lifetime of the process */
+const char* sym_name(symbol s);
+int sym_name_len(symbol s);
+
+/* returns the hash value of a symbol's name, this is cheaper than hashing
+ * the name again */
+uint32_t sym_hash(symbol s);
+
+#endif /* SYMBOL_H */
@@ -8,6 +8,7 @@
 
 #include "types.h"
 #include "eval.h"
+#include "symbol.h"
 
 // -------- internal structures --------
 
@@ -168,7 +169,8 @@ void* tasks_thread_func(void *arg) {
             ctx->queue_back = NULL;
         }
 
-        // determine a task_id for transaction priorities
+        // determine a task_id for transaction priorities. it is the sid of the
+        // transaction, and stays the same when it gets retried
         uint64_t task_id = ctx->task_id_seq++;
 
         struct vm_eval_ctx *vm_eval_ctx = NULL;
@@ -222,25 +224,25 @@ void* tasks_thread_func(void *arg) {
                     eval_ret = EVAL_OK;
                     break;
                 case QUEUE_TYPE_LISTEN_ERROR:
-                    slot = val_make_string(5, "error");
+                    slot = val_make_symbol(sym_intern("error", 5));
                     eval_ret = vm_eval_ctx_exec(vm_eval_ctx, slot, 1,
                         val_make_int(current_item->listen_error_data.errnum));
                     val_dec_ref(slot);
                     break;
                 case QUEUE_TYPE_STOP:
-                    slot = val_make_string(8, "shutdown");
+                    slot = val_make_symbol(sym_intern("shutdown", 8));
                     eval_ret = vm_eval_ctx_exec(vm_eval_ctx, slot, 0);
                     val_dec_ref(slot);
                     ctx->stop_flag = 1;
                     break;
                 case QUEUE_TYPE_ACCEPT:
-                    slot = val_make_string(6, "accept");
+                    slot = val_make_symbol(sym_intern("accept", 6));
                     eval_ret = vm_eval_ctx_exec(vm_eval_ctx, slot, 1,
                         val_make_special(current_item->accept_data.socket));
                     val_dec_ref(slot);
                     break;
                 case QUEUE_TYPE_READ:
-                    slot = val_make_string(4, "read");
+                    slot = val_make_symbol(sym_intern("read", 4));
                     // XXX we really need a separate buffer type that takes pointer
                     // and size, and that can be converted to a string using a
                     // charset.
@@ -255,7 +257,7 @@ void* tasks_thread_func(void *arg) {
                     val_dec_ref(data);
                     break;
                 case QUEUE_TYPE_CLOSED:
-                    slot = val_make_string(6, "closed");
+                    slot = val_make_symbol(sym_intern("closed", 6));
                     eval_ret = vm_eval_ctx_exec(vm_eval_ctx, slot, 1,
                         val_make_special(current_item->closed_data.socket));
                     val_dec_ref(slot);
@@ -268,7 +270,9 @@ void* tasks_thread_func(void *arg) {
                 vm_free_eval_ctx(vm_eval_ctx);
             }
 
-            // commit or roll-back the network transaction
+            // commit or roll-back the network transaction. the store commit
+            // is durable by now, so the output cannot promise anything that
+            // a crash could still take back
             if (eval_ret == EVAL_OK) {
                 ntx_commit_tx(net_tx);
             }
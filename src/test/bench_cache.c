@@ -0,0 +1,171 @@
+#include "bench_cache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cmoo_bench.h"
+#include "cache.h"
+#include "object.h"
+
+// synthetic world: a large number of objects, of which a small set (players
+// and the rooms they are in) is used most of the time
+#define WORLD_OBJECTS   50000
+#define HOT_OBJECTS     1000
+// proportion of accesses that go to the hot set, in percent
+#define HOT_PERCENT     95
+#define TRACE_LENGTH    1000000
+// a sweep across a large part of the world every so often, e.g. a periodic
+// scan of all rooms or a global broadcast
+#define SWEEP_EVERY     100000
+#define SWEEP_LENGTH    20000
+
+static uint64_t rng_state = 88172645463325252ull;
+
+// xorshift, we want the same traces on every run
+uint64_t bench_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+object_id* bench_make_trace(int with_sweeps) {
+    object_id *trace = malloc(sizeof(object_id) * TRACE_LENGTH);
+    int sweep_pos = 0;
+    for (int i = 0; i < TRACE_LENGTH; i++) {
+        if (with_sweeps && (i % SWEEP_EVERY == SWEEP_EVERY - SWEEP_LENGTH)) {
+            sweep_pos = HOT_OBJECTS + bench_rand() % (WORLD_OBJECTS - HOT_OBJECTS - SWEEP_LENGTH);
+        }
+        if (with_sweeps && (i % SWEEP_EVERY >= SWEEP_EVERY - SWEEP_LENGTH)) {
+            trace[i] = sweep_pos++;
+        }
+        else if (bench_rand() % 100 < HOT_PERCENT) {
+            trace[i] = bench_rand() % HOT_OBJECTS;
+        }
+        else {
+            trace[i] = bench_rand() % WORLD_OBJECTS;
+        }
+    }
+    return trace;
+}
+
+int bench_compare_ids(const void *a, const void *b) {
+    object_id ia = *(const object_id*)a;
+    object_id ib = *(const object_id*)b;
+    return (ia > ib) - (ia < ib);
+}
+
+// reads a trace as written by store_record_accesses(), and renumbers the ids
+// densely so that we can keep an object for each of them around. returns NULL
+// if the file cannot be read
+object_id* bench_load_trace(const char *filename, int *length, int *distinct) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        return NULL;
+    }
+    int alloced = 1024;
+    int len = 0;
+    object_id *trace = malloc(sizeof(object_id) * alloced);
+    unsigned long id;
+    while (fscanf(f, "%lu", &id) == 1) {
+        if (len == alloced) {
+            alloced *= 2;
+            trace = realloc(trace, sizeof(object_id) * alloced);
+        }
+        trace[len++] = id;
+    }
+    fclose(f);
+
+    object_id *sorted = malloc(sizeof(object_id) * (len + 1));
+    memcpy(sorted, trace, sizeof(object_id) * len);
+    qsort(sorted, len, sizeof(object_id), bench_compare_ids);
+    int unique = 0;
+    for (int i = 0; i < len; i++) {
+        if ((unique == 0) || (sorted[unique - 1] != sorted[i])) {
+            sorted[unique++] = sorted[i];
+        }
+    }
+    for (int i = 0; i < len; i++) {
+        object_id *pos = bsearch(&trace[i], sorted, unique, sizeof(object_id),
+            bench_compare_ids);
+        trace[i] = pos - sorted;
+    }
+    free(sorted);
+    *length = len;
+    *distinct = unique;
+    return trace;
+}
+
+// runs the trace against a cache and returns the proportion of hits
+double bench_cache_replay(object_id *trace, int length, int distinct,
+        int capacity, enum cache_policy policy) {
+    struct object **objects = malloc(sizeof(struct object*) * distinct);
+    for (int i = 0; i < distinct; i++) {
+        objects[i] = obj_new();
+        obj_set_id(objects[i], i);
+    }
+    // all objects are empty, so the budget is a multiple of their size
+    struct cache *c = cache_new(1024, capacity * obj_get_footprint(objects[0]), policy);
+    int hits = 0;
+    for (int i = 0; i < length; i++) {
+        struct lobject *lo = cache_get_object(c, trace[i]);
+        if (lo) {
+            hits++;
+        }
+        else {
+            lo = lobject_new();
+            obj_retain(objects[trace[i]]);
+            lobject_set_object(lo, objects[trace[i]]);
+            cache_put_object(c, lo);
+        }
+        cache_release_object(c, lo);
+    }
+    cache_free(c);
+    for (int i = 0; i < distinct; i++) {
+        obj_free(objects[i]);
+    }
+    free(objects);
+    return (double)hits / length;
+}
+
+void bench_cache_trace(const char *name, object_id *trace, int length, int distinct) {
+    int capacities[] = { 500, 1000, 2000, 5000 };
+    for (int i = 0; i < sizeof(capacities) / sizeof(capacities[0]); i++) {
+        if (capacities[i] >= distinct) {
+            break;
+        }
+        double lru = bench_cache_replay(trace, length, distinct, capacities[i],
+            CACHE_POLICY_LRU);
+        double arc = bench_cache_replay(trace, length, distinct, capacities[i],
+            CACHE_POLICY_ARC);
+        printf("%12s %8i %10.2f %10.2f\n", name, capacities[i], lru * 100, arc * 100);
+    }
+}
+
+/* hit rates of the eviction policies. on top of the synthetic traces, a trace
+ * recorded by running cmoo with CMOO_ACCESS_LOG=<file> is replayed if the
+ * same variable is set when running the benchmark */
+void run_cache_benchmarks(void) {
+    printf("# object cache hit rates in percent\n");
+    printf("%12s %8s %10s %10s\n", "trace", "capacity", "lru", "arc");
+
+    object_id *trace = bench_make_trace(0);
+    bench_cache_trace("hot", trace, TRACE_LENGTH, WORLD_OBJECTS);
+    free(trace);
+    trace = bench_make_trace(1);
+    bench_cache_trace("hot+sweep", trace, TRACE_LENGTH, WORLD_OBJECTS);
+    free(trace);
+
+    const char *filename = getenv("CMOO_ACCESS_LOG");
+    if (filename) {
+        int length, distinct;
+        trace = bench_load_trace(filename, &length, &distinct);
+        if (!trace) {
+            perror("could not read access log");
+            return;
+        }
+        bench_cache_trace("recorded", trace, length, distinct);
+        free(trace);
+    }
+}
@@ -0,0 +1,6 @@
+#ifndef BENCH_CACHE_H
+#define BENCH_CACHE_H
+
+void run_cache_benchmarks(void);
+
+#endif /* BENCH_CACHE_H */
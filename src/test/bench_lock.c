@@ -0,0 +1,290 @@
+#include "bench_lock.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+
+#define TESTABILITY_FEATURES
+#include "cmoo_bench.h"
+#include "store.h"
+#include "lock.h"
+
+#define MAX_THREADS     32
+// the pattern of test_deadlock_03: each round takes a few of the locks in
+// random order, a quarter of them exclusive and another quarter shared first
+// and then upgraded, and starts over after failing
+#define LOCKS_HELD      3
+// total number of rounds per measurement, split across all threads
+#define LOCK_ROUNDS     40000
+// lock/unlock pairs per measurement for uncontended locks, and how many locks
+// get held at once to see how much memory holding them takes
+#define UNCONTENDED_OPS 10000000
+#define HELD_LOCKS      1000
+// threads handing a single lock back and forth, and how many acquisitions
+// there are per measurement with no hold time. longer holds get fewer, to
+// keep the measurement short
+#define HANDOFF_THREADS 4
+#define HANDOFF_OPS     40000
+
+struct bench_lock_args {
+    struct lock **locks;
+    int lock_count;
+    struct store_tx *tx;
+    int rounds;
+    uint64_t seed;
+    int aborts;
+    pthread_barrier_t *start;
+};
+
+uint64_t bench_lock_rand(struct bench_lock_args *a) {
+    a->seed ^= a->seed << 13;
+    a->seed ^= a->seed >> 7;
+    a->seed ^= a->seed << 17;
+    return a->seed;
+}
+
+void* bench_lock_thread(void *arg) {
+    struct bench_lock_args *a = arg;
+    pthread_barrier_wait(a->start);
+    for (int round = 0; round < a->rounds; round++) {
+        int picked[LOCKS_HELD];
+        for (int i = 0; i < LOCKS_HELD; i++) {
+            bool again;
+            do {
+                picked[i] = bench_lock_rand(a) % a->lock_count;
+                again = false;
+                for (int j = 0; j < i; j++) {
+                    again |= picked[i] == picked[j];
+                }
+            } while (again);
+        }
+        bool done;
+        do {
+            done = true;
+            for (int i = 0; (i < LOCKS_HELD) && done; i++) {
+                struct lock *l = a->locks[picked[i]];
+                int r = bench_lock_rand(a) % 4;
+                int ret = lock_lock(l, r == 0 ? LOCK_EXCLUSIVE : LOCK_SHARED, a->tx);
+                if ((ret == LOCK_TAKEN) && (r == 1)) {
+                    ret = lock_lock(l, LOCK_EXCLUSIVE, a->tx);
+                }
+                done = ret == LOCK_TAKEN;
+            }
+            if (done) {
+                // a short critical section, which lets the others run into us
+                sched_yield();
+            }
+            for (int i = 0; i < LOCKS_HELD; i++) {
+                lock_unlock(a->locks[picked[i]], a->tx);
+            }
+            if (!done) {
+                a->aborts++;
+                sched_yield();
+            }
+        } while (!done);
+    }
+    return NULL;
+}
+
+struct bench_handoff_args {
+    struct lock *lock;
+    struct store_tx *tx;
+    int ops;
+    uint64_t hold_ns;
+    pthread_barrier_t *start;
+};
+
+void* bench_handoff_thread(void *arg) {
+    struct bench_handoff_args *a = arg;
+    pthread_barrier_wait(a->start);
+    for (int i = 0; i < a->ops; i++) {
+        lock_lock(a->lock, LOCK_EXCLUSIVE, a->tx);
+        if (a->hold_ns > 0) {
+            uint64_t until = bench_now_ns() + a->hold_ns;
+            while (bench_now_ns() < until) {
+            }
+        }
+        lock_unlock(a->lock, a->tx);
+    }
+    return NULL;
+}
+
+// acquisitions per second of one lock that all threads take exclusively,
+// holding it for hold_ns each time, with waiters spinning for up to
+// max_spin_ns before they go to sleep
+double bench_lock_handoff(int threads, uint64_t hold_ns, uint64_t max_spin_ns) {
+    struct locks_ctx *ctx = locks_new_ctx(MAX_THREADS);
+    locks_set_max_spin(ctx, max_spin_ns);
+    struct lock *l = lock_new(ctx);
+    int ops = HANDOFF_OPS / (1 + hold_ns / 1000) / threads;
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads);
+    pthread_t tids[MAX_THREADS];
+    struct bench_handoff_args args[MAX_THREADS];
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < threads; i++) {
+        args[i].lock = l;
+        args[i].tx = store_new_mock_tx(i, i);
+        args[i].ops = ops;
+        args[i].hold_ns = hold_ns;
+        args[i].start = &barrier;
+        pthread_create(&tids[i], NULL, bench_handoff_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        store_free_mock_tx(args[i].tx);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+    lock_free(l);
+    locks_free_ctx(ctx);
+    return ops * threads / (elapsed / 1e9);
+}
+
+// rounds per second with the given deadlock policy, and the number of aborts
+// per round through *aborts. a tx keeps its sid across retries
+double bench_lock_policy(int threads, int policy, int lock_count, double *aborts) {
+    struct locks_ctx *ctx = locks_new_ctx(MAX_THREADS);
+    locks_set_policy(ctx, policy);
+    struct lock **locks = malloc(sizeof(struct lock*) * lock_count);
+    for (int i = 0; i < lock_count; i++) {
+        locks[i] = lock_new(ctx);
+    }
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads);
+    pthread_t tids[MAX_THREADS];
+    struct bench_lock_args args[MAX_THREADS];
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < threads; i++) {
+        args[i].locks = locks;
+        args[i].lock_count = lock_count;
+        args[i].tx = store_new_mock_tx((i * 37) % MAX_THREADS, i);
+        args[i].rounds = LOCK_ROUNDS / threads;
+        args[i].seed = 88172645463325252ull + i;
+        args[i].aborts = 0;
+        args[i].start = &barrier;
+        pthread_create(&tids[i], NULL, bench_lock_thread, &args[i]);
+    }
+    int total_aborts = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        total_aborts += args[i].aborts;
+        store_free_mock_tx(args[i].tx);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+    for (int i = 0; i < lock_count; i++) {
+        lock_free(locks[i]);
+    }
+    free(locks);
+    locks_free_ctx(ctx);
+
+    int rounds = (LOCK_ROUNDS / threads) * threads;
+    *aborts = (double)total_aborts / rounds;
+    return rounds / (elapsed / 1e9);
+}
+
+// cost of lock_lock() and lock_unlock() on a lock nobody is waiting for, with
+// the given number of txes sharing it, or a single one locking it exclusively.
+// *heap_bytes is how much more heap is in use while holding a lock like that,
+// which should be nothing: taking such a lock must not allocate
+double bench_lock_uncontended(int holders, int mode, double *heap_bytes) {
+    struct locks_ctx *ctx = locks_new_ctx(MAX_THREADS);
+    struct store_tx *txes[MAX_THREADS];
+    for (int i = 0; i < holders; i++) {
+        txes[i] = store_new_mock_tx(i, i);
+    }
+    struct lock *locks[HELD_LOCKS];
+    for (int i = 0; i < HELD_LOCKS; i++) {
+        locks[i] = lock_new(ctx);
+    }
+
+    size_t before = mallinfo2().uordblks;
+    for (int i = 0; i < HELD_LOCKS; i++) {
+        for (int j = 0; j < holders; j++) {
+            lock_lock(locks[i], mode, txes[j]);
+        }
+    }
+    size_t held = mallinfo2().uordblks;
+    for (int i = 0; i < HELD_LOCKS; i++) {
+        for (int j = 0; j < holders; j++) {
+            lock_unlock(locks[i], txes[j]);
+        }
+    }
+    *heap_bytes = ((double)held - before) / HELD_LOCKS;
+
+    int rounds = UNCONTENDED_OPS / holders;
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < rounds; i++) {
+        for (int j = 0; j < holders; j++) {
+            lock_lock(locks[0], mode, txes[j]);
+        }
+        for (int j = 0; j < holders; j++) {
+            lock_unlock(locks[0], txes[j]);
+        }
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    for (int i = 0; i < HELD_LOCKS; i++) {
+        lock_free(locks[i]);
+    }
+    for (int i = 0; i < holders; i++) {
+        store_free_mock_tx(txes[i]);
+    }
+    locks_free_ctx(ctx);
+    return (double)elapsed / (rounds * holders);
+}
+
+void run_lock_benchmarks(void) {
+    printf("# uncontended locks, ns per lock/unlock and heap bytes per held lock\n");
+    printf("%8s %8s %12s %12s\n", "mode", "holders", "ns", "heap bytes");
+    double heap_bytes;
+    double ns = bench_lock_uncontended(1, LOCK_EXCLUSIVE, &heap_bytes);
+    printf("%8s %8i %12.1f %12.1f\n", "X", 1, ns, heap_bytes);
+    for (int holders = 1; holders <= 16; holders *= 2) {
+        ns = bench_lock_uncontended(holders, LOCK_SHARED, &heap_bytes);
+        printf("%8s %8i %12.1f %12.1f\n", "S", holders, ns, heap_bytes);
+    }
+    printf("\n");
+
+    uint64_t hold_ns[] = { 0, 1000, 10000, 100000 };
+    uint64_t spin_ns[] = { 0, 10000, 100000 };
+    printf("# %i threads on one lock, thousand acquisitions per second by max spin\n",
+        HANDOFF_THREADS);
+    printf("%8s", "hold us");
+    for (int s = 0; s < sizeof(spin_ns) / sizeof(spin_ns[0]); s++) {
+        printf(" %9.0fus", spin_ns[s] / 1e3);
+    }
+    printf("\n");
+    for (int h = 0; h < sizeof(hold_ns) / sizeof(hold_ns[0]); h++) {
+        printf("%8.0f", hold_ns[h] / 1e3);
+        for (int s = 0; s < sizeof(spin_ns) / sizeof(spin_ns[0]); s++) {
+            double ops = bench_lock_handoff(HANDOFF_THREADS, hold_ns[h], spin_ns[s]);
+            printf(" %11.1f", ops / 1e3);
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+    int lock_counts[] = { 8, 64 };
+    int policies[] = { LOCK_DETECT, LOCK_WAIT_DIE, LOCK_WOUND_WAIT };
+    for (int c = 0; c < sizeof(lock_counts) / sizeof(lock_counts[0]); c++) {
+        printf("# %i locks, thousand rounds per second (aborts per round)\n", lock_counts[c]);
+        printf("%8s %20s %20s %20s\n", "threads", "detect", "wait-die", "wound-wait");
+        for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+            printf("%8i", threads);
+            for (int p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+                double aborts;
+                double rounds = bench_lock_policy(threads, policies[p], lock_counts[c], &aborts);
+                printf(" %11.1f (%5.2f)", rounds / 1e3, aborts);
+            }
+            printf("\n");
+        }
+        if (c + 1 < sizeof(lock_counts) / sizeof(lock_counts[0])) {
+            printf("\n");
+        }
+    }
+}
@@ -0,0 +1,6 @@
+#ifndef BENCH_LOCK_H
+#define BENCH_LOCK_H
+
+void run_lock_benchmarks(void);
+
+#endif /* BENCH_LOCK_H */
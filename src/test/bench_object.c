@@ -0,0 +1,143 @@
+#include "bench_object.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "cmoo_bench.h"
+#include "eval.h"
+#include "object.h"
+#include "symbol.h"
+
+// total number of lookups per measurement
+#define LOOKUPS     10000000
+// total number of objects (de)serialized per measurement
+#define SERIALIZED  200000
+
+// prevents the compiler from optimizing the lookups away
+static volatile uint64_t sink;
+
+// lookup cost of methods and globals depending on the number of slots on the
+// object. all names that get looked up exist
+void bench_object_slots(int slots) {
+    struct object *o = obj_new();
+    symbol *names = malloc(sizeof(symbol) * slots);
+    char name[32];
+    opcode code[] = { OP_NOOP };
+    for (int i = 0; i < slots; i++) {
+        int len = snprintf(name, sizeof(name), "bench_slot_%i", i);
+        names[i] = sym_intern(name, len);
+        obj_set_code_sym(o, names[i], code, sizeof(code));
+        obj_set_global_sym(o, names[i], val_make_int(i));
+    }
+
+    opcode *cb;
+    uint64_t acc = 0;
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < LOOKUPS; i++) {
+        acc += obj_get_code_sym(o, names[i % slots], &cb);
+    }
+    uint64_t t_code = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    for (int i = 0; i < LOOKUPS; i++) {
+        acc += obj_get_global_sym(o, names[i % slots]);
+    }
+    uint64_t t_global = bench_now_ns() - start;
+
+    // misses have to look at the whole table if it is small
+    symbol missing = sym_intern("bench_slot_missing", 18);
+    start = bench_now_ns();
+    for (int i = 0; i < LOOKUPS; i++) {
+        acc += obj_get_code_sym(o, missing, &cb);
+    }
+    uint64_t t_miss = bench_now_ns() - start;
+    sink = acc;
+
+    printf("%8i %12.2f %12.2f %12.2f\n", slots,
+        (double)t_code / LOOKUPS, (double)t_global / LOOKUPS, (double)t_miss / LOOKUPS);
+
+    obj_free(o);
+    free(names);
+}
+
+// throughput of obj_*_to_buffer() and of reading the result back, copying out
+// of the buffer or referring to it in place as for objects from the image. the
+// objects have a few methods and globals of every type
+void bench_object_serialize(int slots) {
+    struct object *o = obj_new();
+    obj_set_id(o, 123456);
+    obj_add_parent(o, 1);
+    opcode code[64] = { 0 };
+    char name[32];
+    for (int i = 0; i < slots; i++) {
+        int len = snprintf(name, sizeof(name), "bench_slot_%i", i);
+        symbol sym = sym_intern(name, len);
+        obj_set_code_sym(o, sym, code, sizeof(code));
+        val v;
+        switch (i % 4) {
+            case 0: v = val_make_int(i * 1000); break;
+            case 1: v = val_make_float(i * 0.5f); break;
+            case 2: v = val_make_string(len, name); break;
+            default: v = val_make_symbol(sym); break;
+        }
+        obj_set_global_sym(o, sym, v);
+        if (i % 4 == 2) {
+            val_dec_ref(v);
+        }
+    }
+
+    char *code_buf = NULL;
+    int code_len = 0;
+    char *state_buf = NULL;
+    int state_len = 0;
+    // the buffers get reused, as they are when persisting
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < SERIALIZED; i++) {
+        obj_code_to_buffer(o, &code_buf, &code_len);
+        obj_state_to_buffer(o, &state_buf, &state_len);
+    }
+    uint64_t t_write = bench_now_ns() - start;
+
+    uint64_t t_read[2];
+    for (int mapped = 0; mapped < 2; mapped++) {
+        start = bench_now_ns();
+        for (int i = 0; i < SERIALIZED; i++) {
+            struct object *copy = obj_new();
+            bool ok = mapped
+                ? obj_code_from_mapping(copy, code_buf, code_len)
+                    && obj_state_from_mapping(copy, state_buf, state_len)
+                : obj_code_from_buffer(copy, code_buf, code_len)
+                    && obj_state_from_buffer(copy, state_buf, state_len);
+            sink += ok;
+            obj_free(copy);
+        }
+        t_read[mapped] = bench_now_ns() - start;
+    }
+
+    double mb = (double)(code_len + state_len) * SERIALIZED / (1024 * 1024);
+    printf("%8i %8i %10.0f %8.1f %10.0f %8.1f %10.0f %8.1f\n", slots, code_len + state_len,
+        SERIALIZED / (t_write / 1e9), mb / (t_write / 1e9),
+        SERIALIZED / (t_read[0] / 1e9), mb / (t_read[0] / 1e9),
+        SERIALIZED / (t_read[1] / 1e9), mb / (t_read[1] / 1e9));
+
+    free(code_buf);
+    free(state_buf);
+    obj_free(o);
+}
+
+void run_object_benchmarks(void) {
+    printf("# object slot lookups, ns per lookup\n");
+    printf("%8s %12s %12s %12s\n", "slots", "method", "global", "miss");
+    int sizes[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 1024 };
+    for (int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bench_object_slots(sizes[i]);
+    }
+
+    printf("# object serialization, objects/s and MB/s\n");
+    printf("%8s %8s %10s %8s %10s %8s %10s %8s\n", "slots", "bytes",
+        "write", "MB/s", "read", "MB/s", "mapped", "MB/s");
+    int slot_counts[] = { 4, 16, 64 };
+    for (int i = 0; i < sizeof(slot_counts) / sizeof(slot_counts[0]); i++) {
+        bench_object_serialize(slot_counts[i]);
+    }
+}
@@ -0,0 +1,6 @@
+#ifndef BENCH_OBJECT_H
+#define BENCH_OBJECT_H
+
+void run_object_benchmarks(void);
+
+#endif /* BENCH_OBJECT_H */
@@ -0,0 +1,177 @@
+#include "bench_persist.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "cmoo_bench.h"
+#include "eval.h"
+#include "image.h"
+#include "persist.h"
+
+#define MAX_THREADS     32
+// total number of durable commits per measurement, split across all threads
+#define COMMITS         10000
+// objects per thread, each commit writes one of them
+#define THREAD_OBJECTS  16
+
+struct bench_persist_args {
+    struct persist *persist;
+    int thread;
+    int commits;
+};
+
+// commits one object at a time and waits for each commit to be durable, like
+// store_finish_tx() does
+void* bench_persist_thread(void *arg) {
+    struct bench_persist_args *a = arg;
+    struct object *o = obj_new();
+    for (int i = 0; i < a->commits; i++) {
+        obj_set_id(o, 1000 + a->thread * THREAD_OBJECTS + i % THREAD_OBJECTS);
+        obj_set_global(o, "count", val_make_int(i));
+        persist_sync(a->persist, persist_commit(a->persist, &o, 1));
+    }
+    obj_free(o);
+    return NULL;
+}
+
+// durable commits per second, and the number of syncs per commit through
+// *syncs
+double bench_persist_commits(int threads, int group_size, int latency_us, double *syncs) {
+    struct persist *p = persist_new();
+    persist_set_group_commit(p, group_size, latency_us);
+    struct persist_stats before;
+    persist_get_stats(p, &before);
+
+    pthread_t tids[MAX_THREADS];
+    struct bench_persist_args args[MAX_THREADS];
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < threads; i++) {
+        args[i].persist = p;
+        args[i].thread = i;
+        args[i].commits = COMMITS / threads;
+        pthread_create(&tids[i], NULL, bench_persist_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    struct persist_stats after;
+    persist_get_stats(p, &after);
+    persist_free(p);
+    int commits = (COMMITS / threads) * threads;
+    *syncs = (double)(after.syncs - before.syncs) / commits;
+    return (double)commits / elapsed * 1e9;
+}
+
+// objects are committed to the log this many at a time
+#define STARTUP_BATCH   1000
+
+static void bench_persist_rmdir(char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] != '.') {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+// milliseconds to open a store of count objects that are in the log, and
+// when they are in an image. *get_us is the time it then takes to get an
+// object from the image for the first time
+void bench_persist_startup(int count, double *log_ms, double *image_ms, double *get_us) {
+    char dir[] = "/tmp/cmoo-bench-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        exit(1);
+    }
+    char image[512];
+    snprintf(image, sizeof(image), "%s.img", dir);
+    struct object **objs = malloc(sizeof(struct object*) * count);
+    opcode cb[] = { OP_NOOP, OP_DEBUGI, 0x12, 0x34, 0x56, 0x78, OP_HALT };
+    for (int i = 0; i < count; i++) {
+        objs[i] = obj_new();
+        obj_set_id(objs[i], i);
+        obj_add_parent(objs[i], 1);
+        obj_set_code(objs[i], "run", cb, sizeof(cb));
+        obj_set_global(objs[i], "count", val_make_int(i));
+        obj_set_global(objs[i], "name", val_make_string(9, "an object"));
+    }
+    image_write(image, objs, count);
+    struct persist *p = persist_open(dir, NULL, 0);
+    for (int i = 0; i < count; i += STARTUP_BATCH) {
+        int n = count - i < STARTUP_BATCH ? count - i : STARTUP_BATCH;
+        persist_sync(p, persist_commit(p, objs + i, n));
+    }
+    persist_free(p);
+    for (int i = 0; i < count; i++) {
+        obj_free(objs[i]);
+    }
+    free(objs);
+
+    uint64_t start = bench_now_ns();
+    p = persist_open(dir, NULL, 0);
+    *log_ms = (bench_now_ns() - start) / 1e6;
+    persist_free(p);
+    bench_persist_rmdir(dir);
+
+    // an empty log, so everything comes from the image
+    if (!mkdtemp(strcpy(dir, "/tmp/cmoo-bench-XXXXXX"))) {
+        perror(dir);
+        exit(1);
+    }
+    start = bench_now_ns();
+    p = persist_open(dir, image, 0);
+    *image_ms = (bench_now_ns() - start) / 1e6;
+    start = bench_now_ns();
+    struct object *o = persist_get(p, count / 2);
+    *get_us = (bench_now_ns() - start) / 1e3;
+    obj_free(o);
+    persist_free(p);
+    bench_persist_rmdir(dir);
+    unlink(image);
+}
+
+void run_persist_benchmarks(void) {
+    // group size and maximum latency in microseconds
+    int groups[][2] = { { 1, 0 }, { 4, 100 }, { 16, 500 } };
+    int group_count = sizeof(groups) / sizeof(groups[0]);
+    int threads[] = { 1, 4, 16 };
+    int thread_count = sizeof(threads) / sizeof(threads[0]);
+
+    printf("# durable commits, thousand per second (syncs per commit)\n");
+    printf("%8s", "threads");
+    for (int i = 0; i < group_count; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "group=%d/%dus", groups[i][0], groups[i][1]);
+        printf("%20s", label);
+    }
+    printf("\n");
+    for (int t = 0; t < thread_count; t++) {
+        printf("%8d", threads[t]);
+        for (int i = 0; i < group_count; i++) {
+            double syncs;
+            double rate = bench_persist_commits(threads[t], groups[i][0], groups[i][1], &syncs);
+            printf("%13.1f (%4.2f)", rate / 1000, syncs);
+        }
+        printf("\n");
+    }
+
+    printf("\n# startup with objects in the log and in an image\n");
+    printf("%8s%16s%16s%16s\n", "objects", "log (ms)", "image (ms)", "first get (us)");
+    int counts[] = { 10000, 100000, 300000 };
+    for (int i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+        double log_ms, image_ms, get_us;
+        bench_persist_startup(counts[i], &log_ms, &image_ms, &get_us);
+        printf("%8d%16.1f%16.2f%16.1f\n", counts[i], log_ms, image_ms, get_us);
+    }
+}
@@ -0,0 +1,6 @@
+#ifndef BENCH_PERSIST_H
+#define BENCH_PERSIST_H
+
+void run_persist_benchmarks(void);
+
+#endif /* BENCH_PERSIST_H */
@@ -0,0 +1,309 @@
+#include "bench_store.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cmoo_bench.h"
+#include "store.h"
+#include "lobject.h"
+#include "symbol.h"
+
+#define MAX_THREADS     32
+// objects in the store, all get accessed with shared locks so there is no
+// lock contention, only latch contention
+#define STORE_OBJECTS   10000
+// total number of store_get_object() calls per measurement, split across all
+// threads
+#define STORE_GETS      2000000
+// objects accessed per transaction
+#define GETS_PER_TX     4
+// for the contention benchmark: a small set of hot objects that transactions
+// read a few of, and occasionally write one. and a larger set that makes
+// conflicts between transactions rare
+#define HOT_OBJECTS     64
+#define SPREAD_OBJECTS  8192
+#define READS_PER_TX    8
+#define CONTENTION_TXES 200000
+// checkpoints taken while the contention benchmark runs against a world of
+// this many objects on top of the hot ones
+#define CHECKPOINTS     5
+
+struct bench_store_args {
+    struct store *store;
+    object_id first;
+    int txes;
+    uint64_t seed;
+};
+
+void* bench_store_thread(void *arg) {
+    struct bench_store_args *a = arg;
+    uint64_t x = a->seed;
+    for (int i = 0; i < a->txes; i++) {
+        struct store_tx *tx = store_start_tx(a->store, store_new_sid(a->store));
+        for (int j = 0; j < GETS_PER_TX; j++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            struct lobject *lo = store_get_object(tx, a->first + x % STORE_OBJECTS);
+            if (!lo) {
+                fprintf(stderr, "store_get_object failed in benchmark\n");
+                exit(1);
+            }
+        }
+        store_finish_tx(tx);
+    }
+    return NULL;
+}
+
+// throughput of concurrent read-only transactions with a given number of
+// threads and cache shards, in store_get_object() calls per second
+double bench_store_throughput(int threads, int shards) {
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, MAX_THREADS, shards, STORE_LOCKING);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    object_id first = obj_get_id(lobject_get_object(store_make_object(tx, 0)));
+    for (int i = 1; i < STORE_OBJECTS; i++) {
+        store_make_object(tx, 0);
+    }
+    store_finish_tx(tx);
+
+    pthread_t tids[MAX_THREADS];
+    struct bench_store_args args[MAX_THREADS];
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < threads; i++) {
+        args[i].store = s;
+        args[i].first = first;
+        args[i].txes = STORE_GETS / GETS_PER_TX / threads;
+        args[i].seed = 88172645463325252ull + i;
+        pthread_create(&tids[i], NULL, bench_store_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    store_free(s);
+    persist_free(p);
+    int gets = (STORE_GETS / GETS_PER_TX / threads) * GETS_PER_TX * threads;
+    return (double)gets / elapsed * 1e9;
+}
+
+struct bench_contention_args {
+    struct store *store;
+    object_id first;
+    int objects;
+    int txes;
+    int write_percent;
+    uint64_t seed;
+    int aborts;
+};
+
+uint64_t bench_xorshift(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+// each tx reads some hot objects, and a share of them then increments a
+// counter on the last one they read. failed txes get retried until they
+// commit, like tasks_thread_func() does
+void* bench_contention_thread(void *arg) {
+    struct bench_contention_args *a = arg;
+    uint64_t x = a->seed;
+    symbol count = sym_intern("count", 5);
+    for (int i = 0; i < a->txes; i++) {
+        bool write = (int)(bench_xorshift(&x) % 100) < a->write_percent;
+        uint64_t sid = store_new_sid(a->store);
+        while (true) {
+            struct store_tx *tx = store_start_tx(a->store, sid);
+            struct lobject *lo = NULL;
+            int64_t sum = 0;
+            for (int j = 0; j < READS_PER_TX; j++) {
+                lo = store_get_object(tx, a->first + bench_xorshift(&x) % a->objects);
+                if (!lo) {
+                    break;
+                }
+                val v = obj_get_global_sym(store_get_version(tx, lo), count);
+                sum += val_get_int(v);
+            }
+            struct object *wo = NULL;
+            if (lo && write) {
+                wo = store_write_object(tx, lo);
+                if (wo) {
+                    val v = obj_get_global_sym(wo, count);
+                    obj_set_global_sym(wo, count, val_make_int(val_get_int(v) + 1));
+                }
+            }
+            if (lo && (wo || !write)) {
+                if (store_finish_tx(tx)) {
+                    break;
+                }
+            }
+            else {
+                store_abort_tx(tx);
+            }
+            a->aborts++;
+        }
+    }
+    return NULL;
+}
+
+// committed transactions per second with all transactions working on the same
+// set of objects, and the number of aborts per committed transaction through
+// *aborts
+double bench_store_contention(int threads, enum store_mode mode, int objects,
+        int write_percent, double *aborts) {
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, MAX_THREADS, 16, mode);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    object_id first = 0;
+    for (int i = 0; i < objects; i++) {
+        struct lobject *lo = store_make_object(tx, 0);
+        struct object *o = store_write_object(tx, lo);
+        obj_set_global(o, "count", val_make_int(0));
+        if (i == 0) {
+            first = obj_get_id(o);
+        }
+    }
+    store_finish_tx(tx);
+
+    pthread_t tids[MAX_THREADS];
+    struct bench_contention_args args[MAX_THREADS];
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < threads; i++) {
+        args[i].store = s;
+        args[i].first = first;
+        args[i].objects = objects;
+        args[i].txes = CONTENTION_TXES / threads;
+        args[i].write_percent = write_percent;
+        args[i].seed = 88172645463325252ull + i;
+        args[i].aborts = 0;
+        pthread_create(&tids[i], NULL, bench_contention_thread, &args[i]);
+    }
+    int total_aborts = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        total_aborts += args[i].aborts;
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    store_free(s);
+    persist_free(p);
+    int txes = (CONTENTION_TXES / threads) * threads;
+    *aborts = (double)total_aborts / txes;
+    return (double)txes / elapsed * 1e9;
+}
+
+// checkpoints of a world of objects while transactions keep committing. the
+// pause and the duration per checkpoint are averaged, and the longest pause
+// is returned through *max_pause_ms
+void bench_store_checkpoint(int objects, double *pause_ms, double *max_pause_ms,
+        double *duration_ms) {
+    char path[] = "/tmp/cmoo-bench-checkpoint-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, MAX_THREADS, 16, STORE_LOCKING);
+    object_id first = 0;
+    // in batches, so that the world gets committed in reasonably sized txes
+    for (int i = 0; i < objects + HOT_OBJECTS; i += 1000) {
+        struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+        for (int j = i; (j < i + 1000) && (j < objects + HOT_OBJECTS); j++) {
+            struct object *o = store_write_object(tx, store_make_object(tx, 0));
+            obj_set_global(o, "count", val_make_int(0));
+            obj_set_global(o, "name", val_make_string(9, "an object"));
+            if (j == 0) {
+                first = obj_get_id(o);
+            }
+        }
+        store_finish_tx(tx);
+    }
+
+    int threads = 4;
+    pthread_t tids[MAX_THREADS];
+    struct bench_contention_args args[MAX_THREADS];
+    for (int i = 0; i < threads; i++) {
+        args[i].store = s;
+        args[i].first = first;
+        args[i].objects = HOT_OBJECTS;
+        args[i].txes = CONTENTION_TXES / threads;
+        args[i].write_percent = 25;
+        args[i].seed = 88172645463325252ull + i;
+        args[i].aborts = 0;
+        pthread_create(&tids[i], NULL, bench_contention_thread, &args[i]);
+    }
+    *pause_ms = 0;
+    *max_pause_ms = 0;
+    *duration_ms = 0;
+    for (int i = 0; i < CHECKPOINTS; i++) {
+        store_checkpoint(s, path);
+        store_checkpoint_wait(s);
+        struct store_checkpoint_stats stats;
+        store_get_checkpoint_stats(s, &stats);
+        *pause_ms += stats.last_pause_ns / 1e6 / CHECKPOINTS;
+        *duration_ms += stats.last_duration_ns / 1e6 / CHECKPOINTS;
+        *max_pause_ms = stats.max_pause_ns / 1e6;
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    store_free(s);
+    persist_free(p);
+    unlink(path);
+}
+
+void run_store_benchmarks(void) {
+    printf("# store_get_object() throughput, million calls per second\n");
+    int shards[] = { 1, 4, 16, 64 };
+    int shard_count = sizeof(shards) / sizeof(shards[0]);
+    printf("%8s", "threads");
+    for (int i = 0; i < shard_count; i++) {
+        printf("    shards=%-3i", shards[i]);
+    }
+    printf("\n");
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        printf("%8i", threads);
+        for (int i = 0; i < shard_count; i++) {
+            printf(" %13.2f", bench_store_throughput(threads, shards[i]) / 1e6);
+        }
+        printf("\n");
+    }
+
+    int object_counts[] = { HOT_OBJECTS, SPREAD_OBJECTS };
+    enum store_mode modes[] = { STORE_LOCKING, STORE_MVCC, STORE_OCC };
+    int write_percents[] = { 0, 5, 25, 100 };
+    for (int o = 0; o < sizeof(object_counts) / sizeof(object_counts[0]); o++) {
+        printf("\n# transactions on %i objects, thousand commits per second (aborts per commit)\n",
+            object_counts[o]);
+        printf("%8s %8s %20s %20s %20s\n", "writes%", "threads", "locking", "mvcc", "occ");
+        for (int w = 0; w < sizeof(write_percents) / sizeof(write_percents[0]); w++) {
+            for (int threads = 1; threads <= MAX_THREADS; threads *= 4) {
+                printf("%8i %8i", write_percents[w], threads);
+                for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+                    double aborts;
+                    double commits = bench_store_contention(threads, modes[m],
+                        object_counts[o], write_percents[w], &aborts);
+                    printf(" %11.1f (%5.2f)", commits / 1e3, aborts);
+                }
+                printf("\n");
+            }
+        }
+    }
+
+    printf("\n# checkpoints while 4 threads commit, milliseconds\n");
+    printf("%8s %12s %12s %12s\n", "objects", "pause", "max pause", "duration");
+    int world_sizes[] = { 10000, 100000, 500000 };
+    for (int i = 0; i < sizeof(world_sizes) / sizeof(world_sizes[0]); i++) {
+        double pause, max_pause, duration;
+        bench_store_checkpoint(world_sizes[i], &pause, &max_pause, &duration);
+        printf("%8i %12.2f %12.2f %12.1f\n", world_sizes[i], pause, max_pause, duration);
+    }
+}
@@ -0,0 +1,6 @@
+#ifndef BENCH_STORE_H
+#define BENCH_STORE_H
+
+void run_store_benchmarks(void);
+
+#endif /* BENCH_STORE_H */
@@ -2,13 +2,23 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <string.h>
 
 #include "cache.h"
+#include "persist.h"
+#include "store.h"
+
+#define STORE_OBJECTS   1000000
+#define STORE_BATCH     10000
+#define CONC_THREADS    8
+#define CONC_OBJECTS    500
+#define CONC_LOOKUPS    100000
 
 START_TEST(test_cache_01) {
     printf("  test_cache_01...\n");
 
-    struct cache *c = cache_new(10);
+    struct cache *c = cache_new(10, 0, CACHE_POLICY_LRU);
 
     struct lobject *lo1 = cache_get_object(c, 123);
     ck_assert_msg(lo1 == NULL, "failed to return NULL for absent item");
@@ -55,11 +65,386 @@ START_TEST(test_cache_01) {
 }
 END_TEST
 
+// grows a small cache many times over, checking that all entries can be
+// found at every point, including in the middle of a resize
+START_TEST(test_cache_02) {
+    printf("  test_cache_02...\n");
+
+    struct cache *c = cache_new(10, 0, CACHE_POLICY_LRU);
+    int count = 100000;
+    struct lobject **los = malloc(sizeof(struct lobject*) * count);
+    for (int i = 0; i < count; i++) {
+        los[i] = lobject_new();
+        struct object *o = obj_new();
+        obj_set_id(o, i * 7);
+        lobject_set_object(los[i], o);
+        cache_put_object(c, los[i]);
+        cache_release_object(c, los[i]);
+        // objects from early on, and the one just inserted
+        struct lobject *lo = cache_get_object(c, (i / 2) * 7);
+        ck_assert(lo == los[i / 2]);
+        cache_release_object(c, lo);
+        lo = cache_get_object(c, i * 7);
+        ck_assert(lo == los[i]);
+        cache_release_object(c, lo);
+        ck_assert(cache_get_object(c, i * 7 + 1) == NULL);
+    }
+    for (int i = 0; i < count; i++) {
+        struct lobject *lo = cache_get_object(c, i * 7);
+        ck_assert_msg(lo == los[i], "failed to fetch object after growing");
+        cache_release_object(c, lo);
+    }
+
+    cache_free(c);
+    for (int i = 0; i < count; i++) {
+        lobject_free(los[i]);
+    }
+    free(los);
+}
+END_TEST
+
+// loads a large number of objects through the store, in batches so that the
+// number of locks held at any time stays reasonable. this is way more than
+// fits the budget, so they get evicted and loaded again
+START_TEST(test_cache_03_store) {
+    printf("  test_cache_03_store...\n");
+
+    enum store_mode modes[] = { STORE_LOCKING, STORE_MVCC };
+    for (int m = 0; m < 2; m++) {
+        struct persist *p = persist_new();
+        struct store *s = store_new(p, 1, 4, modes[m]);
+        object_id first = 0;
+        for (int i = 0; i < STORE_OBJECTS; i += STORE_BATCH) {
+            struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+            for (int j = 0; j < STORE_BATCH; j++) {
+                struct lobject *lo = store_make_object(tx, 0);
+                if (i + j == 0) {
+                    first = obj_get_id(lobject_get_object(lo));
+                }
+            }
+            store_finish_tx(tx);
+        }
+        for (int i = 0; i < STORE_OBJECTS; i += STORE_BATCH) {
+            struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+            for (int j = 0; j < STORE_BATCH; j++) {
+                struct lobject *lo = store_get_object(tx, first + i + j);
+                ck_assert(lo != NULL);
+                ck_assert(obj_get_id(lobject_get_object(lo)) == first + i + j);
+            }
+            store_finish_tx(tx);
+        }
+        struct cache_stats stats;
+        store_get_cache_stats(s, &stats);
+        ck_assert(stats.evictions > 0);
+
+        store_free(s);
+        persist_free(p);
+    }
+}
+END_TEST
+
+// uses a small hot set repeatedly, then sweeps across many objects that are
+// only used once. returns how many of the hot set survived the sweep
+int cache_sweep_survivors(enum cache_policy policy) {
+    int hot = 50;
+    int sweep = 1000;
+    struct object **objs = malloc(sizeof(struct object*) * (hot + sweep));
+    for (int i = 0; i < hot + sweep; i++) {
+        objs[i] = obj_new();
+        obj_set_id(objs[i], i);
+    }
+    // all objects are empty and have the same size
+    struct cache *c = cache_new(10, 100 * obj_get_footprint(objs[0]), policy);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < hot; i++) {
+            struct lobject *lo = cache_get_object(c, i);
+            if (!lo) {
+                lo = lobject_new();
+                obj_retain(objs[i]);
+                lobject_set_object(lo, objs[i]);
+                cache_put_object(c, lo);
+            }
+            cache_release_object(c, lo);
+        }
+    }
+    for (int i = hot; i < hot + sweep; i++) {
+        ck_assert(cache_get_object(c, i) == NULL);
+        struct lobject *lo = lobject_new();
+        obj_retain(objs[i]);
+        lobject_set_object(lo, objs[i]);
+        cache_put_object(c, lo);
+        cache_release_object(c, lo);
+        ck_assert(cache_get_entries(c) <= 100);
+    }
+    int survivors = 0;
+    for (int i = 0; i < hot; i++) {
+        struct lobject *lo = cache_get_object(c, i);
+        if (lo) {
+            survivors++;
+            cache_release_object(c, lo);
+        }
+    }
+    cache_free(c);
+    for (int i = 0; i < hot + sweep; i++) {
+        obj_free(objs[i]);
+    }
+    free(objs);
+    return survivors;
+}
+
+// a sweep flushes everything out of an LRU cache, but not out of an ARC one
+START_TEST(test_cache_04_policies) {
+    printf("  test_cache_04_policies...\n");
+
+    ck_assert(cache_sweep_survivors(CACHE_POLICY_LRU) == 0);
+    ck_assert(cache_sweep_survivors(CACHE_POLICY_ARC) == 50);
+}
+END_TEST
+
+// pinned objects stay in the cache even if it is over capacity
+START_TEST(test_cache_05_pinned) {
+    printf("  test_cache_05_pinned...\n");
+
+    enum cache_policy policies[] = { CACHE_POLICY_LRU, CACHE_POLICY_ARC };
+    for (int p = 0; p < 2; p++) {
+        struct lobject *los[8];
+        struct cache *c = NULL;
+        for (int i = 0; i < 8; i++) {
+            los[i] = lobject_new();
+            struct object *o = obj_new();
+            obj_set_id(o, i);
+            lobject_set_object(los[i], o);
+            if (!c) {
+                c = cache_new(10, 4 * obj_get_footprint(o), policies[p]);
+            }
+            cache_put_object(c, los[i]);
+        }
+        ck_assert(cache_get_entries(c) == 8);
+        for (int i = 0; i < 8; i++) {
+            ck_assert(cache_get_object(c, i) == los[i]);
+            cache_release_object(c, los[i]);
+        }
+        // releasing the last pin makes an object evictable, and as the cache
+        // is over capacity it gets evicted right away
+        for (int i = 0; i < 8; i++) {
+            cache_release_object(c, los[i]);
+        }
+        ck_assert(cache_get_entries(c) == 4);
+        for (int i = 0; i < 4; i++) {
+            ck_assert(cache_get_object(c, i) == NULL);
+        }
+        for (int i = 4; i < 8; i++) {
+            struct lobject *lo = cache_get_object(c, i);
+            ck_assert(lo == los[i]);
+            cache_release_object(c, lo);
+        }
+        cache_free(c);
+        for (int i = 4; i < 8; i++) {
+            lobject_free(los[i]);
+        }
+    }
+}
+END_TEST
+
+struct test_cache_06_args {
+    struct cache *c;
+    pthread_mutex_t *latch;
+    struct object **objs;
+    int seed;
+};
+
+// uses the cache the same way the store does: lookups without the latch, and
+// everything else with it
+void* test_cache_06_thread(void *arg) {
+    struct test_cache_06_args *a = arg;
+    unsigned int x = a->seed;
+    for (int i = 0; i < CONC_LOOKUPS; i++) {
+        x = x * 1103515245 + 12345;
+        object_id id = (x >> 8) % CONC_OBJECTS;
+        struct lobject *lo = cache_get_object(a->c, id);
+        if (!lo) {
+            pthread_mutex_lock(a->latch);
+            lo = cache_get_object(a->c, id);
+            if (!lo) {
+                lo = lobject_new();
+                obj_retain(a->objs[id]);
+                lobject_set_object(lo, a->objs[id]);
+                cache_put_object(a->c, lo);
+            }
+            pthread_mutex_unlock(a->latch);
+        }
+        ck_assert(lobject_get_object(lo) == a->objs[id]);
+        pthread_mutex_lock(a->latch);
+        cache_release_object(a->c, lo);
+        pthread_mutex_unlock(a->latch);
+    }
+    return NULL;
+}
+
+// lock-free lookups racing with insertions, evictions and growing the table
+START_TEST(test_cache_06_concurrent) {
+    printf("  test_cache_06_concurrent...\n");
+
+    enum cache_policy policies[] = { CACHE_POLICY_LRU, CACHE_POLICY_ARC };
+    for (int p = 0; p < 2; p++) {
+        pthread_mutex_t latch;
+        pthread_mutex_init(&latch, NULL);
+        struct object **objs = malloc(sizeof(struct object*) * CONC_OBJECTS);
+        for (int i = 0; i < CONC_OBJECTS; i++) {
+            objs[i] = obj_new();
+            obj_set_id(objs[i], i);
+        }
+        struct cache *c = cache_new(4, 100 * obj_get_footprint(objs[0]), policies[p]);
+        pthread_t threads[CONC_THREADS];
+        struct test_cache_06_args args[CONC_THREADS];
+        for (int i = 0; i < CONC_THREADS; i++) {
+            args[i].c = c;
+            args[i].latch = &latch;
+            args[i].objs = objs;
+            args[i].seed = i;
+            pthread_create(&threads[i], NULL, test_cache_06_thread, &args[i]);
+        }
+        for (int i = 0; i < CONC_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        ck_assert(cache_get_entries(c) <= 100);
+
+        cache_free(c);
+        for (int i = 0; i < CONC_OBJECTS; i++) {
+            obj_free(objs[i]);
+        }
+        free(objs);
+        pthread_mutex_destroy(&latch);
+    }
+}
+END_TEST
+
+// the cache evicts by size rather than by number of objects, and picks up
+// objects growing while they are pinned
+START_TEST(test_cache_07_budget) {
+    printf("  test_cache_07_budget...\n");
+
+    struct object *objs[20];
+    struct lobject *los[20];
+    for (int i = 0; i < 20; i++) {
+        objs[i] = obj_new();
+        obj_set_id(objs[i], i);
+    }
+    size_t empty = obj_get_footprint(objs[0]);
+    struct cache *c = cache_new(10, 10 * empty, CACHE_POLICY_LRU);
+    for (int i = 0; i < 10; i++) {
+        los[i] = lobject_new();
+        obj_retain(objs[i]);
+        lobject_set_object(los[i], objs[i]);
+        cache_put_object(c, los[i]);
+        cache_release_object(c, los[i]);
+    }
+    struct cache_stats stats;
+    cache_get_stats(c, &stats);
+    ck_assert(stats.objects == 10);
+    ck_assert(stats.resident_bytes == 10 * empty);
+    ck_assert(stats.pinned_bytes == 0);
+    ck_assert(stats.evictions == 0);
+
+    // grow one object while it is pinned, this pushes out the oldest ones
+    // once it gets released
+    struct lobject *lo = cache_get_object(c, 9);
+    char big[1000];
+    memset(big, 'x', sizeof(big));
+    obj_set_global(objs[9], "big", val_make_string(sizeof(big), big));
+    cache_get_stats(c, &stats);
+    ck_assert(stats.pinned_objects == 1);
+    ck_assert(stats.pinned_bytes == empty);
+    cache_release_object(c, lo);
+    size_t big_size = obj_get_footprint(objs[9]);
+    ck_assert(big_size > empty + sizeof(big));
+    cache_get_stats(c, &stats);
+    ck_assert(stats.resident_bytes <= 10 * empty);
+    ck_assert(stats.evictions > 0);
+    ck_assert(stats.evicted_bytes == stats.evictions * empty);
+    ck_assert(stats.objects == 10 - stats.evictions);
+    ck_assert(cache_get_object(c, 0) == NULL);
+    lo = cache_get_object(c, 9);
+    ck_assert(lo == los[9]);
+    cache_release_object(c, lo);
+
+    cache_free(c);
+    for (int i = 0; i < 20; i++) {
+        obj_free(objs[i]);
+    }
+}
+END_TEST
+
+bool test_cache_08_check(struct lobject *lo, void *arg) {
+    bool *evictable = arg;
+    return evictable[obj_get_id(lobject_get_object(lo))];
+}
+
+// objects the check refuses stay in the cache, even if that keeps it over
+// its budget
+START_TEST(test_cache_08_evict_check) {
+    printf("  test_cache_08_evict_check...\n");
+
+    bool evictable[10];
+    struct lobject *los[8];
+    struct cache *c = NULL;
+    for (int i = 0; i < 8; i++) {
+        evictable[i] = (i % 2) == 1;
+        los[i] = lobject_new();
+        struct object *o = obj_new();
+        obj_set_id(o, i);
+        lobject_set_object(los[i], o);
+        if (!c) {
+            c = cache_new(10, 4 * obj_get_footprint(o), CACHE_POLICY_LRU);
+            cache_set_evict_check(c, test_cache_08_check, evictable);
+        }
+        cache_put_object(c, los[i]);
+    }
+    for (int i = 0; i < 8; i++) {
+        cache_release_object(c, los[i]);
+    }
+    ck_assert(cache_get_entries(c) == 4);
+    for (int i = 0; i < 8; i++) {
+        struct lobject *lo = cache_get_object(c, i);
+        ck_assert((lo == NULL) == evictable[i]);
+        if (lo) {
+            cache_release_object(c, lo);
+        }
+    }
+
+    // nothing left that can go
+    for (int i = 8; i < 10; i++) {
+        evictable[i] = false;
+        struct lobject *lo = lobject_new();
+        struct object *o = obj_new();
+        obj_set_id(o, i);
+        lobject_set_object(lo, o);
+        cache_put_object(c, lo);
+        cache_release_object(c, lo);
+    }
+    ck_assert(cache_get_entries(c) == 6);
+    cache_set_evict_check(c, NULL, NULL);
+    struct lobject *lo = cache_get_object(c, 0);
+    cache_release_object(c, lo);
+    ck_assert(cache_get_entries(c) == 4);
+
+    cache_free(c);
+}
+END_TEST
+
 TCase* make_cache_checks(void) {
     TCase *tc_cache;
 
     tc_cache = tcase_create("Cache");
+    tcase_set_timeout(tc_cache, 60);
     tcase_add_test(tc_cache, test_cache_01);
+    tcase_add_test(tc_cache, test_cache_02);
+    tcase_add_test(tc_cache, test_cache_03_store);
+    tcase_add_test(tc_cache, test_cache_04_policies);
+    tcase_add_test(tc_cache, test_cache_05_pinned);
+    tcase_add_test(tc_cache, test_cache_06_concurrent);
+    tcase_add_test(tc_cache, test_cache_07_budget);
+    tcase_add_test(tc_cache, test_cache_08_evict_check);
 
     return tc_cache;
 }
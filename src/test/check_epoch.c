@@ -0,0 +1,106 @@
+#include "check_epoch.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "epoch.h"
+
+static atomic_int freed = 0;
+
+void test_epoch_free(void *p) {
+    atomic_fetch_add(&freed, 1);
+    free(p);
+}
+
+struct test_epoch_reader {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int state; // 0: starting, 1: in read section, 2: asked to leave
+};
+
+void* test_epoch_01_thread(void *arg) {
+    struct test_epoch_reader *r = arg;
+    epoch_enter();
+    pthread_mutex_lock(&r->mutex);
+    r->state = 1;
+    pthread_cond_broadcast(&r->cond);
+    while (r->state != 2) {
+        pthread_cond_wait(&r->cond, &r->mutex);
+    }
+    pthread_mutex_unlock(&r->mutex);
+    epoch_exit();
+    return NULL;
+}
+
+// memory retired while another thread is in a read section must survive until
+// that thread has left it
+START_TEST(test_epoch_01) {
+    printf("  test_epoch_01...\n");
+
+    struct test_epoch_reader r;
+    pthread_mutex_init(&r.mutex, NULL);
+    pthread_cond_init(&r.cond, NULL);
+    r.state = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, test_epoch_01_thread, &r);
+    pthread_mutex_lock(&r.mutex);
+    while (r.state != 1) {
+        pthread_cond_wait(&r.cond, &r.mutex);
+    }
+    pthread_mutex_unlock(&r.mutex);
+
+    atomic_store(&freed, 0);
+    epoch_retire(malloc(16), test_epoch_free);
+    for (int i = 0; i < 10; i++) {
+        epoch_reclaim();
+    }
+    ck_assert_msg(atomic_load(&freed) == 0, "freed while a reader could see it");
+
+    pthread_mutex_lock(&r.mutex);
+    r.state = 2;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.mutex);
+    pthread_join(thread, NULL);
+
+    epoch_reclaim();
+    ck_assert_msg(atomic_load(&freed) == 1, "not freed after reader left");
+
+    pthread_cond_destroy(&r.cond);
+    pthread_mutex_destroy(&r.mutex);
+}
+END_TEST
+
+// read sections nest, and our own read section holds up reclamation as well
+START_TEST(test_epoch_02) {
+    printf("  test_epoch_02...\n");
+
+    atomic_store(&freed, 0);
+    epoch_enter();
+    epoch_enter();
+    epoch_retire(malloc(16), test_epoch_free);
+    epoch_exit();
+    epoch_reclaim();
+    ck_assert(atomic_load(&freed) == 0);
+    epoch_exit();
+    epoch_reclaim();
+    ck_assert(atomic_load(&freed) == 1);
+
+    // lots of retiring without explicit reclaiming still frees things
+    for (int i = 0; i < 1000; i++) {
+        epoch_retire(malloc(16), test_epoch_free);
+    }
+    ck_assert(atomic_load(&freed) > 500);
+}
+END_TEST
+
+TCase* make_epoch_checks(void) {
+    TCase *tc_epoch;
+
+    tc_epoch = tcase_create("Epoch");
+    tcase_add_test(tc_epoch, test_epoch_01);
+    tcase_add_test(tc_epoch, test_epoch_02);
+
+    return tc_epoch;
+}
@@ -0,0 +1,8 @@
+#ifndef CHECK_EPOCH_H
+#define CHECK_EPOCH_H
+
+#include <check.h>
+
+TCase* make_epoch_checks(void);
+
+#endif /* CHECK_EPOCH_H */
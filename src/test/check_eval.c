@@ -3,7 +3,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "epoch.h"
 #include "eval.h"
+#include "object.h"
+#include "persist.h"
+#include "store.h"
+#include "symbol.h"
 
 // XXX improve debug function to just create concatenated string, much better!
 void eval_debug_callback(val v, void *a) {
@@ -31,12 +36,16 @@ void eval_debug_callback(val v, void *a) {
         strcat(res, buffer);
     }
     else if (val_type(v) == TYPE_STRING) {
-        char buffer[val_get_string_len(v)+1];
+        char buffer[val_get_string_len(v)+2];
         buffer[0] = 's';
         memcpy(&buffer[1], val_get_string_data(v), val_get_string_len(v));
         buffer[val_get_string_len(v)+1] = '\0';
         strcat(res, buffer);
     }
+    else if (val_type(v) == TYPE_SYMBOL) {
+        strcat(res, "#");
+        strcat(res, sym_name(val_get_symbol(v)));
+    }
     else {
         ck_abort_msg("unexpected type in debug callback");
     }
@@ -451,6 +460,302 @@ START_TEST(test_eval_10_string) {
 }
 END_TEST
 
+START_TEST(test_eval_11_call_ic) {
+    printf("  test_eval_11_call_ic...\n");
+
+    // object 100 inherits "get" from object 101
+    struct persist *p = persist_new();
+    struct object *o100 = obj_new();
+    obj_set_id(o100, 100);
+    obj_add_parent(o100, 101);
+    persist_put(p, o100);
+    struct object *o101 = obj_new();
+    obj_set_id(o101, 101);
+    opcode get1[] = {   OP_ARGS_LOCALS, 0x00, 0x01,
+                        OP_DEBUGI, 0x01, 0x00, 0x00, 0x00,
+                        OP_RETURN, 0x00};
+    opcode get2[] = {   OP_ARGS_LOCALS, 0x00, 0x01,
+                        OP_DEBUGI, 0x02, 0x00, 0x00, 0x00,
+                        OP_RETURN, 0x00};
+    opcode get3[] = {   OP_ARGS_LOCALS, 0x00, 0x01,
+                        OP_DEBUGI, 0x03, 0x00, 0x00, 0x00,
+                        OP_RETURN, 0x00};
+    obj_set_code(o101, "get", get1, sizeof(get1));
+    persist_put(p, o101);
+    obj_free(o100);
+    obj_free(o101);
+
+    struct store *s = store_new(p, 1, 1, STORE_LOCKING);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    // the methods get changed below on the objects the store loaded
+    o100 = lobject_get_object(store_get_object(tx, 100));
+    o101 = lobject_get_object(store_get_object(tx, 101));
+    struct eval_ctx *ex = eval_new_ctx(0, tx);
+    char trace[4096];
+    trace[0] = '\0';
+    eval_set_dbg_handler(ex, &eval_debug_callback, trace);
+
+    // the same call site gets executed on each run
+    opcode code[] = {   OP_ARGS_LOCALS, 0x01, 0x02,
+                        OP_LOAD_STRING, 0x01, 0x03, 0x00, 'g', 'e', 't',
+                        OP_PUSH, 0x00,
+                        OP_PUSH, 0x01,
+                        OP_PUSH, 0x02,
+                        OP_CALL, 0x00,
+                        OP_POP, 0x02,
+                        OP_HALT};
+
+    eval_push_arg(ex, val_make_objref(100));
+    eval_exec(ex, code);
+    eval_push_arg(ex, val_make_objref(100));
+    eval_exec(ex, code);
+    // changing the method on the parent needs to invalidate the cache
+    obj_set_code(o101, "get", get2, sizeof(get2));
+    eval_push_arg(ex, val_make_objref(100));
+    eval_exec(ex, code);
+    // as does shadowing it on the receiver
+    obj_set_code(o100, "get", get3, sizeof(get3));
+    eval_push_arg(ex, val_make_objref(100));
+    eval_exec(ex, code);
+    // a different receiver at the same site
+    eval_push_arg(ex, val_make_objref(101));
+    eval_exec(ex, code);
+    eval_push_arg(ex, val_make_objref(100));
+    eval_exec(ex, code);
+
+    printf("debug trace: %s\n", trace);
+    ck_assert_msg(strcmp(trace, "I1I1I2I3I2I3") == 0,
+        "unexpected debug callback trace");
+
+    eval_free_ctx(ex);
+    store_finish_tx(tx);
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
+/* the name of the method comes from a register, so one call site can call
+ * different methods on the same receiver */
+START_TEST(test_eval_14_call_ic_name) {
+    printf("  test_eval_14_call_ic_name...\n");
+
+    struct persist *p = persist_new();
+    struct object *o100 = obj_new();
+    obj_set_id(o100, 100);
+    opcode a[] = {      OP_ARGS_LOCALS, 0x00, 0x01,
+                        OP_DEBUGI, 0x0a, 0x00, 0x00, 0x00,
+                        OP_RETURN, 0x00};
+    opcode b[] = {      OP_ARGS_LOCALS, 0x00, 0x01,
+                        OP_DEBUGI, 0x0b, 0x00, 0x00, 0x00,
+                        OP_RETURN, 0x00};
+    obj_set_code(o100, "a", a, sizeof(a));
+    obj_set_code(o100, "b", b, sizeof(b));
+    persist_put(p, o100);
+    obj_free(o100);
+
+    struct store *s = store_new(p, 1, 1, STORE_LOCKING);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    struct eval_ctx *ex = eval_new_ctx(0, tx);
+    char trace[4096];
+    trace[0] = '\0';
+    eval_set_dbg_handler(ex, &eval_debug_callback, trace);
+
+    opcode code[] = {   OP_ARGS_LOCALS, 0x02, 0x01,
+                        OP_PUSH, 0x00,
+                        OP_PUSH, 0x01,
+                        OP_PUSH, 0x02,
+                        OP_CALL, 0x00,
+                        OP_POP, 0x02,
+                        OP_HALT};
+
+    val name_a = val_make_symbol(sym_intern("a", 1));
+    val name_b = val_make_symbol(sym_intern("b", 1));
+    eval_push_arg(ex, val_make_objref(100));
+    eval_push_arg(ex, name_a);
+    eval_exec(ex, code);
+    eval_push_arg(ex, val_make_objref(100));
+    eval_push_arg(ex, name_b);
+    eval_exec(ex, code);
+    eval_push_arg(ex, val_make_objref(100));
+    eval_push_arg(ex, name_a);
+    eval_exec(ex, code);
+
+    printf("debug trace: %s\n", trace);
+    ck_assert_msg(strcmp(trace, "I10I11I10") == 0,
+        "unexpected debug callback trace");
+
+    eval_free_ctx(ex);
+    store_finish_tx(tx);
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
+/* the call-site cache keeps the objects of its entries alive, so a parent
+ * that got superseded by a commit and freed can still be checked */
+START_TEST(test_eval_15_call_ic_superseded) {
+    printf("  test_eval_15_call_ic_superseded...\n");
+
+    struct persist *p = persist_new();
+    struct object *o100 = obj_new();
+    obj_set_id(o100, 100);
+    obj_add_parent(o100, 101);
+    persist_put(p, o100);
+    obj_free(o100);
+    struct object *o101 = obj_new();
+    obj_set_id(o101, 101);
+    opcode get1[] = {   OP_ARGS_LOCALS, 0x00, 0x01,
+                        OP_DEBUGI, 0x01, 0x00, 0x00, 0x00,
+                        OP_RETURN, 0x00};
+    opcode get2[] = {   OP_ARGS_LOCALS, 0x00, 0x01,
+                        OP_DEBUGI, 0x02, 0x00, 0x00, 0x00,
+                        OP_RETURN, 0x00};
+    obj_set_code(o101, "get", get1, sizeof(get1));
+    persist_put(p, o101);
+    obj_free(o101);
+
+    opcode code[] = {   OP_ARGS_LOCALS, 0x01, 0x02,
+                        OP_LOAD_STRING, 0x01, 0x03, 0x00, 'g', 'e', 't',
+                        OP_PUSH, 0x00,
+                        OP_PUSH, 0x01,
+                        OP_PUSH, 0x02,
+                        OP_CALL, 0x00,
+                        OP_POP, 0x02,
+                        OP_HALT};
+    char trace[4096];
+    trace[0] = '\0';
+    struct store *s = store_new(p, 1, 1, STORE_LOCKING);
+    for (int round = 0; round < 2; round++) {
+        struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+        struct eval_ctx *ex = eval_new_ctx(0, tx);
+        eval_set_dbg_handler(ex, &eval_debug_callback, trace);
+        eval_push_arg(ex, val_make_objref(100));
+        eval_exec(ex, code);
+        eval_free_ctx(ex);
+        store_finish_tx(tx);
+
+        if (round == 0) {
+            // replace the parent by a version with a different method, the
+            // old one gets freed as soon as nobody can see it anymore
+            tx = store_start_tx(s, store_new_sid(s));
+            struct lobject *lo = store_get_object(tx, 101);
+            obj_set_code(store_write_object(tx, lo), "get", get2, sizeof(get2));
+            store_finish_tx(tx);
+            epoch_reclaim();
+        }
+    }
+
+    printf("debug trace: %s\n", trace);
+    ck_assert_msg(strcmp(trace, "I1I2") == 0,
+        "unexpected debug callback trace");
+
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
+START_TEST(test_eval_12_symbol) {
+    printf("  test_eval_12_symbol...\n");
+    struct eval_ctx *ex = eval_new_ctx(0, NULL);
+    struct syscall_table *st = syscall_table_new();
+    syscall_table_add_a1(st, "sys_t1", sys_t1);
+    eval_set_syscall_table(ex, st);
+    scall_count = 0;
+
+    char trace[4096];
+    trace[0] = '\0';
+    eval_set_dbg_handler(ex, &eval_debug_callback, trace);
+
+    opcode code[] = {   OP_NOOP,
+                        OP_ARGS_LOCALS, 0x00, 0x05,
+                        OP_LOAD_SYMBOL, 0x00, 0x06, 0x00, 's', 'y', 's', '_', 't', '1',
+                        OP_LOAD_SYMBOL, 0x01, 0x06, 0x00, 's', 'y', 's', '_', 't', '1',
+                        OP_LOAD_STRING, 0x02, 0x06, 0x00, 's', 'y', 's', '_', 't', '1',
+                        OP_DEBUGR, 0x00,
+                        OP_EQ, 0x03, 0x00, 0x01,
+                        OP_DEBUGR, 0x03,
+                        OP_EQ, 0x03, 0x00, 0x02,
+                        OP_DEBUGR, 0x03,
+                        OP_LOAD_INT, 0x04, 0x05, 0x00, 0x00, 0x00,
+                        OP_PUSH, 0x00,
+                        OP_PUSH, 0x04,
+                        OP_SYSCALL, 0x01,
+                        OP_HALT};
+
+    eval_exec(ex, code);
+
+    printf("debug trace: %s\n", trace);
+    ck_assert_msg(strcmp(trace, "#sys_t1TF") == 0,
+        "unexpected debug callback trace");
+    ck_assert_msg(scall_count == 5, "syscall not executed as expected");
+
+    eval_free_ctx(ex);
+    syscall_table_free(st);
+}
+END_TEST
+
+START_TEST(test_eval_13_global_ic) {
+    printf("  test_eval_13_global_ic...\n");
+
+    // object 300 is the parent of the clones and has the methods
+    struct persist *p = persist_new();
+    struct object *o300 = obj_new();
+    obj_set_id(o300, 300);
+    opcode set[] = {    OP_ARGS_LOCALS, 0x01, 0x02,
+                        OP_LOAD_SYMBOL, 0x01, 0x01, 0x00, 'a',
+                        OP_SETGLOBAL, 0x01, 0x00,
+                        OP_LOAD_SYMBOL, 0x01, 0x01, 0x00, 'b',
+                        OP_LOAD_INT, 0x02, 0x07, 0x00, 0x00, 0x00,
+                        OP_SETGLOBAL, 0x01, 0x02,
+                        OP_HALT};
+    opcode get[] = {    OP_ARGS_LOCALS, 0x00, 0x02,
+                        OP_LOAD_SYMBOL, 0x00, 0x01, 0x00, 'a',
+                        OP_GETGLOBAL, 0x01, 0x00,
+                        OP_DEBUGR, 0x01,
+                        OP_LOAD_SYMBOL, 0x00, 0x01, 0x00, 'b',
+                        OP_GETGLOBAL, 0x01, 0x00,
+                        OP_DEBUGR, 0x01,
+                        OP_HALT};
+    obj_set_code(o300, "set", set, sizeof(set));
+    obj_set_code(o300, "get", get, sizeof(get));
+    persist_put(p, o300);
+    obj_free(o300);
+
+    struct store *s = store_new(p, 1, 1, STORE_LOCKING);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    o300 = lobject_get_object(store_get_object(tx, 300));
+    struct eval_ctx *ex = eval_new_ctx(0, tx);
+    char trace[4096];
+    trace[0] = '\0';
+    eval_set_dbg_handler(ex, &eval_debug_callback, trace);
+
+    val m_set = val_make_symbol(sym_intern("set", 3));
+    val m_get = val_make_symbol(sym_intern("get", 3));
+    struct lobject *c1 = store_make_object(tx, 300);
+    struct lobject *c2 = store_make_object(tx, 300);
+    eval_exec_method(ex, c1, m_set, 1, val_make_int(1));
+    eval_exec_method(ex, c2, m_set, 1, val_make_int(2));
+    eval_exec_method(ex, c1, m_get, 0);
+    eval_exec_method(ex, c2, m_get, 0);
+    // the parent has different globals and hence a different shape, so the
+    // cached index from the clones does not apply
+    obj_set_global(o300, "b", val_make_int(9));
+    eval_exec_method(ex, store_get_object(tx, 300), m_get, 0);
+
+    printf("debug trace: %s\n", trace);
+    ck_assert_msg(strcmp(trace, "I1I7I2I7NI9") == 0,
+        "unexpected debug callback trace");
+    // clones that got the same globals share the shape
+    ck_assert(obj_get_shape(lobject_get_object(c1)) == obj_get_shape(lobject_get_object(c2)));
+    ck_assert(obj_get_shape(lobject_get_object(c1)) != obj_get_shape(o300));
+
+    eval_free_ctx(ex);
+    store_finish_tx(tx);
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
 TCase* make_eval_checks(void) {
     TCase *tc_eval;
 
@@ -465,6 +770,11 @@ TCase* make_eval_checks(void) {
     tcase_add_test(tc_eval, test_eval_08);
     tcase_add_test(tc_eval, test_eval_09_syscall);
     tcase_add_test(tc_eval, test_eval_10_string);
+    tcase_add_test(tc_eval, test_eval_11_call_ic);
+    tcase_add_test(tc_eval, test_eval_12_symbol);
+    tcase_add_test(tc_eval, test_eval_13_global_ic);
+    tcase_add_test(tc_eval, test_eval_14_call_ic_name);
+    tcase_add_test(tc_eval, test_eval_15_call_ic_superseded);
 
     return tc_eval;
 }
@@ -0,0 +1,105 @@
+#include "check_image.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "eval.h"
+#include "image.h"
+#include "object.h"
+
+// objects come back from the image as they went in, and can be looked at in
+// place without materializing them
+START_TEST(test_image_01) {
+    printf("  test_image_01...\n");
+    char path[] = "/tmp/cmoo-check-image-XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    close(fd);
+
+    // not in id order, the image sorts them
+    struct object *objs[100];
+    opcode cb[] = { OP_NOOP, OP_DEBUGI, 0x12, 0x34, 0x56, 0x78, OP_HALT };
+    for (int i = 0; i < 100; i++) {
+        objs[i] = obj_new();
+        obj_set_id(objs[i], 1000 + (i * 37) % 100);
+        obj_add_parent(objs[i], 1);
+        obj_set_code(objs[i], "test", cb, sizeof(cb));
+        obj_set_global(objs[i], "n", val_make_int((i * 37) % 100));
+    }
+    ck_assert(image_write(path, objs, 100));
+    // the same id twice is not an image, and leaves the file alone
+    objs[1] = objs[0];
+    ck_assert(!image_write(path, objs, 2));
+    for (int i = 0; i < 100; i++) {
+        if (i != 1) {
+            obj_free(objs[i]);
+        }
+    }
+
+    struct image *img = image_open(path);
+    ck_assert(img != NULL);
+    ck_assert(image_get_object_count(img) == 100);
+    ck_assert(image_next_id(img) == 1100);
+    ck_assert(!image_contains(img, 999));
+    ck_assert(!image_contains(img, 1100));
+    ck_assert(image_get(img, 5) == NULL);
+    char *code;
+    char *state;
+    int code_len;
+    int state_len;
+    ck_assert(image_find(img, 1042, &code, &code_len, &state, &state_len));
+    struct object *found = obj_new();
+    ck_assert(obj_code_from_mapping(found, code, code_len));
+    ck_assert(obj_state_from_mapping(found, state, state_len));
+    ck_assert(obj_get_id(found) == 1042);
+    obj_free(found);
+    for (int i = 0; i < 100; i++) {
+        struct object *o = image_get(img, 1000 + i);
+        ck_assert(o != NULL);
+        ck_assert(obj_get_id(o) == 1000 + i);
+        ck_assert(obj_get_parent_count(o) == 1);
+        opcode *code_buf;
+        ck_assert(obj_get_code(o, "test", &code_buf) == sizeof(cb));
+        ck_assert(memcmp(code_buf, cb, sizeof(cb)) == 0);
+        ck_assert(val_get_int(obj_get_global(o, "n")) == i);
+        obj_free(o);
+    }
+    image_close(img);
+    unlink(path);
+}
+END_TEST
+
+// files that are not complete images get rejected
+START_TEST(test_image_02) {
+    printf("  test_image_02...\n");
+    char path[] = "/tmp/cmoo-check-image-XXXXXX";
+    int fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    ck_assert(write(fd, "not an image, not even close to one", 35) == 35);
+    close(fd);
+    ck_assert(image_open(path) == NULL);
+
+    struct object *o = obj_new();
+    obj_set_id(o, 7);
+    ck_assert(image_write(path, &o, 1));
+    obj_free(o);
+    struct image *img = image_open(path);
+    ck_assert(img != NULL);
+    image_close(img);
+    ck_assert(truncate(path, 60) == 0);
+    ck_assert(image_open(path) == NULL);
+    unlink(path);
+}
+END_TEST
+
+TCase* make_image_checks(void) {
+    TCase *tc_image;
+
+    tc_image = tcase_create("Image");
+    tcase_add_test(tc_image, test_image_01);
+    tcase_add_test(tc_image, test_image_02);
+
+    return tc_image;
+}
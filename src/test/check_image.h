@@ -0,0 +1,8 @@
+#ifndef CHECK_IMAGE_H
+#define CHECK_IMAGE_H
+
+#include <check.h>
+
+TCase* make_image_checks(void);
+
+#endif /* CHECK_IMAGE_H */
@@ -2,9 +2,11 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "eval.h"
 #include "object.h"
+#include "symbol.h"
 
 START_TEST(test_object_01) {
     printf("  test_object_01...\n");
@@ -72,11 +74,293 @@ START_TEST(test_object_01) {
 }
 END_TEST
 
+// enough slots to go past the linearly searched table size
+START_TEST(test_object_02) {
+    printf("  test_object_02...\n");
+    struct object *obj = obj_new();
+    char name[32];
+    opcode code[] = { OP_DEBUGI, 0x00, 0x00, 0x00, 0x00 };
+
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "m%i", i);
+        code[1] = i;
+        obj_set_code(obj, name, code, sizeof(code));
+        snprintf(name, sizeof(name), "g%i", i);
+        obj_set_global(obj, name, val_make_int(i));
+    }
+    // overwriting must not add slots
+    obj_set_global(obj, "g7", val_make_int(700));
+    code[1] = 0x77;
+    obj_set_code(obj, "m7", code, sizeof(code));
+
+    struct object *copy = obj_copy(obj);
+    obj_set_global(obj, "g8", val_make_int(800));
+    obj_free(obj);
+
+    opcode *cb;
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "m%i", i);
+        ck_assert(obj_get_code(copy, name, &cb) == sizeof(code));
+        ck_assert(cb[1] == ((i == 7) ? 0x77 : i));
+        snprintf(name, sizeof(name), "g%i", i);
+        val v = obj_get_global(copy, name);
+        ck_assert(val_get_int(v) == ((i == 7) ? 700 : i));
+    }
+    ck_assert(obj_get_code(copy, "m100", &cb) == 0);
+    ck_assert(val_type(obj_get_global(copy, "g100")) == TYPE_NIL);
+
+    char *buf = NULL;
+    int buf_len = 0;
+    obj_code_to_buffer(copy, &buf, &buf_len);
+    ck_assert(buf_len > 100 * (int)sizeof(code));
+    free(buf);
+
+    obj_free(copy);
+}
+END_TEST
+
+START_TEST(test_object_03_shape) {
+    printf("  test_object_03_shape...\n");
+    struct object *a = obj_new();
+    struct object *b = obj_new();
+    struct object *c = obj_new();
+    ck_assert(obj_get_shape(a) == obj_get_shape(b));
+
+    obj_set_global(a, "x", val_make_int(1));
+    obj_set_global(a, "y", val_make_int(2));
+    obj_set_global(b, "x", val_make_int(3));
+    ck_assert(obj_get_shape(a) != obj_get_shape(b));
+    obj_set_global(b, "y", val_make_int(4));
+    ck_assert(obj_get_shape(a) == obj_get_shape(b));
+    // overwriting does not change the shape
+    struct shape *sh = obj_get_shape(a);
+    obj_set_global(a, "x", val_make_int(5));
+    ck_assert(obj_get_shape(a) == sh);
+    // a different order gives a different shape
+    obj_set_global(c, "y", val_make_int(6));
+    obj_set_global(c, "x", val_make_int(7));
+    ck_assert(obj_get_shape(c) != sh);
+
+    symbol x = sym_lookup("x", 1);
+    int idx = shape_get_global_index(sh, x);
+    ck_assert(idx >= 0);
+    ck_assert(val_get_int(obj_get_global_at(a, idx)) == 5);
+    ck_assert(val_get_int(obj_get_global_at(b, idx)) == 3);
+    obj_set_global_at(b, idx, val_make_int(8));
+    ck_assert(val_get_int(obj_get_global(b, "x")) == 8);
+    ck_assert(shape_get_global_index(sh, sym_intern("z", 1)) == -1);
+
+    // copies share the shape
+    struct object *d = obj_copy(b);
+    ck_assert(obj_get_shape(d) == sh);
+    ck_assert(val_get_int(obj_get_global(d, "y")) == 4);
+
+    obj_free(a);
+    obj_free(b);
+    obj_free(c);
+    obj_free(d);
+}
+END_TEST
+
+START_TEST(test_object_04_copy) {
+    printf("  test_object_04_copy...\n");
+    struct object *obj = obj_new();
+    opcode code1[] = { OP_DEBUGI, 0x01, 0x00, 0x00, 0x00 };
+    opcode code2[] = { OP_DEBUGI, 0x02, 0x00, 0x00, 0x00 };
+    obj_add_parent(obj, 1);
+    obj_set_code(obj, "m1", code1, sizeof(code1));
+    obj_set_code(obj, "m2", code1, sizeof(code1));
+    obj_set_global(obj, "g1", val_make_int(1));
+
+    struct object *copy = obj_copy(obj);
+    opcode *cb_obj, *cb_copy;
+    obj_get_code(obj, "m1", &cb_obj);
+    obj_get_code(copy, "m1", &cb_copy);
+    ck_assert_msg(cb_obj == cb_copy, "code buffers should be shared");
+
+    // changes on either side must not be visible on the other
+    obj_set_code(obj, "m1", code2, sizeof(code2));
+    obj_add_parent(copy, 2);
+    obj_set_global(copy, "g1", val_make_int(2));
+    obj_set_global(obj, "g2", val_make_int(3));
+
+    obj_get_code(obj, "m1", &cb_obj);
+    obj_get_code(copy, "m1", &cb_copy);
+    ck_assert(cb_obj[1] == 0x02);
+    ck_assert(cb_copy[1] == 0x01);
+    // untouched methods are still shared after the method table got copied
+    obj_get_code(obj, "m2", &cb_obj);
+    obj_get_code(copy, "m2", &cb_copy);
+    ck_assert(cb_obj == cb_copy);
+    ck_assert(obj_get_parent_count(obj) == 1);
+    ck_assert(obj_get_parent_count(copy) == 2);
+    ck_assert(val_get_int(obj_get_global(obj, "g1")) == 1);
+    ck_assert(val_get_int(obj_get_global(copy, "g1")) == 2);
+    ck_assert(val_get_int(obj_get_global(obj, "g2")) == 3);
+    ck_assert(val_type(obj_get_global(copy, "g2")) == TYPE_NIL);
+
+    // freeing the original must leave the copy intact
+    obj_free(obj);
+    obj_get_code(copy, "m2", &cb_copy);
+    ck_assert(cb_copy[1] == 0x01);
+    obj_free(copy);
+}
+END_TEST
+
+// the footprint follows the object as it gets modified
+START_TEST(test_object_05_footprint) {
+    printf("  test_object_05_footprint...\n");
+
+    struct object *obj = obj_new();
+    size_t empty = obj_get_footprint(obj);
+    ck_assert(empty > 0);
+
+    opcode code[100] = { OP_NOOP };
+    obj_set_code(obj, "m1", code, sizeof(code));
+    size_t with_code = obj_get_footprint(obj);
+    ck_assert(with_code >= empty + sizeof(code));
+    // replacing a method with one of the same size does not change anything
+    obj_set_code(obj, "m1", code, sizeof(code));
+    ck_assert(obj_get_footprint(obj) == with_code);
+
+    char str[500];
+    memset(str, 'a', sizeof(str));
+    val v = val_make_string(sizeof(str), str);
+    obj_set_global(obj, "g1", v);
+    val_dec_ref(v);
+    size_t with_string = obj_get_footprint(obj);
+    ck_assert(with_string >= with_code + sizeof(str));
+    obj_set_global(obj, "g1", val_make_int(1));
+    size_t with_int = obj_get_footprint(obj);
+    ck_assert(with_int < with_code + sizeof(str));
+    ck_assert(with_int > with_code);
+
+    // a copy has the same footprint, and modifying it only affects the copy
+    struct object *copy = obj_copy(obj);
+    ck_assert(obj_get_footprint(copy) == with_int);
+    obj_set_code(copy, "m2", code, sizeof(code));
+    ck_assert(obj_get_footprint(copy) > with_int);
+    ck_assert(obj_get_footprint(obj) == with_int);
+
+    obj_free(copy);
+    obj_free(obj);
+}
+END_TEST
+
+// every type of value survives serialization, with and without copying out
+// of the buffer, and broken buffers get rejected rather than read past
+START_TEST(test_object_06_serialize) {
+    printf("  test_object_06_serialize...\n");
+
+    struct object *obj = obj_new();
+    obj_set_id(obj, 123456);
+    obj_add_parent(obj, 1);
+    obj_add_parent(obj, 300);
+    opcode code[] = { OP_NOOP, OP_DEBUGI, 0x12, 0x34, 0x56, 0x78, OP_HALT };
+    obj_set_code(obj, "run", code, sizeof(code));
+    obj_set_code(obj, "stop", code, 1);
+    obj_set_global(obj, "n", val_make_nil());
+    obj_set_global(obj, "t", val_make_bool(true));
+    obj_set_global(obj, "f", val_make_bool(false));
+    obj_set_global(obj, "small", val_make_int(-3));
+    obj_set_global(obj, "large", val_make_int(-2000000000));
+    obj_set_global(obj, "pi", val_make_float(3.25f));
+    val str = val_make_string(5, "hello");
+    obj_set_global(obj, "s", str);
+    val_dec_ref(str);
+    obj_set_global(obj, "ref", val_make_objref(0xFFFFFFFFFF));
+    // one symbol that is also the name of a global, and one that is not
+    obj_set_global(obj, "sym1", val_make_symbol(sym_intern("small", 5)));
+    obj_set_global(obj, "sym2", val_make_symbol(sym_intern("elsewhere", 9)));
+    obj_set_global(obj, "sym3", val_make_symbol(sym_intern("elsewhere", 9)));
+
+    char *code_buf = NULL;
+    int code_len = 0;
+    char *state_buf = NULL;
+    int state_len = 0;
+    obj_code_to_buffer(obj, &code_buf, &code_len);
+    obj_state_to_buffer(obj, &state_buf, &state_len);
+    // varints and a shared name table keep it small: the names take 50
+    // bytes, the values 27 and the tags 11
+    ck_assert(state_len < 100);
+
+    for (int mapped = 0; mapped < 2; mapped++) {
+        struct object *o = obj_new();
+        if (mapped) {
+            ck_assert(obj_code_from_mapping(o, code_buf, code_len));
+            ck_assert(obj_state_from_mapping(o, state_buf, state_len));
+        }
+        else {
+            ck_assert(obj_code_from_buffer(o, code_buf, code_len));
+            ck_assert(obj_state_from_buffer(o, state_buf, state_len));
+        }
+        ck_assert(obj_get_id(o) == 123456);
+        ck_assert(obj_get_parent_count(o) == 2);
+        opcode *cb;
+        ck_assert(obj_get_code(o, "run", &cb) == sizeof(code));
+        ck_assert(memcmp(cb, code, sizeof(code)) == 0);
+        // in place, or a copy
+        ck_assert(((char*)cb >= code_buf && (char*)cb < code_buf + code_len) == mapped);
+        ck_assert(obj_get_code(o, "stop", &cb) == 1);
+        ck_assert(val_type(obj_get_global(o, "n")) == TYPE_NIL);
+        ck_assert(val_get_bool(obj_get_global(o, "t")));
+        ck_assert(!val_get_bool(obj_get_global(o, "f")));
+        ck_assert(val_get_int(obj_get_global(o, "small")) == -3);
+        ck_assert(val_get_int(obj_get_global(o, "large")) == -2000000000);
+        ck_assert(val_get_float(obj_get_global(o, "pi")) == 3.25f);
+        ck_assert(val_get_objref(obj_get_global(o, "ref")) == 0xFFFFFFFFFF);
+        ck_assert(val_get_symbol(obj_get_global(o, "sym1")) == sym_intern("small", 5));
+        ck_assert(val_get_symbol(obj_get_global(o, "sym2")) == sym_intern("elsewhere", 9));
+        ck_assert(val_get_symbol(obj_get_global(o, "sym3")) == sym_intern("elsewhere", 9));
+        val s = obj_get_global(o, "s");
+        ck_assert(val_get_string_len(s) == 5);
+        ck_assert(strcmp(val_get_string_data(s), "hello") == 0);
+        char *data = val_get_string_data(s);
+        ck_assert((data >= state_buf && data < state_buf + state_len) == mapped);
+        val_dec_ref(s);
+
+        // and it comes out the same again
+        char *again = NULL;
+        int again_len = 0;
+        obj_state_to_buffer(o, &again, &again_len);
+        ck_assert(again_len == state_len);
+        ck_assert(memcmp(again, state_buf, state_len) == 0);
+        free(again);
+        obj_free(o);
+    }
+
+    // cut short anywhere, or not the format we know
+    for (int len = 0; len < state_len; len++) {
+        struct object *o = obj_new();
+        ck_assert(!obj_state_from_buffer(o, state_buf, len));
+        obj_free(o);
+    }
+    for (int len = 0; len < code_len; len++) {
+        struct object *o = obj_new();
+        ck_assert(!obj_code_from_buffer(o, code_buf, len));
+        obj_free(o);
+    }
+    state_buf[0]++;
+    struct object *o = obj_new();
+    ck_assert(!obj_state_from_buffer(o, state_buf, state_len));
+    obj_free(o);
+
+    free(code_buf);
+    free(state_buf);
+    obj_free(obj);
+}
+END_TEST
+
 TCase* make_object_checks(void) {
     TCase *tc_object;
 
     tc_object = tcase_create("Object");
     tcase_add_test(tc_object, test_object_01);
+    tcase_add_test(tc_object, test_object_02);
+    tcase_add_test(tc_object, test_object_03_shape);
+    tcase_add_test(tc_object, test_object_04_copy);
+    tcase_add_test(tc_object, test_object_05_footprint);
+    tcase_add_test(tc_object, test_object_06_serialize);
 
     return tc_object;
 }
@@ -0,0 +1,426 @@
+#include "check_persist.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "eval.h"
+#include "image.h"
+#include "object.h"
+#include "persist.h"
+#include "store.h"
+#include "symbol.h"
+
+// a directory that survives persist_free(), so that the store can be reopened
+char* test_persist_mkdir(void) {
+    char *ret = strdup("/tmp/cmoo-check-XXXXXX");
+    ck_assert(mkdtemp(ret) != NULL);
+    return ret;
+}
+
+void test_persist_rmdir(char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] != '.') {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+    free(dir);
+}
+
+int test_persist_get_int(struct persist *p, object_id oid, char *name) {
+    struct object *o = persist_get(p, oid);
+    ck_assert(o != NULL);
+    val v = obj_get_global(o, name);
+    ck_assert(val_type(v) == TYPE_INT);
+    int ret = val_get_int(v);
+    obj_free(o);
+    return ret;
+}
+
+// the newest segment file in the directory, they sort by name
+void test_persist_last_segment(char *dir, char *path, size_t len) {
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    char last[256] = "";
+    while ((de = readdir(d))) {
+        if ((de->d_name[0] != '.') && (strcmp(de->d_name, last) > 0)) {
+            strcpy(last, de->d_name);
+        }
+    }
+    closedir(d);
+    snprintf(path, len, "%s/%s", dir, last);
+}
+
+// everything in an object survives a round trip, and a put does not consume
+// the object
+START_TEST(test_persist_01) {
+    printf("  test_persist_01...\n");
+    struct persist *p = persist_new();
+    // the bootstrap objects are there from the start
+    ck_assert(persist_next_id(p) == 3);
+    struct object *o0 = persist_get(p, 0);
+    opcode *code;
+    ck_assert(obj_get_code(o0, "init", &code) > 0);
+    obj_free(o0);
+    ck_assert(persist_get(p, 100) == NULL);
+
+    struct object *o = obj_new();
+    obj_set_id(o, 100);
+    obj_add_parent(o, 1);
+    obj_add_parent(o, 2);
+    opcode cb[] = { OP_NOOP, OP_DEBUGI, 0x12, 0x34, 0x56, 0x78, OP_HALT };
+    obj_set_code(o, "test", cb, sizeof(cb));
+    obj_set_global(o, "nil", val_make_nil());
+    obj_set_global(o, "bool", val_make_bool(true));
+    obj_set_global(o, "int", val_make_int(-42));
+    obj_set_global(o, "float", val_make_float(1.5));
+    val str = val_make_string(5, "hello");
+    obj_set_global(o, "string", str);
+    val_dec_ref(str);
+    obj_set_global(o, "objref", val_make_objref(1234));
+    obj_set_global(o, "symbol", val_make_symbol(sym_intern("sym", 3)));
+    persist_put(p, o);
+    ck_assert(obj_get_id(o) == 100);
+    ck_assert(persist_next_id(p) == 101);
+
+    struct object *r = persist_get(p, 100);
+    ck_assert(r != NULL);
+    ck_assert(r != o);
+    ck_assert(obj_get_id(r) == 100);
+    ck_assert(obj_get_parent_count(r) == 2);
+    ck_assert(obj_get_parent(r, 0) == 1);
+    ck_assert(obj_get_parent(r, 1) == 2);
+    ck_assert(obj_get_code(r, "test", &code) == sizeof(cb));
+    ck_assert(memcmp(code, cb, sizeof(cb)) == 0);
+    ck_assert(val_type(obj_get_global(r, "nil")) == TYPE_NIL);
+    ck_assert(val_get_bool(obj_get_global(r, "bool")));
+    ck_assert(val_get_int(obj_get_global(r, "int")) == -42);
+    ck_assert(val_get_float(obj_get_global(r, "float")) == 1.5);
+    val rs = obj_get_global(r, "string");
+    ck_assert(val_get_string_len(rs) == 5);
+    ck_assert(memcmp(val_get_string_data(rs), "hello", 5) == 0);
+    val_dec_ref(rs);
+    ck_assert(val_get_objref(obj_get_global(r, "objref")) == 1234);
+    ck_assert(val_get_symbol(obj_get_global(r, "symbol")) == sym_intern("sym", 3));
+    // same globals in the same order, so the same shape
+    ck_assert(obj_get_shape(r) == obj_get_shape(o));
+    obj_free(r);
+
+    // the newest version wins, and tells so
+    uint64_t version = persist_get_version(p, 100);
+    ck_assert(persist_get_version(p, 100) == version);
+    obj_set_global(o, "int", val_make_int(7));
+    persist_put(p, o);
+    ck_assert(test_persist_get_int(p, 100, "int") == 7);
+    ck_assert(persist_get_version(p, 100) != version);
+    obj_free(o);
+
+    struct persist_stats stats;
+    persist_get_stats(p, &stats);
+    ck_assert(stats.objects == 4);
+    ck_assert(stats.live_bytes < stats.log_bytes);
+    persist_free(p);
+}
+END_TEST
+
+// objects survive reopening the store, including what the store committed,
+// and a torn record at the end of the log gets dropped
+START_TEST(test_persist_02) {
+    printf("  test_persist_02...\n");
+    char *dir = test_persist_mkdir();
+    struct persist *p = persist_open(dir, NULL, 0);
+    ck_assert(p != NULL);
+    struct store *s = store_new(p, 1, 1, STORE_LOCKING);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    struct lobject *lo = store_make_object(tx, 2);
+    struct object *o = store_write_object(tx, lo);
+    obj_set_global(o, "count", val_make_int(1));
+    object_id oid = obj_get_id(o);
+    store_finish_tx(tx);
+    tx = store_start_tx(s, store_new_sid(s));
+    o = store_write_object(tx, store_get_object(tx, oid));
+    obj_set_global(o, "count", val_make_int(2));
+    store_finish_tx(tx);
+    // aborted changes must not make it into the log
+    tx = store_start_tx(s, store_new_sid(s));
+    o = store_write_object(tx, store_get_object(tx, oid));
+    obj_set_global(o, "count", val_make_int(3));
+    store_abort_tx(tx);
+    store_free(s);
+    persist_free(p);
+
+    // garbage at the end of the log, as if we crashed while writing
+    char path[512];
+    test_persist_last_segment(dir, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_APPEND);
+    ck_assert(fd >= 0);
+    ck_assert(write(fd, "CMOO garbage", 12) == 12);
+    close(fd);
+
+    p = persist_open(dir, NULL, 0);
+    ck_assert(p != NULL);
+    ck_assert(test_persist_get_int(p, oid, "count") == 2);
+    ck_assert(test_persist_get_int(p, 2, "count") == 0);
+    // new objects do not reuse the ids from before
+    s = store_new(p, 1, 1, STORE_LOCKING);
+    tx = store_start_tx(s, store_new_sid(s));
+    lo = store_make_object(tx, 2);
+    ck_assert(obj_get_id(lobject_get_object(lo)) > oid);
+    store_finish_tx(tx);
+    store_free(s);
+    persist_free(p);
+    test_persist_rmdir(dir);
+}
+END_TEST
+
+// compaction gets rid of superseded records without losing anything
+START_TEST(test_persist_03) {
+    printf("  test_persist_03...\n");
+    char *dir = test_persist_mkdir();
+    // small segments, so that there is something to compact quickly
+    struct persist *p = persist_open(dir, NULL, 4096);
+    struct object *o = obj_new();
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 20; i++) {
+            obj_set_id(o, 1000 + i);
+            obj_set_global(o, "round", val_make_int(round));
+            persist_put(p, o);
+        }
+    }
+    obj_free(o);
+    struct persist_stats before;
+    persist_get_stats(p, &before);
+    ck_assert(before.segments > 2);
+
+    persist_compact(p);
+    struct persist_stats after;
+    persist_get_stats(p, &after);
+    ck_assert(after.compactions > before.compactions);
+    ck_assert(after.log_bytes < before.log_bytes);
+    ck_assert(after.segments < before.segments);
+    ck_assert(after.live_bytes == before.live_bytes);
+    ck_assert(after.objects == 23);
+    for (int i = 0; i < 20; i++) {
+        ck_assert(test_persist_get_int(p, 1000 + i, "round") == 49);
+    }
+    persist_free(p);
+
+    // and the index rebuilt from the compacted log agrees
+    p = persist_open(dir, NULL, 4096);
+    struct persist_stats reopened;
+    persist_get_stats(p, &reopened);
+    ck_assert(reopened.objects == 23);
+    ck_assert(reopened.live_bytes == after.live_bytes);
+    for (int i = 0; i < 20; i++) {
+        ck_assert(test_persist_get_int(p, 1000 + i, "round") == 49);
+    }
+    persist_free(p);
+    test_persist_rmdir(dir);
+}
+END_TEST
+
+// a transaction without its commit record gets dropped as a whole
+START_TEST(test_persist_04) {
+    printf("  test_persist_04...\n");
+    char *dir = test_persist_mkdir();
+    struct persist *p = persist_open(dir, NULL, 0);
+    struct object *o[2];
+    for (int i = 0; i < 2; i++) {
+        o[i] = obj_new();
+        obj_set_id(o[i], 100 + i);
+        obj_set_global(o[i], "v", val_make_int(1));
+    }
+    persist_sync(p, persist_commit(p, o, 2));
+    for (int i = 0; i < 2; i++) {
+        obj_set_global(o[i], "v", val_make_int(2));
+    }
+    uint64_t lsn = persist_commit(p, o, 2);
+    ck_assert(lsn > 0);
+    persist_sync(p, lsn);
+    ck_assert(persist_get_lsn(p) == lsn);
+    persist_free(p);
+    obj_free(o[0]);
+    obj_free(o[1]);
+
+    // cut off the commit record of the second transaction, which leaves its
+    // object records intact
+    char path[512];
+    test_persist_last_segment(dir, path, sizeof(path));
+    struct stat st;
+    ck_assert(stat(path, &st) == 0);
+    ck_assert(truncate(path, st.st_size - 1) == 0);
+
+    p = persist_open(dir, NULL, 0);
+    ck_assert(test_persist_get_int(p, 100, "v") == 1);
+    ck_assert(test_persist_get_int(p, 101, "v") == 1);
+    persist_free(p);
+    test_persist_rmdir(dir);
+}
+END_TEST
+
+struct test_persist_05_args {
+    struct persist *persist;
+    int thread;
+};
+
+void* test_persist_05_thread(void *arg) {
+    struct test_persist_05_args *a = arg;
+    struct object *o = obj_new();
+    obj_set_id(o, 1000 + a->thread);
+    for (int i = 0; i < 20; i++) {
+        obj_set_global(o, "v", val_make_int(i));
+        persist_sync(a->persist, persist_commit(a->persist, &o, 1));
+    }
+    obj_free(o);
+    return NULL;
+}
+
+// concurrent commits share syncs, and everyone gets to see theirs durable
+START_TEST(test_persist_05) {
+    printf("  test_persist_05...\n");
+    struct persist *p = persist_new();
+    // a generous latency, so the groups fill up
+    persist_set_group_commit(p, 4, 100000);
+    struct persist_stats before;
+    persist_get_stats(p, &before);
+    pthread_t tids[8];
+    struct test_persist_05_args args[8];
+    for (int i = 0; i < 8; i++) {
+        args[i].persist = p;
+        args[i].thread = i;
+        pthread_create(&tids[i], NULL, test_persist_05_thread, &args[i]);
+    }
+    for (int i = 0; i < 8; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    struct persist_stats after;
+    persist_get_stats(p, &after);
+    ck_assert(after.commits - before.commits == 160);
+    ck_assert(after.syncs - before.syncs <= 160 / 4 + 8);
+    for (int i = 0; i < 8; i++) {
+        ck_assert(test_persist_get_int(p, 1000 + i, "v") == 19);
+    }
+    persist_free(p);
+}
+END_TEST
+
+// a store that starts out from an image gets its objects from there until
+// they are written, and the writes survive a restart on top of the image
+START_TEST(test_persist_06) {
+    printf("  test_persist_06...\n");
+    char *dir = test_persist_mkdir();
+    char image[512];
+    snprintf(image, sizeof(image), "%s.img", dir);
+    struct object *objs[3];
+    for (int i = 0; i < 3; i++) {
+        objs[i] = obj_new();
+        obj_set_id(objs[i], i == 2 ? 500 : i);
+        obj_set_global(objs[i], "v", val_make_int(10 + i));
+    }
+    ck_assert(image_write(image, objs, 3));
+
+    struct persist *p = persist_open(dir, image, 0);
+    ck_assert(p != NULL);
+    struct persist_stats stats;
+    persist_get_stats(p, &stats);
+    // the image has a root object, so there is nothing to bootstrap
+    ck_assert(stats.objects == 0);
+    ck_assert(stats.image_objects == 3);
+    ck_assert(persist_next_id(p) == 501);
+    ck_assert(test_persist_get_int(p, 0, "v") == 10);
+    ck_assert(test_persist_get_int(p, 500, "v") == 12);
+    ck_assert(persist_get(p, 2) == NULL);
+    obj_set_global(objs[2], "v", val_make_int(42));
+    persist_put(p, objs[2]);
+    ck_assert(test_persist_get_int(p, 500, "v") == 42);
+    persist_free(p);
+
+    p = persist_open(dir, image, 0);
+    ck_assert(p != NULL);
+    ck_assert(test_persist_get_int(p, 1, "v") == 11);
+    ck_assert(test_persist_get_int(p, 500, "v") == 42);
+    persist_free(p);
+    // an image that is not there is an error, not an empty one
+    ck_assert(persist_open(dir, "/nonexistent/cmoo.img", 0) == NULL);
+
+    for (int i = 0; i < 3; i++) {
+        obj_free(objs[i]);
+    }
+    unlink(image);
+    test_persist_rmdir(dir);
+}
+END_TEST
+
+// a damaged segment ends the log, the transactions in the ones after it might
+// have read what got lost and must not be replayed
+START_TEST(test_persist_07) {
+    printf("  test_persist_07...\n");
+    char *dir = test_persist_mkdir();
+    struct persist *p = persist_open(dir, NULL, 0);
+    struct object *o = obj_new();
+    obj_set_id(o, 100);
+    obj_set_global(o, "v", val_make_int(1));
+    persist_put(p, o);
+    persist_free(p);
+    // every open starts a new segment
+    p = persist_open(dir, NULL, 0);
+    obj_set_global(o, "v", val_make_int(2));
+    persist_put(p, o);
+    obj_set_id(o, 101);
+    persist_put(p, o);
+    persist_free(p);
+
+    // the end of the first segment, which has the commit of v=1, did not
+    // make it to disk
+    char path[512];
+    snprintf(path, sizeof(path), "%s/seg-000000.log", dir);
+    struct stat st;
+    ck_assert(stat(path, &st) == 0);
+    ck_assert(truncate(path, st.st_size - 1) == 0);
+
+    p = persist_open(dir, NULL, 0);
+    ck_assert(persist_get(p, 100) == NULL);
+    ck_assert(persist_get(p, 101) == NULL);
+    // the objects written before the damage are still there
+    ck_assert(test_persist_get_int(p, 2, "count") == 0);
+    obj_set_id(o, 100);
+    obj_set_global(o, "v", val_make_int(3));
+    persist_put(p, o);
+    persist_free(p);
+    obj_free(o);
+
+    // what got dropped stays dropped, and what came after the recovery is
+    // there
+    p = persist_open(dir, NULL, 0);
+    ck_assert(test_persist_get_int(p, 100, "v") == 3);
+    ck_assert(persist_get(p, 101) == NULL);
+    persist_free(p);
+    test_persist_rmdir(dir);
+}
+END_TEST
+
+TCase* make_persist_checks(void) {
+    TCase *tc_persist;
+
+    tc_persist = tcase_create("Persist");
+    tcase_add_test(tc_persist, test_persist_01);
+    tcase_add_test(tc_persist, test_persist_02);
+    tcase_add_test(tc_persist, test_persist_03);
+    tcase_add_test(tc_persist, test_persist_04);
+    tcase_add_test(tc_persist, test_persist_05);
+    tcase_add_test(tc_persist, test_persist_06);
+    tcase_add_test(tc_persist, test_persist_07);
+
+    return tc_persist;
+}
@@ -0,0 +1,8 @@
+#ifndef CHECK_PERSIST_H
+#define CHECK_PERSIST_H
+
+#include <check.h>
+
+TCase* make_persist_checks(void);
+
+#endif /* CHECK_PERSIST_H */
@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <time.h>
+#include <sched.h>
 
 #define TESTABILITY_FEATURES
 #include "store.h"
@@ -513,6 +515,164 @@ START_TEST(test_rwlock_06) {
 }
 END_TEST*/
 
+/* the same rules apply whether a lock only has one holder, which takes it
+ * without the latch, or several. nothing here has to wait, so no threads */
+START_TEST(test_rwlock_07) {
+    printf("  test_rwlock_07...\n");
+
+    struct locks_ctx *locks = locks_new_ctx(2);
+    struct lock *l = lock_new(locks);
+    struct store_tx *a = store_new_mock_tx(0, 0);
+    struct store_tx *b = store_new_mock_tx(1, 1);
+
+    // reentrant, and upgrading right away as the only holder
+    ck_assert(lock_lock(l, LOCK_SHARED, a) == LOCK_TAKEN);
+    ck_assert(lock_lock(l, LOCK_SHARED, a) == LOCK_TAKEN);
+    ck_assert(lock_lock(l, LOCK_EXCLUSIVE, a) == LOCK_TAKEN);
+    ck_assert(lock_lock(l, LOCK_SHARED, a) == LOCK_TAKEN);
+    // unlocking a lock someone else holds does nothing
+    lock_unlock(l, b);
+    lock_unlock(l, a);
+    lock_unlock(l, a);
+
+    // a second holder needs the waitgroups, and the first one is in them
+    ck_assert(lock_lock(l, LOCK_SHARED, a) == LOCK_TAKEN);
+    ck_assert(lock_lock(l, LOCK_SHARED, b) == LOCK_TAKEN);
+    ck_assert(lock_lock(l, LOCK_SHARED, a) == LOCK_TAKEN);
+    lock_unlock(l, a);
+    ck_assert(lock_lock(l, LOCK_EXCLUSIVE, b) == LOCK_TAKEN);
+    lock_unlock(l, b);
+
+    // and free again, which lock_free() checks
+    ck_assert(lock_lock(l, LOCK_EXCLUSIVE, a) == LOCK_TAKEN);
+    lock_unlock(l, a);
+    lock_free(l);
+    store_free_mock_tx(a);
+    store_free_mock_tx(b);
+    locks_free_ctx(locks);
+}
+END_TEST
+
+/* a contended lock, and a stale upgrade on another one, for the statistics */
+char tfstats01(int t, int p, void *arg) {
+    struct tfunc_args *tfa = arg;
+    if (t == 0) {
+        if (p == 0) {
+            return map_lock_ret(lock_lock(tfa->locks[0], LOCK_EXCLUSIVE, tfa->txes[t]));
+        }
+        else if (p == 2) {
+            lock_unlock(tfa->locks[0], tfa->txes[t]);
+            return 'U';
+        }
+        else if (p == 4) {
+            return map_lock_ret(lock_lock(tfa->locks[1], LOCK_SHARED, tfa->txes[t]));
+        }
+        else if (p == 6) {
+            return map_lock_ret(lock_lock(tfa->locks[1], LOCK_EXCLUSIVE, tfa->txes[t]));
+        }
+        else if (p == 7) {
+            lock_unlock(tfa->locks[1], tfa->txes[t]);
+            return 'U';
+        }
+    }
+    else if (t == 1) {
+        if (p == 1) {
+            return map_lock_ret(lock_lock(tfa->locks[0], LOCK_EXCLUSIVE, tfa->txes[t]));
+        }
+        else if (p == 3) {
+            lock_unlock(tfa->locks[0], tfa->txes[t]);
+            return 'U';
+        }
+        else if (p == 4) {
+            return map_lock_ret(lock_lock(tfa->locks[1], LOCK_SHARED, tfa->txes[t]));
+        }
+        else if (p == 7) {
+            lock_unlock(tfa->locks[1], tfa->txes[t]);
+            return 'U';
+        }
+    }
+    else if (t == 2) {
+        if (p == 5) {
+            return map_lock_ret(lock_lock(tfa->locks[1], LOCK_EXCLUSIVE, tfa->txes[t]));
+        }
+        else if (p == 8) {
+            lock_unlock(tfa->locks[1], tfa->txes[t]);
+            return 'U';
+        }
+    }
+    return '.';
+}
+
+START_TEST(test_rwlock_08) {
+    printf("  test_rwlock_08...\n");
+
+    struct tfunc_args tfa;
+    struct locks_ctx *locks = locks_new_ctx(3);
+    for (int i = 0; i < 3; i++) {
+        tfa.locks[i] = lock_new(locks);
+        tfa.txes[i] = store_new_mock_tx(i, i);
+    }
+    lock_set_id(tfa.locks[0], 7);
+    lock_set_id(tfa.locks[1], 8);
+    struct scaff_ctx *scaff = scaff_new_ctx(3, 9, &tfstats01, &tfa);
+
+    scaff_run(scaff);
+    scaff_print_results(scaff);
+
+    ck_scaff_assert(scaff,
+        "T.U.T.SU."
+        ".-TUT..U."
+        ".....--TU");
+
+    // the second tx waited for about a phase, which falls into one bucket
+    struct lock_stats stats;
+    lock_get_stats(tfa.locks[0], &stats);
+    ck_assert(stats.id == 7);
+    ck_assert(stats.acquisitions == 2);
+    ck_assert(stats.contended == 1);
+    ck_assert(stats.wait_ns > PHASE_SLEEP_NS / 2);
+    uint64_t waits = 0;
+    for (int i = 0; i < LOCK_WAIT_BUCKETS; i++) {
+        waits += stats.wait_hist[i];
+    }
+    ck_assert(waits == 1);
+    // the first acquisition of a free lock is always measured
+    ck_assert(stats.hold_samples >= 1);
+    ck_assert(stats.hold_ns > PHASE_SLEEP_NS / 2);
+
+    lock_get_stats(tfa.locks[1], &stats);
+    ck_assert(stats.acquisitions == 3);
+    ck_assert(stats.contended == 1);
+    ck_assert(stats.upgrades == 1);
+    ck_assert(stats.stale == 1);
+    ck_assert(stats.deadlocks == 0);
+
+    // the third lock never had to wait, and the other one waited longer. the
+    // statistics for an id survive its lock, and add up with the next one
+    lock_free(tfa.locks[0]);
+    tfa.locks[0] = lock_new(locks);
+    lock_set_id(tfa.locks[0], 7);
+    ck_assert(lock_lock(tfa.locks[0], LOCK_SHARED, tfa.txes[0]) == LOCK_TAKEN);
+    lock_unlock(tfa.locks[0], tfa.txes[0]);
+    struct lock_stats top[4];
+    ck_assert(locks_top_contended(locks, top, 4) == 3);
+    ck_assert(top[0].id == 8);
+    ck_assert(top[1].id == 7);
+    ck_assert(top[1].acquisitions == 3);
+    ck_assert(top[1].contended == 1);
+    ck_assert(top[2].id == LOCK_NO_ID);
+    ck_assert(locks_top_contended(locks, top, 1) == 1);
+    locks_dump_contention(locks, stdout, 4);
+
+    for (int i = 0; i < 3; i++) {
+        lock_free(tfa.locks[i]);
+        store_free_mock_tx(tfa.txes[i]);
+    }
+    scaff_free_ctx(scaff);
+    locks_free_ctx(locks);
+}
+END_TEST
+
 /* two threads that try to cross-lock two locks, this is a simple multi-lock
  * deadlock */
 char tfdead01(int t, int p, void *arg) {
@@ -565,6 +725,9 @@ START_TEST(test_deadlock_01) {
     ck_scaff_assert(scaff,
         "T---TUU"
         "T.D.U..");
+    struct lock_stats stats;
+    lock_get_stats(tfa.locks[0], &stats);
+    ck_assert(stats.deadlocks == 1);
 
     lock_free(tfa.locks[0]);
     lock_free(tfa.locks[1]);
@@ -640,6 +803,212 @@ START_TEST(test_deadlock_02) {
 }
 END_TEST
 
+// stress test for the deadlock detector, with enough txes for the wait-for
+// graph to get dense, and with their cids spread out over a large locks ctx.
+// every thread keeps taking a few random locks in random order and mode, some
+// of them upgraded, and starts over whenever it gets faulted out
+#define STRESS_MAX_TASKS    4096
+#define STRESS_THREADS      32
+#define STRESS_LOCKS        8
+#define STRESS_HELD         3
+#define STRESS_ROUNDS       200
+
+struct stress_args {
+    struct lock **locks;
+    pthread_barrier_t *start;
+    struct store_tx *tx;
+    uint64_t seed;
+    int deadlocks;
+    int stale;
+};
+
+uint64_t stress_rand(struct stress_args *args) {
+    args->seed ^= args->seed << 13;
+    args->seed ^= args->seed >> 7;
+    args->seed ^= args->seed << 17;
+    return args->seed;
+}
+
+void* stress_thread(void *va) {
+    struct stress_args *args = va;
+    pthread_barrier_wait(args->start);
+    for (int round = 0; round < STRESS_ROUNDS; round++) {
+        int picked[STRESS_HELD];
+        for (int i = 0; i < STRESS_HELD; i++) {
+            bool again;
+            do {
+                picked[i] = stress_rand(args) % STRESS_LOCKS;
+                again = false;
+                for (int j = 0; j < i; j++) {
+                    again |= picked[i] == picked[j];
+                }
+            } while (again);
+        }
+        bool done;
+        do {
+            done = true;
+            for (int i = 0; (i < STRESS_HELD) && done; i++) {
+                struct lock *l = args->locks[picked[i]];
+                int r = stress_rand(args) % 4;
+                int ret = lock_lock(l, r == 0 ? LOCK_EXCLUSIVE : LOCK_SHARED, args->tx);
+                if ((ret == LOCK_TAKEN) && (r == 1)) {
+                    ret = lock_lock(l, LOCK_EXCLUSIVE, args->tx);
+                }
+                if (ret == LOCK_DEADLOCK) {
+                    args->deadlocks++;
+                    done = false;
+                }
+                else if (ret == LOCK_STALE) {
+                    args->stale++;
+                    done = false;
+                }
+            }
+            if (done) {
+                // give the others a chance to run into us
+                sched_yield();
+            }
+            // unlocking what we do not hold is fine
+            for (int i = 0; i < STRESS_HELD; i++) {
+                lock_unlock(args->locks[picked[i]], args->tx);
+            }
+            if (!done) {
+                // without backing off, a tx that keeps failing right away
+                // (as with wait-die) can starve the ones it failed for
+                sched_yield();
+            }
+        } while (!done);
+    }
+    return NULL;
+}
+
+void stress_run(int policy, uint64_t max_spin_ns) {
+    struct locks_ctx *locks = locks_new_ctx(STRESS_MAX_TASKS);
+    locks_set_policy(locks, policy);
+    locks_set_max_spin(locks, max_spin_ns);
+    struct lock *l[STRESS_LOCKS];
+    for (int i = 0; i < STRESS_LOCKS; i++) {
+        l[i] = lock_new(locks);
+    }
+    pthread_t threads[STRESS_THREADS];
+    struct stress_args args[STRESS_THREADS];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, STRESS_THREADS);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < STRESS_THREADS; t++) {
+        // distinct sids in a different order than the cids
+        args[t].tx = store_new_mock_tx((t * 37) % STRESS_THREADS, (t * 127) % STRESS_MAX_TASKS);
+        args[t].locks = l;
+        args[t].start = &barrier;
+        args[t].seed = 88172645463325252ull + t;
+        args[t].deadlocks = 0;
+        args[t].stale = 0;
+        ck_assert(pthread_create(&threads[t], NULL, stress_thread, &args[t]) == 0);
+    }
+    int deadlocks = 0;
+    int stale = 0;
+    for (int t = 0; t < STRESS_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        deadlocks += args[t].deadlocks;
+        stale += args[t].stale;
+        store_free_mock_tx(args[t].tx);
+    }
+    pthread_barrier_destroy(&barrier);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("    %i rounds in %.2fs, %.0f/s, %i deadlocks, %i stale upgrades\n",
+        STRESS_THREADS * STRESS_ROUNDS, s, STRESS_THREADS * STRESS_ROUNDS / s, deadlocks, stale);
+    ck_assert(deadlocks > 0);
+
+    // all locks are free again, and so is the wait-for graph, which
+    // locks_free_ctx() asserts
+    for (int i = 0; i < STRESS_LOCKS; i++) {
+        lock_free(l[i]);
+    }
+    locks_free_ctx(locks);
+}
+
+START_TEST(test_deadlock_03) {
+    printf("  test_deadlock_03...\n");
+    stress_run(LOCK_DETECT, 0);
+}
+END_TEST
+
+/* the cross-locking of tfdead02 with deadlock prevention instead. the
+ * younger tx dies as soon as it would wait for the older one */
+START_TEST(test_deadlock_04) {
+    printf("  test_deadlock_04...\n");
+
+    struct tfunc_args tfa;
+    struct locks_ctx *locks = locks_new_ctx(2);
+    locks_set_policy(locks, LOCK_WAIT_DIE);
+    tfa.locks[0] = lock_new(locks);
+    tfa.locks[1] = lock_new(locks);
+    tfa.txes[0] = store_new_mock_tx(1, 0);
+    tfa.txes[1] = store_new_mock_tx(0, 1);
+    struct scaff_ctx *scaff = scaff_new_ctx(2, 7, &tfdead02, &tfa);
+
+    scaff_run(scaff);
+    scaff_print_results(scaff);
+
+    ck_scaff_assert(scaff,
+        "TD.UU.."
+        "T.--TUU");
+
+    lock_free(tfa.locks[0]);
+    lock_free(tfa.locks[1]);
+    store_free_mock_tx(tfa.txes[0]);
+    store_free_mock_tx(tfa.txes[1]);
+    scaff_free_ctx(scaff);
+    locks_free_ctx(locks);
+
+    stress_run(LOCK_WAIT_DIE, 0);
+}
+END_TEST
+
+/* the younger tx waits for the older one, and gets wounded by it while
+ * waiting. so it fails at the same point as with the detector */
+START_TEST(test_deadlock_05) {
+    printf("  test_deadlock_05...\n");
+
+    struct tfunc_args tfa;
+    struct locks_ctx *locks = locks_new_ctx(2);
+    locks_set_policy(locks, LOCK_WOUND_WAIT);
+    tfa.locks[0] = lock_new(locks);
+    tfa.locks[1] = lock_new(locks);
+    tfa.txes[0] = store_new_mock_tx(1, 0);
+    tfa.txes[1] = store_new_mock_tx(0, 1);
+    struct scaff_ctx *scaff = scaff_new_ctx(2, 7, &tfdead02, &tfa);
+
+    scaff_run(scaff);
+    scaff_print_results(scaff);
+
+    ck_scaff_assert(scaff,
+        "T-DUU.."
+        "T.--TUU");
+
+    lock_free(tfa.locks[0]);
+    lock_free(tfa.locks[1]);
+    store_free_mock_tx(tfa.txes[0]);
+    store_free_mock_tx(tfa.txes[1]);
+    scaff_free_ctx(scaff);
+    locks_free_ctx(locks);
+
+    stress_run(LOCK_WOUND_WAIT, 0);
+}
+END_TEST
+
+/* the stress tests again, with waiters spinning before they go to sleep. a
+ * wake-up that comes while a waiter is still spinning must not get lost */
+START_TEST(test_deadlock_06) {
+    printf("  test_deadlock_06...\n");
+    stress_run(LOCK_DETECT, 20000);
+    stress_run(LOCK_WAIT_DIE, 20000);
+    stress_run(LOCK_WOUND_WAIT, 20000);
+}
+END_TEST
+
 TCase* make_rwlock_checks(void) {
     TCase *tc_rwlock;
 
@@ -650,9 +1019,15 @@ TCase* make_rwlock_checks(void) {
     tcase_add_test(tc_rwlock, test_rwlock_04);
     tcase_add_test(tc_rwlock, test_rwlock_05);
     //tcase_add_test(tc_rwlock, test_rwlock_06);
+    tcase_add_test(tc_rwlock, test_rwlock_07);
+    tcase_add_test(tc_rwlock, test_rwlock_08);
 
     tcase_add_test(tc_rwlock, test_deadlock_01);
     tcase_add_test(tc_rwlock, test_deadlock_02);
+    tcase_add_test(tc_rwlock, test_deadlock_03);
+    tcase_add_test(tc_rwlock, test_deadlock_04);
+    tcase_add_test(tc_rwlock, test_deadlock_05);
+    tcase_add_test(tc_rwlock, test_deadlock_06);
 
     return tc_rwlock;
 }
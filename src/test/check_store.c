@@ -0,0 +1,496 @@
+#include "check_store.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "epoch.h"
+#include "image.h"
+#include "persist.h"
+#include "store.h"
+
+#define CONC_THREADS    4
+#define CONC_INCREMENTS 2000
+
+// versions on an lobject, independent from the store
+START_TEST(test_store_01_versions) {
+    printf("  test_store_01_versions...\n");
+
+    struct object *o[4];
+    for (int i = 0; i < 4; i++) {
+        o[i] = obj_new();
+    }
+    struct lobject *lo = lobject_new();
+    lobject_set_object(lo, o[0]);
+    lobject_add_version(lo, o[1], 5);
+    lobject_add_version(lo, o[2], 10);
+    ck_assert(lobject_get_object(lo) == o[2]);
+    ck_assert(lobject_get_version_ts(lo) == 10);
+    ck_assert(lobject_get_version(lo, 0) == o[0]);
+    ck_assert(lobject_get_version(lo, 4) == o[0]);
+    ck_assert(lobject_get_version(lo, 5) == o[1]);
+    ck_assert(lobject_get_version(lo, 100) == o[2]);
+
+    // uncommitted versions are invisible until they get a timestamp
+    lobject_add_version(lo, o[3], LOBJECT_UNCOMMITTED);
+    ck_assert(lobject_get_object(lo) == o[3]);
+    ck_assert(lobject_get_version(lo, 100) == o[2]);
+    lobject_set_version_ts(lo, 20);
+    ck_assert(lobject_get_version(lo, 100) == o[3]);
+
+    // a reader at 7 still needs the version from 5, but not the one from 0
+    ck_assert(lobject_prune_versions(lo, 7) == 1);
+    ck_assert(lobject_get_version(lo, 7) == o[1]);
+    ck_assert(lobject_prune_versions(lo, 7) == 0);
+    ck_assert(lobject_prune_versions(lo, 20) == 2);
+    ck_assert(lobject_get_version(lo, 20) == o[3]);
+    ck_assert(lobject_get_version(lo, 19) == NULL);
+
+    // the lobject owns the objects, the pruned ones are freed through the epochs
+    lobject_free(lo);
+    epoch_reclaim();
+}
+END_TEST
+
+// a snapshot does not see what got committed after it was taken, and cannot
+// write to objects that changed since
+START_TEST(test_store_02_snapshot) {
+    printf("  test_store_02_snapshot...\n");
+
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, 4, 4, STORE_MVCC);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    object_id oid = obj_get_id(lobject_get_object(store_make_object(tx, 0)));
+    store_finish_tx(tx);
+
+    struct store_tx *reader = store_start_tx(s, store_new_sid(s));
+    struct lobject *rlo = store_get_object(reader, oid);
+    ck_assert(rlo != NULL);
+    ck_assert(val_type(obj_get_global(store_get_version(reader, rlo), "a")) == TYPE_NIL);
+
+    // this would block behind the shared lock of the reader with STORE_LOCKING
+    struct store_tx *writer = store_start_tx(s, store_new_sid(s));
+    struct lobject *wlo = store_get_object(writer, oid);
+    struct object *wo = store_write_object(writer, wlo);
+    ck_assert(wo != NULL);
+    ck_assert(wo != lobject_get_object(wlo));
+    obj_set_global(wo, "a", val_make_int(1));
+    // a write is visible to the writer right away, and to nobody else
+    ck_assert(store_get_version(writer, wlo) == wo);
+    ck_assert(val_type(obj_get_global(store_get_version(reader, rlo), "a")) == TYPE_NIL);
+    store_finish_tx(writer);
+
+    ck_assert(val_type(obj_get_global(store_get_version(reader, rlo), "a")) == TYPE_NIL);
+    ck_assert(store_write_object(reader, rlo) == NULL);
+    store_abort_tx(reader);
+
+    tx = store_start_tx(s, store_new_sid(s));
+    struct lobject *lo = store_get_object(tx, oid);
+    ck_assert(val_get_int(obj_get_global(store_get_version(tx, lo), "a")) == 1);
+    store_finish_tx(tx);
+
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
+// neither writes nor objects created in an aborted tx are visible
+START_TEST(test_store_03_abort) {
+    printf("  test_store_03_abort...\n");
+
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, 4, 4, STORE_MVCC);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    object_id oid = obj_get_id(lobject_get_object(store_make_object(tx, 0)));
+    store_finish_tx(tx);
+
+    uint64_t sid = store_new_sid(s);
+    tx = store_start_tx(s, sid);
+    struct object *o = store_write_object(tx, store_get_object(tx, oid));
+    obj_set_global(o, "a", val_make_int(1));
+    struct lobject *created = store_make_object(tx, oid);
+    object_id created_id = obj_get_id(lobject_get_object(created));
+    // the creating tx can see the new object, but nobody else can
+    ck_assert(store_get_object(tx, created_id) == created);
+    struct store_tx *other = store_start_tx(s, store_new_sid(s));
+    ck_assert(store_get_object(other, created_id) == NULL);
+    store_finish_tx(other);
+    store_abort_tx(tx);
+
+    // like a retry, which keeps the sid of the aborted try
+    tx = store_start_tx(s, sid);
+    ck_assert(store_tx_get_sid(tx) == sid);
+    struct lobject *lo = store_get_object(tx, oid);
+    ck_assert(val_type(obj_get_global(store_get_version(tx, lo), "a")) == TYPE_NIL);
+    ck_assert(store_get_object(tx, created_id) == NULL);
+    // the aborted tx did not leave a newer version behind, so this can write
+    ck_assert(store_write_object(tx, lo) != NULL);
+    store_finish_tx(tx);
+
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
+struct conc_args {
+    struct store *store;
+    object_id oid;
+    int retries;
+};
+
+void* conc_increment_thread(void *arg) {
+    struct conc_args *a = arg;
+    for (int i = 0; i < CONC_INCREMENTS; i++) {
+        uint64_t sid = store_new_sid(a->store);
+        while (true) {
+            struct store_tx *tx = store_start_tx(a->store, sid);
+            struct lobject *lo = store_get_object(tx, a->oid);
+            struct object *o = NULL;
+            if (lo) {
+                int count = val_get_int(obj_get_global(store_get_version(tx, lo), "count"));
+                o = store_write_object(tx, lo);
+                if (o) {
+                    obj_set_global(o, "count", val_make_int(count + 1));
+                }
+            }
+            if (o) {
+                if (store_finish_tx(tx)) {
+                    break;
+                }
+            }
+            else {
+                store_abort_tx(tx);
+            }
+            a->retries++;
+        }
+    }
+    return NULL;
+}
+
+// runs concurrent read-modify-write cycles on the same object, none of the
+// updates must get lost
+void conc_check_increments(enum store_mode mode) {
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, CONC_THREADS + 1, 4, mode);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    struct lobject *lo = store_make_object(tx, 0);
+    object_id oid = obj_get_id(lobject_get_object(lo));
+    obj_set_global(store_write_object(tx, lo), "count", val_make_int(0));
+    store_finish_tx(tx);
+
+    pthread_t tids[CONC_THREADS];
+    struct conc_args args[CONC_THREADS];
+    for (int i = 0; i < CONC_THREADS; i++) {
+        args[i].store = s;
+        args[i].oid = oid;
+        args[i].retries = 0;
+        pthread_create(&tids[i], NULL, conc_increment_thread, &args[i]);
+    }
+    for (int i = 0; i < CONC_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    tx = store_start_tx(s, store_new_sid(s));
+    lo = store_get_object(tx, oid);
+    ck_assert(val_get_int(obj_get_global(store_get_version(tx, lo), "count"))
+        == CONC_THREADS * CONC_INCREMENTS);
+    store_finish_tx(tx);
+
+    store_free(s);
+    persist_free(p);
+}
+
+START_TEST(test_store_04_concurrent) {
+    printf("  test_store_04_concurrent...\n");
+
+    conc_check_increments(STORE_LOCKING);
+    conc_check_increments(STORE_MVCC);
+    conc_check_increments(STORE_OCC);
+}
+END_TEST
+
+struct share_args {
+    struct store *store;
+    object_id oid;
+    atomic_bool *done;
+};
+
+void* share_read_thread(void *arg) {
+    struct share_args *a = arg;
+    while (!atomic_load(a->done)) {
+        struct store_tx *tx = store_start_tx(a->store, store_new_sid(a->store));
+        struct lobject *lo = store_get_object(tx, a->oid);
+        val v = obj_get_global(store_get_version(tx, lo), "s");
+        ck_assert(strncmp(val_get_string_data(v), "version", 7) == 0);
+        val_dec_ref(v);
+        store_finish_tx(tx);
+    }
+    return NULL;
+}
+
+// snapshot readers share the strings of the version they read with each other
+// and with the writer, which replaces the string while they are at it. the
+// old versions get freed by whoever reclaims them
+void share_check_strings(enum store_mode mode) {
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, CONC_THREADS + 1, 4, mode);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    struct lobject *lo = store_make_object(tx, 0);
+    object_id oid = obj_get_id(lobject_get_object(lo));
+    obj_set_global(store_write_object(tx, lo), "s", val_make_string(7, "version"));
+    store_finish_tx(tx);
+
+    atomic_bool done;
+    atomic_init(&done, false);
+    pthread_t tids[CONC_THREADS];
+    struct share_args args = { s, oid, &done };
+    for (int i = 0; i < CONC_THREADS; i++) {
+        pthread_create(&tids[i], NULL, share_read_thread, &args);
+    }
+    char buf[32];
+    for (int i = 0; i < CONC_INCREMENTS; i++) {
+        tx = store_start_tx(s, store_new_sid(s));
+        struct object *o = store_write_object(tx, store_get_object(tx, oid));
+        ck_assert(o != NULL);
+        int len = snprintf(buf, sizeof(buf), "version %i", i);
+        obj_set_global(o, "s", val_make_string(len, buf));
+        ck_assert(store_finish_tx(tx));
+    }
+    atomic_store(&done, true);
+    for (int i = 0; i < CONC_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    store_free(s);
+    persist_free(p);
+}
+
+START_TEST(test_store_08_shared_strings) {
+    printf("  test_store_08_shared_strings...\n");
+
+    share_check_strings(STORE_MVCC);
+    share_check_strings(STORE_OCC);
+}
+END_TEST
+
+// objects created in an aborted tx go from the cache, also when someone else
+// had them pinned at the time
+START_TEST(test_store_09_abort_created) {
+    printf("  test_store_09_abort_created...\n");
+
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, 4, 4, STORE_MVCC);
+    struct cache_stats stats;
+    store_get_cache_stats(s, &stats);
+    int objects = stats.objects;
+
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    store_make_object(tx, 0);
+    store_make_object(tx, 0);
+    store_get_cache_stats(s, &stats);
+    ck_assert(stats.objects == objects + 2);
+    store_abort_tx(tx);
+    store_get_cache_stats(s, &stats);
+    ck_assert(stats.objects == objects);
+
+    tx = store_start_tx(s, store_new_sid(s));
+    object_id oid = obj_get_id(lobject_get_object(store_make_object(tx, 0)));
+    struct store_tx *other = store_start_tx(s, store_new_sid(s));
+    ck_assert(store_get_object(other, oid) == NULL);
+    store_abort_tx(tx);
+    store_get_cache_stats(s, &stats);
+    ck_assert(stats.objects == objects + 1);
+    store_finish_tx(other);
+    store_get_cache_stats(s, &stats);
+    ck_assert(stats.objects == objects);
+    epoch_reclaim();
+
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
+// with STORE_LOCKING the tx holds the objects exclusively, but still writes to
+// a copy so that aborting it does not leave anything behind
+START_TEST(test_store_05_rollback) {
+    printf("  test_store_05_rollback...\n");
+
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, 4, 4, STORE_LOCKING);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    struct lobject *lo = store_make_object(tx, 0);
+    object_id oid = obj_get_id(lobject_get_object(lo));
+    // created objects need no copy
+    ck_assert(store_write_object(tx, lo) == lobject_get_object(lo));
+    obj_set_global(store_write_object(tx, lo), "a", val_make_int(1));
+    store_finish_tx(tx);
+
+    tx = store_start_tx(s, store_new_sid(s));
+    lo = store_get_object(tx, oid);
+    struct object *committed = lobject_get_object(lo);
+    struct object *o = store_write_object(tx, lo);
+    ck_assert(o != committed);
+    ck_assert(store_write_object(tx, lo) == o);
+    obj_set_global(o, "a", val_make_int(2));
+    ck_assert(val_get_int(obj_get_global(store_get_version(tx, lo), "a")) == 2);
+    ck_assert(val_get_int(obj_get_global(committed, "a")) == 1);
+    store_abort_tx(tx);
+
+    tx = store_start_tx(s, store_new_sid(s));
+    lo = store_get_object(tx, oid);
+    ck_assert(lobject_get_object(lo) == committed);
+    ck_assert(val_get_int(obj_get_global(store_get_version(tx, lo), "a")) == 1);
+    obj_set_global(store_write_object(tx, lo), "a", val_make_int(3));
+    store_finish_tx(tx);
+
+    tx = store_start_tx(s, store_new_sid(s));
+    lo = store_get_object(tx, oid);
+    ck_assert(lobject_get_object(lo) != committed);
+    ck_assert(val_get_int(obj_get_global(store_get_version(tx, lo), "a")) == 3);
+    store_finish_tx(tx);
+
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
+// with STORE_OCC nobody blocks, conflicts only show when committing. unlike
+// STORE_MVCC, this includes objects that were only read
+START_TEST(test_store_06_occ) {
+    printf("  test_store_06_occ...\n");
+
+    struct persist *p = persist_new();
+    struct store *s = store_new(p, 4, 4, STORE_OCC);
+    struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+    object_id a = obj_get_id(lobject_get_object(store_make_object(tx, 0)));
+    object_id b = obj_get_id(lobject_get_object(store_make_object(tx, 0)));
+    ck_assert(store_finish_tx(tx));
+
+    // both write the same object, the second one to commit loses
+    struct store_tx *tx1 = store_start_tx(s, store_new_sid(s));
+    struct store_tx *tx2 = store_start_tx(s, store_new_sid(s));
+    struct object *o1 = store_write_object(tx1, store_get_object(tx1, a));
+    struct object *o2 = store_write_object(tx2, store_get_object(tx2, a));
+    ck_assert(o1 != NULL);
+    ck_assert(o2 != NULL);
+    obj_set_global(o1, "x", val_make_int(1));
+    obj_set_global(o2, "x", val_make_int(2));
+    ck_assert(store_finish_tx(tx1));
+    ck_assert(!store_finish_tx(tx2));
+
+    // write skew: each reads one object and writes the other. this would
+    // commit with STORE_MVCC
+    tx1 = store_start_tx(s, store_new_sid(s));
+    tx2 = store_start_tx(s, store_new_sid(s));
+    store_get_object(tx1, a);
+    store_get_object(tx2, b);
+    obj_set_global(store_write_object(tx1, store_get_object(tx1, b)), "y", val_make_int(1));
+    obj_set_global(store_write_object(tx2, store_get_object(tx2, a)), "y", val_make_int(2));
+    ck_assert(store_finish_tx(tx1));
+    ck_assert(!store_finish_tx(tx2));
+
+    // a read-only tx reads from its snapshot, so it always commits
+    tx1 = store_start_tx(s, store_new_sid(s));
+    struct lobject *lo = store_get_object(tx1, a);
+    tx2 = store_start_tx(s, store_new_sid(s));
+    obj_set_global(store_write_object(tx2, store_get_object(tx2, a)), "x", val_make_int(3));
+    ck_assert(store_finish_tx(tx2));
+    ck_assert(val_get_int(obj_get_global(store_get_version(tx1, lo), "x")) == 1);
+    ck_assert(store_finish_tx(tx1));
+
+    tx = store_start_tx(s, store_new_sid(s));
+    lo = store_get_object(tx, a);
+    ck_assert(val_get_int(obj_get_global(store_get_version(tx, lo), "x")) == 3);
+    ck_assert(val_type(obj_get_global(store_get_version(tx, lo), "y")) == TYPE_NIL);
+    lo = store_get_object(tx, b);
+    ck_assert(val_get_int(obj_get_global(store_get_version(tx, lo), "y")) == 1);
+    ck_assert(store_finish_tx(tx));
+
+    store_free(s);
+    persist_free(p);
+}
+END_TEST
+
+// a checkpoint has what got committed before it, and nothing that was still
+// in flight, whether it comes from the cache or the log
+START_TEST(test_store_07_checkpoint) {
+    printf("  test_store_07_checkpoint...\n");
+
+    enum store_mode modes[] = { STORE_LOCKING, STORE_MVCC };
+    for (int m = 0; m < 2; m++) {
+        char path[] = "/tmp/cmoo-check-checkpoint-XXXXXX";
+        int fd = mkstemp(path);
+        ck_assert(fd >= 0);
+        close(fd);
+        struct persist *p = persist_new();
+        struct store *s = store_new(p, 4, 4, modes[m]);
+        struct store_tx *tx = store_start_tx(s, store_new_sid(s));
+        struct lobject *lo = store_make_object(tx, 0);
+        object_id a = obj_get_id(lobject_get_object(lo));
+        obj_set_global(store_write_object(tx, lo), "v", val_make_int(1));
+        ck_assert(store_finish_tx(tx));
+
+        tx = store_start_tx(s, store_new_sid(s));
+        obj_set_global(store_write_object(tx, store_get_object(tx, a)), "v", val_make_int(2));
+        object_id b = obj_get_id(lobject_get_object(store_make_object(tx, a)));
+        ck_assert(store_checkpoint(s, path));
+        ck_assert(store_finish_tx(tx));
+        ck_assert(store_checkpoint_wait(s));
+
+        struct store_checkpoint_stats stats;
+        store_get_checkpoint_stats(s, &stats);
+        ck_assert(stats.checkpoints == 1);
+        ck_assert(stats.failures == 0);
+        ck_assert(!stats.running);
+        ck_assert(stats.last_pause_ns > 0);
+        ck_assert(stats.last_duration_ns >= stats.last_pause_ns);
+
+        struct image *img = image_open(path);
+        ck_assert(img != NULL);
+        // the bootstrap objects never got into the cache
+        ck_assert(image_contains(img, 0));
+        ck_assert(image_get_object_count(img) == 4);
+        struct object *o = image_get(img, a);
+        ck_assert(o != NULL);
+        ck_assert(val_get_int(obj_get_global(o, "v")) == 1);
+        obj_free(o);
+        ck_assert(!image_contains(img, b));
+        image_close(img);
+
+        // the next one sees the commit
+        ck_assert(store_checkpoint(s, path));
+        ck_assert(store_checkpoint_wait(s));
+        img = image_open(path);
+        o = image_get(img, a);
+        ck_assert(val_get_int(obj_get_global(o, "v")) == 2);
+        obj_free(o);
+        ck_assert(image_contains(img, b));
+        image_close(img);
+
+        store_free(s);
+        persist_free(p);
+        unlink(path);
+    }
+}
+END_TEST
+
+TCase* make_store_checks(void) {
+    TCase *tc_store;
+
+    tc_store = tcase_create("Store");
+    tcase_set_timeout(tc_store, 60);
+    tcase_add_test(tc_store, test_store_01_versions);
+    tcase_add_test(tc_store, test_store_02_snapshot);
+    tcase_add_test(tc_store, test_store_03_abort);
+    tcase_add_test(tc_store, test_store_04_concurrent);
+    tcase_add_test(tc_store, test_store_05_rollback);
+    tcase_add_test(tc_store, test_store_06_occ);
+    tcase_add_test(tc_store, test_store_07_checkpoint);
+    tcase_add_test(tc_store, test_store_08_shared_strings);
+    tcase_add_test(tc_store, test_store_09_abort_created);
+
+    return tc_store;
+}
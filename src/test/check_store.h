@@ -0,0 +1,8 @@
+#ifndef CHECK_STORE_H
+#define CHECK_STORE_H
+
+#include <check.h>
+
+TCase* make_store_checks(void);
+
+#endif /* CHECK_STORE_H */
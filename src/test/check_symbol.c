@@ -0,0 +1,99 @@
+#include "check_symbol.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "symbol.h"
+#include "types.h"
+
+#define SYM_THREADS     8
+#define SYM_PER_THREAD  2000
+
+START_TEST(test_symbol_01) {
+    printf("  test_symbol_01...\n");
+
+    ck_assert(sym_lookup("test_symbol_01_a", 16) == SYM_NONE);
+    symbol a = sym_intern("test_symbol_01_a", 16);
+    ck_assert(a != SYM_NONE);
+    ck_assert(sym_lookup("test_symbol_01_a", 16) == a);
+    ck_assert(sym_intern("test_symbol_01_a", 16) == a);
+    // names need not be terminated
+    ck_assert(sym_intern("test_symbol_01_a_and_more", 16) == a);
+    symbol b = sym_intern("test_symbol_01_b", 16);
+    ck_assert(b != a);
+    ck_assert_str_eq(sym_name(a), "test_symbol_01_a");
+    ck_assert(sym_name_len(b) == 16);
+
+    // symbols as values
+    val v = val_make_symbol(b);
+    ck_assert(val_type(v) == TYPE_SYMBOL);
+    ck_assert(val_get_symbol(v) == b);
+    char *p = val_print(v);
+    ck_assert_str_eq(p, "#test_symbol_01_b");
+    free(p);
+}
+END_TEST
+
+// interns names well beyond the initial chunk and index size
+START_TEST(test_symbol_02) {
+    printf("  test_symbol_02...\n");
+
+    char buf[32];
+    symbol *syms = malloc(sizeof(symbol) * 5000);
+    for (int i = 0; i < 5000; i++) {
+        int len = snprintf(buf, sizeof(buf), "test_symbol_02_%i", i);
+        syms[i] = sym_intern(buf, len);
+    }
+    for (int i = 0; i < 5000; i++) {
+        int len = snprintf(buf, sizeof(buf), "test_symbol_02_%i", i);
+        ck_assert(sym_lookup(buf, len) == syms[i]);
+        ck_assert(strcmp(sym_name(syms[i]), buf) == 0);
+    }
+    free(syms);
+}
+END_TEST
+
+void* test_symbol_03_thread(void *arg) {
+    symbol *syms = arg;
+    char buf[32];
+    for (int i = 0; i < SYM_PER_THREAD; i++) {
+        int len = snprintf(buf, sizeof(buf), "test_symbol_03_%i", i);
+        syms[i] = sym_intern(buf, len);
+    }
+    return NULL;
+}
+
+// all threads intern the same names concurrently, they need to agree on the
+// symbols
+START_TEST(test_symbol_03) {
+    printf("  test_symbol_03...\n");
+
+    pthread_t threads[SYM_THREADS];
+    symbol *syms = malloc(sizeof(symbol) * SYM_THREADS * SYM_PER_THREAD);
+    for (int i = 0; i < SYM_THREADS; i++) {
+        pthread_create(&threads[i], NULL, test_symbol_03_thread, &syms[i * SYM_PER_THREAD]);
+    }
+    for (int i = 0; i < SYM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 1; i < SYM_THREADS; i++) {
+        for (int j = 0; j < SYM_PER_THREAD; j++) {
+            ck_assert(syms[i * SYM_PER_THREAD + j] == syms[j]);
+        }
+    }
+    free(syms);
+}
+END_TEST
+
+TCase* make_symbol_checks(void) {
+    TCase *tc_symbol;
+
+    tc_symbol = tcase_create("Symbol");
+    tcase_add_test(tc_symbol, test_symbol_01);
+    tcase_add_test(tc_symbol, test_symbol_02);
+    tcase_add_test(tc_symbol, test_symbol_03);
+
+    return tc_symbol;
+}
@@ -0,0 +1,8 @@
+#ifndef CHECK_SYMBOL_H
+#define CHECK_SYMBOL_H
+
+#include <check.h>
+
+TCase* make_symbol_checks(void);
+
+#endif /* CHECK_SYMBOL_H */
@@ -0,0 +1,76 @@
+#include "check_trace.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "trace.h"
+#include "eval.h"
+
+START_TEST(test_trace_01) {
+    printf("  test_trace_01...\n");
+
+    struct trace_record *buf = malloc(sizeof(struct trace_record) * TRACE_RING_SIZE * 2);
+
+    // fill the ring more than once, only the latest records should survive
+    // and they should come out in order
+    for (int i = 0; i < TRACE_RING_SIZE + 10; i++) {
+        trace_record(OP_NOOP, i, 17, 42);
+    }
+    int count = trace_snapshot(buf, TRACE_RING_SIZE * 2);
+    ck_assert_msg(count == TRACE_RING_SIZE, "unexpected number of records in ring");
+    ck_assert(buf[0].ip_offset == 10);
+    ck_assert(buf[count-1].ip_offset == TRACE_RING_SIZE + 9);
+    for (int i = 1; i < count; i++) {
+        ck_assert_msg(buf[i].seq == buf[i-1].seq + 1, "records out of order");
+    }
+    ck_assert(buf[0].oid == 17);
+    ck_assert(buf[0].task_id == 42);
+
+    free(buf);
+}
+END_TEST
+
+#ifdef EVAL_TRACE
+START_TEST(test_trace_02) {
+    printf("  test_trace_02...\n");
+
+    struct trace_record *buf = malloc(sizeof(struct trace_record) * TRACE_RING_SIZE);
+    struct eval_ctx *ex = eval_new_ctx(5, NULL);
+    opcode code[] = {   OP_NOOP,
+                        OP_ARGS_LOCALS, 0x00, 0x01,
+                        OP_LOAD_INT, 0x00, 0x00, 0x00, 0x00, 0x02,
+                        OP_HALT};
+
+    // nothing gets recorded while tracing is disabled
+    eval_exec(ex, code);
+    ck_assert(trace_snapshot(buf, TRACE_RING_SIZE) == 0);
+
+    trace_set_enabled(true);
+    eval_exec(ex, code);
+    trace_set_enabled(false);
+
+    int count = trace_snapshot(buf, TRACE_RING_SIZE);
+    ck_assert_msg(count == 4, "unexpected number of trace records");
+    ck_assert(buf[0].op == OP_NOOP && buf[0].ip_offset == 0);
+    ck_assert(buf[1].op == OP_ARGS_LOCALS && buf[1].ip_offset == 1);
+    ck_assert(buf[2].op == OP_LOAD_INT && buf[2].ip_offset == 4);
+    ck_assert(buf[3].op == OP_HALT && buf[3].ip_offset == 10);
+    ck_assert(buf[3].task_id == 5);
+
+    eval_free_ctx(ex);
+    free(buf);
+}
+END_TEST
+#endif
+
+TCase* make_trace_checks(void) {
+    TCase *tc_trace;
+
+    tc_trace = tcase_create("Trace");
+    tcase_add_test(tc_trace, test_trace_01);
+#ifdef EVAL_TRACE
+    tcase_add_test(tc_trace, test_trace_02);
+#endif
+
+    return tc_trace;
+}
@@ -0,0 +1,8 @@
+#ifndef CHECK_TRACE_H
+#define CHECK_TRACE_H
+
+#include <check.h>
+
+TCase* make_trace_checks(void);
+
+#endif /* CHECK_TRACE_H */
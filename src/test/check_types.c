@@ -2,6 +2,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "types.h"
 
@@ -57,12 +59,53 @@ START_TEST(test_types_02) {
 }
 END_TEST
 
+#define SHARE_THREADS   4
+#define SHARE_REFS      20000
+#define SHARE_HELD      70000
+
+void* share_string_thread(void *arg) {
+    val v = *(val*)arg;
+    for (int i = 0; i < SHARE_REFS; i++) {
+        val_inc_ref(v);
+    }
+    for (int i = 0; i < SHARE_REFS; i++) {
+        val_dec_ref(v);
+    }
+    return NULL;
+}
+
+// strings are shared between versions of objects that different threads hold
+// on to, more of them than fit into 16 bits in total here
+START_TEST(test_types_03_shared) {
+    printf("  test_types_03_shared...\n");
+    char *in = "shared";
+    val v = val_make_string(strlen(in), in);
+    for (int i = 0; i < SHARE_HELD; i++) {
+        val_inc_ref(v);
+    }
+    pthread_t threads[SHARE_THREADS];
+    for (int i = 0; i < SHARE_THREADS; i++) {
+        pthread_create(&threads[i], NULL, share_string_thread, &v);
+    }
+    for (int i = 0; i < SHARE_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < SHARE_HELD; i++) {
+        val_dec_ref(v);
+    }
+    // the threads let go of all the refs they took, so ours is still there
+    ck_assert(strncmp(val_get_string_data(v), in, 6) == 0);
+    val_dec_ref(v);
+}
+END_TEST
+
 TCase* make_types_checks(void) {
     TCase *tc_types;
 
     tc_types = tcase_create("Types");
     tcase_add_test(tc_types, test_types_01);
     tcase_add_test(tc_types, test_types_02);
+    tcase_add_test(tc_types, test_types_03_shared);
 
     return tc_types;
 }
@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cmoo_bench.h"
+#include "bench_object.h"
+#include "bench_cache.h"
+#include "bench_store.h"
+#include "bench_persist.h"
+#include "bench_lock.h"
+
+struct benchmark {
+    const char *name;
+    void (*run)(void);
+};
+
+static struct benchmark benchmarks[] = {
+    { "object", run_object_benchmarks },
+    { "cache", run_cache_benchmarks },
+    { "store", run_store_benchmarks },
+    { "persist", run_persist_benchmarks },
+    { "lock", run_lock_benchmarks },
+};
+
+/* runs all benchmarks, or only the ones named on the command line */
+int main(int argc, char **argv) {
+    int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    for (int i = 0; i < count; i++) {
+        int selected = (argc < 2);
+        for (int j = 1; j < argc; j++) {
+            if (strcmp(argv[j], benchmarks[i].name) == 0) {
+                selected = 1;
+            }
+        }
+        if (selected) {
+            benchmarks[i].run();
+            printf("\n");
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,19 @@
+#ifndef CMOO_BENCH_H
+#define CMOO_BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* microbenchmarks, these are not run as part of "make check" but through
+ * "make bench". each bench_*.c file provides a run function that gets
+ * registered in cmoo_bench.c, and prints its results as plain text tables
+ * to stdout. */
+
+/* monotonic time in nanoseconds */
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif /* CMOO_BENCH_H */
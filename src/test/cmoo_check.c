@@ -5,7 +5,13 @@
 #include "check_eval.h"
 #include "check_object.h"
 #include "check_cache.h"
+#include "check_store.h"
+#include "check_persist.h"
+#include "check_image.h"
 #include "check_rwlock.h"
+#include "check_trace.h"
+#include "check_symbol.h"
+#include "check_epoch.h"
 
 int main(int argc, char **argv) {
     Suite *s = suite_create("CMOO");
@@ -14,7 +20,13 @@ int main(int argc, char **argv) {
     suite_add_tcase(s, make_eval_checks());
     suite_add_tcase(s, make_object_checks());
     suite_add_tcase(s, make_cache_checks());
+    suite_add_tcase(s, make_store_checks());
+    suite_add_tcase(s, make_persist_checks());
+    suite_add_tcase(s, make_image_checks());
     suite_add_tcase(s, make_rwlock_checks());
+    suite_add_tcase(s, make_trace_checks());
+    suite_add_tcase(s, make_symbol_checks());
+    suite_add_tcase(s, make_epoch_checks());
 
     SRunner *sr = srunner_create(s);
     srunner_run_all(sr, CK_NORMAL);
@@ -0,0 +1,129 @@
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "eval.h"
+
+// -------- internal structures --------
+
+/* a ring is only ever written by the thread that owns it, so the writer needs
+ * no synchronisation with other writers. readers check the per-record
+ * sequence number before and after copying to detect records that got
+ * overwritten underneath them */
+struct trace_ring {
+    int thread_idx;
+    atomic_uint_fast64_t head;
+    struct trace_record records[TRACE_RING_SIZE];
+    struct trace_ring *next;
+};
+
+// -------- module state --------
+
+atomic_bool trace_enabled = false;
+
+static _Thread_local struct trace_ring *local_ring = NULL;
+
+// rings of all threads that ever traced, only needed for registration and
+// for reading, never in the tracing path itself. rings are never freed so
+// that the records of exited threads can still be decoded
+static pthread_mutex_t rings_latch = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *rings = NULL;
+static int ring_count = 0;
+
+// -------- internal functions --------
+
+struct trace_ring* trace_local_ring(void) {
+    if (!local_ring) {
+        struct trace_ring *r = malloc(sizeof(struct trace_ring));
+        memset(r, 0, sizeof(struct trace_ring));
+        atomic_init(&r->head, 0);
+        pthread_mutex_lock(&rings_latch);
+        r->thread_idx = ring_count++;
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock(&rings_latch);
+        local_ring = r;
+    }
+    return local_ring;
+}
+
+// copies the valid records of one ring in order, returns the count
+int trace_ring_snapshot(struct trace_ring *r, struct trace_record *buf, int max_records) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+    int count = 0;
+    for (uint64_t i = first; (i < head) && (count < max_records); i++) {
+        struct trace_record *rec = &r->records[i & (TRACE_RING_SIZE - 1)];
+        uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        buf[count] = *rec;
+        atomic_thread_fence(memory_order_acquire);
+        if ((seq == i + 1) && (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq)) {
+            buf[count].seq = seq;
+            count++;
+        }
+    }
+    return count;
+}
+
+// -------- implementation of public functions --------
+
+void trace_set_enabled(bool enabled) {
+    atomic_store(&trace_enabled, enabled);
+}
+
+void trace_record(opcode op, uint32_t ip_offset, object_id oid, uint64_t task_id) {
+    struct trace_ring *r = trace_local_ring();
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    struct trace_record *rec = &r->records[h & (TRACE_RING_SIZE - 1)];
+    // invalidate first so that a concurrent reader does not mistake a half
+    // written record for the old one
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    atomic_thread_fence(memory_order_release);
+    rec->task_id = task_id;
+    rec->oid = oid;
+    rec->ip_offset = ip_offset;
+    rec->op = op;
+    __atomic_store_n(&rec->seq, h + 1, __ATOMIC_RELEASE);
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+int trace_snapshot(struct trace_record *buf, int max_records) {
+    int count = 0;
+    pthread_mutex_lock(&rings_latch);
+    struct trace_ring *r = rings;
+    while (r && (count < max_records)) {
+        count += trace_ring_snapshot(r, &buf[count], max_records - count);
+        r = r->next;
+    }
+    pthread_mutex_unlock(&rings_latch);
+    return count;
+}
+
+void trace_dump(FILE *out) {
+#ifndef EVAL_TRACE
+    fprintf(out, "# instruction tracing not compiled in, rebuild with TRACE=1\n");
+#endif
+    struct trace_record *buf = malloc(sizeof(struct trace_record) * TRACE_RING_SIZE);
+    pthread_mutex_lock(&rings_latch);
+    struct trace_ring *r = rings;
+    while (r) {
+        int count = trace_ring_snapshot(r, buf, TRACE_RING_SIZE);
+        fprintf(out, ",-- thread %i, %i records\n", r->thread_idx, count);
+        for (int i = 0; i < count; i++) {
+            fprintf(out, "| %10lu task:%-6lu obj:%-8lu ", buf[i].seq, buf[i].task_id, buf[i].oid);
+            if (buf[i].ip_offset == TRACE_IP_UNKNOWN) {
+                fprintf(out, "ip:?????? ");
+            }
+            else {
+                fprintf(out, "ip:%06X ", buf[i].ip_offset);
+            }
+            fprintf(out, "%s\n", eval_op_name(buf[i].op));
+        }
+        fprintf(out, "'--\n");
+        r = r->next;
+    }
+    pthread_mutex_unlock(&rings_latch);
+    free(buf);
+}
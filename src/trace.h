@@ -0,0 +1,59 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "defs.h"
+
+/* this implements instruction tracing for the evaluator. Rather than
+ * formatting text for every executed opcode, a fixed-size binary record is
+ * appended to a ring buffer owned by the executing thread. The hot path
+ * therefore takes no locks, does no allocations and never touches stdio.
+ * The rings are only decoded into text when someone asks for it through
+ * trace_dump().
+ *
+ * The evaluator only calls into this module if it was built with EVAL_TRACE
+ * defined (see "make TRACE=1"), otherwise all tracing is compiled out. Even
+ * when compiled in, tracing needs to be switched on at runtime with
+ * trace_set_enabled().
+ * */
+
+/* number of records kept per thread, older ones get overwritten. needs to be
+ * a power of two */
+#define TRACE_RING_SIZE     4096
+
+/* ip offset used when the start of the current code buffer is not known */
+#define TRACE_IP_UNKNOWN    0xFFFFFFFF
+
+struct trace_record {
+    uint64_t seq;       // sequence number within the ring, 0 means invalid
+    uint64_t task_id;
+    object_id oid;
+    uint32_t ip_offset; // relative to the start of the executing method
+    opcode op;
+};
+
+/* this is only exposed so that trace_is_enabled() can be inlined into the
+ * dispatch loop, use the functions below to access it */
+extern atomic_bool trace_enabled;
+
+static inline bool trace_is_enabled(void) {
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed);
+}
+
+void trace_set_enabled(bool enabled);
+
+/* append a record to the ring of the calling thread */
+void trace_record(opcode op, uint32_t ip_offset, object_id oid, uint64_t task_id);
+
+/* copy the valid records from all threads into buf, returns the number of
+ * records copied. records that are overwritten while being copied are
+ * skipped, so this can be called while other threads are tracing */
+int trace_snapshot(struct trace_record *buf, int max_records);
+
+/* decode the rings of all threads into a human-readable listing */
+void trace_dump(FILE *out);
+
+#endif /* TRACE_H */
@@ -4,6 +4,9 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdatomic.h>
+
+#include "symbol.h"
 
 /* XXX in the longer run we should change the type tagging scheme so that
  * the lowest bits only indicate whether this is a non-immediate, and if 
@@ -11,13 +14,19 @@
  * * the other 32bits can contain the payload and we have extra low bits to
  * further differentiate. this would allow us to have far more types, which
  * would be good given that with hashes and arrays we will already run out
- * of type bits */
+ * of type bits. with TYPE_SYMBOL all 8 of them are taken */
 
 // XXX all the shifts, shouldn't they be by 3???
 
+/* the characters are in data, unless the string refers to characters
+ * somewhere else (see val_make_string_ref()), in which case data holds a
+ * pointer to them. strings are immutable, but the versions of an object that
+ * share them get read and freed by different threads, so the count is
+ * atomic */
 struct heap_string {
-    uint16_t ref_count;
+    atomic_uint ref_count;
     uint16_t length;
+    bool external;
     char data[];
 };
 
@@ -48,11 +57,24 @@ val val_make_float(float i) {
 }
 
 val val_make_string(uint16_t len, char *s) {
-    struct heap_string *hs = malloc(len + sizeof(uint16_t) * 2 + 1);
+    struct heap_string *hs = malloc(sizeof(struct heap_string) + len + 1);
     memcpy(hs->data, s, len);
     hs->data[len] = '\0';
-    hs->ref_count = 1;
+    atomic_init(&hs->ref_count, 1);
+    hs->length = len;
+    hs->external = false;
+    uint64_t ret = (uint64_t)hs;
+    ret |= TYPE_STRING;
+    return ret;
+}
+
+val val_make_string_ref(uint16_t len, char *s) {
+    assert(s[len] == '\0');
+    struct heap_string *hs = malloc(sizeof(struct heap_string) + sizeof(char*));
+    memcpy(hs->data, &s, sizeof(char*));
+    atomic_init(&hs->ref_count, 1);
     hs->length = len;
+    hs->external = true;
     uint64_t ret = (uint64_t)hs;
     ret |= TYPE_STRING;
     return ret;
@@ -69,10 +91,14 @@ val val_make_special(void *special) {
     return (uint64_t)special | TYPE_SPECIAL;
 }
 
+val val_make_symbol(symbol s) {
+    return ((val)s << 4) | TYPE_SYMBOL;
+}
+
 void val_inc_ref(val v) {
     if (((uint64_t)v & 0x7) == TYPE_STRING) {
         struct heap_string *hs = (struct heap_string*)((uint64_t)v & (~0x7));
-        hs->ref_count++;
+        atomic_fetch_add_explicit(&hs->ref_count, 1, memory_order_acq_rel);
     }
 }
 
@@ -80,13 +106,21 @@ void val_dec_ref(val v) {
     // cleanup if non-immediate type
     if (((uint64_t)v & 0x7) == TYPE_STRING) {
         struct heap_string *hs = (struct heap_string*)((uint64_t)v & (~0x7));
-        hs->ref_count--;
-        if (hs->ref_count == 0) {
+        if (atomic_fetch_sub_explicit(&hs->ref_count, 1, memory_order_acq_rel) == 1) {
             free(hs);
         }
     }
 }
 
+size_t val_heap_size(val v) {
+    if (((uint64_t)v & 0x7) == TYPE_STRING) {
+        struct heap_string *hs = (struct heap_string*)((uint64_t)v & (~0x7));
+        // the characters of an external string are not on our heap
+        return sizeof(struct heap_string) + (hs->external ? sizeof(char*) : hs->length + 1u);
+    }
+    return 0;
+}
+
 void val_clear(val *v) {
     val_dec_ref(*v);
     *v = 0;
@@ -119,6 +153,11 @@ float val_get_float(val v) {
 char* val_get_string_data(val v) {
     assert((v & 0x7) == TYPE_STRING);
     struct heap_string *hs = (struct heap_string*)((uint64_t)v & (~0x7));
+    if (hs->external) {
+        char *ret;
+        memcpy(&ret, hs->data, sizeof(char*));
+        return ret;
+    }
     return hs->data;
 }
 
@@ -137,6 +176,11 @@ void* val_get_special(val v) {
     return (void*)((uint64_t)v & (~0x07));
 }
 
+symbol val_get_symbol(val v) {
+    assert((v & 0x7) == TYPE_SYMBOL);
+    return v >> 4;
+}
+
 char* val_print(val v) {
     char *buf = malloc(128);
     switch (val_type(v)) {
@@ -162,6 +206,9 @@ char* val_print(val v) {
         case TYPE_SPECIAL:
             snprintf(buf, 128, "SPECIAL");
             break;
+        case TYPE_SYMBOL:
+            snprintf(buf, 128, "#%s", sym_name(val_get_symbol(v)));
+            break;
         default:
             snprintf(buf, 128, "??");
             break;
@@ -2,6 +2,7 @@
 #define TYPES_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "defs.h"
 
@@ -13,7 +14,9 @@
  * is a string, because the actual character buffer is kept somewhere on the 
  * heap. there is a type for "special" items like file handles and a type
  * for object references. these two are somewhere inbetween or are not very
- * well classified by the system above. supported types: 
+ * well classified by the system above. symbols are interned names (see 
+ * symbol.h), they are immediates that are cheap to compare and are used to
+ * refer to methods, globals and syscalls. supported types: 
  * */
 
 #define TYPE_NIL        0
@@ -23,6 +26,7 @@
 #define TYPE_STRING     4
 #define TYPE_OBJREF     5
 #define TYPE_SPECIAL    6
+#define TYPE_SYMBOL     7
 
 /* this returns the type of a value */
 int val_type(val v);
@@ -33,9 +37,13 @@ val val_make_bool(bool i);
 val val_make_int(int i);
 val val_make_float(float i);
 val val_make_string(uint16_t len, char *s); // copies, does not consume argument
+// does not copy either, s must be NUL terminated and stay around unchanged for
+// as long as the value does, e.g. in a mapped image
+val val_make_string_ref(uint16_t len, char *s);
 val val_make_objref(object_id ref);
 // XXX we need a way to tell the different specials apart
 val val_make_special(void *special);
+val val_make_symbol(symbol s);
 // XXX more creators
 
 /* sets the value pointed to to NIL and runs cleanups for non-immediates
@@ -50,6 +58,10 @@ void val_init(val *v);
 void val_inc_ref(val v);
 void val_dec_ref(val v);
 
+/* returns the number of heap bytes a non-immediate refers to, 0 for
+ * immediates. shared heap items are counted in full for every value */
+size_t val_heap_size(val v);
+
 /* get the value assuming that the type is correct */
 bool val_get_bool(val v);
 int val_get_int(val v);
@@ -58,6 +70,7 @@ char* val_get_string_data(val v);
 uint16_t val_get_string_len(val v);
 object_id val_get_objref(val v);
 void* val_get_special(val v);
+symbol val_get_symbol(val v);
 // XXX more getters
 
 /* return a textual representation, caller needs to free memory */
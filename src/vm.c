@@ -13,6 +13,7 @@
 #include "store.h"
 #include "lobject.h"
 #include "eval.h"
+#include "symbol.h"
 
 // -------- implementation of declared public structures --------
 
@@ -87,7 +88,7 @@ void vm_init(struct vm *v, struct tasks_ctx *tc) {
     struct vm_eval_ctx *ec = vm_get_eval_ctx(v, 0, 0);
     // XXX the args are stubby, just needed until we have a more complete core with globals and
     // object creation
-    val method_name = val_make_string(4, "init");
+    val method_name = val_make_symbol(sym_intern("init", 4));
     vm_eval_ctx_exec(ec, method_name, 1, val_make_objref(11));
     vm_free_eval_ctx(ec);
     val_dec_ref(method_name);
@@ -97,7 +98,7 @@ struct vm_eval_ctx* vm_get_eval_ctx(struct vm *v, object_id id, uint64_t task_id
     struct vm_eval_ctx *ret = malloc(sizeof(struct vm_eval_ctx));
     ret->v = v;
     ret->task_id = task_id;
-    ret->stx = store_start_tx(v->store);
+    ret->stx = store_start_tx(v->store, task_id);
     ret->start_obj = store_get_object(ret->stx, id);
     assert(ret->start_obj);
     printf("# vm_get_eval_ctx %li -> %p\n", id, ret);
@@ -153,8 +154,16 @@ int vm_eval_ctx_exec(struct vm_eval_ctx *ex, val method, int num_args, ...) {
     }
 
     va_end(argp);
-    // XXX do we not need to tell the store to throw away all changes within the
-    // tx if ret != EVAL_OK
-    store_finish_tx(ex->stx);
+    // anything but success means the tx gets retried or given up, either way
+    // its changes must not become visible
+    if (ret == EVAL_OK) {
+        if (!store_finish_tx(ex->stx)) {
+            // a conflicting commit came first with STORE_OCC
+            ret = EVAL_RETRY_TX;
+        }
+    }
+    else {
+        store_abort_tx(ex->stx);
+    }
     return ret;
 }